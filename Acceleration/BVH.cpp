@@ -0,0 +1,508 @@
+#include "BVH.h"
+#include "../Platform.h"
+#include <algorithm>
+
+// Number of bins used to evaluate surface area heuristic along split axis.
+const int BVH_BinCount = 16;
+// Beyond this depth we split at median so that depth (and traversal stack) stays bounded.
+const int BVH_MaxSAHDepth = 64;
+// Nodes with at least this many primitives are split in top phase of build, with parallel binning.
+const int BVH_ParallelThreshold = 16 * 1024;
+// Number of chunks primitives are divided to for parallel binning.
+const int BVH_ParallelChunks = 64;
+
+// Partitions primitives to the left of split bin.
+struct BinPredicate
+{
+	int axis, split;
+	Scalar axisMin, binScale;
+	BinPredicate(int a, Scalar minimum, Scalar scale, int s) : axis(a), split(s), axisMin(minimum), binScale(scale) {}
+	bool operator()(const BVHBuildPrimitive& p) const
+	{
+		return std::min(BVH_BinCount - 1, (int)((p.centroid.data[axis] - axisMin) * binScale)) < split;
+	}
+};
+
+// Orders primitives by centroid along axis.
+struct CentroidLess
+{
+	int axis;
+	CentroidLess(int a) : axis(a) {}
+	bool operator()(const BVHBuildPrimitive& p1, const BVHBuildPrimitive& p2) const
+	{
+		return p1.centroid.data[axis] < p2.centroid.data[axis];
+	}
+};
+
+// Bounds of primitives and their centroids.
+static void ComputeBounds(const BVHBuildPrimitive* build, int start, int end, bool parallel,
+	BoundingBox& bounds, BoundingBox& centroidBounds)
+{
+	if(!parallel)
+	{
+		for(int i = start; i < end; i++)
+		{
+			bounds.Extend(build[i].bounds);
+			centroidBounds.Extend(build[i].centroid);
+		}
+		return;
+	}
+
+	// Each chunk is bounded separately and then reduced, so result does not depend on thread count.
+	BoundingBox chunkBounds[BVH_ParallelChunks], chunkCentroids[BVH_ParallelChunks];
+	long long N = end - start;
+	#pragma omp parallel for
+	for(int c = 0; c < BVH_ParallelChunks; c++)
+	{
+		int chunkEnd = start + (int)(N*(c+1)/BVH_ParallelChunks);
+		for(int i = start + (int)(N*c/BVH_ParallelChunks); i < chunkEnd; i++)
+		{
+			chunkBounds[c].Extend(build[i].bounds);
+			chunkCentroids[c].Extend(build[i].centroid);
+		}
+	}
+	for(int c = 0; c < BVH_ParallelChunks; c++)
+	{
+		bounds.Extend(chunkBounds[c]);
+		centroidBounds.Extend(chunkCentroids[c]);
+	}
+}
+
+// Primitive counts and bounds of bins.
+struct BVHBins
+{
+	BoundingBox bounds[BVH_BinCount];
+	int count[BVH_BinCount];
+
+	BVHBins() { for(int b = 0; b < BVH_BinCount; b++) count[b] = 0; }
+};
+
+static void ComputeBins(const BVHBuildPrimitive* build, int start, int end, bool parallel, int axis,
+	Scalar axisMin, Scalar binScale, BVHBins& bins)
+{
+	if(!parallel)
+	{
+		for(int i = start; i < end; i++)
+		{
+			int b = std::min(BVH_BinCount - 1, (int)((build[i].centroid.data[axis] - axisMin) * binScale));
+			bins.count[b]++;
+			bins.bounds[b].Extend(build[i].bounds);
+		}
+		return;
+	}
+
+	std::vector<BVHBins> chunkBins(BVH_ParallelChunks);
+	long long N = end - start;
+	#pragma omp parallel for
+	for(int c = 0; c < BVH_ParallelChunks; c++)
+	{
+		int chunkStart = start + (int)(N*c/BVH_ParallelChunks), chunkEnd = start + (int)(N*(c+1)/BVH_ParallelChunks);
+		ComputeBins(build, chunkStart, chunkEnd, false, axis, axisMin, binScale, chunkBins[c]);
+	}
+	for(int c = 0; c < BVH_ParallelChunks; c++)
+	{
+		for(int b = 0; b < BVH_BinCount; b++)
+		{
+			bins.count[b] += chunkBins[c].count[b];
+			bins.bounds[b].Extend(chunkBins[c].bounds[b]);
+		}
+	}
+}
+
+// SAH cost of each subtree of depth first ordered nodes (offsets relative to array): area weighted sum of
+// traversal costs of inner nodes and primitive counts of leaves.
+static void ComputeCosts(const std::vector<BVHNode>& nodes, Scalar traversalCost, std::vector<Scalar>& costs)
+{
+	costs.resize(nodes.size());
+	for(int i = (int)nodes.size() - 1; i >= 0; i--)
+	{
+		const BVHNode& node = nodes[i];
+		Scalar area = node.bounds.SurfaceArea();
+		if(node.IsLeaf())
+			costs[i] = area * node.count;
+		else
+			costs[i] = area * traversalCost + costs[i + 1] + costs[node.offset];
+	}
+}
+
+// A node of the top part of tree, split breadth first in parallel build. It is either split
+// further (children) or its range is built as a subtree.
+struct BVHTopNode
+{
+	BoundingBox bounds;
+	int start, end, depth;
+	int axis;
+	int children[2];	//< Top nodes of children, -1 if not split.
+	int subtree;		//< Index of subtree built from range, -1 if split.
+};
+
+void BVH::Build(const std::vector<BoundingBox>& primitiveBounds)
+{
+	double startTime = GetTime();
+	Clear();
+	stats = BVHBuildStats();
+	int N = primitiveBounds.size();
+	if(N == 0)
+		return;
+
+	std::vector<BVHBuildPrimitive> build(N);
+	#pragma omp parallel for
+	for(int i = 0; i < N; i++)
+	{
+		build[i].bounds = primitiveBounds[i];
+		build[i].centroid = primitiveBounds[i].Center();
+		build[i].index = i;
+	}
+
+	// Top phase: large nodes are split level by level, each split uses parallel binning. It stops when
+	// there are enough nodes to keep all threads busy building them as independent subtrees.
+	int threads = GetThreadCount();
+	std::vector<BVHTopNode> top(1);
+	top[0].start = 0; top[0].end = N; top[0].depth = 0;
+	std::vector<int> level(1, 0), nextLevel, subtreeNodes;
+	while(!level.empty())
+	{
+		nextLevel.clear();
+		for(unsigned int l = 0; l < level.size(); l++)
+		{
+			int t = level[l];
+			top[t].children[0] = top[t].children[1] = -1;
+			top[t].subtree = -1;
+
+			int start = top[t].start, end = top[t].end;
+			int mid = -1;
+			if(end - start >= BVH_ParallelThreshold && (int)subtreeNodes.size() + (int)level.size() < 4 * threads)
+				mid = Split(&build[0], start, end, top[t].depth, true, top[t].bounds, top[t].axis);
+			if(mid < 0)
+			{
+				top[t].subtree = subtreeNodes.size();
+				subtreeNodes.push_back(t);
+				continue;
+			}
+
+			for(int c = 0; c < 2; c++)
+			{
+				BVHTopNode child;
+				child.start = c == 0 ? start : mid;
+				child.end = c == 0 ? mid : end;
+				child.depth = top[t].depth + 1;
+				top[t].children[c] = top.size();
+				nextLevel.push_back(top.size());
+				top.push_back(child);
+			}
+		}
+		level.swap(nextLevel);
+	}
+
+	// Subtrees are built in parallel into their own arrays.
+	int subtreeCount = subtreeNodes.size();
+	std::vector<std::vector<BVHNode> > subtrees(subtreeCount);
+	std::vector<std::vector<int> > subtreePrimitives(subtreeCount);
+	#pragma omp parallel for schedule(dynamic, 1)
+	for(int i = 0; i < subtreeCount; i++)
+	{
+		const BVHTopNode& t = top[subtreeNodes[i]];
+		subtrees[i].reserve(2*(t.end - t.start) - 1);
+		subtreePrimitives[i].reserve(t.end - t.start);
+		BuildRecursive(&build[0], t.start, t.end, t.depth, subtrees[i], subtreePrimitives[i]);
+	}
+
+	// Tree with leaves of at least one primitive has at most 2N-1 nodes.
+	nodes.reserve(2*N - 1);
+	primitives.reserve(N);
+	SpliceTop(top, 0, subtrees, subtreePrimitives);
+	ComputeCosts(nodes, traversalCost, buildCosts);
+
+	stats.time = GetTime() - startTime;
+	stats.nodeCount = nodes.size();
+	stats.primitiveCount = stats.rebuiltPrimitives = N;
+}
+
+int BVH::SpliceTop(const std::vector<BVHTopNode>& top, int index, std::vector<std::vector<BVHNode> >& subtrees,
+	std::vector<std::vector<int> >& subtreePrimitives)
+{
+	int nodeIndex = nodes.size();
+	const BVHTopNode& t = top[index];
+	if(t.subtree >= 0)
+	{
+		// Subtree offsets are relative to its own arrays.
+		std::vector<BVHNode>& subtree = subtrees[t.subtree];
+		std::vector<int>& subPrimitives = subtreePrimitives[t.subtree];
+		int primitiveBase = primitives.size();
+		for(unsigned int i = 0; i < subtree.size(); i++)
+		{
+			BVHNode node = subtree[i];
+			node.offset += node.IsLeaf() ? primitiveBase : nodeIndex;
+			nodes.push_back(node);
+		}
+		primitives.insert(primitives.end(), subPrimitives.begin(), subPrimitives.end());
+		std::vector<BVHNode>().swap(subtree);
+		std::vector<int>().swap(subPrimitives);
+		return nodeIndex;
+	}
+
+	nodes.push_back(BVHNode());
+	SpliceTop(top, t.children[0], subtrees, subtreePrimitives);
+	int second = SpliceTop(top, t.children[1], subtrees, subtreePrimitives);
+
+	BVHNode& node = nodes[nodeIndex];
+	node.bounds = t.bounds;
+	node.offset = second;
+	node.count = 0;
+	node.axis = t.axis;
+	return nodeIndex;
+}
+
+int BVH::Split(BVHBuildPrimitive* build, int start, int end, int depth, bool parallel, BoundingBox& bounds, int& axis) const
+{
+	BoundingBox centroidBounds;
+	bounds = BoundingBox();
+	ComputeBounds(build, start, end, parallel, bounds, centroidBounds);
+
+	int N = end - start;
+	axis = centroidBounds.MaximumExtentAxis();
+	Scalar axisMin = centroidBounds.minDim.data[axis];
+	Scalar axisExtent = centroidBounds.maxDim.data[axis] - axisMin;
+	int mid = -1;
+
+	if(N > 1 && axisExtent > 0 && depth < BVH_MaxSAHDepth)
+	{
+		// Bin primitives by centroid.
+		BVHBins bins;
+		Scalar binScale = BVH_BinCount / axisExtent;
+		ComputeBins(build, start, end, parallel, axis, axisMin, binScale, bins);
+
+		// Sweep from right to get area and count of right side for each split.
+		Scalar rightArea[BVH_BinCount];
+		int rightCount[BVH_BinCount];
+		BoundingBox accumulated;
+		int count = 0;
+		for(int b = BVH_BinCount - 1; b > 0; b--)
+		{
+			accumulated.Extend(bins.bounds[b]);
+			count += bins.count[b];
+			rightArea[b] = accumulated.SurfaceArea();
+			rightCount[b] = count;
+		}
+
+		// Sweep from left and evaluate cost of splitting before bin b.
+		Scalar bestCost = std::numeric_limits<Scalar>::max();
+		int bestSplit = -1;
+		accumulated = BoundingBox();
+		count = 0;
+		for(int b = 1; b < BVH_BinCount; b++)
+		{
+			accumulated.Extend(bins.bounds[b-1]);
+			count += bins.count[b-1];
+			if(count == 0 || rightCount[b] == 0)
+				continue;
+			Scalar cost = accumulated.SurfaceArea()*count + rightArea[b]*rightCount[b];
+			if(cost < bestCost)
+			{
+				bestCost = cost;
+				bestSplit = b;
+			}
+		}
+
+		Scalar area = bounds.SurfaceArea();
+		Scalar splitCost = area > 0 ? traversalCost + bestCost / area : 0;
+		if(bestSplit > 0 && (N > maxLeafSize || splitCost < N))
+		{
+			BVHBuildPrimitive* middle = std::partition(build + start, build + end,
+				BinPredicate(axis, axisMin, binScale, bestSplit));
+			mid = middle - build;
+		}
+	}
+
+	// Split at median if primitives cannot be separated by SAH (or tree is too deep).
+	if(mid < 0 && N > maxLeafSize)
+	{
+		mid = (start + end) / 2;
+		std::nth_element(build + start, build + mid, build + end, CentroidLess(axis));
+	}
+	return mid;
+}
+
+int BVH::BuildRecursive(BVHBuildPrimitive* build, int start, int end, int depth, 
+	std::vector<BVHNode>& outNodes, std::vector<int>& outPrimitives) const
+{
+	int nodeIndex = outNodes.size();
+	outNodes.push_back(BVHNode());
+
+	BoundingBox bounds;
+	int axis;
+	int mid = Split(build, start, end, depth, false, bounds, axis);
+	if(mid < 0)
+	{
+		// Create leaf.
+		BVHNode& node = outNodes[nodeIndex];
+		node.bounds = bounds;
+		node.offset = outPrimitives.size();
+		node.count = end - start;
+		node.axis = 0;
+		for(int i = start; i < end; i++)
+			outPrimitives.push_back(build[i].index);
+		return nodeIndex;
+	}
+
+	// Create inner node; first child directly follows it.
+	BuildRecursive(build, start, mid, depth + 1, outNodes, outPrimitives);
+	int second = BuildRecursive(build, mid, end, depth + 1, outNodes, outPrimitives);
+
+	BVHNode& node = outNodes[nodeIndex];
+	node.bounds = bounds;
+	node.offset = second;
+	node.count = 0;
+	node.axis = axis;
+	return nodeIndex;
+}
+
+int BVH::Refit(const std::vector<BoundingBox>& primitiveBounds)
+{
+	if(nodes.empty())
+		return 0;
+	double startTime = GetTime();
+
+	// Leaves are refitted in parallel, inner nodes in reverse order since children always follow parent.
+	int N = nodes.size();
+	#pragma omp parallel for
+	for(int i = 0; i < N; i++)
+	{
+		BVHNode& node = nodes[i];
+		if(!node.IsLeaf())
+			continue;
+		node.bounds = BoundingBox();
+		for(int j = 0; j < node.count; j++)
+			node.bounds.Extend(primitiveBounds[primitives[node.offset + j]]);
+	}
+	for(int i = N - 1; i >= 0; i--)
+	{
+		BVHNode& node = nodes[i];
+		if(node.IsLeaf())
+			continue;
+		node.bounds = nodes[i + 1].bounds;
+		node.bounds.Extend(nodes[node.offset].bounds);
+	}
+
+	std::vector<Scalar> costs;
+	ComputeCosts(nodes, traversalCost, costs);
+	std::vector<std::pair<int, int> > degraded;
+	FindDegraded(0, 0, costs, degraded);
+
+	int rebuilt = degraded.empty() ? 0 : RebuildSubtrees(degraded, primitiveBounds);
+
+	stats.time = GetTime() - startTime;
+	stats.nodeCount = nodes.size();
+	stats.primitiveCount = primitives.size();
+	stats.rebuiltPrimitives = rebuilt;
+	return rebuilt;
+}
+
+int BVH::SubtreeEnd(int index) const
+{
+	// Last node of subtree is reached by always taking the second child.
+	while(!nodes[index].IsLeaf())
+		index = nodes[index].offset;
+	return index + 1;
+}
+
+void BVH::FindDegraded(int index, int depth, const std::vector<Scalar>& costs, 
+	std::vector<std::pair<int, int> >& degraded) const
+{
+	// Leaves cannot be improved by rebuilding.
+	const BVHNode& node = nodes[index];
+	if(node.IsLeaf())
+		return;
+
+	if(costs[index] > rebuildThreshold * buildCosts[index])
+	{
+		degraded.push_back(std::make_pair(index, depth));
+		return;
+	}
+	FindDegraded(index + 1, depth + 1, costs, degraded);
+	FindDegraded(node.offset, depth + 1, costs, degraded);
+}
+
+int BVH::RebuildSubtrees(const std::vector<std::pair<int, int> >& degraded, const std::vector<BoundingBox>& primitiveBounds)
+{
+	// Degraded subtrees are disjoint, each holds consecutive nodes and consecutive slots (starting with slots
+	// of its first leaf), so they are rebuilt independently and only their own slots are reordered.
+	int count = degraded.size();
+	std::vector<int> ends(count), slotCounts(count);
+	std::vector<std::vector<BVHNode> > subtrees(count);
+	std::vector<std::vector<Scalar> > subtreeCosts(count);
+	#pragma omp parallel for schedule(dynamic, 1)
+	for(int d = 0; d < count; d++)
+	{
+		int index = degraded[d].first;
+		int end = SubtreeEnd(index);
+		int firstLeaf = index;
+		while(!nodes[firstLeaf].IsLeaf())
+			firstLeaf++;
+		int firstSlot = nodes[firstLeaf].offset;
+		int N = 0;
+		for(int i = index; i < end; i++)
+			N += nodes[i].count;
+
+		std::vector<BVHBuildPrimitive> build(N);
+		for(int i = 0; i < N; i++)
+		{
+			int primitive = primitives[firstSlot + i];
+			build[i].bounds = primitiveBounds[primitive];
+			build[i].centroid = build[i].bounds.Center();
+			build[i].index = primitive;
+		}
+		std::vector<int> subPrimitives;
+		subtrees[d].reserve(2*N - 1);
+		subPrimitives.reserve(N);
+		BuildRecursive(&build[0], 0, N, degraded[d].second, subtrees[d], subPrimitives);
+		ComputeCosts(subtrees[d], traversalCost, subtreeCosts[d]);
+
+		for(unsigned int i = 0; i < subtrees[d].size(); i++)
+			if(subtrees[d][i].IsLeaf())
+				subtrees[d][i].offset += firstSlot;
+		std::copy(subPrimitives.begin(), subPrimitives.end(), primitives.begin() + firstSlot);
+		ends[d] = end;
+		slotCounts[d] = N;
+	}
+
+	// Nodes are assembled in one pass; offsets of kept inner nodes are remapped afterwards, since they
+	// point forward (to kept nodes or roots of rebuilt subtrees).
+	std::vector<BVHNode> newNodes;
+	std::vector<Scalar> newCosts;
+	std::vector<int> remap(nodes.size(), -1), kept;
+	newNodes.reserve(nodes.size());
+	newCosts.reserve(nodes.size());
+	int rebuilt = 0, d = 0;
+	for(int i = 0; i < (int)nodes.size();)
+	{
+		remap[i] = newNodes.size();
+		if(d < count && i == degraded[d].first)
+		{
+			int base = newNodes.size();
+			for(unsigned int j = 0; j < subtrees[d].size(); j++)
+			{
+				newNodes.push_back(subtrees[d][j]);
+				if(!newNodes.back().IsLeaf())
+					newNodes.back().offset += base;
+			}
+			newCosts.insert(newCosts.end(), subtreeCosts[d].begin(), subtreeCosts[d].end());
+			rebuilt += slotCounts[d];
+			i = ends[d++];
+			continue;
+		}
+		kept.push_back(i);
+		newNodes.push_back(nodes[i]);
+		newCosts.push_back(buildCosts[i]);
+		i++;
+	}
+	for(unsigned int k = 0; k < kept.size(); k++)
+	{
+		BVHNode& node = newNodes[remap[kept[k]]];
+		if(!node.IsLeaf())
+			node.offset = remap[node.offset];
+	}
+	nodes.swap(newNodes);
+	buildCosts.swap(newCosts);
+	return rebuilt;
+}
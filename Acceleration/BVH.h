@@ -0,0 +1,310 @@
+#pragma once
+
+#include "../Illumination.h"
+#include <vector>
+#include <algorithm>
+
+// A node of bounding volume hierarchy. Nodes are stored in depth first order, so the first child
+// of inner node always directly follows it. Hierarchies are built in Scalar precision (BVHNode),
+// ConvertNodes gives copies in other precision for traversal.
+template<class T>
+struct BVHNodeT
+{
+	BoundingBoxT<T> bounds;
+	int offset;		//< First primitive for leaves, index of second child for inner nodes.
+	int count;		//< Number of primitives in leaf, 0 for inner nodes.
+	int axis;		//< Split axis of inner node, used for front to back traversal.
+
+	bool IsLeaf() const { return count > 0; }
+};
+
+typedef BVHNodeT<Scalar> BVHNode;
+
+// Primitive data used while building hierarchies.
+struct BVHBuildPrimitive
+{
+	BoundingBox bounds;
+	Vec3 centroid;
+	int index;
+};
+
+struct BVHTopNode;
+
+// Timed phase of the last Build or Refit of a hierarchy.
+struct BVHBuildStats
+{
+	double time;				//< Seconds spent in Build or Refit.
+	int nodeCount;
+	int primitiveCount;
+	int rebuiltPrimitives;		//< Primitives placed by a full build (all for Build, rebuilt subtrees for Refit).
+
+	BVHBuildStats() : time(0), nodeCount(0), primitiveCount(0), rebuiltPrimitives(0) {}
+};
+
+// A bounding volume hierarchy over abstract primitives, built with binned surface area heuristic (in parallel:
+// large nodes are split with parallel binning, then subtrees are built on separate threads).
+// Only bounds of primitives are needed for build; the owner intersects the primitives itself through
+// intersector object passed to Intersect. Primitives are referenced by slots: leaves hold consecutive
+// slots and GetPrimitiveOrder maps slot to primitive index, so owner can store its data in slot order.
+class BVH
+{
+	std::vector<BVHNode> nodes;
+	std::vector<int> primitives;
+	// SAH cost of each subtree when it was built, Refit compares current costs against it.
+	std::vector<Scalar> buildCosts;
+	BVHBuildStats stats;
+
+	// Computes bounds of range and partitions it by best split, returns middle or -1 if range should be a leaf.
+	int Split(BVHBuildPrimitive* build, int start, int end, int depth, bool parallel, BoundingBox& bounds, int& axis) const;
+	// Builds subtree into given arrays (offsets are relative to them).
+	int BuildRecursive(BVHBuildPrimitive* build, int start, int end, int depth, 
+		std::vector<BVHNode>& outNodes, std::vector<int>& outPrimitives) const;
+	// Appends top part of tree and subtrees to nodes in depth first order.
+	int SpliceTop(const std::vector<BVHTopNode>& top, int index, std::vector<std::vector<BVHNode> >& subtrees,
+		std::vector<std::vector<int> >& subtreePrimitives);
+	// Index after the last node of subtree.
+	int SubtreeEnd(int index) const;
+	// Collects roots (and depths) of topmost subtrees whose cost degraded past rebuildThreshold.
+	void FindDegraded(int index, int depth, const std::vector<Scalar>& costs, std::vector<std::pair<int, int> >& degraded) const;
+	// Rebuilds given subtrees from current primitive bounds (in parallel) and splices them into nodes,
+	// returns number of their primitives.
+	int RebuildSubtrees(const std::vector<std::pair<int, int> >& degraded, const std::vector<BoundingBox>& primitiveBounds);
+
+	// Splits nodes with Split when they are first visited.
+	friend class LazyBVH;
+public:
+	// Maximum number of primitives in leaf (more only if they cannot be separated).
+	int maxLeafSize;
+	// Cost of traversing a node relative to primitive intersection, used by surface area heuristic.
+	Scalar traversalCost;
+	// Refit rebuilds subtrees whose SAH cost grew by more than this factor since they were built.
+	Scalar rebuildThreshold;
+
+	BVH() : maxLeafSize(4), traversalCost((Scalar)0.125), rebuildThreshold((Scalar)1.5) {}
+
+	// Builds hierarchy from primitive bounds; primitive i is reported as index i to intersector.
+	void Build(const std::vector<BoundingBox>& primitiveBounds);
+	// Updates hierarchy after primitives moved: bounds are recomputed bottom-up keeping the topology, then
+	// subtrees that degraded (see rebuildThreshold) are rebuilt. Slots are only reordered inside rebuilt
+	// subtrees, but owner must refresh its slot ordered data anyway. Returns number of rebuilt primitives.
+	int Refit(const std::vector<BoundingBox>& primitiveBounds);
+	bool IsBuilt() const { return !nodes.empty(); }
+	void Clear() { nodes.clear(); primitives.clear(); buildCosts.clear(); }
+	// Stats of the last Build or Refit; they are kept by Clear, so owners may release the hierarchy after conversion.
+	const BVHBuildStats& GetStats() const { return stats; }
+
+	int GetNodeCount() const { return nodes.size(); }
+	const std::vector<BVHNode>& GetNodes() const { return nodes; }
+	// Primitive index for each slot.
+	const std::vector<int>& GetPrimitiveOrder() const { return primitives; }
+	BoundingBox GetBounds() const { return nodes.empty() ? BoundingBox() : nodes[0].bounds; }
+
+	// Intersects the hierarchy. Intersector is called as intersector(slot, ray, result) for every primitive
+	// in leaves hit by ray and must update result if closer hit is found, like IGeometry.
+	template<class Intersector>
+	void Intersect(const Ray& ray, IntersectResult& result, Intersector& intersector) const
+	{
+		if(!nodes.empty())
+			IntersectNodes(&nodes[0], ray, result, intersector);
+	}
+
+	// Any hit query. Occluder is called as occluder(slot, ray, maxDistance) and returns true if primitive
+	// blocks the ray; traversal stops at first such primitive.
+	template<class Occluder>
+	bool Occluded(const Ray& ray, Scalar maxDistance, Occluder& occluder) const
+	{
+		return !nodes.empty() && OccludedNodes(&nodes[0], ray, maxDistance, occluder);
+	}
+
+	// Traversals of node arrays not owned by a BVH (mapped from a cache file); nodes must be laid out
+	// like GetNodes of a built hierarchy.
+	// Boxes are tested in precision T of nodes.
+	template<class T, class Intersector>
+	static void IntersectNodes(const BVHNodeT<T>* nodes, const Ray& ray, IntersectResult& result, Intersector& intersector);
+	template<class T, class Occluder>
+	static bool OccludedNodes(const BVHNodeT<T>* nodes, const Ray& ray, Scalar maxDistance, Occluder& occluder);
+	// Copies nodes to precision T; bounds are rounded outwards, so no hit is lost.
+	template<class T>
+	void ConvertNodes(std::vector<BVHNodeT<T> >& result) const;
+
+	// Intersects all rays of prepared packet together. Nodes are culled for whole packet by interval arithmetic
+	// and by testing rays until the first one hits; rays before it are skipped in the subtree. Intersector is
+	// called as intersector(slot, packet, results, active, activeCount) for leaf primitives, where active
+	// lists indices of rays that hit the leaf box.
+	template<class Intersector>
+	void IntersectPacket(const RayPacket& packet, IntersectResult* results, Intersector& intersector) const;
+};
+
+// Traversal stack depth; build guarantees depth of tree is below it.
+const int BVH_MaxDepth = 128;
+
+template<class T, class Intersector>
+void BVH::IntersectNodes(const BVHNodeT<T>* nodes, const Ray& ray, IntersectResult& result, Intersector& intersector)
+{
+	Vec3T<T> origin(ray.origin);
+	Vec3T<T> invDirection(Vec3(1/ray.direction.x, 1/ray.direction.y, 1/ray.direction.z));
+	int dirIsNegative[3] = { invDirection.x < 0, invDirection.y < 0, invDirection.z < 0 };
+
+	// Nodes are visited front to back, so result.distance shrinks fast and culls far nodes.
+	int stack[BVH_MaxDepth];
+	int stackSize = 0, current = 0;
+	for(;;)
+	{
+		const BVHNodeT<T>& node = nodes[current];
+		if(node.bounds.IntersectRay(origin, invDirection, ToPrecision<T>(result.distance)))
+		{
+			if(node.IsLeaf())
+			{
+				for(int i = 0; i < node.count; i++)
+					intersector(node.offset + i, ray, result);
+			} else {
+				if(dirIsNegative[node.axis])
+				{
+					stack[stackSize++] = current + 1;
+					current = node.offset;
+				} else {
+					stack[stackSize++] = node.offset;
+					current = current + 1;
+				}
+				continue;
+			}
+		}
+
+		if(stackSize == 0)
+			break;
+		current = stack[--stackSize];
+	}
+}
+
+template<class T, class Occluder>
+bool BVH::OccludedNodes(const BVHNodeT<T>* nodes, const Ray& ray, Scalar maxDistance, Occluder& occluder)
+{
+	Vec3T<T> origin(ray.origin);
+	Vec3T<T> invDirection(Vec3(1/ray.direction.x, 1/ray.direction.y, 1/ray.direction.z));
+	int dirIsNegative[3] = { invDirection.x < 0, invDirection.y < 0, invDirection.z < 0 };
+	T boxDistance = ToPrecision<T>(maxDistance);
+
+	// Near children are still visited first, blockers close to the origin are the most common.
+	int stack[BVH_MaxDepth];
+	int stackSize = 0, current = 0;
+	for(;;)
+	{
+		const BVHNodeT<T>& node = nodes[current];
+		if(node.bounds.IntersectRay(origin, invDirection, boxDistance))
+		{
+			if(node.IsLeaf())
+			{
+				for(int i = 0; i < node.count; i++)
+					if(occluder(node.offset + i, ray, maxDistance))
+						return true;
+			} else {
+				if(dirIsNegative[node.axis])
+				{
+					stack[stackSize++] = current + 1;
+					current = node.offset;
+				} else {
+					stack[stackSize++] = node.offset;
+					current = current + 1;
+				}
+				continue;
+			}
+		}
+
+		if(stackSize == 0)
+			break;
+		current = stack[--stackSize];
+	}
+	return false;
+}
+
+template<class Intersector>
+void BVH::IntersectPacket(const RayPacket& packet, IntersectResult* results, Intersector& intersector) const
+{
+	if(nodes.empty() || packet.size == 0)
+		return;
+
+	// Traversal order is chosen by the first ray, packet is assumed coherent.
+	const Vec3& direction = packet.rays[0].direction;
+	int dirIsNegative[3] = { direction.x < 0, direction.y < 0, direction.z < 0 };
+
+	int stack[BVH_MaxDepth], stackFirst[BVH_MaxDepth];
+	int stackSize = 0, current = 0, first = 0;
+	for(;;)
+	{
+		const BVHNode& node = nodes[current];
+
+		Scalar maxDistance = 0;
+		for(int i = first; i < packet.size; i++)
+			maxDistance = std::max(maxDistance, results[i].distance);
+
+		if(packet.MayIntersect(node.bounds, maxDistance))
+		{
+			while(first < packet.size && !node.bounds.IntersectRay(packet.rays[first].origin, 
+				packet.invDirections[first], results[first].distance))
+				first++;
+		} else
+			first = packet.size;
+
+		if(first < packet.size)
+		{
+			if(node.IsLeaf())
+			{
+				// Only rays that hit the leaf box are passed on.
+				int active[RayPacket::MaxSize];
+				int activeCount = 0;
+				active[activeCount++] = first;
+				for(int i = first + 1; i < packet.size; i++)
+				{
+					if(node.bounds.IntersectRay(packet.rays[i].origin, packet.invDirections[i], results[i].distance))
+						active[activeCount++] = i;
+				}
+
+				for(int i = 0; i < node.count; i++)
+					intersector(node.offset + i, packet, results, active, activeCount);
+			} else {
+				stackFirst[stackSize] = first;
+				if(dirIsNegative[node.axis])
+				{
+					stack[stackSize++] = current + 1;
+					current = node.offset;
+				} else {
+					stack[stackSize++] = node.offset;
+					current = current + 1;
+				}
+				continue;
+			}
+		}
+
+		if(stackSize == 0)
+			break;
+		--stackSize;
+		current = stack[stackSize];
+		first = stackFirst[stackSize];
+	}
+}
+
+template<class T>
+void BVH::ConvertNodes(std::vector<BVHNodeT<T> >& result) const
+{
+	// Boxes of lower precision are padded by several ulps of the scene scale, which covers both rounding of
+	// the bounds and of ray origin and slab distances in precision T (like boxes of WideBVH).
+	BoundingBox bounds = GetBounds();
+	Scalar scale = 0;
+	for(int k = 0; k < 3; k++)
+		scale = std::max(scale, std::max(std::abs(bounds.minDim.data[k]), std::abs(bounds.maxDim.data[k])));
+	Scalar padding = sizeof(T) < sizeof(Scalar) ? scale * 16 * std::numeric_limits<T>::epsilon() : 0;
+
+	result.resize(nodes.size());
+	for(unsigned int i = 0; i < nodes.size(); i++)
+	{
+		const BVHNode& node = nodes[i];
+		for(int k = 0; k < 3; k++)
+		{
+			result[i].bounds.minDim.data[k] = (T)(node.bounds.minDim.data[k] - padding);
+			result[i].bounds.maxDim.data[k] = (T)(node.bounds.maxDim.data[k] + padding);
+		}
+		result[i].offset = node.offset;
+		result[i].count = node.count;
+		result[i].axis = node.axis;
+	}
+}
@@ -0,0 +1,83 @@
+#include "CompiledTriangles.h"
+#include <map>
+
+template<class T>
+void CompiledTrianglesT<T>::Compile(const std::vector<Vec3>& vertices, const std::vector<int>& indices,
+	const std::vector<Material*>& materials, const std::vector<int>& order)
+{
+	int N = order.size();
+	storage.resize(CompiledTriangles_ArrayCount * N);
+	materialIdStorage.resize(N);
+
+	// Palette of distinct materials. Neighbouring triangles mostly share material, so map is rarely searched.
+	std::map<Material*, int> ids;
+	paletteStorage.clear();
+	for(unsigned int i = 0; i < materials.size(); i++)
+	{
+		if(i > 0 && materials[i] == materials[i-1])
+			continue;
+		if(ids.insert(std::make_pair(materials[i], (int)paletteStorage.size())).second)
+			paletteStorage.push_back(materials[i]);
+	}
+
+	T* arrays = storage.empty() ? 0 : &storage[0];
+	#pragma omp parallel
+	{
+		Material* lastMaterial = 0;
+		int lastId = -1;
+		#pragma omp for
+		for(int i = 0; i < N; i++)
+		{
+			int triangle = order[i];
+			const Vec3& p1 = vertices[indices[triangle*3]];
+			Vec3 e1 = vertices[indices[triangle*3+1]] - p1;
+			Vec3 e2 = vertices[indices[triangle*3+2]] - p1;
+			Vec3 n = (e1 ^ e2).Normal();
+
+			for(int k = 0; k < 3; k++)
+			{
+				arrays[(CompiledTriangles_Vertex0 + k)*N + i] = (T)p1.data[k];
+				arrays[(CompiledTriangles_Edge1 + k)*N + i] = (T)e1.data[k];
+				arrays[(CompiledTriangles_Edge2 + k)*N + i] = (T)e2.data[k];
+				arrays[(CompiledTriangles_Normal + k)*N + i] = (T)n.data[k];
+			}
+			if(lastId < 0 || materials[triangle] != lastMaterial)
+			{
+				lastMaterial = materials[triangle];
+				lastId = ids.find(lastMaterial)->second;
+			}
+			materialIdStorage[i] = lastId;
+		}
+	}
+
+	data = arrays;
+	materialIds = materialIdStorage.empty() ? 0 : &materialIdStorage[0];
+	palette = paletteStorage.empty() ? 0 : &paletteStorage[0];
+	count = N;
+}
+
+template<class T>
+void CompiledTrianglesT<T>::Attach(const T* data, const int* materialIds, int count, Material* const* palette)
+{
+	Clear();
+	this->data = data;
+	this->materialIds = materialIds;
+	this->palette = palette;
+	this->count = count;
+}
+
+template<class T>
+void CompiledTrianglesT<T>::Clear()
+{
+	storage.clear();
+	materialIdStorage.clear();
+	paletteStorage.clear();
+	data = 0;
+	materialIds = 0;
+	palette = 0;
+	count = 0;
+}
+
+// Precisions used by meshes.
+template class CompiledTrianglesT<Scalar>;
+template class CompiledTrianglesT<ScalarCompressed>;
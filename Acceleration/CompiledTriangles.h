@@ -0,0 +1,184 @@
+#pragma once
+
+#include "../Illumination.h"
+#include <vector>
+
+// Arrays of compiled triangles, each holds x, y and z component arrays.
+const int CompiledTriangles_Vertex0 = 0;
+const int CompiledTriangles_Edge1 = 3;
+const int CompiledTriangles_Edge2 = 6;
+const int CompiledTriangles_Normal = 9;
+const int CompiledTriangles_ArrayCount = 12;
+
+// Triangles compiled for intersection. First vertex, both edges and normal are precomputed and stored as
+// structure of arrays, in order given at compile time (usually BVH slot order), so the intersection
+// kernel reads consecutive memory and needs no vertex indirection or normalization. All arrays are in
+// one block and materials are stored as indices to a palette, so compiled triangles hold no pointers
+// and can be attached to external memory (a memory mapped mesh cache) instead of being compiled.
+// Triangles are stored and intersected in precision T; single precision halves memory traffic of
+// kernels, hit distances are then accurate to float rounding only.
+template<class T>
+class CompiledTrianglesT
+{
+	std::vector<T> storage;
+	std::vector<int> materialIdStorage;
+	std::vector<Material*> paletteStorage;
+	// Arrays used by kernels; they point to storage or to attached memory.
+	const T* data;
+	const int* materialIds;
+	Material* const* palette;
+	int count;
+
+	// Not copyable (pointers refer to own storage).
+	CompiledTrianglesT(const CompiledTrianglesT&);
+	CompiledTrianglesT& operator=(const CompiledTrianglesT&);
+public:
+	CompiledTrianglesT() : data(0), materialIds(0), palette(0), count(0) {}
+
+	// Compiles triangles; triangle i is given by vertices[indices[order[i]*3+k]] and materials[order[i]].
+	void Compile(const std::vector<Vec3>& vertices, const std::vector<int>& indices,
+		const std::vector<Material*>& materials, const std::vector<int>& order);
+	// Uses external arrays laid out as by GetData and GetMaterialIds; they must outlive the attachment.
+	void Attach(const T* data, const int* materialIds, int count, Material* const* palette);
+	void Clear();
+	int Count() const { return count; }
+	Vec3T<T> GetArray(int array, int i) const
+	{
+		const T* p = data + array*count + i;
+		return Vec3T<T>(p[0], p[count], p[2*count]);
+	}
+	Vec3T<T> GetVertex0(int i) const { return GetArray(CompiledTriangles_Vertex0, i); }
+	Vec3T<T> GetEdge1(int i) const { return GetArray(CompiledTriangles_Edge1, i); }
+	Vec3T<T> GetEdge2(int i) const { return GetArray(CompiledTriangles_Edge2, i); }
+	Material* GetMaterial(int i) const { return palette[materialIds[i]]; }
+
+	// CompiledTriangles_ArrayCount component arrays of Count() values, one after another.
+	const T* GetData() const { return data; }
+	// Index of material of each triangle into palette.
+	const int* GetMaterialIds() const { return materialIds; }
+	Material* const* GetPalette() const { return palette; }
+
+	// Moller-Trumbore intersection of triangle i by ray given in precision T, updates result if hit is closer.
+	inline void Intersect(int i, const Vec3T<T>& origin, const Vec3T<T>& direction, IntersectResult& result) const;
+	// True if triangle i is hit at distance in [IL_MinimumNextIntersectionDistance, maxDistance).
+	inline bool Occludes(int i, const Vec3T<T>& origin, const Vec3T<T>& direction, Scalar maxDistance) const;
+	// Same for ray in Scalar precision (converted for every call, intersectors below convert once).
+	void Intersect(int i, const Ray& ray, IntersectResult& result) const
+	{
+		Intersect(i, Vec3T<T>(ray.origin), Vec3T<T>(ray.direction), result);
+	}
+	bool Occludes(int i, const Ray& ray, Scalar maxDistance) const
+	{
+		return Occludes(i, Vec3T<T>(ray.origin), Vec3T<T>(ray.direction), maxDistance);
+	}
+};
+
+typedef CompiledTrianglesT<Scalar> CompiledTriangles;
+
+// Intersects compiled triangles in BVH leaves. Ray is converted to precision of triangles once and
+// again only when intersector is called with another ray.
+template<class T>
+struct TriangleIntersectorT
+{
+	const CompiledTrianglesT<T>& triangles;
+	const Ray* converted;
+	Vec3T<T> origin, direction;
+
+	TriangleIntersectorT(const CompiledTrianglesT<T>& t) : triangles(t), converted(0) {}
+	void operator()(int slot, const Ray& ray, IntersectResult& result)
+	{
+		if(&ray != converted)
+		{
+			origin = Vec3T<T>(ray.origin);
+			direction = Vec3T<T>(ray.direction);
+			converted = &ray;
+		}
+		triangles.Intersect(slot, origin, direction, result);
+	}
+	void operator()(int slot, const RayPacket& packet, IntersectResult* results, const int* active, int activeCount)
+	{
+		for(int i = 0; i < activeCount; i++)
+			triangles.Intersect(slot, packet.rays[active[i]], results[active[i]]);
+	}
+};
+
+template<class T>
+struct TriangleOccluderT
+{
+	const CompiledTrianglesT<T>& triangles;
+	const Ray* converted;
+	Vec3T<T> origin, direction;
+
+	TriangleOccluderT(const CompiledTrianglesT<T>& t) : triangles(t), converted(0) {}
+	bool operator()(int slot, const Ray& ray, Scalar maxDistance)
+	{
+		if(&ray != converted)
+		{
+			origin = Vec3T<T>(ray.origin);
+			direction = Vec3T<T>(ray.direction);
+			converted = &ray;
+		}
+		return triangles.Occludes(slot, origin, direction, maxDistance);
+	}
+};
+
+typedef TriangleIntersectorT<Scalar> TriangleIntersector;
+typedef TriangleOccluderT<Scalar> TriangleOccluder;
+
+template<class T>
+void CompiledTrianglesT<T>::Intersect(int i, const Vec3T<T>& origin, const Vec3T<T>& direction, IntersectResult& result) const
+{
+	Vec3T<T> e1 = GetEdge1(i);
+	Vec3T<T> e2 = GetEdge2(i);
+
+	// Determinant is zero when ray is parallel to triangle plane.
+	Vec3T<T> p = direction ^ e2;
+	T det = e1 * p;
+	if(det == 0)
+		return;
+	T invDet = 1 / det;
+
+	// Barycentric coordinates; edges are inclusive.
+	Vec3T<T> t = origin - GetVertex0(i);
+	T u = (t * p) * invDet;
+	if(u < 0 || u > 1)
+		return;
+	Vec3T<T> q = t ^ e1;
+	T v = (direction * q) * invDet;
+	if(v < 0 || u + v > 1)
+		return;
+
+	Scalar distance = (e2 * q) * invDet;
+	if(distance < IL_MinimumNextIntersectionDistance || distance > result.distance)
+		return;
+
+	result.distance = distance;
+	result.normal = Vec3(GetArray(CompiledTriangles_Normal, i));
+	result.materialData = NULL;
+	result.material = GetMaterial(i);
+}
+
+template<class T>
+bool CompiledTrianglesT<T>::Occludes(int i, const Vec3T<T>& origin, const Vec3T<T>& direction, Scalar maxDistance) const
+{
+	Vec3T<T> e1 = GetEdge1(i);
+	Vec3T<T> e2 = GetEdge2(i);
+
+	Vec3T<T> p = direction ^ e2;
+	T det = e1 * p;
+	if(det == 0)
+		return false;
+	T invDet = 1 / det;
+
+	Vec3T<T> t = origin - GetVertex0(i);
+	T u = (t * p) * invDet;
+	if(u < 0 || u > 1)
+		return false;
+	Vec3T<T> q = t ^ e1;
+	T v = (direction * q) * invDet;
+	if(v < 0 || u + v > 1)
+		return false;
+
+	Scalar distance = (e2 * q) * invDet;
+	return distance >= IL_MinimumNextIntersectionDistance && distance < maxDistance;
+}
@@ -0,0 +1,69 @@
+#include "CpuFeatures.h"
+
+#ifdef _MSC_VER
+#include <intrin.h>
+#else
+#include <cpuid.h>
+#endif
+
+static void Cpuid(int info[4], int function)
+{
+#ifdef _MSC_VER
+	__cpuidex(info, function, 0);
+#else
+	__cpuid_count(function, 0, info[0], info[1], info[2], info[3]);
+#endif
+}
+
+// Reads extended control register 0 (which register states OS saves on context switch).
+static unsigned int ReadXCR0()
+{
+#ifdef _MSC_VER
+	return (unsigned int)_xgetbv(0);
+#else
+	unsigned int eax, edx;
+	__asm__("xgetbv" : "=a"(eax), "=d"(edx) : "c"(0));
+	return eax;
+#endif
+}
+
+static SimdLevel DetectSimdLevel()
+{
+	int info[4];
+	Cpuid(info, 0);
+	int maxFunction = info[0];
+	if(maxFunction < 1)
+		return SimdScalar;
+
+	Cpuid(info, 1);
+	bool sse2 = (info[3] & (1 << 26)) != 0;
+	bool osxsave = (info[2] & (1 << 27)) != 0;
+	bool avx = (info[2] & (1 << 28)) != 0;
+	bool fma = (info[2] & (1 << 12)) != 0;
+	if(!sse2)
+		return SimdScalar;
+
+	// AVX needs OS support for saving YMM registers.
+	if(!osxsave || !avx || !fma || (ReadXCR0() & 6) != 6 || maxFunction < 7)
+		return SimdSSE2;
+
+	Cpuid(info, 7);
+	bool avx2 = (info[1] & (1 << 5)) != 0;
+	return avx2 ? SimdAVX2 : SimdSSE2;
+}
+
+static volatile int detectedLevel = -1;
+static volatile int levelLimit = SimdAVX2;
+
+SimdLevel GetSimdLevel()
+{
+	// Detection is idempotent, so concurrent first calls are harmless.
+	if(detectedLevel < 0)
+		detectedLevel = DetectSimdLevel();
+	return (SimdLevel)(detectedLevel < levelLimit ? detectedLevel : levelLimit);
+}
+
+void LimitSimdLevel(SimdLevel maxLevel)
+{
+	levelLimit = maxLevel;
+}
@@ -0,0 +1,15 @@
+#pragma once
+
+// Instruction sets usable by SIMD kernels, in increasing order.
+enum SimdLevel
+{
+	SimdScalar = 0,		//< No SIMD, plain C++ fallback.
+	SimdSSE2 = 1,		//< 4 wide float kernels.
+	SimdAVX2 = 2		//< 8 wide float kernels.
+};
+
+// Detects best instruction set supported by both CPU and OS (detected once, cached).
+SimdLevel GetSimdLevel();
+
+// Limits detected level (for benchmarks and testing of fallbacks), SimdAVX2 means no limit.
+void LimitSimdLevel(SimdLevel maxLevel);
@@ -0,0 +1,238 @@
+#include "KdTree.h"
+#include <algorithm>
+#include <cmath>
+
+// Nodes with at least this many primitives evaluate split axes in parallel.
+const int KdTree_ParallelThreshold = 4 * 1024;
+// Nodes with at least this many primitives evaluate only planes at bin boundaries instead of sorting bounds.
+const int KdTree_BinThreshold = 1024;
+const int KdTree_BinCount = 64;
+
+// Candidate split plane given by primitive bounds. At equal positions ends are processed before
+// planar primitives and those before starts, so counts on both sides are right when plane is evaluated.
+struct KdTreeEvent
+{
+	enum Type { End = 0, Planar = 1, Start = 2 };
+
+	Scalar position;
+	int type;
+
+	KdTreeEvent() {}
+	KdTreeEvent(Scalar p, int t) : position(p), type(t) {}
+	bool operator<(const KdTreeEvent& e) const
+	{
+		return position < e.position || (position == e.position && type < e.type);
+	}
+};
+
+void KdTree::Build(const std::vector<BoundingBox>& primitiveBounds)
+{
+	Clear();
+
+	std::vector<KdTreeBuildPrimitive> build;
+	build.reserve(primitiveBounds.size());
+	for(unsigned int i = 0; i < primitiveBounds.size(); i++)
+	{
+		if(primitiveBounds[i].IsEmpty())
+			continue;
+		KdTreeBuildPrimitive primitive;
+		primitive.bounds = primitiveBounds[i];
+		primitive.index = i;
+		build.push_back(primitive);
+		bounds.Extend(primitiveBounds[i]);
+	}
+	if(build.empty())
+		return;
+
+	int N = build.size();
+	int depthLimit = maxDepth > 0 ? maxDepth : (int)(8 + 1.3 * std::log((double)N) / std::log(2.0));
+	depthLimit = std::min(depthLimit, KdTree_MaxDepth - 1);
+	BuildRecursive(build, bounds, 0, depthLimit);
+}
+
+bool KdTree::FindSplit(const std::vector<KdTreeBuildPrimitive>& build, const BoundingBox& nodeBounds, int& axis, Scalar& split) const
+{
+	int N = build.size();
+	Scalar area = nodeBounds.SurfaceArea();
+	if(N <= 1 || area <= 0)
+		return false;
+	Vec3 extent = nodeBounds.Extent();
+
+	// Each axis is swept separately, leaf cost is N primitive intersections.
+	Scalar bestCost[3] = { (Scalar)N, (Scalar)N, (Scalar)N };
+	Scalar bestSplit[3];
+	#pragma omp parallel for if(N >= KdTree_ParallelThreshold)
+	for(int a = 0; a < 3; a++)
+	{
+		// Areas of children are linear in split position: area of slab faces plus perimeter times length.
+		int a1 = (a + 1) % 3, a2 = (a + 2) % 3;
+		Scalar capArea = 2 * extent.data[a1] * extent.data[a2];
+		Scalar perimeter = 2 * (extent.data[a1] + extent.data[a2]);
+		Scalar nodeMin = nodeBounds.minDim.data[a], nodeMax = nodeBounds.maxDim.data[a];
+		if(extent.data[a] <= 0)
+			continue;
+
+		if(N >= KdTree_BinThreshold)
+		{
+			// Primitive overlaps left side of boundary k if it starts in bin below k, right side if it ends in bin k or above.
+			int starts[KdTree_BinCount], ends[KdTree_BinCount];
+			std::fill(starts, starts + KdTree_BinCount, 0);
+			std::fill(ends, ends + KdTree_BinCount, 0);
+			Scalar binScale = KdTree_BinCount / extent.data[a];
+			for(int i = 0; i < N; i++)
+			{
+				int startBin = (int)((build[i].bounds.minDim.data[a] - nodeMin) * binScale);
+				int endBin = (int)((build[i].bounds.maxDim.data[a] - nodeMin) * binScale);
+				starts[std::max(0, std::min(KdTree_BinCount - 1, startBin))]++;
+				ends[std::max(0, std::min(KdTree_BinCount - 1, endBin))]++;
+			}
+
+			int left = 0, right = N;
+			for(int k = 1; k < KdTree_BinCount; k++)
+			{
+				left += starts[k-1];
+				right -= ends[k-1];
+				Scalar position = nodeMin + extent.data[a] * k / KdTree_BinCount;
+				Scalar leftArea = capArea + perimeter * (position - nodeMin);
+				Scalar rightArea = capArea + perimeter * (nodeMax - position);
+				Scalar bonus = left == 0 || right == 0 ? 1 - emptyBonus : 1;
+				Scalar cost = traversalCost + bonus * (leftArea * left + rightArea * right) / area;
+				if(cost < bestCost[a])
+				{
+					bestCost[a] = cost;
+					bestSplit[a] = position;
+				}
+			}
+			continue;
+		}
+
+		std::vector<KdTreeEvent> events;
+		events.reserve(2*N);
+		for(int i = 0; i < N; i++)
+		{
+			Scalar minimum = build[i].bounds.minDim.data[a], maximum = build[i].bounds.maxDim.data[a];
+			if(minimum == maximum)
+				events.push_back(KdTreeEvent(minimum, KdTreeEvent::Planar));
+			else
+			{
+				events.push_back(KdTreeEvent(minimum, KdTreeEvent::Start));
+				events.push_back(KdTreeEvent(maximum, KdTreeEvent::End));
+			}
+		}
+		std::sort(events.begin(), events.end());
+
+		// Planar primitives on split plane go to the left (below) child.
+		int left = 0, right = N;
+		int E = events.size();
+		for(int e = 0; e < E;)
+		{
+			Scalar position = events[e].position;
+			int ends = 0, planars = 0, starts = 0;
+			while(e < E && events[e].position == position && events[e].type == KdTreeEvent::End) { ends++; e++; }
+			while(e < E && events[e].position == position && events[e].type == KdTreeEvent::Planar) { planars++; e++; }
+			while(e < E && events[e].position == position && events[e].type == KdTreeEvent::Start) { starts++; e++; }
+
+			right -= ends + planars;
+			if(position > nodeMin && position < nodeMax)
+			{
+				int leftCount = left + planars;
+				Scalar leftArea = capArea + perimeter * (position - nodeMin);
+				Scalar rightArea = capArea + perimeter * (nodeMax - position);
+				Scalar bonus = leftCount == 0 || right == 0 ? 1 - emptyBonus : 1;
+				Scalar cost = traversalCost + bonus * (leftArea * leftCount + rightArea * right) / area;
+				if(cost < bestCost[a])
+				{
+					bestCost[a] = cost;
+					bestSplit[a] = position;
+				}
+			}
+			left += starts + planars;
+		}
+	}
+
+	axis = -1;
+	Scalar cost = (Scalar)N;
+	for(int a = 0; a < 3; a++)
+	{
+		if(bestCost[a] < cost)
+		{
+			cost = bestCost[a];
+			axis = a;
+			split = bestSplit[a];
+		}
+	}
+	return axis >= 0;
+}
+
+void KdTree::BuildRecursive(std::vector<KdTreeBuildPrimitive>& build, const BoundingBox& nodeBounds, int depth, int depthLimit)
+{
+	int nodeIndex = nodes.size();
+	nodes.push_back(KdTreeNode());
+
+	int axis;
+	Scalar split;
+	if(depth >= depthLimit || !FindSplit(build, nodeBounds, axis, split))
+	{
+		// Create leaf.
+		KdTreeNode& node = nodes[nodeIndex];
+		node.split = 0;
+		node.axis = 3;
+		node.offset = primitives.size();
+		node.count = build.size();
+		for(unsigned int i = 0; i < build.size(); i++)
+			primitives.push_back(build[i].index);
+		return;
+	}
+
+	// Classify primitives (same rules as the sweep in FindSplit) and clip their bounds to children.
+	std::vector<KdTreeBuildPrimitive> below, above;
+	for(unsigned int i = 0; i < build.size(); i++)
+	{
+		KdTreeBuildPrimitive primitive = build[i];
+		Scalar minimum = primitive.bounds.minDim.data[axis], maximum = primitive.bounds.maxDim.data[axis];
+		if(minimum < split || (minimum == split && maximum == split))
+		{
+			below.push_back(primitive);
+			below.back().bounds.maxDim.data[axis] = std::min(maximum, split);
+		}
+		if(maximum > split)
+		{
+			above.push_back(primitive);
+			above.back().bounds.minDim.data[axis] = std::max(minimum, split);
+		}
+	}
+	std::vector<KdTreeBuildPrimitive>().swap(build);
+
+	BoundingBox belowBounds = nodeBounds, aboveBounds = nodeBounds;
+	belowBounds.maxDim.data[axis] = split;
+	aboveBounds.minDim.data[axis] = split;
+
+	// Create inner node; first child directly follows it.
+	BuildRecursive(below, belowBounds, depth + 1, depthLimit);
+	int second = nodes.size();
+	BuildRecursive(above, aboveBounds, depth + 1, depthLimit);
+
+	KdTreeNode& node = nodes[nodeIndex];
+	node.split = split;
+	node.axis = axis;
+	node.offset = second;
+	node.count = 0;
+}
+
+bool KdTree::ClipRay(const Vec3& origin, const Vec3& invDirection, Scalar maxDistance, Scalar& tMin, Scalar& tMax) const
+{
+	tMin = 0;
+	tMax = maxDistance;
+	for(int axis = 0; axis < 3; axis++)
+	{
+		Scalar tNear = (bounds.minDim.data[axis] - origin.data[axis]) * invDirection.data[axis];
+		Scalar tFar = (bounds.maxDim.data[axis] - origin.data[axis]) * invDirection.data[axis];
+		if(tNear > tFar) { Scalar t = tNear; tNear = tFar; tFar = t; }
+		tFar *= 1 + 4*std::numeric_limits<Scalar>::epsilon();
+		if(tNear > tMin) tMin = tNear;
+		if(tFar < tMax) tMax = tFar;
+		if(tMin > tMax)
+			return false;
+	}
+	return true;
+}
@@ -0,0 +1,184 @@
+#pragma once
+
+#include "../Illumination.h"
+#include <vector>
+
+// A node of kd-tree. Nodes are stored in depth first order, so the first (below split) child of inner
+// node always directly follows it.
+struct KdTreeNode
+{
+	Scalar split;	//< Position of split plane of inner node.
+	int axis;		//< Split axis (0,1,2) of inner node, 3 for leaves.
+	int offset;		//< First entry in primitive list for leaves, index of second (above split) child for inner nodes.
+	int count;		//< Number of primitives in leaf.
+
+	bool IsLeaf() const { return axis == 3; }
+};
+
+// Primitive reference used while building; bounds are clipped to node being built.
+struct KdTreeBuildPrimitive
+{
+	BoundingBox bounds;
+	int index;
+};
+
+// Traversal stack depth; build limits depth of tree below it.
+const int KdTree_MaxDepth = 64;
+
+// A kd-tree over abstract primitives, built with surface area heuristic evaluated at all candidate planes
+// (sorted primitive bounds) of small nodes and at bin boundaries of large ones. Primitives overlapping both sides of split are referenced from both, so tree
+// cuts off empty space and traversal stops at the first leaf containing a hit; it often beats BVH on static
+// scenes with large axis aligned primitives (architecture). Like BVH, only bounds are needed for build and
+// owner intersects primitives through intersector object, but primitives are reported by their index.
+class KdTree
+{
+	std::vector<KdTreeNode> nodes;
+	std::vector<int> primitives;
+	BoundingBox bounds;
+
+	// Finds best split of node, returns false if leaf is cheaper.
+	bool FindSplit(const std::vector<KdTreeBuildPrimitive>& build, const BoundingBox& nodeBounds, int& axis, Scalar& split) const;
+	// Builds subtree, build primitives are consumed.
+	void BuildRecursive(std::vector<KdTreeBuildPrimitive>& build, const BoundingBox& nodeBounds, int depth, int depthLimit);
+	// Range of ray inside tree bounds, false if ray misses it.
+	bool ClipRay(const Vec3& origin, const Vec3& invDirection, Scalar maxDistance, Scalar& tMin, Scalar& tMax) const;
+public:
+	// Cost of traversal step relative to primitive intersection.
+	Scalar traversalCost;
+	// Fraction of cost saved by splits with one empty side, favours cutting off empty space.
+	Scalar emptyBonus;
+	// Maximum depth, 0 chooses it from primitive count.
+	int maxDepth;
+
+	KdTree() : traversalCost((Scalar)2), emptyBonus((Scalar)0.2), maxDepth(0) {}
+
+	// Builds tree from primitive bounds; primitive i is reported as index i to intersector.
+	void Build(const std::vector<BoundingBox>& primitiveBounds);
+	bool IsBuilt() const { return !nodes.empty(); }
+	void Clear() { nodes.clear(); primitives.clear(); bounds = BoundingBox(); }
+
+	int GetNodeCount() const { return nodes.size(); }
+	// Number of primitive references in leaves (primitives are counted once for every leaf they overlap).
+	int GetReferenceCount() const { return primitives.size(); }
+	BoundingBox GetBounds() const { return bounds; }
+
+	// Intersects the tree, leaves are visited front to back. Intersector is called as intersector(index, ray, result)
+	// and must update result if closer hit is found, like IGeometry.
+	template<class Intersector>
+	void Intersect(const Ray& ray, IntersectResult& result, Intersector& intersector) const;
+
+	// Any hit query. Occluder is called as occluder(index, ray, maxDistance) and returns true if primitive
+	// blocks the ray; traversal stops at first such primitive.
+	template<class Occluder>
+	bool Occluded(const Ray& ray, Scalar maxDistance, Occluder& occluder) const;
+};
+
+// Far child waiting on traversal stack with ray range inside it.
+struct KdTreeStackEntry
+{
+	int node;
+	Scalar tMin, tMax;
+};
+
+template<class Intersector>
+void KdTree::Intersect(const Ray& ray, IntersectResult& result, Intersector& intersector) const
+{
+	Vec3 invDirection(1/ray.direction.x, 1/ray.direction.y, 1/ray.direction.z);
+	Scalar tMin, tMax;
+	if(nodes.empty() || !ClipRay(ray.origin, invDirection, result.distance, tMin, tMax))
+		return;
+
+	KdTreeStackEntry stack[KdTree_MaxDepth];
+	int stackSize = 0, current = 0;
+	for(;;)
+	{
+		const KdTreeNode& node = nodes[current];
+		if(!node.IsLeaf())
+		{
+			// Child on the side of ray origin is visited first; the other one only if ray crosses split within range.
+			int axis = node.axis;
+			Scalar tSplit = (node.split - ray.origin.data[axis]) * invDirection.data[axis];
+			bool isBelowFirst = ray.origin.data[axis] < node.split ||
+				(ray.origin.data[axis] == node.split && ray.direction.data[axis] <= 0);
+			int first = isBelowFirst ? current + 1 : node.offset;
+			int second = isBelowFirst ? node.offset : current + 1;
+
+			if(tSplit > tMax || tSplit <= 0)
+				current = first;
+			else if(tSplit < tMin)
+				current = second;
+			else
+			{
+				stack[stackSize].node = second;
+				stack[stackSize].tMin = tSplit;
+				stack[stackSize++].tMax = tMax;
+				current = first;
+				tMax = tSplit;
+			}
+			continue;
+		}
+
+		for(int i = 0; i < node.count; i++)
+			intersector(primitives[node.offset + i], ray, result);
+
+		// Hit inside this leaf is closer than anything in leaves behind it.
+		if(result.distance <= tMax || stackSize == 0)
+			return;
+		--stackSize;
+		if(result.distance < stack[stackSize].tMin)
+			return;
+		current = stack[stackSize].node;
+		tMin = stack[stackSize].tMin;
+		tMax = stack[stackSize].tMax;
+	}
+}
+
+template<class Occluder>
+bool KdTree::Occluded(const Ray& ray, Scalar maxDistance, Occluder& occluder) const
+{
+	Vec3 invDirection(1/ray.direction.x, 1/ray.direction.y, 1/ray.direction.z);
+	Scalar tMin, tMax;
+	if(nodes.empty() || !ClipRay(ray.origin, invDirection, maxDistance, tMin, tMax))
+		return false;
+
+	KdTreeStackEntry stack[KdTree_MaxDepth];
+	int stackSize = 0, current = 0;
+	for(;;)
+	{
+		const KdTreeNode& node = nodes[current];
+		if(!node.IsLeaf())
+		{
+			int axis = node.axis;
+			Scalar tSplit = (node.split - ray.origin.data[axis]) * invDirection.data[axis];
+			bool isBelowFirst = ray.origin.data[axis] < node.split ||
+				(ray.origin.data[axis] == node.split && ray.direction.data[axis] <= 0);
+			int first = isBelowFirst ? current + 1 : node.offset;
+			int second = isBelowFirst ? node.offset : current + 1;
+
+			if(tSplit > tMax || tSplit <= 0)
+				current = first;
+			else if(tSplit < tMin)
+				current = second;
+			else
+			{
+				stack[stackSize].node = second;
+				stack[stackSize].tMin = tSplit;
+				stack[stackSize++].tMax = tMax;
+				current = first;
+				tMax = tSplit;
+			}
+			continue;
+		}
+
+		for(int i = 0; i < node.count; i++)
+			if(occluder(primitives[node.offset + i], ray, maxDistance))
+				return true;
+
+		if(stackSize == 0)
+			return false;
+		--stackSize;
+		current = stack[stackSize].node;
+		tMin = stack[stackSize].tMin;
+		tMax = stack[stackSize].tMax;
+	}
+}
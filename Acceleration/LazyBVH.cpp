@@ -0,0 +1,99 @@
+#include "LazyBVH.h"
+
+void LazyBVH::Build(const std::vector<BoundingBox>& primitiveBounds)
+{
+	Clear();
+	int N = primitiveBounds.size();
+	if(N == 0)
+		return;
+
+	build.resize(N);
+	#pragma omp parallel for
+	for(int i = 0; i < N; i++)
+	{
+		build[i].bounds = primitiveBounds[i];
+		build[i].centroid = primitiveBounds[i].Center();
+		build[i].index = i;
+	}
+	splitter.maxLeafSize = maxLeafSize;
+	splitter.traversalCost = traversalCost;
+
+	// Tree with leaves of at least one primitive has at most 2N-1 nodes.
+	blocks.assign((2*N - 1 + LazyBVH_BlockSize - 1) / LazyBVH_BlockSize, (LazyBVHNode*)0);
+	LazyBVHNode& root = GetNode(AllocateNodes(1));
+	for(int i = 0; i < N; i++)
+		root.bounds.Extend(primitiveBounds[i]);
+	root.start = 0;
+	root.end = N;
+	root.depth = 0;
+	root.axis = 0;
+	root.child = LazyBVH_Unexpanded;
+}
+
+void LazyBVH::Clear()
+{
+	for(unsigned int i = 0; i < blocks.size(); i++)
+		delete[] blocks[i];
+	blocks.clear();
+	build.clear();
+	nodeCount = 0;
+}
+
+int LazyBVH::AllocateNodes(int count)
+{
+	int first = nodeCount;
+	for(int b = first >> LazyBVH_BlockShift; b <= (first + count - 1) >> LazyBVH_BlockShift; b++)
+		if(!blocks[b])
+			blocks[b] = new LazyBVHNode[LazyBVH_BlockSize];
+	nodeCount = first + count;
+	return first;
+}
+
+int LazyBVH::Expand(int index)
+{
+	int child;
+	#pragma omp critical(LazyBVH_Expand)
+	{
+		// Another thread may have expanded the node while we waited.
+		LazyBVHNode& node = GetNode(index);
+		child = node.child;
+		if(child == LazyBVH_Unexpanded)
+		{
+			BoundingBox bounds;
+			int axis;
+			int mid = splitter.Split(&build[0], node.start, node.end, node.depth, false, bounds, axis);
+			if(mid < 0)
+				child = LazyBVH_Leaf;
+			else
+			{
+				child = AllocateNodes(2);
+				for(int c = 0; c < 2; c++)
+				{
+					LazyBVHNode& n = GetNode(child + c);
+					n.bounds = BoundingBox();
+					n.start = c == 0 ? node.start : mid;
+					n.end = c == 0 ? mid : node.end;
+					for(int i = n.start; i < n.end; i++)
+						n.bounds.Extend(build[i].bounds);
+					n.depth = node.depth + 1;
+					n.axis = 0;
+					n.child = LazyBVH_Unexpanded;
+				}
+				node.axis = axis;
+			}
+
+			// Children must be complete before other threads can reach them.
+			#pragma omp flush
+			node.child = child;
+		}
+	}
+	return child;
+}
+
+void LazyBVH::ExpandAll()
+{
+	// Nodes are appended, so a single pass over growing node count visits all of them.
+	for(int i = 0; i < nodeCount; i++)
+		if(GetNode(i).child == LazyBVH_Unexpanded)
+			Expand(i);
+}
@@ -0,0 +1,148 @@
+#pragma once
+
+#include "BVH.h"
+#include <vector>
+
+// Values of LazyBVHNode::child other than index of the first child.
+const int LazyBVH_Unexpanded = 0;
+const int LazyBVH_Leaf = -1;
+
+// A node of lazy BVH. Children of a node are a consecutive pair, allocated when node is expanded.
+struct LazyBVHNode
+{
+	BoundingBox bounds;
+	int start, end;		//< Range of primitives in build order.
+	int depth;
+	int axis;			//< Split axis of inner node, used for front to back traversal.
+	volatile int child;	//< First child, LazyBVH_Unexpanded before the node is visited or LazyBVH_Leaf.
+};
+
+// Number of nodes in a block of node pool.
+const int LazyBVH_BlockShift = 12;
+const int LazyBVH_BlockSize = 1 << LazyBVH_BlockShift;
+
+// A bounding volume hierarchy built on demand: Build only stores primitive bounds and the root, and each node
+// is split (with the binned SAH of BVH) the first time a ray enters it. Parts of the scene no ray reaches are
+// never built, so a crop or a low sample preview of a huge scene starts rendering almost immediately.
+// Traversal is safe from several threads: expansion is done in a critical section and children are
+// published only when complete. Nodes are allocated from blocks of fixed size which are never moved, so
+// nodes can be read while other threads are expanding. Primitives are reported by their index.
+class LazyBVH
+{
+	std::vector<BVHBuildPrimitive> build;
+	// Node blocks; the table is sized for the largest possible tree, so it is never reallocated.
+	std::vector<LazyBVHNode*> blocks;
+	volatile int nodeCount;
+	// Holds split parameters (its Split is used for expansion).
+	BVH splitter;
+
+	LazyBVHNode& GetNode(int index) const { return blocks[index >> LazyBVH_BlockShift][index & (LazyBVH_BlockSize - 1)]; }
+	int AllocateNodes(int count);
+	// Splits node (or marks it as leaf) if no other thread did it yet, returns its child field.
+	int Expand(int index);
+
+	LazyBVH(const LazyBVH&);
+	LazyBVH& operator=(const LazyBVH&);
+public:
+	// Same meaning as in BVH.
+	int maxLeafSize;
+	Scalar traversalCost;
+
+	LazyBVH() : nodeCount(0), maxLeafSize(4), traversalCost((Scalar)0.125) {}
+	~LazyBVH() { Clear(); }
+
+	// Stores primitive bounds and creates the root; primitive i is reported as index i to intersector.
+	void Build(const std::vector<BoundingBox>& primitiveBounds);
+	// Expands all remaining nodes (steady state for benchmarks).
+	void ExpandAll();
+	bool IsBuilt() const { return nodeCount > 0; }
+	void Clear();
+
+	// Number of nodes created so far.
+	int GetNodeCount() const { return nodeCount; }
+	BoundingBox GetBounds() const { return nodeCount > 0 ? GetNode(0).bounds : BoundingBox(); }
+
+	// Intersects the hierarchy, expanding visited nodes. Intersector is called as intersector(index, ray, result)
+	// and must update result if closer hit is found, like IGeometry.
+	template<class Intersector>
+	void Intersect(const Ray& ray, IntersectResult& result, Intersector& intersector);
+
+	// Any hit query. Occluder is called as occluder(index, ray, maxDistance) and returns true if primitive
+	// blocks the ray; traversal stops at first such primitive.
+	template<class Occluder>
+	bool Occluded(const Ray& ray, Scalar maxDistance, Occluder& occluder);
+};
+
+template<class Intersector>
+void LazyBVH::Intersect(const Ray& ray, IntersectResult& result, Intersector& intersector)
+{
+	if(nodeCount == 0)
+		return;
+	Vec3 invDirection(1/ray.direction.x, 1/ray.direction.y, 1/ray.direction.z);
+	int dirIsNegative[3] = { invDirection.x < 0, invDirection.y < 0, invDirection.z < 0 };
+
+	int stack[BVH_MaxDepth];
+	int stackSize = 0, current = 0;
+	for(;;)
+	{
+		const LazyBVHNode& node = GetNode(current);
+		if(node.bounds.IntersectRay(ray.origin, invDirection, result.distance))
+		{
+			int child = node.child;
+			if(child == LazyBVH_Unexpanded)
+				child = Expand(current);
+			if(child == LazyBVH_Leaf)
+			{
+				for(int i = node.start; i < node.end; i++)
+					intersector(build[i].index, ray, result);
+			} else {
+				int first = dirIsNegative[node.axis];
+				stack[stackSize++] = child + 1 - first;
+				current = child + first;
+				continue;
+			}
+		}
+
+		if(stackSize == 0)
+			break;
+		current = stack[--stackSize];
+	}
+}
+
+template<class Occluder>
+bool LazyBVH::Occluded(const Ray& ray, Scalar maxDistance, Occluder& occluder)
+{
+	if(nodeCount == 0)
+		return false;
+	Vec3 invDirection(1/ray.direction.x, 1/ray.direction.y, 1/ray.direction.z);
+	int dirIsNegative[3] = { invDirection.x < 0, invDirection.y < 0, invDirection.z < 0 };
+
+	int stack[BVH_MaxDepth];
+	int stackSize = 0, current = 0;
+	for(;;)
+	{
+		const LazyBVHNode& node = GetNode(current);
+		if(node.bounds.IntersectRay(ray.origin, invDirection, maxDistance))
+		{
+			int child = node.child;
+			if(child == LazyBVH_Unexpanded)
+				child = Expand(current);
+			if(child == LazyBVH_Leaf)
+			{
+				for(int i = node.start; i < node.end; i++)
+					if(occluder(build[i].index, ray, maxDistance))
+						return true;
+			} else {
+				int first = dirIsNegative[node.axis];
+				stack[stackSize++] = child + 1 - first;
+				current = child + first;
+				continue;
+			}
+		}
+
+		if(stackSize == 0)
+			break;
+		current = stack[--stackSize];
+	}
+	return false;
+}
@@ -0,0 +1,118 @@
+#include "PrimitiveBlocks.h"
+#include <emmintrin.h>
+#include <cmath>
+
+// Same NaN behaviour as SIMD min/max (second operand is returned), so scalar kernels match them.
+static inline Scalar MinSecond(Scalar a, Scalar b) { return a < b ? a : b; }
+static inline Scalar MaxSecond(Scalar a, Scalar b) { return a > b ? a : b; }
+
+int IntersectSphereBlock(const SphereBlock& block, const Ray& ray, Scalar maxDistance, Scalar* distances)
+{
+	Scalar a = ray.direction * ray.direction;
+	int mask = 0;
+	for(int lane = 0; lane < block.count; lane++)
+	{
+		Scalar ocX = ray.origin.x - block.centerX[lane];
+		Scalar ocY = ray.origin.y - block.centerY[lane];
+		Scalar ocZ = ray.origin.z - block.centerZ[lane];
+		Scalar b = ray.direction.x*ocX + ray.direction.y*ocY + ray.direction.z*ocZ;
+		Scalar c = ocX*ocX + ocY*ocY + ocZ*ocZ - block.radiusSquared[lane];
+		Scalar D = b*b - a*c;
+		Scalar sD = std::sqrt(MaxSecond(D, 0));
+
+		// Near intersection if in range, far one otherwise.
+		Scalar negativeB = 0 - b;
+		Scalar t1 = (negativeB - sD) / a, t2 = (negativeB + sD) / a;
+		Scalar t = t1 >= IL_MinimumNextIntersectionDistance && t1 <= maxDistance ? t1 : t2;
+		distances[lane] = t;
+		if(D > 0 && t >= IL_MinimumNextIntersectionDistance && t <= maxDistance)
+			mask |= 1 << lane;
+	}
+	return mask;
+}
+
+int IntersectBoxBlock(const BoxBlock& block, const Ray& ray, const Vec3& invDirection, Scalar maxDistance, Scalar* distances)
+{
+	int mask = 0;
+	for(int lane = 0; lane < block.count; lane++)
+	{
+		Scalar x0 = (block.minX[lane] - ray.origin.x) * invDirection.x, x1 = (block.maxX[lane] - ray.origin.x) * invDirection.x;
+		Scalar y0 = (block.minY[lane] - ray.origin.y) * invDirection.y, y1 = (block.maxY[lane] - ray.origin.y) * invDirection.y;
+		Scalar z0 = (block.minZ[lane] - ray.origin.z) * invDirection.z, z1 = (block.maxZ[lane] - ray.origin.z) * invDirection.z;
+
+		// Slabs giving NaN (ray in the plane of a face) are ignored.
+		Scalar entry = MaxSecond(MinSecond(x0, x1), MaxSecond(MinSecond(y0, y1),
+			MaxSecond(MinSecond(z0, z1), -std::numeric_limits<Scalar>::infinity())));
+		Scalar exit = MinSecond(MaxSecond(x0, x1), MinSecond(MaxSecond(y0, y1),
+			MinSecond(MaxSecond(z0, z1), std::numeric_limits<Scalar>::infinity())));
+
+		// Entry face if in range, exit face for rays starting inside.
+		Scalar t = entry >= IL_MinimumNextIntersectionDistance ? entry : exit;
+		distances[lane] = t;
+		if(entry <= exit && t >= IL_MinimumNextIntersectionDistance && t <= maxDistance)
+			mask |= 1 << lane;
+	}
+	return mask;
+}
+
+int IntersectSphereBlock_SSE2(const SphereBlock& block, const Ray& ray, Scalar maxDistance, Scalar* distances)
+{
+	__m128d dx = _mm_set1_pd(ray.direction.x), dy = _mm_set1_pd(ray.direction.y), dz = _mm_set1_pd(ray.direction.z);
+	__m128d a = _mm_set1_pd(ray.direction * ray.direction);
+	__m128d minimum = _mm_set1_pd(IL_MinimumNextIntersectionDistance), maximum = _mm_set1_pd(maxDistance);
+	__m128d zero = _mm_setzero_pd();
+	int mask = 0;
+
+	// Two lanes per half.
+	for(int half = 0; half < PrimitiveBlock_Width; half += 2)
+	{
+		__m128d ocX = _mm_sub_pd(_mm_set1_pd(ray.origin.x), _mm_loadu_pd(block.centerX + half));
+		__m128d ocY = _mm_sub_pd(_mm_set1_pd(ray.origin.y), _mm_loadu_pd(block.centerY + half));
+		__m128d ocZ = _mm_sub_pd(_mm_set1_pd(ray.origin.z), _mm_loadu_pd(block.centerZ + half));
+		__m128d b = _mm_add_pd(_mm_add_pd(_mm_mul_pd(dx, ocX), _mm_mul_pd(dy, ocY)), _mm_mul_pd(dz, ocZ));
+		__m128d c = _mm_sub_pd(_mm_add_pd(_mm_add_pd(_mm_mul_pd(ocX, ocX), _mm_mul_pd(ocY, ocY)), _mm_mul_pd(ocZ, ocZ)),
+			_mm_loadu_pd(block.radiusSquared + half));
+		__m128d D = _mm_sub_pd(_mm_mul_pd(b, b), _mm_mul_pd(a, c));
+		__m128d sD = _mm_sqrt_pd(_mm_max_pd(D, zero));
+
+		__m128d negativeB = _mm_sub_pd(zero, b);
+		__m128d t1 = _mm_div_pd(_mm_sub_pd(negativeB, sD), a), t2 = _mm_div_pd(_mm_add_pd(negativeB, sD), a);
+		__m128d isNear = _mm_and_pd(_mm_cmpge_pd(t1, minimum), _mm_cmple_pd(t1, maximum));
+		__m128d t = _mm_or_pd(_mm_and_pd(isNear, t1), _mm_andnot_pd(isNear, t2));
+		__m128d isHit = _mm_and_pd(_mm_cmpgt_pd(D, zero), _mm_and_pd(_mm_cmpge_pd(t, minimum), _mm_cmple_pd(t, maximum)));
+		_mm_storeu_pd(distances + half, t);
+		mask |= _mm_movemask_pd(isHit) << half;
+	}
+	return mask & ((1 << block.count) - 1);
+}
+
+int IntersectBoxBlock_SSE2(const BoxBlock& block, const Ray& ray, const Vec3& invDirection, Scalar maxDistance, Scalar* distances)
+{
+	__m128d ox = _mm_set1_pd(ray.origin.x), oy = _mm_set1_pd(ray.origin.y), oz = _mm_set1_pd(ray.origin.z);
+	__m128d ix = _mm_set1_pd(invDirection.x), iy = _mm_set1_pd(invDirection.y), iz = _mm_set1_pd(invDirection.z);
+	__m128d minimum = _mm_set1_pd(IL_MinimumNextIntersectionDistance), maximum = _mm_set1_pd(maxDistance);
+	__m128d infinity = _mm_set1_pd(std::numeric_limits<Scalar>::infinity());
+	__m128d negativeInfinity = _mm_set1_pd(-std::numeric_limits<Scalar>::infinity());
+	int mask = 0;
+
+	for(int half = 0; half < PrimitiveBlock_Width; half += 2)
+	{
+		__m128d x0 = _mm_mul_pd(_mm_sub_pd(_mm_loadu_pd(block.minX + half), ox), ix);
+		__m128d x1 = _mm_mul_pd(_mm_sub_pd(_mm_loadu_pd(block.maxX + half), ox), ix);
+		__m128d y0 = _mm_mul_pd(_mm_sub_pd(_mm_loadu_pd(block.minY + half), oy), iy);
+		__m128d y1 = _mm_mul_pd(_mm_sub_pd(_mm_loadu_pd(block.maxY + half), oy), iy);
+		__m128d z0 = _mm_mul_pd(_mm_sub_pd(_mm_loadu_pd(block.minZ + half), oz), iz);
+		__m128d z1 = _mm_mul_pd(_mm_sub_pd(_mm_loadu_pd(block.maxZ + half), oz), iz);
+
+		// Min/max return second operand for NaN, so NaN slabs are ignored.
+		__m128d entry = _mm_max_pd(_mm_min_pd(x0, x1), _mm_max_pd(_mm_min_pd(y0, y1), _mm_max_pd(_mm_min_pd(z0, z1), negativeInfinity)));
+		__m128d exit = _mm_min_pd(_mm_max_pd(x0, x1), _mm_min_pd(_mm_max_pd(y0, y1), _mm_min_pd(_mm_max_pd(z0, z1), infinity)));
+
+		__m128d isEntry = _mm_cmpge_pd(entry, minimum);
+		__m128d t = _mm_or_pd(_mm_and_pd(isEntry, entry), _mm_andnot_pd(isEntry, exit));
+		__m128d isHit = _mm_and_pd(_mm_cmple_pd(entry, exit), _mm_and_pd(_mm_cmpge_pd(t, minimum), _mm_cmple_pd(t, maximum)));
+		_mm_storeu_pd(distances + half, t);
+		mask |= _mm_movemask_pd(isHit) << half;
+	}
+	return mask & ((1 << block.count) - 1);
+}
@@ -0,0 +1,57 @@
+#pragma once
+
+#include "../Illumination.h"
+#include "CpuFeatures.h"
+
+// Number of primitives in a block, tested at once by block kernels.
+const int PrimitiveBlock_Width = 4;
+
+// Spheres in structure of arrays form. Unused lanes repeat the last sphere and are masked by count.
+struct SphereBlock
+{
+	Scalar centerX[PrimitiveBlock_Width], centerY[PrimitiveBlock_Width], centerZ[PrimitiveBlock_Width];
+	Scalar radiusSquared[PrimitiveBlock_Width];
+	int index[PrimitiveBlock_Width];	//< Index of sphere in its set.
+	int count;							//< Number of used lanes.
+};
+
+// Axis aligned boxes in structure of arrays form. Unused lanes repeat the last box and are masked by count.
+struct BoxBlock
+{
+	Scalar minX[PrimitiveBlock_Width], minY[PrimitiveBlock_Width], minZ[PrimitiveBlock_Width];
+	Scalar maxX[PrimitiveBlock_Width], maxY[PrimitiveBlock_Width], maxZ[PrimitiveBlock_Width];
+	int index[PrimitiveBlock_Width];	//< Index of box in its set.
+	int count;							//< Number of used lanes.
+};
+
+// Block kernels compute for each lane the nearest hit in range [IL_MinimumNextIntersectionDistance, maxDistance]
+// into distances and return bitmask of lanes having one. They are branchless and in double precision without
+// fused operations, so all instruction sets give bit identical results.
+int IntersectSphereBlock(const SphereBlock& block, const Ray& ray, Scalar maxDistance, Scalar* distances);
+int IntersectSphereBlock_SSE2(const SphereBlock& block, const Ray& ray, Scalar maxDistance, Scalar* distances);
+int IntersectSphereBlock_AVX2(const SphereBlock& block, const Ray& ray, Scalar maxDistance, Scalar* distances);
+
+// Box kernels use slab test (ray inside a box hits its exit face); invDirection is 1/ray.direction.
+int IntersectBoxBlock(const BoxBlock& block, const Ray& ray, const Vec3& invDirection, Scalar maxDistance, Scalar* distances);
+int IntersectBoxBlock_SSE2(const BoxBlock& block, const Ray& ray, const Vec3& invDirection, Scalar maxDistance, Scalar* distances);
+int IntersectBoxBlock_AVX2(const BoxBlock& block, const Ray& ray, const Vec3& invDirection, Scalar maxDistance, Scalar* distances);
+
+// Kernels chosen by instruction set.
+inline int IntersectSphereBlock(SimdLevel level, const SphereBlock& block, const Ray& ray, Scalar maxDistance, Scalar* distances)
+{
+	if(level == SimdAVX2)
+		return IntersectSphereBlock_AVX2(block, ray, maxDistance, distances);
+	if(level == SimdSSE2)
+		return IntersectSphereBlock_SSE2(block, ray, maxDistance, distances);
+	return IntersectSphereBlock(block, ray, maxDistance, distances);
+}
+
+inline int IntersectBoxBlock(SimdLevel level, const BoxBlock& block, const Ray& ray, const Vec3& invDirection,
+	Scalar maxDistance, Scalar* distances)
+{
+	if(level == SimdAVX2)
+		return IntersectBoxBlock_AVX2(block, ray, invDirection, maxDistance, distances);
+	if(level == SimdSSE2)
+		return IntersectBoxBlock_SSE2(block, ray, invDirection, maxDistance, distances);
+	return IntersectBoxBlock(block, ray, invDirection, maxDistance, distances);
+}
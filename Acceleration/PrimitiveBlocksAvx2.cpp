@@ -0,0 +1,60 @@
+// AVX2 kernels of primitive blocks. This file is compiled with /arch:AVX2 and is only called after CPU detection,
+// so it must not contain any code shared with other translation units (inline functions, templates).
+#include "PrimitiveBlocks.h"
+#include <immintrin.h>
+#include <limits>
+
+int IntersectSphereBlock_AVX2(const SphereBlock& block, const Ray& ray, Scalar maxDistance, Scalar* distances)
+{
+	const Scalar* direction = ray.direction.data;
+	const Scalar* origin = ray.origin.data;
+	__m256d dx = _mm256_set1_pd(direction[0]), dy = _mm256_set1_pd(direction[1]), dz = _mm256_set1_pd(direction[2]);
+	__m256d a = _mm256_set1_pd(direction[0]*direction[0] + direction[1]*direction[1] + direction[2]*direction[2]);
+	__m256d minimum = _mm256_set1_pd(IL_MinimumNextIntersectionDistance), maximum = _mm256_set1_pd(maxDistance);
+	__m256d zero = _mm256_setzero_pd();
+
+	__m256d ocX = _mm256_sub_pd(_mm256_set1_pd(origin[0]), _mm256_loadu_pd(block.centerX));
+	__m256d ocY = _mm256_sub_pd(_mm256_set1_pd(origin[1]), _mm256_loadu_pd(block.centerY));
+	__m256d ocZ = _mm256_sub_pd(_mm256_set1_pd(origin[2]), _mm256_loadu_pd(block.centerZ));
+	__m256d b = _mm256_add_pd(_mm256_add_pd(_mm256_mul_pd(dx, ocX), _mm256_mul_pd(dy, ocY)), _mm256_mul_pd(dz, ocZ));
+	__m256d c = _mm256_sub_pd(_mm256_add_pd(_mm256_add_pd(_mm256_mul_pd(ocX, ocX), _mm256_mul_pd(ocY, ocY)), _mm256_mul_pd(ocZ, ocZ)),
+		_mm256_loadu_pd(block.radiusSquared));
+	__m256d D = _mm256_sub_pd(_mm256_mul_pd(b, b), _mm256_mul_pd(a, c));
+	__m256d sD = _mm256_sqrt_pd(_mm256_max_pd(D, zero));
+
+	__m256d negativeB = _mm256_sub_pd(zero, b);
+	__m256d t1 = _mm256_div_pd(_mm256_sub_pd(negativeB, sD), a), t2 = _mm256_div_pd(_mm256_add_pd(negativeB, sD), a);
+	__m256d isNear = _mm256_and_pd(_mm256_cmp_pd(t1, minimum, _CMP_GE_OQ), _mm256_cmp_pd(t1, maximum, _CMP_LE_OQ));
+	__m256d t = _mm256_blendv_pd(t2, t1, isNear);
+	__m256d isHit = _mm256_and_pd(_mm256_cmp_pd(D, zero, _CMP_GT_OQ),
+		_mm256_and_pd(_mm256_cmp_pd(t, minimum, _CMP_GE_OQ), _mm256_cmp_pd(t, maximum, _CMP_LE_OQ)));
+	_mm256_storeu_pd(distances, t);
+	return _mm256_movemask_pd(isHit) & ((1 << block.count) - 1);
+}
+
+int IntersectBoxBlock_AVX2(const BoxBlock& block, const Ray& ray, const Vec3& invDirection, Scalar maxDistance, Scalar* distances)
+{
+	const Scalar* origin = ray.origin.data;
+	__m256d ox = _mm256_set1_pd(origin[0]), oy = _mm256_set1_pd(origin[1]), oz = _mm256_set1_pd(origin[2]);
+	__m256d ix = _mm256_set1_pd(invDirection.data[0]), iy = _mm256_set1_pd(invDirection.data[1]), iz = _mm256_set1_pd(invDirection.data[2]);
+	__m256d minimum = _mm256_set1_pd(IL_MinimumNextIntersectionDistance), maximum = _mm256_set1_pd(maxDistance);
+	__m256d infinity = _mm256_set1_pd(std::numeric_limits<Scalar>::infinity());
+	__m256d negativeInfinity = _mm256_set1_pd(-std::numeric_limits<Scalar>::infinity());
+
+	__m256d x0 = _mm256_mul_pd(_mm256_sub_pd(_mm256_loadu_pd(block.minX), ox), ix);
+	__m256d x1 = _mm256_mul_pd(_mm256_sub_pd(_mm256_loadu_pd(block.maxX), ox), ix);
+	__m256d y0 = _mm256_mul_pd(_mm256_sub_pd(_mm256_loadu_pd(block.minY), oy), iy);
+	__m256d y1 = _mm256_mul_pd(_mm256_sub_pd(_mm256_loadu_pd(block.maxY), oy), iy);
+	__m256d z0 = _mm256_mul_pd(_mm256_sub_pd(_mm256_loadu_pd(block.minZ), oz), iz);
+	__m256d z1 = _mm256_mul_pd(_mm256_sub_pd(_mm256_loadu_pd(block.maxZ), oz), iz);
+
+	// Min/max return second operand for NaN, so NaN slabs are ignored.
+	__m256d entry = _mm256_max_pd(_mm256_min_pd(x0, x1), _mm256_max_pd(_mm256_min_pd(y0, y1), _mm256_max_pd(_mm256_min_pd(z0, z1), negativeInfinity)));
+	__m256d exit = _mm256_min_pd(_mm256_max_pd(x0, x1), _mm256_min_pd(_mm256_max_pd(y0, y1), _mm256_min_pd(_mm256_max_pd(z0, z1), infinity)));
+
+	__m256d t = _mm256_blendv_pd(exit, entry, _mm256_cmp_pd(entry, minimum, _CMP_GE_OQ));
+	__m256d isHit = _mm256_and_pd(_mm256_cmp_pd(entry, exit, _CMP_LE_OQ),
+		_mm256_and_pd(_mm256_cmp_pd(t, minimum, _CMP_GE_OQ), _mm256_cmp_pd(t, maximum, _CMP_LE_OQ)));
+	_mm256_storeu_pd(distances, t);
+	return _mm256_movemask_pd(isHit) & ((1 << block.count) - 1);
+}
@@ -0,0 +1,93 @@
+#include "QuantizedBVH.h"
+#include <cmath>
+#include <exception>
+
+template<class Q>
+void QuantizedBVH<Q>::Build(const BVH& bvh)
+{
+	Clear();
+	if(!bvh.IsBuilt())
+		return;
+
+	const std::vector<BVHNode>& binary = bvh.GetNodes();
+	rootBounds = bvh.GetBounds();
+	nodes.reserve(binary.size() / 2 + 1);
+	if(binary[0].IsLeaf())
+	{
+		// Single leaf is stored as the only child of root node.
+		QuantizedBVHNode<Q> node;
+		for(int k = 0; k < 3; k++)
+		{
+			node.childMin[0][k] = node.childMin[1][k] = 0;
+			node.childMax[0][k] = node.childMax[1][k] = (Q)Maximum;
+		}
+		node.child[0] = binary[0].offset;
+		node.count[0] = (unsigned char)binary[0].count;
+		node.child[1] = -1;
+		node.count[1] = 0;
+		nodes.push_back(node);
+		return;
+	}
+	Quantize(binary, 0, rootBounds);
+}
+
+template<class Q>
+void QuantizedBVH<Q>::Quantize(const std::vector<BVHNode>& binary, int index, const BoundingBox& decoded)
+{
+	int nodeIndex = nodes.size();
+	nodes.push_back(QuantizedBVHNode<Q>());
+
+	int children[2] = { index + 1, binary[index].offset };
+	QuantizedBVHNode<Q> node;
+	BoundingBox childDecoded[2];
+	for(int c = 0; c < 2; c++)
+	{
+		const BVHNode& child = binary[children[c]];
+		for(int k = 0; k < 3; k++)
+		{
+			Scalar parentMin = decoded.minDim.data[k], parentMax = decoded.maxDim.data[k];
+			Scalar extent = parentMax - parentMin;
+			Scalar childMin = child.bounds.minDim.data[k], childMax = child.bounds.maxDim.data[k];
+
+			// Estimate and then move outwards until decoded value contains the child; grid ends
+			// are exact parent bounds, so this always terminates.
+			int qMin = 0, qMax = Maximum;
+			if(extent > 0)
+			{
+				qMin = std::max(0, std::min(Maximum, (int)std::floor((childMin - parentMin) / extent * Maximum)));
+				qMax = std::max(0, std::min(Maximum, (int)std::ceil((childMax - parentMin) / extent * Maximum)));
+			}
+			while(qMin > 0 && Decode(parentMin, parentMax, qMin) > childMin)
+				qMin--;
+			while(qMax < Maximum && Decode(parentMin, parentMax, qMax) < childMax)
+				qMax++;
+
+			node.childMin[c][k] = (Q)qMin;
+			node.childMax[c][k] = (Q)qMax;
+		}
+		childDecoded[c] = DecodeChild(node, c, decoded);
+
+		if(child.IsLeaf())
+		{
+			if(child.count > 255)
+				throw std::exception("Quantized BVH leaf has too many primitives.");
+			node.child[c] = child.offset;
+			node.count[c] = (unsigned char)child.count;
+		} else {
+			node.count[c] = 0;
+		}
+	}
+
+	// Inner children are appended depth first, their indices are known after recursion.
+	for(int c = 0; c < 2; c++)
+	{
+		if(node.count[c] != 0)
+			continue;
+		node.child[c] = nodes.size();
+		Quantize(binary, children[c], childDecoded[c]);
+	}
+	nodes[nodeIndex] = node;
+}
+
+template class QuantizedBVH<unsigned char>;
+template class QuantizedBVH<unsigned short>;
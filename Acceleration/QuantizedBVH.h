@@ -0,0 +1,169 @@
+#pragma once
+
+#include "BVH.h"
+#include <vector>
+
+// A node of quantized BVH. Boxes of both children are stored on a grid of Q (unsigned char or unsigned short)
+// over the decoded box of the node itself, so only root bounds are kept in full precision. Leaf children
+// are referenced directly from their parent.
+template<class Q>
+struct QuantizedBVHNode
+{
+	int child[2];				//< Node index of inner child, first slot of leaf child, -1 for empty child.
+	Q childMin[2][3];
+	Q childMax[2][3];
+	unsigned char count[2];		//< Number of primitives of leaf child, 0 for inner child.
+};
+
+// A compact BVH with quantized child bounds (8 bit nodes take 24 bytes, 16 bit ones 36 bytes, compared to
+// 64 bytes of BVHNode). It is converted from binary BVH and uses its slots, so the binary BVH can be
+// released after build. Decoded boxes always contain the original ones (rounded outwards), so traversal
+// gives the same hits as the binary BVH.
+template<class Q>
+class QuantizedBVH
+{
+	std::vector<QuantizedBVHNode<Q> > nodes;
+	BoundingBox rootBounds;
+
+	void Quantize(const std::vector<BVHNode>& binary, int index, const BoundingBox& decoded);
+public:
+	// Largest quantized value.
+	static const int Maximum = (Q)-1;
+
+	// Coordinate of grid point q between decoded parent bounds; ends are exact, so decoded children
+	// never leave decoded parent.
+	static Scalar Decode(Scalar parentMin, Scalar parentMax, int q)
+	{
+		if(q == 0)
+			return parentMin;
+		if(q == Maximum)
+			return parentMax;
+		return parentMin + (parentMax - parentMin) * (q * (Scalar(1) / Maximum));
+	}
+	static BoundingBox DecodeChild(const QuantizedBVHNode<Q>& node, int c, const BoundingBox& parent)
+	{
+		BoundingBox box;
+		for(int k = 0; k < 3; k++)
+		{
+			box.minDim.data[k] = Decode(parent.minDim.data[k], parent.maxDim.data[k], node.childMin[c][k]);
+			box.maxDim.data[k] = Decode(parent.minDim.data[k], parent.maxDim.data[k], node.childMax[c][k]);
+		}
+		return box;
+	}
+
+	// Converts binary BVH (leaves must hold at most 255 primitives).
+	void Build(const BVH& bvh);
+	void Clear() { nodes.clear(); }
+	bool IsBuilt() const { return !nodes.empty(); }
+	int GetNodeCount() const { return nodes.size(); }
+	BoundingBox GetBounds() const { return nodes.empty() ? BoundingBox() : rootBounds; }
+
+	// Same as BVH::Intersect and BVH::Occluded.
+	template<class Intersector>
+	void Intersect(const Ray& ray, IntersectResult& result, Intersector& intersector) const;
+	template<class Occluder>
+	bool Occluded(const Ray& ray, Scalar maxDistance, Occluder& occluder) const;
+};
+
+typedef QuantizedBVH<unsigned char> QuantizedBVH8;
+typedef QuantizedBVH<unsigned short> QuantizedBVH16;
+
+template<class Q>
+template<class Intersector>
+void QuantizedBVH<Q>::Intersect(const Ray& ray, IntersectResult& result, Intersector& intersector) const
+{
+	Vec3 invDirection(1/ray.direction.x, 1/ray.direction.y, 1/ray.direction.z);
+	if(nodes.empty() || !rootBounds.IntersectRay(ray.origin, invDirection, result.distance))
+		return;
+
+	// Decoded box travels with node on stack.
+	int stack[BVH_MaxDepth];
+	BoundingBox stackBounds[BVH_MaxDepth];
+	int stackSize = 0, current = 0;
+	BoundingBox currentBounds = rootBounds;
+	for(;;)
+	{
+		const QuantizedBVHNode<Q>& node = nodes[current];
+		BoundingBox childBounds[2];
+		Scalar entry[2];
+		bool isHit[2];
+		for(int c = 0; c < 2; c++)
+		{
+			isHit[c] = false;
+			if(node.child[c] < 0)
+				continue;
+			childBounds[c] = DecodeChild(node, c, currentBounds);
+			isHit[c] = childBounds[c].IntersectRay(ray.origin, invDirection, result.distance, entry[c]);
+			if(isHit[c] && node.count[c] > 0)
+			{
+				for(int i = 0; i < node.count[c]; i++)
+					intersector(node.child[c] + i, ray, result);
+				isHit[c] = false;
+			}
+		}
+
+		if(isHit[0] && isHit[1])
+		{
+			// Nearer child first.
+			int nearChild = entry[1] < entry[0] ? 1 : 0;
+			stack[stackSize] = node.child[1 - nearChild];
+			stackBounds[stackSize++] = childBounds[1 - nearChild];
+			current = node.child[nearChild];
+			currentBounds = childBounds[nearChild];
+			continue;
+		}
+		if(isHit[0] || isHit[1])
+		{
+			int c = isHit[0] ? 0 : 1;
+			current = node.child[c];
+			currentBounds = childBounds[c];
+			continue;
+		}
+
+		if(stackSize == 0)
+			break;
+		--stackSize;
+		current = stack[stackSize];
+		currentBounds = stackBounds[stackSize];
+	}
+}
+
+template<class Q>
+template<class Occluder>
+bool QuantizedBVH<Q>::Occluded(const Ray& ray, Scalar maxDistance, Occluder& occluder) const
+{
+	Vec3 invDirection(1/ray.direction.x, 1/ray.direction.y, 1/ray.direction.z);
+	if(nodes.empty() || !rootBounds.IntersectRay(ray.origin, invDirection, maxDistance))
+		return false;
+
+	int stack[BVH_MaxDepth];
+	BoundingBox stackBounds[BVH_MaxDepth];
+	int stackSize = 1;
+	stack[0] = 0;
+	stackBounds[0] = rootBounds;
+	while(stackSize > 0)
+	{
+		--stackSize;
+		const QuantizedBVHNode<Q>& node = nodes[stack[stackSize]];
+		BoundingBox bounds = stackBounds[stackSize];
+		for(int c = 0; c < 2; c++)
+		{
+			if(node.child[c] < 0)
+				continue;
+			BoundingBox childBounds = DecodeChild(node, c, bounds);
+			if(!childBounds.IntersectRay(ray.origin, invDirection, maxDistance))
+				continue;
+
+			if(node.count[c] == 0)
+			{
+				stack[stackSize] = node.child[c];
+				stackBounds[stackSize++] = childBounds;
+				continue;
+			}
+			for(int i = 0; i < node.count[c]; i++)
+				if(occluder(node.child[c] + i, ray, maxDistance))
+					return true;
+		}
+	}
+	return false;
+}
@@ -0,0 +1,475 @@
+#include "WideBVH.h"
+#include <cmath>
+#include <algorithm>
+#include <emmintrin.h>
+
+/// ------------------------------------------------------------------------------------------------------------
+/// Build
+/// ------------------------------------------------------------------------------------------------------------
+
+const float WideBVH_Infinity = std::numeric_limits<float>::infinity();
+
+// Conversion of bounds to single precision, always rounded outwards.
+static float RoundDown(Scalar x, Scalar pad)
+{
+	x -= pad;
+	float f = (float)x;
+	return (Scalar)f > x ? nextafterf(f, -WideBVH_Infinity) : f;
+}
+
+static float RoundUp(Scalar x, Scalar pad)
+{
+	x += pad;
+	float f = (float)x;
+	return (Scalar)f < x ? nextafterf(f, WideBVH_Infinity) : f;
+}
+
+WideRay::WideRay(const Ray& ray)
+{
+	for(int k = 0; k < 3; k++)
+	{
+		exactOrigin[k] = ray.origin.data[k];
+		origin[k] = (float)ray.origin.data[k];
+		direction[k] = (float)ray.direction.data[k];
+		invDirection[k] = 1 / direction[k];
+		isNegative[k] = invDirection[k] < 0;
+	}
+}
+
+void WideBVH::Build(const BVH& bvh, const CompiledTriangles& triangles)
+{
+	Clear();
+	if(!bvh.IsBuilt())
+		return;
+
+	level = GetSimdLevel();
+	if(level == SimdAVX2)
+		Collapse<8>(bvh, triangles, nodes8, blocks8);
+	else
+		Collapse<4>(bvh, triangles, nodes4, blocks4);
+}
+
+void WideBVH::Clear()
+{
+	nodes4.clear();
+	blocks4.clear();
+	nodes8.clear();
+	blocks8.clear();
+}
+
+template<int W>
+void WideBVH::Collapse(const BVH& bvh, const CompiledTriangles& triangles,
+	std::vector<WideBVHNode<W> >& nodes, std::vector<WideTriangleBlock<W> >& blocks)
+{
+	BoundingBox bounds = bvh.GetBounds();
+	Scalar scale = 0;
+	for(int k = 0; k < 3; k++)
+		scale = std::max(scale, std::max(std::abs(bounds.minDim.data[k]), std::abs(bounds.maxDim.data[k])));
+	// Padding of boxes, covers rounding of ray origin and slab distances in single precision.
+	boxPadding = scale * (Scalar)1.9e-6;
+
+	nodes.reserve(bvh.GetNodeCount() / 2 + 1);
+	blocks.reserve(triangles.Count() / 2 + 1);
+	CollapseNode<W>(bvh.GetNodes(), 0, triangles, nodes, blocks);
+}
+
+template<int W>
+int WideBVH::CollapseNode(const std::vector<BVHNode>& binary, int index, const CompiledTriangles& triangles,
+		std::vector<WideBVHNode<W> >& nodes, std::vector<WideTriangleBlock<W> >& blocks)
+{
+	// Gather up to W children by opening the inner child with largest surface area.
+	int children[W];
+	int count = 0;
+	if(binary[index].IsLeaf())
+		children[count++] = index;
+	else
+	{
+		children[count++] = index + 1;
+		children[count++] = binary[index].offset;
+	}
+	while(count < W)
+	{
+		int best = -1;
+		Scalar bestArea = -1;
+		for(int i = 0; i < count; i++)
+		{
+			const BVHNode& child = binary[children[i]];
+			if(!child.IsLeaf() && child.bounds.SurfaceArea() > bestArea)
+			{
+				best = i;
+				bestArea = child.bounds.SurfaceArea();
+			}
+		}
+		if(best < 0)
+			break;
+		int opened = children[best];
+		children[best] = opened + 1;
+		children[count++] = binary[opened].offset;
+	}
+
+	int nodeIndex = nodes.size();
+	nodes.push_back(WideBVHNode<W>());
+
+	WideBVHNode<W> node;
+	for(int i = 0; i < W; i++)
+	{
+		node.minX[i] = node.minY[i] = node.minZ[i] = WideBVH_Infinity;
+		node.maxX[i] = node.maxY[i] = node.maxZ[i] = -WideBVH_Infinity;
+		node.child[i] = -1;
+		node.count[i] = 0;
+	}
+
+	for(int i = 0; i < count; i++)
+	{
+		const BVHNode& child = binary[children[i]];
+		node.minX[i] = RoundDown(child.bounds.minDim.x, boxPadding);
+		node.minY[i] = RoundDown(child.bounds.minDim.y, boxPadding);
+		node.minZ[i] = RoundDown(child.bounds.minDim.z, boxPadding);
+		node.maxX[i] = RoundUp(child.bounds.maxDim.x, boxPadding);
+		node.maxY[i] = RoundUp(child.bounds.maxDim.y, boxPadding);
+		node.maxZ[i] = RoundUp(child.bounds.maxDim.z, boxPadding);
+
+		if(!child.IsLeaf())
+		{
+			node.child[i] = CollapseNode<W>(binary, children[i], triangles, nodes, blocks);
+			continue;
+		}
+
+		// Pack leaf triangles into blocks of W.
+		node.child[i] = blocks.size();
+		node.count[i] = (child.count + W - 1) / W;
+		for(int first = 0; first < child.count; first += W)
+		{
+			WideTriangleBlock<W> block;
+			block.count = std::min(W, child.count - first);
+			Vec3 anchor = triangles.GetVertex0(child.offset + first);
+			for(int k = 0; k < 3; k++)
+				block.anchor[k] = anchor.data[k];
+			for(int lane = 0; lane < W; lane++)
+			{
+				// Unused lanes repeat last triangle, they are masked by count.
+				int slot = child.offset + first + std::min(lane, block.count - 1);
+				Vec3 v0 = triangles.GetVertex0(slot) - anchor, e1 = triangles.GetEdge1(slot), e2 = triangles.GetEdge2(slot);
+				block.v0X[lane] = (float)v0.x; block.v0Y[lane] = (float)v0.y; block.v0Z[lane] = (float)v0.z;
+				block.e1X[lane] = (float)e1.x; block.e1Y[lane] = (float)e1.y; block.e1Z[lane] = (float)e1.z;
+				block.e2X[lane] = (float)e2.x; block.e2Y[lane] = (float)e2.y; block.e2Z[lane] = (float)e2.z;
+				Scalar edgeSize = std::max(std::abs(e1.x) + std::abs(e1.y) + std::abs(e1.z),
+					std::abs(e2.x) + std::abs(e2.y) + std::abs(e2.z));
+				block.edgeSize[lane] = RoundUp(edgeSize, 0);
+				block.errorScale[lane] = WideBVH_ErrorBound * block.edgeSize[lane];
+				block.extent[lane] = RoundUp(edgeSize + std::abs(v0.x) + std::abs(v0.y) + std::abs(v0.z), 0);
+				block.slot[lane] = slot;
+			}
+			blocks.push_back(block);
+		}
+	}
+
+	nodes[nodeIndex] = node;
+	return nodeIndex;
+}
+
+/// ------------------------------------------------------------------------------------------------------------
+/// Scalar and SSE kernels
+/// ------------------------------------------------------------------------------------------------------------
+
+// Minimum tolerances of single precision triangle filter (barycentric and relative distance), added to
+// error bounds of lanes.
+const float WideBVH_BarycentricTolerance = 1e-4f;
+const float WideBVH_DistanceTolerance = 1e-4f;
+
+int IntersectBoxes4(const WideBVHNode<4>& node, const WideRay& ray, float maxDistance, float* tNear)
+{
+	const float* minDim[3] = { node.minX, node.minY, node.minZ };
+	const float* maxDim[3] = { node.maxX, node.maxY, node.maxZ };
+	int mask = 0;
+	for(int lane = 0; lane < 4; lane++)
+	{
+		float t0 = 0, t1 = maxDistance;
+		for(int k = 0; k < 3; k++)
+		{
+			const float* nearDim = ray.isNegative[k] ? maxDim[k] : minDim[k];
+			const float* farDim = ray.isNegative[k] ? minDim[k] : maxDim[k];
+			float n = (nearDim[lane] - ray.origin[k]) * ray.invDirection[k];
+			float f = (farDim[lane] - ray.origin[k]) * ray.invDirection[k];
+			if(n > t0) t0 = n;
+			if(f < t1) t1 = f;
+		}
+		tNear[lane] = t0;
+		if(t0 <= t1)
+			mask |= 1 << lane;
+	}
+	return mask;
+}
+
+int IntersectTriangles4(const WideTriangleBlock<4>& block, const WideRay& ray, float maxDistance)
+{
+	const float* d = ray.direction;
+	float o[3] = { (float)(ray.exactOrigin[0] - block.anchor[0]), (float)(ray.exactOrigin[1] - block.anchor[1]),
+		(float)(ray.exactOrigin[2] - block.anchor[2]) };
+	int mask = 0;
+	for(int lane = 0; lane < block.count; lane++)
+	{
+		float e1[3] = { block.e1X[lane], block.e1Y[lane], block.e1Z[lane] };
+		float e2[3] = { block.e2X[lane], block.e2Y[lane], block.e2Z[lane] };
+		float t[3] = { o[0] - block.v0X[lane], o[1] - block.v0Y[lane], o[2] - block.v0Z[lane] };
+		float p[3] = { d[1]*e2[2] - d[2]*e2[1], d[2]*e2[0] - d[0]*e2[2], d[0]*e2[1] - d[1]*e2[0] };
+		float q[3] = { t[1]*e1[2] - t[2]*e1[1], t[2]*e1[0] - t[0]*e1[2], t[0]*e1[1] - t[1]*e1[0] };
+		float det = e1[0]*p[0] + e1[1]*p[1] + e1[2]*p[2];
+		float invDet = 1 / det;
+		float u = (t[0]*p[0] + t[1]*p[1] + t[2]*p[2]) * invDet;
+		float v = (d[0]*q[0] + d[1]*q[1] + d[2]*q[2]) * invDet;
+		float distance = (e2[0]*q[0] + e2[1]*q[1] + e2[2]*q[2]) * invDet;
+		float error = block.errorScale[lane] * std::abs(invDet) *
+			(std::abs(t[0]) + std::abs(t[1]) + std::abs(t[2]) + block.extent[lane]);
+		float tolerance = WideBVH_BarycentricTolerance + error;
+		float distanceError = error * block.edgeSize[lane];
+
+		// Written as rejection, so NaNs stay candidates.
+		bool reject = u < -tolerance || v < -tolerance || u + v > 1 + tolerance ||
+			distance < -WideBVH_DistanceTolerance - distanceError ||
+			distance > maxDistance * (1 + WideBVH_DistanceTolerance) + distanceError;
+		if(!reject || det == 0)
+			mask |= 1 << lane;
+	}
+	return mask;
+}
+
+int IntersectBoxes4_SSE(const WideBVHNode<4>& node, const WideRay& ray, float maxDistance, float* tNear)
+{
+	const float* nearX = ray.isNegative[0] ? node.maxX : node.minX;
+	const float* nearY = ray.isNegative[1] ? node.maxY : node.minY;
+	const float* nearZ = ray.isNegative[2] ? node.maxZ : node.minZ;
+	const float* farX = ray.isNegative[0] ? node.minX : node.maxX;
+	const float* farY = ray.isNegative[1] ? node.minY : node.maxY;
+	const float* farZ = ray.isNegative[2] ? node.minZ : node.maxZ;
+
+	__m128 ox = _mm_set1_ps(ray.origin[0]), oy = _mm_set1_ps(ray.origin[1]), oz = _mm_set1_ps(ray.origin[2]);
+	__m128 ix = _mm_set1_ps(ray.invDirection[0]), iy = _mm_set1_ps(ray.invDirection[1]), iz = _mm_set1_ps(ray.invDirection[2]);
+
+	__m128 nx = _mm_mul_ps(_mm_sub_ps(_mm_loadu_ps(nearX), ox), ix);
+	__m128 ny = _mm_mul_ps(_mm_sub_ps(_mm_loadu_ps(nearY), oy), iy);
+	__m128 nz = _mm_mul_ps(_mm_sub_ps(_mm_loadu_ps(nearZ), oz), iz);
+	__m128 fx = _mm_mul_ps(_mm_sub_ps(_mm_loadu_ps(farX), ox), ix);
+	__m128 fy = _mm_mul_ps(_mm_sub_ps(_mm_loadu_ps(farY), oy), iy);
+	__m128 fz = _mm_mul_ps(_mm_sub_ps(_mm_loadu_ps(farZ), oz), iz);
+
+	// Min/max return second operand for NaN, so NaN slabs are ignored.
+	__m128 t0 = _mm_max_ps(_mm_max_ps(nx, ny), _mm_max_ps(nz, _mm_setzero_ps()));
+	__m128 t1 = _mm_min_ps(_mm_min_ps(fx, fy), _mm_min_ps(fz, _mm_set1_ps(maxDistance)));
+	_mm_storeu_ps(tNear, t0);
+	return _mm_movemask_ps(_mm_cmple_ps(t0, t1));
+}
+
+int IntersectTriangles4_SSE(const WideTriangleBlock<4>& block, const WideRay& ray, float maxDistance)
+{
+	__m128 dx = _mm_set1_ps(ray.direction[0]), dy = _mm_set1_ps(ray.direction[1]), dz = _mm_set1_ps(ray.direction[2]);
+	__m128 e1x = _mm_loadu_ps(block.e1X), e1y = _mm_loadu_ps(block.e1Y), e1z = _mm_loadu_ps(block.e1Z);
+	__m128 e2x = _mm_loadu_ps(block.e2X), e2y = _mm_loadu_ps(block.e2Y), e2z = _mm_loadu_ps(block.e2Z);
+	__m128 tx = _mm_sub_ps(_mm_set1_ps((float)(ray.exactOrigin[0] - block.anchor[0])), _mm_loadu_ps(block.v0X));
+	__m128 ty = _mm_sub_ps(_mm_set1_ps((float)(ray.exactOrigin[1] - block.anchor[1])), _mm_loadu_ps(block.v0Y));
+	__m128 tz = _mm_sub_ps(_mm_set1_ps((float)(ray.exactOrigin[2] - block.anchor[2])), _mm_loadu_ps(block.v0Z));
+
+	__m128 px = _mm_sub_ps(_mm_mul_ps(dy, e2z), _mm_mul_ps(dz, e2y));
+	__m128 py = _mm_sub_ps(_mm_mul_ps(dz, e2x), _mm_mul_ps(dx, e2z));
+	__m128 pz = _mm_sub_ps(_mm_mul_ps(dx, e2y), _mm_mul_ps(dy, e2x));
+	__m128 qx = _mm_sub_ps(_mm_mul_ps(ty, e1z), _mm_mul_ps(tz, e1y));
+	__m128 qy = _mm_sub_ps(_mm_mul_ps(tz, e1x), _mm_mul_ps(tx, e1z));
+	__m128 qz = _mm_sub_ps(_mm_mul_ps(tx, e1y), _mm_mul_ps(ty, e1x));
+
+	__m128 det = _mm_add_ps(_mm_add_ps(_mm_mul_ps(e1x, px), _mm_mul_ps(e1y, py)), _mm_mul_ps(e1z, pz));
+	__m128 invDet = _mm_div_ps(_mm_set1_ps(1), det);
+	__m128 u = _mm_mul_ps(_mm_add_ps(_mm_add_ps(_mm_mul_ps(tx, px), _mm_mul_ps(ty, py)), _mm_mul_ps(tz, pz)), invDet);
+	__m128 v = _mm_mul_ps(_mm_add_ps(_mm_add_ps(_mm_mul_ps(dx, qx), _mm_mul_ps(dy, qy)), _mm_mul_ps(dz, qz)), invDet);
+	__m128 t = _mm_mul_ps(_mm_add_ps(_mm_add_ps(_mm_mul_ps(e2x, qx), _mm_mul_ps(e2y, qy)), _mm_mul_ps(e2z, qz)), invDet);
+
+	// Error bound of lanes, see WideBVH_ErrorBound.
+	__m128 signMask = _mm_set1_ps(-0.0f);
+	__m128 error = _mm_add_ps(_mm_add_ps(_mm_andnot_ps(signMask, tx), _mm_andnot_ps(signMask, ty)),
+		_mm_add_ps(_mm_andnot_ps(signMask, tz), _mm_loadu_ps(block.extent)));
+	error = _mm_mul_ps(_mm_mul_ps(error, _mm_loadu_ps(block.errorScale)), _mm_andnot_ps(signMask, invDet));
+	__m128 distanceError = _mm_mul_ps(error, _mm_loadu_ps(block.edgeSize));
+
+	// Written as rejection, so NaNs stay candidates.
+	__m128 tolerance = _mm_add_ps(_mm_set1_ps(WideBVH_BarycentricTolerance), error);
+	__m128 negativeTolerance = _mm_xor_ps(tolerance, signMask);
+	__m128 reject = _mm_or_ps(_mm_cmplt_ps(u, negativeTolerance), _mm_cmplt_ps(v, negativeTolerance));
+	reject = _mm_or_ps(reject, _mm_cmpgt_ps(_mm_add_ps(u, v), _mm_add_ps(_mm_set1_ps(1), tolerance)));
+	reject = _mm_or_ps(reject, _mm_cmplt_ps(t, _mm_sub_ps(_mm_set1_ps(-WideBVH_DistanceTolerance), distanceError)));
+	reject = _mm_or_ps(reject, _mm_cmpgt_ps(t, _mm_add_ps(_mm_set1_ps(maxDistance * (1 + WideBVH_DistanceTolerance)),
+		distanceError)));
+	reject = _mm_andnot_ps(_mm_cmpeq_ps(det, _mm_setzero_ps()), reject);
+
+	return ~_mm_movemask_ps(reject) & ((1 << block.count) - 1);
+}
+
+/// ------------------------------------------------------------------------------------------------------------
+/// Traversal
+/// ------------------------------------------------------------------------------------------------------------
+
+struct ScalarKernel4
+{
+	static int Boxes(const WideBVHNode<4>& node, const WideRay& ray, float maxDistance, float* tNear)
+	{ return IntersectBoxes4(node, ray, maxDistance, tNear); }
+	static int Triangles(const WideTriangleBlock<4>& block, const WideRay& ray, float maxDistance)
+	{ return IntersectTriangles4(block, ray, maxDistance); }
+};
+
+struct SSEKernel4
+{
+	static int Boxes(const WideBVHNode<4>& node, const WideRay& ray, float maxDistance, float* tNear)
+	{ return IntersectBoxes4_SSE(node, ray, maxDistance, tNear); }
+	static int Triangles(const WideTriangleBlock<4>& block, const WideRay& ray, float maxDistance)
+	{ return IntersectTriangles4_SSE(block, ray, maxDistance); }
+};
+
+struct AVX2Kernel8
+{
+	static int Boxes(const WideBVHNode<8>& node, const WideRay& ray, float maxDistance, float* tNear)
+	{ return IntersectBoxes8_AVX2(node, ray, maxDistance, tNear); }
+	static int Triangles(const WideTriangleBlock<8>& block, const WideRay& ray, float maxDistance)
+	{ return IntersectTriangles8_AVX2(block, ray, maxDistance); }
+};
+
+// Single precision maximum distance, rounded up.
+static float MaxDistance(Scalar distance)
+{
+	if(distance >= std::numeric_limits<float>::max())
+		return WideBVH_Infinity;
+	return RoundUp(distance, 0);
+}
+
+template<int W, class Kernel>
+static void IntersectWide(const WideBVHNode<W>* nodes, const WideTriangleBlock<W>* blocks,
+	const CompiledTriangles& triangles, const Ray& ray, IntersectResult& result)
+{
+	WideRay wideRay(ray);
+	float maxDistance = MaxDistance(result.distance);
+
+	// Stack holds nodes with their entry distance, so nodes behind a closer hit are skipped.
+	int stack[BVH_MaxDepth * W];
+	float stackNear[BVH_MaxDepth * W];
+	int stackSize = 1;
+	stack[0] = 0;
+	stackNear[0] = 0;
+
+	while(stackSize > 0)
+	{
+		stackSize--;
+		if(stackNear[stackSize] > maxDistance)
+			continue;
+
+		const WideBVHNode<W>& node = nodes[stack[stackSize]];
+		float tNear[W];
+		int mask = Kernel::Boxes(node, wideRay, maxDistance, tNear);
+		if(mask == 0)
+			continue;
+
+		// Leaves are intersected right away, inner children are sorted far to near.
+		int inner[W];
+		int innerCount = 0;
+		for(int lane = 0; lane < W; lane++)
+		{
+			if((mask & (1 << lane)) == 0)
+				continue;
+
+			if(node.count[lane] == 0)
+			{
+				int i = innerCount++;
+				while(i > 0 && tNear[inner[i-1]] < tNear[lane])
+				{
+					inner[i] = inner[i-1];
+					i--;
+				}
+				inner[i] = lane;
+				continue;
+			}
+
+			const WideTriangleBlock<W>* block = blocks + node.child[lane];
+			for(int b = 0; b < node.count[lane]; b++, block++)
+			{
+				int candidates = Kernel::Triangles(*block, wideRay, maxDistance);
+				for(int i = 0; candidates != 0; i++, candidates >>= 1)
+				{
+					if(candidates & 1)
+						triangles.Intersect(block->slot[i], ray, result);
+				}
+			}
+			maxDistance = MaxDistance(result.distance);
+		}
+
+		for(int i = 0; i < innerCount; i++)
+		{
+			stack[stackSize] = node.child[inner[i]];
+			stackNear[stackSize] = tNear[inner[i]];
+			stackSize++;
+		}
+	}
+}
+
+template<int W, class Kernel>
+static bool OccludedWide(const WideBVHNode<W>* nodes, const WideTriangleBlock<W>* blocks,
+	const CompiledTriangles& triangles, const Ray& ray, Scalar maxDistance)
+{
+	WideRay wideRay(ray);
+	float wideMaxDistance = MaxDistance(maxDistance);
+
+	// Order of children does not matter, first confirmed blocker ends the search.
+	int stack[BVH_MaxDepth * W];
+	int stackSize = 1;
+	stack[0] = 0;
+
+	while(stackSize > 0)
+	{
+		const WideBVHNode<W>& node = nodes[stack[--stackSize]];
+		float tNear[W];
+		int mask = Kernel::Boxes(node, wideRay, wideMaxDistance, tNear);
+
+		for(int lane = 0; mask != 0; lane++, mask >>= 1)
+		{
+			if((mask & 1) == 0)
+				continue;
+
+			if(node.count[lane] == 0)
+			{
+				stack[stackSize++] = node.child[lane];
+				continue;
+			}
+
+			const WideTriangleBlock<W>* block = blocks + node.child[lane];
+			for(int b = 0; b < node.count[lane]; b++, block++)
+			{
+				int candidates = Kernel::Triangles(*block, wideRay, wideMaxDistance);
+				for(int i = 0; candidates != 0; i++, candidates >>= 1)
+				{
+					if((candidates & 1) && triangles.Occludes(block->slot[i], ray, maxDistance))
+						return true;
+				}
+			}
+		}
+	}
+	return false;
+}
+
+bool WideBVH::Occluded(const Ray& ray, Scalar maxDistance, const CompiledTriangles& triangles) const
+{
+	if(!nodes8.empty())
+		return OccludedWide<8, AVX2Kernel8>(&nodes8[0], &blocks8[0], triangles, ray, maxDistance);
+	else if(nodes4.empty())
+		return false;
+	else if(level == SimdSSE2)
+		return OccludedWide<4, SSEKernel4>(&nodes4[0], &blocks4[0], triangles, ray, maxDistance);
+	else
+		return OccludedWide<4, ScalarKernel4>(&nodes4[0], &blocks4[0], triangles, ray, maxDistance);
+}
+
+void WideBVH::Intersect(const Ray& ray, IntersectResult& result, const CompiledTriangles& triangles) const
+{
+	if(!nodes8.empty())
+		IntersectWide<8, AVX2Kernel8>(&nodes8[0], &blocks8[0], triangles, ray, result);
+	else if(nodes4.empty())
+		return;
+	else if(level == SimdSSE2)
+		IntersectWide<4, SSEKernel4>(&nodes4[0], &blocks4[0], triangles, ray, result);
+	else
+		IntersectWide<4, ScalarKernel4>(&nodes4[0], &blocks4[0], triangles, ray, result);
+}
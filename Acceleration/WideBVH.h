@@ -0,0 +1,92 @@
+#pragma once
+
+#include "BVH.h"
+#include "CompiledTriangles.h"
+#include "CpuFeatures.h"
+#include <vector>
+
+// A node with W children boxes stored as structure of arrays in single precision, so one SIMD
+// instruction sequence tests a ray against all of them. Bounds are rounded outwards.
+template<int W>
+struct WideBVHNode
+{
+	float minX[W], minY[W], minZ[W];
+	float maxX[W], maxY[W], maxZ[W];
+	int child[W];	//< Node index for inner children, first triangle block for leaves, -1 for empty lanes.
+	int count[W];	//< Number of triangle blocks for leaves, 0 for inner and empty lanes.
+};
+
+// W triangles of a leaf in single precision, tested at once. Lanes only filter candidates; every candidate
+// is confirmed by the exact (double precision) compiled triangle, so results match the binary BVH.
+// Vertices are stored relative to anchor and ray origin is moved to it in double precision, so rounding
+// depends on size of the leaf and distance to it, not on distance from the world origin.
+template<int W>
+struct WideTriangleBlock
+{
+	Scalar anchor[3];
+	float v0X[W], v0Y[W], v0Z[W];	//< Relative to anchor.
+	float e1X[W], e1Y[W], e1Z[W];
+	float e2X[W], e2Y[W], e2Z[W];
+	float edgeSize[W];		//< Largest L1 norm of edges.
+	float errorScale[W];	//< WideBVH_ErrorBound times edge size.
+	float extent[W];		//< Edge size plus L1 norm of v0.
+	int slot[W];	//< Slot in compiled triangles.
+	int count;		//< Number of used lanes.
+};
+
+// Relative error bound of single precision triangle test (a multiple of float epsilon). Barycentric tolerance
+// of lane is errorScale * |1/det| * (|origin - v0|_1 + extent), distance tolerance is that times edge size.
+const float WideBVH_ErrorBound = 32 * 5.96e-8f;
+
+// Ray data in form used by wide kernels.
+struct WideRay
+{
+	Scalar exactOrigin[3];	//< Moved to anchor of triangle blocks.
+	float origin[3];
+	float direction[3];
+	float invDirection[3];
+	int isNegative[3];
+
+	WideRay(const Ray& ray);
+};
+
+// Wide kernels return bitmask of hit lanes; boxes also return entry distance per lane.
+int IntersectBoxes4(const WideBVHNode<4>& node, const WideRay& ray, float maxDistance, float* tNear);
+int IntersectBoxes4_SSE(const WideBVHNode<4>& node, const WideRay& ray, float maxDistance, float* tNear);
+int IntersectBoxes8_AVX2(const WideBVHNode<8>& node, const WideRay& ray, float maxDistance, float* tNear);
+int IntersectTriangles4(const WideTriangleBlock<4>& block, const WideRay& ray, float maxDistance);
+int IntersectTriangles4_SSE(const WideTriangleBlock<4>& block, const WideRay& ray, float maxDistance);
+int IntersectTriangles8_AVX2(const WideTriangleBlock<8>& block, const WideRay& ray, float maxDistance);
+
+// A 4 or 8 wide BVH, collapsed from binary BVH of triangle mesh. Width and kernels are chosen at build time
+// by CPU features: AVX2 uses 8 wide nodes, SSE2 4 wide nodes and otherwise scalar 4 wide fallback is used.
+class WideBVH
+{
+	SimdLevel level;
+	Scalar boxPadding;
+	std::vector<WideBVHNode<4> > nodes4;
+	std::vector<WideTriangleBlock<4> > blocks4;
+	std::vector<WideBVHNode<8> > nodes8;
+	std::vector<WideTriangleBlock<8> > blocks8;
+
+	template<int W>
+	void Collapse(const BVH& bvh, const CompiledTriangles& triangles,
+		std::vector<WideBVHNode<W> >& nodes, std::vector<WideTriangleBlock<W> >& blocks);
+	template<int W>
+	int CollapseNode(const std::vector<BVHNode>& binary, int index, const CompiledTriangles& triangles,
+		std::vector<WideBVHNode<W> >& nodes, std::vector<WideTriangleBlock<W> >& blocks);
+public:
+	WideBVH() : level(SimdScalar), boxPadding(0) {}
+
+	// Width of nodes that would be built on this machine.
+	static int GetPreferredWidth() { return GetSimdLevel() == SimdAVX2 ? 8 : 4; }
+
+	// Builds from binary BVH over compiled triangles (slots of both must match).
+	void Build(const BVH& bvh, const CompiledTriangles& triangles);
+	void Clear();
+	bool IsBuilt() const { return !nodes4.empty() || !nodes8.empty(); }
+
+	void Intersect(const Ray& ray, IntersectResult& result, const CompiledTriangles& triangles) const;
+	// Any hit query, see IGeometry::Occluded.
+	bool Occluded(const Ray& ray, Scalar maxDistance, const CompiledTriangles& triangles) const;
+};
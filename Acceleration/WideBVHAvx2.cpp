@@ -0,0 +1,76 @@
+// AVX2 kernels of wide BVH. This file is compiled with /arch:AVX2 and is only called after CPU detection,
+// so it must not contain any code shared with other translation units (inline functions, templates).
+#include "WideBVH.h"
+#include <immintrin.h>
+
+// Minimum tolerances, as in WideBVH.cpp.
+const float WideBVH_BarycentricToleranceAVX2 = 1e-4f;
+const float WideBVH_DistanceToleranceAVX2 = 1e-4f;
+
+int IntersectBoxes8_AVX2(const WideBVHNode<8>& node, const WideRay& ray, float maxDistance, float* tNear)
+{
+	const float* nearX = ray.isNegative[0] ? node.maxX : node.minX;
+	const float* nearY = ray.isNegative[1] ? node.maxY : node.minY;
+	const float* nearZ = ray.isNegative[2] ? node.maxZ : node.minZ;
+	const float* farX = ray.isNegative[0] ? node.minX : node.maxX;
+	const float* farY = ray.isNegative[1] ? node.minY : node.maxY;
+	const float* farZ = ray.isNegative[2] ? node.minZ : node.maxZ;
+
+	__m256 ox = _mm256_set1_ps(ray.origin[0]), oy = _mm256_set1_ps(ray.origin[1]), oz = _mm256_set1_ps(ray.origin[2]);
+	__m256 ix = _mm256_set1_ps(ray.invDirection[0]), iy = _mm256_set1_ps(ray.invDirection[1]), iz = _mm256_set1_ps(ray.invDirection[2]);
+
+	__m256 nx = _mm256_mul_ps(_mm256_sub_ps(_mm256_loadu_ps(nearX), ox), ix);
+	__m256 ny = _mm256_mul_ps(_mm256_sub_ps(_mm256_loadu_ps(nearY), oy), iy);
+	__m256 nz = _mm256_mul_ps(_mm256_sub_ps(_mm256_loadu_ps(nearZ), oz), iz);
+	__m256 fx = _mm256_mul_ps(_mm256_sub_ps(_mm256_loadu_ps(farX), ox), ix);
+	__m256 fy = _mm256_mul_ps(_mm256_sub_ps(_mm256_loadu_ps(farY), oy), iy);
+	__m256 fz = _mm256_mul_ps(_mm256_sub_ps(_mm256_loadu_ps(farZ), oz), iz);
+
+	// Min/max return second operand for NaN, so NaN slabs are ignored.
+	__m256 t0 = _mm256_max_ps(_mm256_max_ps(nx, ny), _mm256_max_ps(nz, _mm256_setzero_ps()));
+	__m256 t1 = _mm256_min_ps(_mm256_min_ps(fx, fy), _mm256_min_ps(fz, _mm256_set1_ps(maxDistance)));
+	_mm256_storeu_ps(tNear, t0);
+	return _mm256_movemask_ps(_mm256_cmp_ps(t0, t1, _CMP_LE_OQ));
+}
+
+int IntersectTriangles8_AVX2(const WideTriangleBlock<8>& block, const WideRay& ray, float maxDistance)
+{
+	__m256 dx = _mm256_set1_ps(ray.direction[0]), dy = _mm256_set1_ps(ray.direction[1]), dz = _mm256_set1_ps(ray.direction[2]);
+	__m256 e1x = _mm256_loadu_ps(block.e1X), e1y = _mm256_loadu_ps(block.e1Y), e1z = _mm256_loadu_ps(block.e1Z);
+	__m256 e2x = _mm256_loadu_ps(block.e2X), e2y = _mm256_loadu_ps(block.e2Y), e2z = _mm256_loadu_ps(block.e2Z);
+	__m256 tx = _mm256_sub_ps(_mm256_set1_ps((float)(ray.exactOrigin[0] - block.anchor[0])), _mm256_loadu_ps(block.v0X));
+	__m256 ty = _mm256_sub_ps(_mm256_set1_ps((float)(ray.exactOrigin[1] - block.anchor[1])), _mm256_loadu_ps(block.v0Y));
+	__m256 tz = _mm256_sub_ps(_mm256_set1_ps((float)(ray.exactOrigin[2] - block.anchor[2])), _mm256_loadu_ps(block.v0Z));
+
+	__m256 px = _mm256_fmsub_ps(dy, e2z, _mm256_mul_ps(dz, e2y));
+	__m256 py = _mm256_fmsub_ps(dz, e2x, _mm256_mul_ps(dx, e2z));
+	__m256 pz = _mm256_fmsub_ps(dx, e2y, _mm256_mul_ps(dy, e2x));
+	__m256 qx = _mm256_fmsub_ps(ty, e1z, _mm256_mul_ps(tz, e1y));
+	__m256 qy = _mm256_fmsub_ps(tz, e1x, _mm256_mul_ps(tx, e1z));
+	__m256 qz = _mm256_fmsub_ps(tx, e1y, _mm256_mul_ps(ty, e1x));
+
+	__m256 det = _mm256_fmadd_ps(e1x, px, _mm256_fmadd_ps(e1y, py, _mm256_mul_ps(e1z, pz)));
+	__m256 invDet = _mm256_div_ps(_mm256_set1_ps(1), det);
+	__m256 u = _mm256_mul_ps(_mm256_fmadd_ps(tx, px, _mm256_fmadd_ps(ty, py, _mm256_mul_ps(tz, pz))), invDet);
+	__m256 v = _mm256_mul_ps(_mm256_fmadd_ps(dx, qx, _mm256_fmadd_ps(dy, qy, _mm256_mul_ps(dz, qz))), invDet);
+	__m256 t = _mm256_mul_ps(_mm256_fmadd_ps(e2x, qx, _mm256_fmadd_ps(e2y, qy, _mm256_mul_ps(e2z, qz))), invDet);
+
+	// Error bound of lanes, see WideBVH_ErrorBound.
+	__m256 signMask = _mm256_set1_ps(-0.0f);
+	__m256 error = _mm256_add_ps(_mm256_add_ps(_mm256_andnot_ps(signMask, tx), _mm256_andnot_ps(signMask, ty)),
+		_mm256_add_ps(_mm256_andnot_ps(signMask, tz), _mm256_loadu_ps(block.extent)));
+	error = _mm256_mul_ps(_mm256_mul_ps(error, _mm256_loadu_ps(block.errorScale)), _mm256_andnot_ps(signMask, invDet));
+	__m256 distanceError = _mm256_mul_ps(error, _mm256_loadu_ps(block.edgeSize));
+
+	// Written as rejection with ordered compares, so NaNs stay candidates.
+	__m256 tolerance = _mm256_add_ps(_mm256_set1_ps(WideBVH_BarycentricToleranceAVX2), error);
+	__m256 negativeTolerance = _mm256_xor_ps(tolerance, signMask);
+	__m256 reject = _mm256_or_ps(_mm256_cmp_ps(u, negativeTolerance, _CMP_LT_OQ), _mm256_cmp_ps(v, negativeTolerance, _CMP_LT_OQ));
+	reject = _mm256_or_ps(reject, _mm256_cmp_ps(_mm256_add_ps(u, v), _mm256_add_ps(_mm256_set1_ps(1), tolerance), _CMP_GT_OQ));
+	reject = _mm256_or_ps(reject, _mm256_cmp_ps(t, _mm256_sub_ps(_mm256_set1_ps(-WideBVH_DistanceToleranceAVX2), distanceError), _CMP_LT_OQ));
+	reject = _mm256_or_ps(reject, _mm256_cmp_ps(t, _mm256_add_ps(_mm256_set1_ps(maxDistance * (1 + WideBVH_DistanceToleranceAVX2)),
+		distanceError), _CMP_GT_OQ));
+	reject = _mm256_andnot_ps(_mm256_cmp_ps(det, _mm256_setzero_ps(), _CMP_EQ_OQ), reject);
+
+	return ~_mm256_movemask_ps(reject) & ((1 << block.count) - 1);
+}
@@ -0,0 +1,60 @@
+#include "AllocationCounter.h"
+#include <new>
+#include <cstdlib>
+
+#ifdef COUNT_HEAP_ALLOCATIONS
+
+// Volatile so the count is read from memory (aligned 64 bit loads are atomic on x64).
+static volatile long long heapAllocationCount = 0;
+
+long long GetHeapAllocationCount()
+{
+	return heapAllocationCount;
+}
+
+void* operator new(size_t size)
+{
+	#pragma omp atomic
+	heapAllocationCount += 1;
+
+	// Zero size allocations must return distinct pointers.
+	void* p = std::malloc(size > 0 ? size : 1);
+	if(p == 0)
+		throw std::bad_alloc();
+	return p;
+}
+
+void* operator new[](size_t size)
+{
+	return operator new(size);
+}
+
+// All deletes are replaced, also sized ones, so no memory from malloc reaches the default delete.
+void operator delete(void* p)
+{
+	std::free(p);
+}
+
+void operator delete[](void* p)
+{
+	std::free(p);
+}
+
+void operator delete(void* p, size_t)
+{
+	std::free(p);
+}
+
+void operator delete[](void* p, size_t)
+{
+	std::free(p);
+}
+
+#else
+
+long long GetHeapAllocationCount()
+{
+	return -1;
+}
+
+#endif
@@ -0,0 +1,8 @@
+#pragma once
+
+// Number of heap allocations made through operator new (and new[]) since program start, or -1 if allocations
+// are not counted. Counting is compiled in only when COUNT_HEAP_ALLOCATIONS is defined (add it to preprocessor
+// definitions of benchmark build): global operator new and delete are then replaced in AllocationCounter.cpp
+// for the whole binary. The count is updated atomically, so it is exact also when threads allocate.
+// Allocations made directly with malloc (the C kd-tree) are not counted.
+long long GetHeapAllocationCount();
@@ -27,6 +27,30 @@ void Sphere::Intersect(const Ray& ray, IntersectResult& result)
 	result.normal = ((ray.origin + t*ray.direction) - this->center).Normal();
 }
 
+bool Sphere::Occluded(const Ray& ray, Scalar maxDistance)
+{
+	Scalar a = ray.direction * ray.direction;
+	Vec3 dummy1 = (ray.origin - this->center);
+	Scalar b = 2 * ray.direction * dummy1;
+	Scalar c = dummy1*dummy1 - this->radius*this->radius;
+
+	Scalar D = b*b - 4*a*c;
+	if(D <= 0)
+		return false;
+
+	// Either of intersections in range blocks the ray.
+	Scalar sD = std::sqrt(D);
+	Scalar t1 = (-b-sD)/(2*a), t2 = (-b+sD)/(2*a);
+	return (t1 >= IL_MinimumNextIntersectionDistance && t1 < maxDistance) ||
+		(t2 >= IL_MinimumNextIntersectionDistance && t2 < maxDistance);
+}
+
+BoundingBox Sphere::GetBounds()
+{
+	Vec3 r(radius, radius, radius);
+	return BoundingBox(center - r, center + r);
+}
+
 Vec3 Sphere::Sample(int sampleIndex, int sampleCount, RandomGenerator* generator, Vec3& normal)
 {
 	Scalar theta = generator->NextUniform()*PI;
@@ -48,55 +72,475 @@ void Scene::Intersect(const Ray& ray, IntersectResult& result)
 		(*i)->Intersect(ray, result);
 }
 
+void Scene::IntersectPacket(const RayPacket& packet, IntersectResult* results)
+{
+	for(std::vector<IGeometry*>::iterator i = geometry.begin(); i != geometry.end(); i++)
+		(*i)->IntersectPacket(packet, results);
+}
+
+bool Scene::Occluded(const Ray& ray, Scalar maxDistance)
+{
+	for(std::vector<IGeometry*>::iterator i = geometry.begin(); i != geometry.end(); i++)
+		if((*i)->Occluded(ray, maxDistance))
+			return true;
+	return false;
+}
+
+BoundingBox Scene::GetBounds()
+{
+	BoundingBox bounds;
+	for(std::vector<IGeometry*>::iterator i = geometry.begin(); i != geometry.end(); i++)
+		bounds.Extend((*i)->GetBounds());
+	return bounds;
+}
+
+/// ------------------------------------------------------------------------------------------------------------
+/// BVH scene intersection
+/// ------------------------------------------------------------------------------------------------------------
+
+// Intersects objects in BVH leaves (geometry is in slot order).
+struct GeometryIntersector
+{
+	IGeometry** geometry;
+	GeometryIntersector(IGeometry** g) : geometry(g) {}
+	void operator()(int slot, const Ray& ray, IntersectResult& result) { geometry[slot]->Intersect(ray, result); }
+	// Objects (meshes) cull the packet by their own structure, so whole packet is passed on.
+	void operator()(int slot, const RayPacket& packet, IntersectResult* results, const int* active, int activeCount) 
+	{ 
+		if(activeCount == 1)
+			geometry[slot]->Intersect(packet.rays[active[0]], results[active[0]]);
+		else
+			geometry[slot]->IntersectPacket(packet, results); 
+	}
+};
+
+// Any hit test of objects in BVH leaves.
+struct GeometryOccluder
+{
+	IGeometry** geometry;
+	GeometryOccluder(IGeometry** g) : geometry(g) {}
+	bool operator()(int slot, const Ray& ray, Scalar maxDistance) { return geometry[slot]->Occluded(ray, maxDistance); }
+};
+
+BVHBuildStats BVHScene::Build()
+{
+	std::vector<BoundingBox> bounds(geometry.size());
+	for(unsigned int i = 0; i < geometry.size(); i++)
+		bounds[i] = geometry[i]->GetBounds();
+
+	// Objects are usually expensive to intersect, so we keep them in separate leaves.
+	bvh.maxLeafSize = 1;
+	bvh.Build(bounds);
+
+	const std::vector<int>& order = bvh.GetPrimitiveOrder();
+	ordered.resize(order.size());
+	for(unsigned int i = 0; i < order.size(); i++)
+		ordered[i] = geometry[order[i]];
+	return bvh.GetStats();
+}
+
+BVHBuildStats BVHScene::Refit()
+{
+	if(!bvh.IsBuilt())
+		return Build();
+
+	std::vector<BoundingBox> bounds(geometry.size());
+	for(unsigned int i = 0; i < geometry.size(); i++)
+		bounds[i] = geometry[i]->GetBounds();
+	if(bvh.Refit(bounds) == 0)
+		return bvh.GetStats();
+
+	const std::vector<int>& order = bvh.GetPrimitiveOrder();
+	for(unsigned int i = 0; i < order.size(); i++)
+		ordered[i] = geometry[order[i]];
+	return bvh.GetStats();
+}
+
+void BVHScene::Intersect(const Ray& ray, IntersectResult& result)
+{
+	if(!bvh.IsBuilt())
+	{
+		Scene::Intersect(ray, result);
+		return;
+	}
+
+	GeometryIntersector intersector(&ordered[0]);
+	bvh.Intersect(ray, result, intersector);
+}
+
+void BVHScene::IntersectPacket(const RayPacket& packet, IntersectResult* results)
+{
+	if(!bvh.IsBuilt())
+	{
+		Scene::IntersectPacket(packet, results);
+		return;
+	}
+
+	GeometryIntersector intersector(&ordered[0]);
+	bvh.IntersectPacket(packet, results, intersector);
+}
+
+bool BVHScene::Occluded(const Ray& ray, Scalar maxDistance)
+{
+	if(!bvh.IsBuilt())
+		return Scene::Occluded(ray, maxDistance);
+
+	GeometryOccluder occluder(&ordered[0]);
+	return bvh.Occluded(ray, maxDistance, occluder);
+}
+
+BoundingBox BVHScene::GetBounds()
+{
+	if(bvh.IsBuilt())
+		return bvh.GetBounds();
+	return Scene::GetBounds();
+}
+
+
+/// ------------------------------------------------------------------------------------------------------------
+/// Transformed geometry
+/// ------------------------------------------------------------------------------------------------------------
+
+TransformedGeometry::TransformedGeometry(IGeometry* geometry, const Mat3x3& transform, const Vec3& translate)
+	: transformedGeometry(geometry)
+{
+	SetTransform(transform, translate);
+}
+
+void TransformedGeometry::SetTransform(const Mat3x3& transform, const Vec3& translate)
+{
+	this->transform = transform;
+	this->translate = translate;
+	invTransform = transform.Inverse();
+	normalTransform = invTransform.Transposed();
+}
+
+void TransformedGeometry::ToLocal(const Ray& ray, Ray& localRay, Scalar& scale)
+{
+	localRay.origin = invTransform * (ray.origin - translate);
+	localRay.direction = invTransform * ray.direction;
+	localRay.medium = ray.medium;
+
+	// Local direction is normalized, so distances are scaled.
+	scale = localRay.direction.Length();
+	localRay.direction = localRay.direction / scale;
+}
+
+// Maps world distance to local one, keeping "no hit" distance.
+static inline Scalar ScaleDistance(Scalar distance, Scalar scale)
+{
+	if(distance >= std::numeric_limits<Scalar>::max())
+		return distance;
+	return distance * scale;
+}
+
+void TransformedGeometry::Intersect(const Ray& ray, IntersectResult& result)
+{
+	Ray localRay;
+	Scalar scale;
+	ToLocal(ray, localRay, scale);
+
+	IntersectResult localResult;
+	localResult.distance = ScaleDistance(result.distance, scale);
+	Scalar maxDistance = localResult.distance;
+	transformedGeometry->Intersect(localRay, localResult);
+	if(localResult.distance >= maxDistance)
+		return;
+
+	result.distance = localResult.distance / scale;
+	result.normal = (normalTransform * localResult.normal).Normal();
+	result.material = localResult.material;
+	result.materialData = localResult.materialData;
+}
+
+void TransformedGeometry::IntersectPacket(const RayPacket& packet, IntersectResult* results)
+{
+	// Whole packet is transformed, so geometry can still trace it as packet.
+	RayPacket localPacket;
+	IntersectResult localResults[RayPacket::MaxSize];
+	Scalar scales[RayPacket::MaxSize], maxDistances[RayPacket::MaxSize];
+	localPacket.size = packet.size;
+	for(int i = 0; i < packet.size; i++)
+	{
+		ToLocal(packet.rays[i], localPacket.rays[i], scales[i]);
+		localResults[i].distance = maxDistances[i] = ScaleDistance(results[i].distance, scales[i]);
+	}
+	localPacket.Prepare();
+	transformedGeometry->IntersectPacket(localPacket, localResults);
+
+	for(int i = 0; i < packet.size; i++)
+	{
+		if(localResults[i].distance >= maxDistances[i])
+			continue;
+		results[i].distance = localResults[i].distance / scales[i];
+		results[i].normal = (normalTransform * localResults[i].normal).Normal();
+		results[i].material = localResults[i].material;
+		results[i].materialData = localResults[i].materialData;
+	}
+}
+
+bool TransformedGeometry::Occluded(const Ray& ray, Scalar maxDistance)
+{
+	Ray localRay;
+	Scalar scale;
+	ToLocal(ray, localRay, scale);
+	return transformedGeometry->Occluded(localRay, ScaleDistance(maxDistance, scale));
+}
+
+BoundingBox TransformedGeometry::GetBounds()
+{
+	// Bounds of all 8 transformed corners.
+	BoundingBox local = transformedGeometry->GetBounds(), bounds;
+	if(local.IsEmpty())
+		return bounds;
+	for(int i = 0; i < 8; i++)
+	{
+		Vec3 corner((i & 1) ? local.maxDim.x : local.minDim.x, (i & 2) ? local.maxDim.y : local.minDim.y,
+			(i & 4) ? local.maxDim.z : local.minDim.z);
+		bounds.Extend(transform * corner + translate);
+	}
+	return bounds;
+}
 
 /// ------------------------------------------------------------------------------------------------------------
 /// Triangle intersection
 /// ------------------------------------------------------------------------------------------------------------
 
 bool TriangleMesh::Intersect(const Ray& ray, const Vec3& p1, const Vec3& p2, const Vec3& p3, 
-		Vec3& point, Vec3& normal, Scalar minDistance, Scalar maxDistance)
+		Scalar& distance, Vec3& normal, Scalar minDistance, Scalar maxDistance)
 {
 
 	// Construct plane of triangle and distance from ray.
 	normal = ((p2-p1)^(p3-p1)).Normal();
 	Scalar d = -((ray.origin - p1) * normal) / (ray.direction * normal);
-	if(d < minDistance || d > maxDistance)
+	if(!(d >= minDistance && d <= maxDistance))
 		return false;
-	point = ray.origin + d*ray.direction;
+	Vec3 point = ray.origin + d*ray.direction;
 
 	// Check if point lies in triangle, against all three side
 	if(((point-p1)^(p2-p1))*normal > 0) return false;
 	if(((point-p2)^(p3-p2))*normal > 0) return false;
 	if(((point-p3)^(p1-p3))*normal > 0) return false;
 
+	distance = d;
 	return true;
 }
 
+void TriangleMesh::IntersectTriangle(int i, const Ray& ray, IntersectResult& result)
+{
+	Scalar distance;
+	Vec3 normal;
+	if(!Intersect(ray, vertices[indices[i*3]], vertices[indices[i*3+1]], vertices[indices[i*3+2]], 
+		distance, normal, IL_MinimumNextIntersectionDistance, result.distance))
+		return;
+
+	// Save current best hit.
+	result.distance = distance;
+	result.normal = normal;
+	result.materialData = NULL;
+	result.material = materials[i];
+}
+
+BoundingBox TriangleMesh::GetBounds()
+{
+	if(bvh.IsBuilt())
+		return bvh.GetBounds();
+	if(quantizedBVH8.IsBuilt())
+		return quantizedBVH8.GetBounds();
+	if(quantizedBVH16.IsBuilt())
+		return quantizedBVH16.GetBounds();
+	if(kdTree.IsBuilt())
+		return kdTree.GetBounds();
+	if(lazyBVH.IsBuilt())
+		return lazyBVH.GetBounds();
+
+	BoundingBox bounds;
+	for(std::vector<Vec3>::iterator i = vertices.begin(); i != vertices.end(); i++)
+		bounds.Extend(*i);
+	return bounds;
+}
+
+void TriangleMesh::ComputeTriangleBounds(std::vector<BoundingBox>& bounds)
+{
+	int N = materials.size();
+	bounds.assign(N, BoundingBox());
+	#pragma omp parallel for
+	for(int i = 0; i < N; i++)
+	{
+		bounds[i].Extend(vertices[indices[i*3]]);
+		bounds[i].Extend(vertices[indices[i*3+1]]);
+		bounds[i].Extend(vertices[indices[i*3+2]]);
+	}
+}
+
+BVHBuildStats TriangleMesh::Build()
+{
+	std::vector<BoundingBox> bounds;
+	ComputeTriangleBounds(bounds);
+	ClearBuild();
+
+	if(accelerator == AcceleratorKdTree || accelerator == AcceleratorLazyBVH)
+	{
+		if(accelerator == AcceleratorKdTree)
+			kdTree.Build(bounds);
+		else
+			lazyBVH.Build(bounds);
+		std::vector<int> order(bounds.size());
+		for(unsigned int i = 0; i < order.size(); i++)
+			order[i] = i;
+		compiled.Compile(vertices, indices, materials, order);
+		return BVHBuildStats();
+	}
+
+	// Leaves of wide BVH are intersected one block of triangles at a time.
+	bvh.maxLeafSize = accelerator == AcceleratorWideBVH ? WideBVH::GetPreferredWidth() : 4;
+	bvh.Build(bounds);
+	CompileTriangles();
+	if(accelerator == AcceleratorWideBVH)
+		wideBVH.Build(bvh, compiled);
+
+	if(accelerator == AcceleratorQuantizedBVH8 || accelerator == AcceleratorQuantizedBVH16)
+	{
+		if(accelerator == AcceleratorQuantizedBVH8)
+			quantizedBVH8.Build(bvh);
+		else
+			quantizedBVH16.Build(bvh);
+		bvh.Clear();
+	}
+	return bvh.GetStats();
+}
+
+BVHBuildStats TriangleMesh::Refit()
+{
+	if(!bvh.IsBuilt())
+		return Build();
+
+	std::vector<BoundingBox> bounds;
+	ComputeTriangleBounds(bounds);
+	bvh.Refit(bounds);
+	// Triangles are stored by value in slot order, so they are compiled again even if no slot moved.
+	CompileTriangles();
+	if(wideBVH.IsBuilt())
+		wideBVH.Build(bvh, compiled);
+	return bvh.GetStats();
+}
+
+void TriangleMesh::CompileTriangles()
+{
+	// Only binary BVH has single precision traversal; it keeps its double nodes for refitting.
+	if(precision == PrecisionFloat && accelerator == AcceleratorBVH)
+	{
+		compiled.Clear();
+		bvh.ConvertNodes(floatNodes);
+		floatCompiled.Compile(vertices, indices, materials, bvh.GetPrimitiveOrder());
+		return;
+	}
+	compiled.Compile(vertices, indices, materials, bvh.GetPrimitiveOrder());
+}
+
 void TriangleMesh::Intersect(const Ray& ray, IntersectResult& result)
 {
-	int N = indices.size()/3;
+	if(wideBVH.IsBuilt())
+	{
+		wideBVH.Intersect(ray, result, compiled);
+		return;
+	}
+	if(kdTree.IsBuilt())
+	{
+		TriangleIntersector intersector(compiled);
+		kdTree.Intersect(ray, result, intersector);
+		return;
+	}
+	if(lazyBVH.IsBuilt())
+	{
+		TriangleIntersector intersector(compiled);
+		lazyBVH.Intersect(ray, result, intersector);
+		return;
+	}
+	if(quantizedBVH8.IsBuilt() || quantizedBVH16.IsBuilt())
+	{
+		TriangleIntersector intersector(compiled);
+		if(quantizedBVH8.IsBuilt())
+			quantizedBVH8.Intersect(ray, result, intersector);
+		else
+			quantizedBVH16.Intersect(ray, result, intersector);
+		return;
+	}
+	if(!floatNodes.empty())
+	{
+		TriangleIntersectorT<ScalarCompressed> intersector(floatCompiled);
+		BVH::IntersectNodes(&floatNodes[0], ray, result, intersector);
+		return;
+	}
+	if(bvh.IsBuilt())
+	{
+		TriangleIntersector intersector(compiled);
+		bvh.Intersect(ray, result, intersector);
+		return;
+	}
 
 	// Foreach triangle
-	Vec3 point, normal;
+	int N = materials.size();
 	for(int i = 0; i < N; i++)
+		IntersectTriangle(i, ray, result);
+}
+
+bool TriangleMesh::Occluded(const Ray& ray, Scalar maxDistance)
+{
+	if(wideBVH.IsBuilt())
+		return wideBVH.Occluded(ray, maxDistance, compiled);
+	if(kdTree.IsBuilt())
 	{
-		// Find intersection
-		Vec3 p1 = vertices[indices[i*3]], p2 = vertices[indices[i*3+1]], p3 = vertices[indices[i*3+2]];
-		if(!Intersect(ray, p1, p2, p3, point, normal, IL_MinimumNextIntersectionDistance, result.distance))
-			continue;
-		
-		// Check against current data, proceed only if this hit is closer.
-		Scalar distance2 = (point - ray.origin).Length2();
-		if(distance2 > result.distance*result.distance || 
-			distance2 < IL_MinimumNextIntersectionDistance*IL_MinimumNextIntersectionDistance)
-			continue;
+		TriangleOccluder occluder(compiled);
+		return kdTree.Occluded(ray, maxDistance, occluder);
+	}
+	if(lazyBVH.IsBuilt())
+	{
+		TriangleOccluder occluder(compiled);
+		return lazyBVH.Occluded(ray, maxDistance, occluder);
+	}
+	if(quantizedBVH8.IsBuilt() || quantizedBVH16.IsBuilt())
+	{
+		TriangleOccluder occluder(compiled);
+		if(quantizedBVH8.IsBuilt())
+			return quantizedBVH8.Occluded(ray, maxDistance, occluder);
+		return quantizedBVH16.Occluded(ray, maxDistance, occluder);
+	}
+	if(!floatNodes.empty())
+	{
+		TriangleOccluderT<ScalarCompressed> occluder(floatCompiled);
+		return BVH::OccludedNodes(&floatNodes[0], ray, maxDistance, occluder);
+	}
+	if(bvh.IsBuilt())
+	{
+		TriangleOccluder occluder(compiled);
+		return bvh.Occluded(ray, maxDistance, occluder);
+	}
 
-		// Save current best hit.
-		result.distance = std::sqrt(distance2);
-		result.normal = normal;
-		result.materialData = NULL;
-		result.material = materials[i];
+	IntersectResult result;
+	result.distance = maxDistance;
+	int N = materials.size();
+	for(int i = 0; i < N; i++)
+	{
+		IntersectTriangle(i, ray, result);
+		if(result.distance < maxDistance)
+			return true;
 	}
+	return false;
+}
+
+void TriangleMesh::IntersectPacket(const RayPacket& packet, IntersectResult* results)
+{
+	// Wide BVH single ray traversal already uses SIMD across children and measured faster than
+	// double precision packets on fine meshes. Single precision nodes have no packet traversal.
+	if(wideBVH.IsBuilt() || !floatNodes.empty() || !bvh.IsBuilt())
+	{
+		IGeometry::IntersectPacket(packet, results);
+		return;
+	}
+
+	TriangleIntersector intersector(compiled);
+	bvh.IntersectPacket(packet, results, intersector);
 }
 
 /// ------------------------------------------------------------------------------------------------------------
@@ -112,6 +556,13 @@ bool Box::IsPointInBox(const Vec3& point)
 	return false;
 }
 
+BoundingBox Box::GetBounds()
+{
+	// Hits are accepted within epsilon of box (see IsPointInBox), so bounds are padded by it too.
+	Vec3 e(IL_Epsilon, IL_Epsilon, IL_Epsilon);
+	return BoundingBox(minDim - e, maxDim + e);
+}
+
 inline bool RayPlane(const Vec3& rayDir, const Vec3& rayOrigin, const Vec3& normal, const Vec3& pointOnPlane, Vec3& point)
 {
 	Scalar denom = normal * rayDir;
@@ -197,11 +648,371 @@ void Box::Intersect(const Ray& ray, IntersectResult& result)
 		}
 	}
 
-	if(bestDistance == std::numeric_limits<Scalar>::max())
+	// Only closer hits than the one in result are accepted (order of geometry must not matter).
+	if(bestDistance == std::numeric_limits<Scalar>::max() || bestDistance > result.distance)
 		return;
 
 	result.normal = normal;
 	result.materialData = 0;
 	result.distance = bestDistance;
 	result.material = this->material;
-}
\ No newline at end of file
+}
+
+bool Box::Occluded(const Ray& ray, Scalar maxDistance)
+{
+	// Faces in the same order as in Intersect; any face hit in range blocks the ray.
+	const Vec3 normals[6] = { Vec3(0,0,-1), Vec3(-1,0,0), Vec3(0,-1,0), Vec3(0,1,0), Vec3(1,0,0), Vec3(0,0,1) };
+	Vec3 point;
+	for(int i = 0; i < 6; i++)
+	{
+		if(RayPlane(ray.direction, ray.origin, normals[i], i < 3 ? minDim : maxDim, point) && IsPointInBox(point)
+			&& (point - ray.origin).Length() < maxDistance)
+			return true;
+	}
+	return false;
+}
+/// ------------------------------------------------------------------------------------------------------------
+/// Primitive sets
+/// ------------------------------------------------------------------------------------------------------------
+
+// Groups primitives into blocks of nearby primitives: leaves of BVH with leaves of at most block width.
+// Block b holds primitives order[start[b]] ... order[start[b+1]-1].
+static void GroupIntoBlocks(const std::vector<BoundingBox>& bounds, std::vector<int>& order, std::vector<int>& start)
+{
+	BVH grouping;
+	grouping.maxLeafSize = PrimitiveBlock_Width;
+	grouping.Build(bounds);
+	order = grouping.GetPrimitiveOrder();
+
+	// Leaves in depth first order have increasing offsets.
+	const std::vector<BVHNode>& nodes = grouping.GetNodes();
+	start.clear();
+	for(unsigned int i = 0; i < nodes.size(); i++)
+		if(nodes[i].IsLeaf())
+			start.push_back(nodes[i].offset);
+	start.push_back(order.size());
+}
+
+// Lane with nearest hit of kernel result.
+static int NearestLane(int mask, const Scalar* distances)
+{
+	int best = -1;
+	for(int lane = 0; mask != 0; lane++, mask >>= 1)
+		if((mask & 1) && (best < 0 || distances[lane] < distances[best]))
+			best = lane;
+	return best;
+}
+
+struct SphereBlockIntersector
+{
+	const std::vector<SphereBlock>& blocks;
+	const std::vector<Material*>& materials;
+	SimdLevel level;
+	SphereBlockIntersector(const std::vector<SphereBlock>& b, const std::vector<Material*>& m, SimdLevel l) 
+		: blocks(b), materials(m), level(l) {}
+
+	void Intersect(const SphereBlock& block, const Ray& ray, IntersectResult& result)
+	{
+		Scalar distances[PrimitiveBlock_Width];
+		int mask = IntersectSphereBlock(level, block, ray, result.distance, distances);
+		if(mask == 0)
+			return;
+
+		int lane = NearestLane(mask, distances);
+		Vec3 center(block.centerX[lane], block.centerY[lane], block.centerZ[lane]);
+		result.distance = distances[lane];
+		result.material = materials[block.index[lane]];
+		result.materialData = NULL;
+		result.normal = ((ray.origin + distances[lane]*ray.direction) - center).Normal();
+	}
+	void operator()(int slot, const Ray& ray, IntersectResult& result) { Intersect(blocks[slot], ray, result); }
+};
+
+struct SphereBlockOccluder
+{
+	const std::vector<SphereBlock>& blocks;
+	SimdLevel level;
+	SphereBlockOccluder(const std::vector<SphereBlock>& b, SimdLevel l) : blocks(b), level(l) {}
+
+	bool Occludes(const SphereBlock& block, const Ray& ray, Scalar maxDistance)
+	{
+		Scalar distances[PrimitiveBlock_Width];
+		int mask = IntersectSphereBlock(level, block, ray, maxDistance, distances);
+		for(int lane = 0; mask != 0; lane++, mask >>= 1)
+			if((mask & 1) && distances[lane] < maxDistance)
+				return true;
+		return false;
+	}
+	bool operator()(int slot, const Ray& ray, Scalar maxDistance) { return Occludes(blocks[slot], ray, maxDistance); }
+};
+
+void SphereSet::FillBlock(const int* indices, int count, SphereBlock& block)
+{
+	block.count = count;
+	for(int lane = 0; lane < PrimitiveBlock_Width; lane++)
+	{
+		// Unused lanes repeat the last sphere.
+		int i = indices[std::min(lane, count - 1)];
+		block.centerX[lane] = centers[i].x;
+		block.centerY[lane] = centers[i].y;
+		block.centerZ[lane] = centers[i].z;
+		block.radiusSquared[lane] = radii[i]*radii[i];
+		block.index[lane] = i;
+	}
+}
+
+void SphereSet::Build()
+{
+	int N = centers.size();
+	std::vector<BoundingBox> bounds(N);
+	for(int i = 0; i < N; i++)
+	{
+		Vec3 r(radii[i], radii[i], radii[i]);
+		bounds[i] = BoundingBox(centers[i] - r, centers[i] + r);
+	}
+	bvh.Clear();
+	blocks.clear();
+	if(N == 0)
+		return;
+
+	std::vector<int> order, start;
+	GroupIntoBlocks(bounds, order, start);
+	int B = start.size() - 1;
+	std::vector<SphereBlock> grouped(B);
+	std::vector<BoundingBox> blockBounds(B);
+	for(int b = 0; b < B; b++)
+	{
+		FillBlock(&order[start[b]], start[b+1] - start[b], grouped[b]);
+		for(int i = start[b]; i < start[b+1]; i++)
+			blockBounds[b].Extend(bounds[order[i]]);
+	}
+
+	// Blocks are stored in slot order of hierarchy over them.
+	bvh.maxLeafSize = 1;
+	bvh.Build(blockBounds);
+	const std::vector<int>& blockOrder = bvh.GetPrimitiveOrder();
+	blocks.resize(B);
+	for(int i = 0; i < B; i++)
+		blocks[i] = grouped[blockOrder[i]];
+	level = GetSimdLevel();
+}
+
+void SphereSet::Intersect(const Ray& ray, IntersectResult& result)
+{
+	SphereBlockIntersector intersector(blocks, materials, level);
+	if(bvh.IsBuilt())
+	{
+		bvh.Intersect(ray, result, intersector);
+		return;
+	}
+
+	int N = centers.size();
+	for(int first = 0; first < N; first += PrimitiveBlock_Width)
+	{
+		int indices[PrimitiveBlock_Width];
+		int count = std::min(PrimitiveBlock_Width, N - first);
+		for(int lane = 0; lane < count; lane++)
+			indices[lane] = first + lane;
+		SphereBlock block;
+		FillBlock(indices, count, block);
+		intersector.Intersect(block, ray, result);
+	}
+}
+
+bool SphereSet::Occluded(const Ray& ray, Scalar maxDistance)
+{
+	SphereBlockOccluder occluder(blocks, level);
+	if(bvh.IsBuilt())
+		return bvh.Occluded(ray, maxDistance, occluder);
+
+	int N = centers.size();
+	for(int first = 0; first < N; first += PrimitiveBlock_Width)
+	{
+		int indices[PrimitiveBlock_Width];
+		int count = std::min(PrimitiveBlock_Width, N - first);
+		for(int lane = 0; lane < count; lane++)
+			indices[lane] = first + lane;
+		SphereBlock block;
+		FillBlock(indices, count, block);
+		if(occluder.Occludes(block, ray, maxDistance))
+			return true;
+	}
+	return false;
+}
+
+BoundingBox SphereSet::GetBounds()
+{
+	if(bvh.IsBuilt())
+		return bvh.GetBounds();
+
+	BoundingBox bounds;
+	for(unsigned int i = 0; i < centers.size(); i++)
+	{
+		Vec3 r(radii[i], radii[i], radii[i]);
+		bounds.Extend(BoundingBox(centers[i] - r, centers[i] + r));
+	}
+	return bounds;
+}
+
+// Box intersector and occluder are created for one ray, so its inverse direction is computed once.
+struct BoxBlockIntersector
+{
+	const std::vector<BoxBlock>& blocks;
+	const std::vector<Material*>& materials;
+	SimdLevel level;
+	Vec3 invDirection;
+	BoxBlockIntersector(const std::vector<BoxBlock>& b, const std::vector<Material*>& m, SimdLevel l, const Ray& ray) 
+		: blocks(b), materials(m), level(l), invDirection(1/ray.direction.x, 1/ray.direction.y, 1/ray.direction.z) {}
+
+	void Intersect(const BoxBlock& block, const Ray& ray, IntersectResult& result)
+	{
+		Scalar distances[PrimitiveBlock_Width];
+		int mask = IntersectBoxBlock(level, block, ray, invDirection, result.distance, distances);
+		if(mask == 0)
+			return;
+
+		int lane = NearestLane(mask, distances);
+		result.distance = distances[lane];
+		result.material = materials[block.index[lane]];
+		result.materialData = NULL;
+
+		// Outward normal of face nearest to hit point.
+		Vec3 point = ray.origin + distances[lane]*ray.direction;
+		Vec3 minimum(block.minX[lane], block.minY[lane], block.minZ[lane]);
+		Vec3 maximum(block.maxX[lane], block.maxY[lane], block.maxZ[lane]);
+		Scalar nearest = std::numeric_limits<Scalar>::max();
+		for(int axis = 0; axis < 3; axis++)
+		{
+			Scalar toMin = std::abs(point.data[axis] - minimum.data[axis]), toMax = std::abs(point.data[axis] - maximum.data[axis]);
+			if(toMin < nearest)
+			{
+				nearest = toMin;
+				result.normal = Vec3(0,0,0);
+				result.normal.data[axis] = -1;
+			}
+			if(toMax < nearest)
+			{
+				nearest = toMax;
+				result.normal = Vec3(0,0,0);
+				result.normal.data[axis] = 1;
+			}
+		}
+	}
+	void operator()(int slot, const Ray& ray, IntersectResult& result) { Intersect(blocks[slot], ray, result); }
+};
+
+struct BoxBlockOccluder
+{
+	const std::vector<BoxBlock>& blocks;
+	SimdLevel level;
+	Vec3 invDirection;
+	BoxBlockOccluder(const std::vector<BoxBlock>& b, SimdLevel l, const Ray& ray) 
+		: blocks(b), level(l), invDirection(1/ray.direction.x, 1/ray.direction.y, 1/ray.direction.z) {}
+
+	bool Occludes(const BoxBlock& block, const Ray& ray, Scalar maxDistance)
+	{
+		Scalar distances[PrimitiveBlock_Width];
+		int mask = IntersectBoxBlock(level, block, ray, invDirection, maxDistance, distances);
+		for(int lane = 0; mask != 0; lane++, mask >>= 1)
+			if((mask & 1) && distances[lane] < maxDistance)
+				return true;
+		return false;
+	}
+	bool operator()(int slot, const Ray& ray, Scalar maxDistance) { return Occludes(blocks[slot], ray, maxDistance); }
+};
+
+void BoxSet::FillBlock(const int* indices, int count, BoxBlock& block)
+{
+	block.count = count;
+	for(int lane = 0; lane < PrimitiveBlock_Width; lane++)
+	{
+		// Unused lanes repeat the last box.
+		const BoundingBox& box = boxes[indices[std::min(lane, count - 1)]];
+		block.minX[lane] = box.minDim.x; block.minY[lane] = box.minDim.y; block.minZ[lane] = box.minDim.z;
+		block.maxX[lane] = box.maxDim.x; block.maxY[lane] = box.maxDim.y; block.maxZ[lane] = box.maxDim.z;
+		block.index[lane] = indices[std::min(lane, count - 1)];
+	}
+}
+
+void BoxSet::Build()
+{
+	int N = boxes.size();
+	bvh.Clear();
+	blocks.clear();
+	if(N == 0)
+		return;
+
+	std::vector<int> order, start;
+	GroupIntoBlocks(boxes, order, start);
+	int B = start.size() - 1;
+	std::vector<BoxBlock> grouped(B);
+	std::vector<BoundingBox> blockBounds(B);
+	for(int b = 0; b < B; b++)
+	{
+		FillBlock(&order[start[b]], start[b+1] - start[b], grouped[b]);
+		for(int i = start[b]; i < start[b+1]; i++)
+			blockBounds[b].Extend(boxes[order[i]]);
+	}
+
+	bvh.maxLeafSize = 1;
+	bvh.Build(blockBounds);
+	const std::vector<int>& blockOrder = bvh.GetPrimitiveOrder();
+	blocks.resize(B);
+	for(int i = 0; i < B; i++)
+		blocks[i] = grouped[blockOrder[i]];
+	level = GetSimdLevel();
+}
+
+void BoxSet::Intersect(const Ray& ray, IntersectResult& result)
+{
+	BoxBlockIntersector intersector(blocks, materials, level, ray);
+	if(bvh.IsBuilt())
+	{
+		bvh.Intersect(ray, result, intersector);
+		return;
+	}
+
+	int N = boxes.size();
+	for(int first = 0; first < N; first += PrimitiveBlock_Width)
+	{
+		int indices[PrimitiveBlock_Width];
+		int count = std::min(PrimitiveBlock_Width, N - first);
+		for(int lane = 0; lane < count; lane++)
+			indices[lane] = first + lane;
+		BoxBlock block;
+		FillBlock(indices, count, block);
+		intersector.Intersect(block, ray, result);
+	}
+}
+
+bool BoxSet::Occluded(const Ray& ray, Scalar maxDistance)
+{
+	BoxBlockOccluder occluder(blocks, level, ray);
+	if(bvh.IsBuilt())
+		return bvh.Occluded(ray, maxDistance, occluder);
+
+	int N = boxes.size();
+	for(int first = 0; first < N; first += PrimitiveBlock_Width)
+	{
+		int indices[PrimitiveBlock_Width];
+		int count = std::min(PrimitiveBlock_Width, N - first);
+		for(int lane = 0; lane < count; lane++)
+			indices[lane] = first + lane;
+		BoxBlock block;
+		FillBlock(indices, count, block);
+		if(occluder.Occludes(block, ray, maxDistance))
+			return true;
+	}
+	return false;
+}
+
+BoundingBox BoxSet::GetBounds()
+{
+	if(bvh.IsBuilt())
+		return bvh.GetBounds();
+
+	BoundingBox bounds;
+	for(unsigned int i = 0; i < boxes.size(); i++)
+		bounds.Extend(boxes[i]);
+	return bounds;
+}
@@ -1,28 +1,72 @@
 #pragma once
 
 #include "Illumination.h"
+#include "Acceleration\BVH.h"
+#include "Acceleration\CompiledTriangles.h"
+#include "Acceleration\WideBVH.h"
+#include "Acceleration\QuantizedBVH.h"
+#include "Acceleration\KdTree.h"
+#include "Acceleration\LazyBVH.h"
+#include "Acceleration\PrimitiveBlocks.h"
 #include <vector>
 
 // A scene is collection of geometry. If you check against it, you check against all geometry.
 class Scene : public IGeometry
 {
+protected:
 	std::vector<IGeometry*> geometry;
 public:
 	Scene() {}
-	void AddGeometry(IGeometry* geom) { geometry.push_back(geom); }
+	virtual void AddGeometry(IGeometry* geom) { geometry.push_back(geom); }
 	virtual void Intersect(const Ray& ray, IntersectResult& result);
+	virtual void IntersectPacket(const RayPacket& packet, IntersectResult* results);
+	virtual bool Occluded(const Ray& ray, Scalar maxDistance);
+	virtual BoundingBox GetBounds();
 };
 
-// TODO: add scene that organizes geometry in bounding boxes or sth (kd trees etc). For example octree for
-// all objects and k-d trees for enviorment (terrain, rooms etc).
+// A scene that organizes geometry in bounding volume hierarchy (surface area heuristic), so intersection
+// is logarithmic in number of objects. Geometry with its own structure (meshes) is a single leaf object.
+class BVHScene : public Scene
+{
+	BVH bvh;
+	// Geometry in BVH slot order.
+	std::vector<IGeometry*> ordered;
+public:
+	BVHScene() {}
+	virtual void AddGeometry(IGeometry* geom) { Scene::AddGeometry(geom); bvh.Clear(); }
+	// Builds the hierarchy: must be called after all geometry is added and before any intersections are done.
+	// Until it is built, scene is intersected linearly. Returns stats of the hierarchy build.
+	BVHBuildStats Build();
+	// Updates the hierarchy after geometry moved or changed shape (see BVH::Refit), much faster than Build.
+	BVHBuildStats Refit();
+	virtual void Intersect(const Ray& ray, IntersectResult& result);
+	virtual void IntersectPacket(const RayPacket& packet, IntersectResult* results);
+	virtual bool Occluded(const Ray& ray, Scalar maxDistance);
+	virtual BoundingBox GetBounds();
+};
 
 // Allowed geometry to be translated/rotated by applying inverse transformation in intersect ray.
+// An instance: world point is transform*local + translate. Geometry (and its acceleration structure) is shared
+// by all instances, so put instances into BVHScene to get two level hierarchy with memory scaling with unique
+// geometry. Remarks: IL_MinimumNextIntersectionDistance is applied in local space.
 class TransformedGeometry : public IGeometry
 {
-	Vec3 invTranslate;
 	IGeometry* transformedGeometry;
-	//Mat3x3 invRotate;
+	Mat3x3 transform, invTransform, normalTransform;
+	Vec3 translate;
+
+	// Transforms ray to local space, scale is local distance per world distance.
+	void ToLocal(const Ray& ray, Ray& localRay, Scalar& scale);
 public:
+	TransformedGeometry(IGeometry* geometry, const Mat3x3& transform, const Vec3& translate);
+
+	// Moves the instance; scene containing it must be refitted or rebuilt.
+	void SetTransform(const Mat3x3& transform, const Vec3& translate);
+
+	virtual void Intersect(const Ray& ray, IntersectResult& result);
+	virtual void IntersectPacket(const RayPacket& packet, IntersectResult* results);
+	virtual bool Occluded(const Ray& ray, Scalar maxDistance);
+	virtual BoundingBox GetBounds();
 };
 
 /// A sphere geometry.
@@ -35,11 +79,34 @@ public:
 	Sphere(const Vec3& c, Scalar r, Material* material) 
 		: center(c), radius(r) { this->material = material; }
 	virtual void Intersect(const Ray& ray, IntersectResult& result);
+	virtual bool Occluded(const Ray& ray, Scalar maxDistance);
+	virtual BoundingBox GetBounds();
 
 	virtual Vec3 Sample(int sampleIndex, int sampleCount, RandomGenerator* generator, Vec3& normal);
 
 };
 
+// Acceleration structure used by triangle mesh.
+enum MeshAccelerator
+{
+	AcceleratorBVH,			//< Binary BVH, double precision.
+	AcceleratorWideBVH,		//< 4/8 wide BVH with SIMD kernels chosen by CPU (binary BVH is still built under it).
+	AcceleratorQuantizedBVH8,	//< Binary BVH with 8 bit child bounds, smallest memory footprint.
+	AcceleratorQuantizedBVH16,	//< Binary BVH with 16 bit child bounds, tighter boxes than 8 bit.
+	AcceleratorKdTree,		//< SAH kd-tree, often faster than BVH for static scenes with large axis aligned triangles.
+	AcceleratorLazyBVH		//< Binary BVH split on demand while rendering, for fast start of previews of huge meshes.
+};
+
+// Precision of ray kernels of triangle mesh. Hits are always reported in Scalar precision.
+enum MeshPrecision
+{
+	PrecisionDouble,		//< Nodes and triangles in Scalar (double) precision.
+	PrecisionFloat			//< Nodes and triangles in single precision, used with AcceleratorBVH (others stay in double).
+};
+// PrecisionFloat triangle test is not watertight: rays through shared edges may slip between triangles, and as
+// vertices are rounded in world coordinates, hits are lost more often far from the origin (see
+// Benchmark_FarFromOrigin). Use PrecisionDouble or AcceleratorWideBVH (single precision filter, exact hits) there.
+
 // A triangle mesh.
 // Data is saved in indexed format. 3 indices define triangle, each triangle has it's own material (can be shared). Size
 // of material array is always 1/3 of size of indices array.
@@ -48,17 +115,66 @@ class TriangleMesh : public IGeometry
 	std::vector<Vec3> vertices;
 	std::vector<int> indices;
 	std::vector<Material*> materials;
+
+	// Hierarchy over triangles and triangles compiled in its slot order, empty until Build is called.
+	BVH bvh;
+	CompiledTriangles compiled;
+	WideBVH wideBVH;
+	// Quantized hierarchies replace bvh (it is released after conversion).
+	QuantizedBVH8 quantizedBVH8;
+	QuantizedBVH16 quantizedBVH16;
+	// Kd-tree and lazy BVH reference triangles by index, so they are compiled in mesh order.
+	KdTree kdTree;
+	LazyBVH lazyBVH;
+	// Single precision copies of bvh and compiled (which is then empty), used by PrecisionFloat.
+	std::vector<BVHNodeT<ScalarCompressed> > floatNodes;
+	CompiledTrianglesT<ScalarCompressed> floatCompiled;
+
+	void ClearBuild() 
+	{ 
+		bvh.Clear(); compiled.Clear(); wideBVH.Clear(); quantizedBVH8.Clear(); quantizedBVH16.Clear(); kdTree.Clear(); lazyBVH.Clear();
+		floatNodes.clear(); floatCompiled.Clear();
+	}
+	// Compiles triangles in slot order of bvh in chosen precision.
+	void CompileTriangles();
+	void ComputeTriangleBounds(std::vector<BoundingBox>& bounds);
 public:
-	TriangleMesh(int capacity = 0) { if(capacity) 
+	// Structure built by Build.
+	MeshAccelerator accelerator;
+	// Precision of structures built by Build.
+	MeshPrecision precision;
+
+	TriangleMesh(int capacity = 0) : accelerator(AcceleratorWideBVH), precision(PrecisionDouble) { if(capacity) 
 	{ materials.reserve(capacity); indices.reserve(capacity*3); } }
 	virtual void Intersect(const Ray& ray, IntersectResult& result);
+	// Packets are traversed together through binary BVH; with wide BVH rays are traced one by one.
+	virtual void IntersectPacket(const RayPacket& packet, IntersectResult* results);
+	virtual bool Occluded(const Ray& ray, Scalar maxDistance);
+	virtual BoundingBox GetBounds();
+
+	// Builds hierarchy over triangles: must be called after mesh is constructed and before any intersections
+	// are done. Until it is built (or after mesh is changed), triangles are intersected linearly. Returns stats
+	// of the binary hierarchy phase, which conversions to other structures start from (empty for kd-tree and lazy BVH).
+	BVHBuildStats Build();
+	// Updates built structures after vertices were moved by SetVertex; topology of hierarchy is kept except for
+	// degraded subtrees (see BVH::Refit). Quantized hierarchies, kd-tree and lazy BVH cannot be refitted and are rebuilt.
+	BVHBuildStats Refit();
+	int GetTriangleCount() { return materials.size(); }
+
+	// Intersects a single triangle, updating result if hit is closer.
+	void IntersectTriangle(int idx, const Ray& ray, IntersectResult& result);
 
 	// Mesh constructing methods.
-	int AddVertex(const Vec3& p) { vertices.push_back(p); return vertices.size()-1; }
+	int AddVertex(const Vec3& p) { vertices.push_back(p); ClearBuild(); return vertices.size()-1; }
+	// Moves vertex (for animation), built structures are kept until Refit.
+	void SetVertex(int idx, const Vec3& p) { vertices[idx] = p; }
+	const Vec3& GetVertex(int idx) { return vertices[idx]; }
+	int GetVertexCount() { return vertices.size(); }
 	void AddIndexedTriangle(int id1, int id2, int id3, Material* material) 
 	{ 
 		indices.push_back(id1); indices.push_back(id2); indices.push_back(id3); 
 		materials.push_back(material);
+		ClearBuild();
 	}
 	int AddTriangle(const Vec3& p1, const Vec3& p2, const Vec3& p3, Material* material)
 	{
@@ -66,17 +182,43 @@ public:
 		AddIndexedTriangle(idx, idx+1, idx+2, material);
 		return materials.size() - 1;
 	}
+	// Bulk construction (used by importers): sets vertex and triangle counts at once, contents are then
+	// written through data pointers. Existing contents are kept up to new counts.
+	void Resize(int vertexCount, int triangleCount)
+	{
+		vertices.resize(vertexCount); indices.resize(triangleCount*3); materials.resize(triangleCount);
+		ClearBuild();
+	}
+	// Exchanges triangles and vertices with other mesh; built structures of both are released.
+	void Swap(TriangleMesh& other)
+	{
+		vertices.swap(other.vertices); indices.swap(other.indices); materials.swap(other.materials);
+		ClearBuild(); other.ClearBuild();
+	}
+	// Bytes of vertex, index and material arrays (built structures are not counted).
+	long long GetDataSize()
+	{
+		return (long long)vertices.size() * sizeof(Vec3) + (long long)indices.size() * sizeof(int)
+			+ (long long)materials.size() * sizeof(Material*);
+	}
+	Vec3* GetVertexData() { return vertices.empty() ? 0 : &vertices[0]; }
+	int* GetIndexData() { return indices.empty() ? 0 : &indices[0]; }
+	Material** GetMaterialData() { return materials.empty() ? 0 : &materials[0]; }
+	// Built structures (empty until Build, BVH is also empty for kd-tree, lazy and quantized accelerators,
+	// compiled triangles are empty in single precision).
+	const BVH& GetBVH() const { return bvh; }
+	const CompiledTriangles& GetCompiledTriangles() const { return compiled; }
 	void GetTriangle(int idx, Vec3& p1, Vec3& p2, Vec3& p3, Material* &material)
 	{
 		p1 = vertices[indices[idx*3]];
 		p2 = vertices[indices[idx*3+1]];
 		p3 = vertices[indices[idx*3+2]];
-		material = materials[indices[idx]];
+		material = materials[idx];
 	}
 
-	// A static helper triangle-ray intersection
+	// A static helper triangle-ray intersection, distance is along (normalized) ray direction.
 	static bool Intersect(const Ray& ray, const Vec3& p1, const Vec3& p2, const Vec3& p3, 
-		Vec3& point, Vec3& normal, Scalar minDistance, Scalar maxDistance);
+		Scalar& distance, Vec3& normal, Scalar minDistance, Scalar maxDistance);
 	
 };
 
@@ -88,4 +230,71 @@ public:
 	Box(const Vec3& min, const Vec3& max, Material* mat) : minDim(min), maxDim(max), material(mat) {}
 	bool IsPointInBox(const Vec3& point);
 	virtual void Intersect(const Ray& ray, IntersectResult& result);
+	virtual bool Occluded(const Ray& ray, Scalar maxDistance);
+	virtual BoundingBox GetBounds();
+};
+
+// Many spheres as one geometry (particles). Spheres are grouped into blocks of nearby spheres stored as structure
+// of arrays; blocks are leaf primitives of set's BVH and are intersected with SIMD kernels, so there is no
+// virtual call or separate BVH leaf per sphere.
+class SphereSet : public IGeometry
+{
+	std::vector<Vec3> centers;
+	std::vector<Scalar> radii;
+	std::vector<Material*> materials;
+
+	// Hierarchy over blocks and blocks in its slot order, empty until Build is called.
+	BVH bvh;
+	std::vector<SphereBlock> blocks;
+	SimdLevel level;
+
+	void FillBlock(const int* indices, int count, SphereBlock& block);
+public:
+	SphereSet() : level(SimdScalar) {}
+
+	int AddSphere(const Vec3& center, Scalar radius, Material* material)
+	{
+		centers.push_back(center); radii.push_back(radius); materials.push_back(material);
+		bvh.Clear(); blocks.clear();
+		return centers.size() - 1;
+	}
+	int GetSphereCount() { return centers.size(); }
+
+	// Builds blocks and hierarchy: must be called after all spheres are added. Until it is built, spheres
+	// are intersected linearly.
+	void Build();
+	virtual void Intersect(const Ray& ray, IntersectResult& result);
+	virtual bool Occluded(const Ray& ray, Scalar maxDistance);
+	virtual BoundingBox GetBounds();
+};
+
+// Many axis aligned boxes as one geometry (debris), organized the same way as SphereSet. Boxes are intersected
+// with exact slab test, ray starting inside a box hits its exit face.
+class BoxSet : public IGeometry
+{
+	std::vector<BoundingBox> boxes;
+	std::vector<Material*> materials;
+
+	BVH bvh;
+	std::vector<BoxBlock> blocks;
+	SimdLevel level;
+
+	void FillBlock(const int* indices, int count, BoxBlock& block);
+public:
+	BoxSet() : level(SimdScalar) {}
+
+	int AddBox(const Vec3& min, const Vec3& max, Material* material)
+	{
+		boxes.push_back(BoundingBox(min, max)); materials.push_back(material);
+		bvh.Clear(); blocks.clear();
+		return boxes.size() - 1;
+	}
+	int GetBoxCount() { return boxes.size(); }
+
+	// Builds blocks and hierarchy: must be called after all boxes are added. Until it is built, boxes
+	// are intersected linearly.
+	void Build();
+	virtual void Intersect(const Ray& ray, IntersectResult& result);
+	virtual bool Occluded(const Ray& ray, Scalar maxDistance);
+	virtual BoundingBox GetBounds();
 };
@@ -2,12 +2,9 @@
 #include <cmath>
 
 
-ColourScalar PointLight::Radiance(const Vec3& surfacePoint, Vec3& towardsLightDirection, IGeometry* geometry)
+ColourScalar PointLight::UnoccludedRadiance(const Vec3& surfacePoint, Vec3& towardsLightDirection, Vec3& shadowPoint)
 {
-	// Check visibility first.
-	if(geometry->IsInShadow(surfacePoint, position))
-		return Vec3(0,0,0);
-
+	shadowPoint = position;
 	towardsLightDirection = (this->position - surfacePoint);
 	ColourScalar s = (this->intensity) / (towardsLightDirection.Length2());
 	towardsLightDirection.Normalize();
@@ -21,13 +18,10 @@ Vec3 PointLight::Sample(int indexOfPhoton, int sampleCount, RandomGenerator* ran
 	return this->intensity / (Scalar)sampleCount;
 }
 
-ColourScalar DirectionalLight::Radiance(const Vec3& surfacePoint, Vec3& towardsLightDirection, IGeometry* geometry)
+ColourScalar DirectionalLight::UnoccludedRadiance(const Vec3& surfacePoint, Vec3& towardsLightDirection, Vec3& shadowPoint)
 {
 	const Scalar BIG = 100000;
-	// Check visibility first.
-	if(geometry->IsInShadow(surfacePoint, surfacePoint - direction * BIG))
-		return Vec3(0,0,0);
-
+	shadowPoint = surfacePoint - direction * BIG;
 	towardsLightDirection = -direction;
 	return intensity;
 }
@@ -9,7 +9,7 @@ public:
 	ColourScalar intensity;
 
 	PointLight(const Vec3& p, const ColourScalar& inten) : position(p), intensity(inten) {}
-	ColourScalar Radiance(const Vec3& surfacePoint, Vec3& towardsLightDirection, IGeometry* geometry);
+	ColourScalar UnoccludedRadiance(const Vec3& surfacePoint, Vec3& towardsLightDirection, Vec3& shadowPoint);
 	Vec3 Sample(int indexOfPhoton, int sampleCount, RandomGenerator* random, Vec3& position, Vec3& direction);
 };
 
@@ -21,7 +21,7 @@ public:
 	ColourScalar intensity;
 
 	DirectionalLight(const Vec3& dir, const ColourScalar& inten) : direction(dir), intensity(inten) {}
-	ColourScalar Radiance(const Vec3& surfacePoint, Vec3& towardsLightDirection, IGeometry* geometry);
+	ColourScalar UnoccludedRadiance(const Vec3& surfacePoint, Vec3& towardsLightDirection, Vec3& shadowPoint);
 	Vec3 Sample(int indexOfPhoton, int sampleCount, RandomGenerator* random, Vec3& position, Vec3& direction);
 };
 
@@ -1,4 +1,5 @@
 #include "Illumination.h"
+#include <algorithm>
 
 
 /// -------------------------------------------------------------------------------------------------------
@@ -100,19 +101,104 @@ Vec3 RandomGenerator::NextHemisphereDirection(const Vec3& normal)
 /// Geometry
 /// -------------------------------------------------------------------------------------------------------
 
+void IGeometry::IntersectPacket(const RayPacket& packet, IntersectResult* results)
+{
+	for(int i = 0; i < packet.size; i++)
+		this->Intersect(packet.rays[i], results[i]);
+}
+
+void RayPacket::Prepare()
+{
+	for(int i = 0; i < size; i++)
+	{
+		const Vec3& d = rays[i].direction;
+		invDirections[i] = Vec3(1/d.x, 1/d.y, 1/d.z);
+	}
+
+	minOrigin = maxOrigin = rays[0].origin;
+	minInvDirection = maxInvDirection = invDirections[0];
+	for(int i = 1; i < size; i++)
+	{
+		for(int axis = 0; axis < 3; axis++)
+		{
+			minOrigin.data[axis] = std::min(minOrigin.data[axis], rays[i].origin.data[axis]);
+			maxOrigin.data[axis] = std::max(maxOrigin.data[axis], rays[i].origin.data[axis]);
+			minInvDirection.data[axis] = std::min(minInvDirection.data[axis], invDirections[i].data[axis]);
+			maxInvDirection.data[axis] = std::max(maxInvDirection.data[axis], invDirections[i].data[axis]);
+		}
+	}
+
+	for(int axis = 0; axis < 3; axis++)
+	{
+		Scalar lo = minInvDirection.data[axis], hi = maxInvDirection.data[axis];
+		isAxisCoherent[axis] = (lo > 0 || hi < 0) && std::abs(lo) < std::numeric_limits<Scalar>::max() 
+			&& std::abs(hi) < std::numeric_limits<Scalar>::max();
+	}
+}
+
+// Bounds of product of intervals [a0,a1]*[b0,b1].
+static inline void IntervalMultiply(Scalar a0, Scalar a1, Scalar b0, Scalar b1, Scalar& lo, Scalar& hi)
+{
+	Scalar p1 = a0*b0, p2 = a0*b1, p3 = a1*b0, p4 = a1*b1;
+	lo = std::min(std::min(p1, p2), std::min(p3, p4));
+	hi = std::max(std::max(p1, p2), std::max(p3, p4));
+}
+
+bool RayPacket::MayIntersect(const BoundingBox& box, Scalar maxDistance) const
+{
+	// Every ray's interval [max near_i, min far_i] lies within [max lower(near_i), min upper(far_i)].
+	Scalar t0 = 0, t1 = maxDistance;
+	for(int axis = 0; axis < 3; axis++)
+	{
+		if(!isAxisCoherent[axis])
+			continue;
+
+		bool isNegative = minInvDirection.data[axis] < 0;
+		Scalar nearPlane = isNegative ? box.maxDim.data[axis] : box.minDim.data[axis];
+		Scalar farPlane = isNegative ? box.minDim.data[axis] : box.maxDim.data[axis];
+		Scalar lo, hi, dummy;
+		IntervalMultiply(nearPlane - maxOrigin.data[axis], nearPlane - minOrigin.data[axis],
+			minInvDirection.data[axis], maxInvDirection.data[axis], lo, dummy);
+		IntervalMultiply(farPlane - maxOrigin.data[axis], farPlane - minOrigin.data[axis],
+			minInvDirection.data[axis], maxInvDirection.data[axis], dummy, hi);
+		hi *= 1 + 4*std::numeric_limits<Scalar>::epsilon();
+
+		if(lo > t0) t0 = lo;
+		if(hi < t1) t1 = hi;
+		if(t0 > t1)
+			return false;
+	}
+	return true;
+}
+
 bool IGeometry::IsInShadow(const Vec3& p1, const Vec3& p2)
 {
 	// We calculate in range [minDistance, maxDistance].
-	IntersectResult result;
 	Scalar maxDistance = (p2-p1).Length() - IL_Epsilon;
-	result.distance = maxDistance;
 
-	// Generate ray and check for intersection.
-	Ray ray(p1, (p2-p1)/result.distance);
+	// Generate ray and check for any intersection.
+	Ray ray(p1, (p2-p1)/maxDistance);
+	return this->Occluded(ray, maxDistance);
+}
+
+bool IGeometry::Occluded(const Ray& ray, Scalar maxDistance)
+{
+	IntersectResult result;
+	result.distance = maxDistance;
 	this->Intersect(ray, result);
-	if(result.distance < maxDistance)
-		return true;
-	return false;
+	return result.distance < maxDistance;
+}
+
+ColourScalar ISingularLight::Radiance(const Vec3& surfacePoint, const Vec3& normal, Scalar distance, Vec3& towardsLightDirection,
+	IGeometry* geometry)
+{
+	Vec3 shadowPoint;
+	ColourScalar L = UnoccludedRadiance(surfacePoint, towardsLightDirection, shadowPoint);
+
+	// Check visibility.
+	if(geometry->IsInShadow(OffsetRayOrigin(surfacePoint, distance, normal, towardsLightDirection), shadowPoint))
+		return Vec3(0,0,0);
+	return L;
 }
 
 
@@ -121,4 +207,5 @@ bool IGeometry::IsInShadow(const Vec3& p1, const Vec3& p2)
 /// ----------------------------------------------------------------------------------------------------------
 
 Scalar IL_Epsilon = (Scalar)1e-5;
-Scalar IL_MinimumNextIntersectionDistance = (Scalar)1e-3;
+Scalar IL_MinimumNextIntersectionDistance = (Scalar)1e-5;
+Scalar IL_RayOffset = (Scalar)1e-5;
@@ -3,6 +3,7 @@
 #include "LinearAlgebra.h"
 
 #include <vector>
+#include <algorithm>
 
 // Constants.
 const Scalar PI = (Scalar)3.141592653589793238462643383279;
@@ -10,6 +11,7 @@ const Scalar PI = (Scalar)3.141592653589793238462643383279;
 // Configuration data.
 extern Scalar IL_Epsilon;						  //< Epsilon for numerical comparison (abs(x-y)<epsilon <===> x==y)
 extern Scalar IL_MinimumNextIntersectionDistance; //< Default minimum distance for next intersection.
+extern Scalar IL_RayOffset;						  //< Offset of secondary ray origins relative to scale of hit (see OffsetRayOrigin).
 
 
 // A colour type, final data in image.
@@ -56,6 +58,163 @@ struct Ray
 	Ray(const Vec3& o, const Vec3& dir) : origin(o), direction(dir), medium(0) {}
 };
 
+// Nesting of mediums (glass in water in ...) stored inline in MediumStack.
+const int MediumStack_InlineSize = 8;
+
+// Mediums a ray is nested in: when ray enters a surface, the medium it leaves is pushed, and popped when it
+// exits. First MediumStack_InlineSize mediums are stored inline, so tracers keep it on their stack and allocate
+// only for deeper nesting.
+struct MediumStack
+{
+	IMedium* mediums[MediumStack_InlineSize];
+	std::vector<IMedium*> spilled;	//< Mediums above inline ones.
+	int size;
+
+	MediumStack() : size(0) {}
+	// Copies only used inline entries (the rest is never read).
+	MediumStack(const MediumStack& other) : spilled(other.spilled), size(other.size) { CopyInline(other); }
+	MediumStack& operator=(const MediumStack& other)
+	{
+		spilled = other.spilled;
+		size = other.size;
+		CopyInline(other);
+		return *this;
+	}
+	void CopyInline(const MediumStack& other)
+	{
+		for(int i = 0; i < size && i < MediumStack_InlineSize; i++)
+			mediums[i] = other.mediums[i];
+	}
+
+	bool IsEmpty() const { return size == 0; }
+	IMedium* Top() const { return size > MediumStack_InlineSize ? spilled.back() : mediums[size - 1]; }
+	void Push(IMedium* medium)
+	{
+		if(size < MediumStack_InlineSize)
+			mediums[size] = medium;
+		else
+			spilled.push_back(medium);
+		size++;
+	}
+	void Pop()
+	{
+		if(size > MediumStack_InlineSize)
+			spilled.pop_back();
+		size--;
+	}
+};
+
+// An axis aligned bounding box of precision T (BoundingBox is in Scalar precision).
+template<class T>
+struct BoundingBoxT
+{
+	Vec3T<T> minDim, maxDim;
+
+	// Constructs an empty box (extending it with any point makes it valid).
+	BoundingBoxT() 
+		: minDim(std::numeric_limits<T>::max(), std::numeric_limits<T>::max(), std::numeric_limits<T>::max()),
+		  maxDim(-std::numeric_limits<T>::max(), -std::numeric_limits<T>::max(), -std::numeric_limits<T>::max()) {}
+	BoundingBoxT(const Vec3T<T>& min, const Vec3T<T>& max) : minDim(min), maxDim(max) {}
+
+	bool IsEmpty() const { return minDim.x > maxDim.x || minDim.y > maxDim.y || minDim.z > maxDim.z; }
+	Vec3T<T> Center() const { return (minDim + maxDim) * (T)0.5; }
+	Vec3T<T> Extent() const { return maxDim - minDim; }
+
+	void Extend(const Vec3T<T>& p)
+	{
+		if(p.x < minDim.x) minDim.x = p.x;
+		if(p.y < minDim.y) minDim.y = p.y;
+		if(p.z < minDim.z) minDim.z = p.z;
+		if(p.x > maxDim.x) maxDim.x = p.x;
+		if(p.y > maxDim.y) maxDim.y = p.y;
+		if(p.z > maxDim.z) maxDim.z = p.z;
+	}
+	void Extend(const BoundingBoxT& box)
+	{
+		// Component wise, so extending by empty box keeps the box unchanged.
+		for(int i = 0; i < 3; i++)
+		{
+			if(box.minDim.data[i] < minDim.data[i]) minDim.data[i] = box.minDim.data[i];
+			if(box.maxDim.data[i] > maxDim.data[i]) maxDim.data[i] = box.maxDim.data[i];
+		}
+	}
+	// Surface area of box, used by surface area heuristic.
+	T SurfaceArea() const
+	{
+		if(IsEmpty())
+			return 0;
+		Vec3T<T> e = Extent();
+		return 2*(e.x*e.y + e.y*e.z + e.z*e.x);
+	}
+	// Axis (0,1,2) where box is largest.
+	int MaximumExtentAxis() const
+	{
+		Vec3T<T> e = Extent();
+		if(e.x > e.y && e.x > e.z)
+			return 0;
+		return e.y > e.z ? 1 : 2;
+	}
+	// Slab test, true if ray (given by origin and inverse direction) overlaps the box in range [0, maxDistance].
+	bool IntersectRay(const Vec3T<T>& origin, const Vec3T<T>& invDirection, T maxDistance) const
+	{
+		T entryDistance;
+		return IntersectRay(origin, invDirection, maxDistance, entryDistance);
+	}
+	// Slab test that also returns distance where ray enters the box (0 if origin is inside).
+	bool IntersectRay(const Vec3T<T>& origin, const Vec3T<T>& invDirection, T maxDistance, T& entryDistance) const
+	{
+		T t0 = 0, t1 = maxDistance;
+		for(int axis = 0; axis < 3; axis++)
+		{
+			// NaNs (ray parallel to and on the slab) fail both compares, so the test stays conservative.
+			T tNear = (minDim.data[axis] - origin.data[axis]) * invDirection.data[axis];
+			T tFar = (maxDim.data[axis] - origin.data[axis]) * invDirection.data[axis];
+			if(tNear > tFar) { T t = tNear; tNear = tFar; tFar = t; }
+			// Rounding must not reject hits on box faces (flat boxes of planar geometry).
+			tFar *= 1 + 4*std::numeric_limits<T>::epsilon();
+			if(tNear > t0) t0 = tNear;
+			if(tFar < t1) t1 = tFar;
+			if(t0 > t1)
+				return false;
+		}
+		entryDistance = t0;
+		return true;
+	}
+};
+
+typedef BoundingBoxT<Scalar> BoundingBox;
+
+// Converts distance to precision T of a kernel; distances above its range become its maximum.
+template<class T>
+inline T ToPrecision(Scalar value)
+{
+	return value < std::numeric_limits<T>::max() ? (T)value : std::numeric_limits<T>::max();
+}
+
+// A packet of coherent rays (for example neighbouring camera rays), intersected together so acceleration
+// structures can cull nodes for whole packet at once.
+struct RayPacket
+{
+	enum { MaxSize = 64 };
+
+	Ray rays[MaxSize];
+	Vec3 invDirections[MaxSize];
+	int size;
+
+	// Bounds of origins and inverse directions over packet, valid after Prepare.
+	Vec3 minOrigin, maxOrigin;
+	Vec3 minInvDirection, maxInvDirection;
+	// If directions on axis have same sign (and are non zero), the axis is used for culling.
+	bool isAxisCoherent[3];
+
+	RayPacket() : size(0) {}
+
+	// Computes inverse directions and bounds; must be called after rays are set.
+	void Prepare();
+	// Interval arithmetic test; false only if no ray in packet can hit the box in range [0, maxDistance].
+	bool MayIntersect(const BoundingBox& box, Scalar maxDistance) const;
+};
+
 class IGeometry;
 struct Material;
 class ISurfaceLight;
@@ -77,6 +236,17 @@ struct IntersectResult
 	IntersectResult() : distance(std::numeric_limits<Scalar>::max()) {}
 };
 
+// Origin of a ray leaving surface at position, hit at distance along previous ray. Position is moved off the
+// surface along normal, to the side of new direction, by IL_RayOffset of the larger of position magnitude and
+// distance; rounding error of the hit (also in single precision kernels) is relative to them, so the offset
+// works at any scene scale without sliding the origin along the ray.
+inline Vec3 OffsetRayOrigin(const Vec3& position, Scalar distance, const Vec3& normal, const Vec3& direction)
+{
+	Scalar scale = std::max(distance, std::max(std::abs(position.x), std::max(std::abs(position.y), std::abs(position.z))));
+	Scalar offset = scale * IL_RayOffset;
+	return position + (direction * normal > 0 ? offset : -offset) * normal;
+}
+
 // A light, must be able to sample photons. Poton map can be generated this way.
 class ILight
 {
@@ -103,7 +273,14 @@ struct Photon;
 class ISingularLight : public ILight
 {
 public:
-	virtual ColourScalar Radiance(const Vec3& surfacePoint, Vec3& towardsLightDirection, IGeometry* geometry)=0;
+	// Radiance arriving at surface point, zero if light is shadowed by geometry. Shadow ray starts at surface
+	// point moved by OffsetRayOrigin (normal and distance are of the hit).
+	virtual ColourScalar Radiance(const Vec3& surfacePoint, const Vec3& normal, Scalar distance, Vec3& towardsLightDirection,
+		IGeometry* geometry);
+
+	// Radiance arriving at surface point if nothing blocks the light. Point is lit if segment from surface point
+	// to shadowPoint is not occluded. This allows visibility to be tested later (batched).
+	virtual ColourScalar UnoccludedRadiance(const Vec3& surfacePoint, Vec3& towardsLightDirection, Vec3& shadowPoint)=0;
 };
 
 // The sampling needed by material, flag like.
@@ -202,10 +379,24 @@ struct Material
 class IGeometry
 {
 public:
+	// Geometries (meshes, instances) are deleted through this interface.
+	virtual ~IGeometry() {}
+
 	// Intersects geometry versus enviorment. This call must update result when
 	// better hit than the one in result is found (closer). 
 	virtual void Intersect(const Ray& ray, IntersectResult& result)=0;
 
+	// Obtains axis aligned bounds of geometry (in world space); used by acceleration structures.
+	virtual BoundingBox GetBounds()=0;
+
+	// Intersects all rays of packet, results[i] belongs to packet.rays[i]. Default implementation
+	// intersects rays one by one.
+	virtual void IntersectPacket(const RayPacket& packet, IntersectResult* results);
+
+	// Any hit query: true if ray hits geometry at distance in [IL_MinimumNextIntersectionDistance, maxDistance).
+	// Search stops at first hit found. Default implementation uses closest hit Intersect.
+	virtual bool Occluded(const Ray& ray, Scalar maxDistance);
+
 	// A shadow ray from point 1 to point 2, if any intersection found, result is true.
 	bool IsInShadow(const Vec3& p1, const Vec3& p2);
 };
@@ -9,36 +9,97 @@ typedef double Scalar;
 typedef float ScalarCompressed;
 typedef unsigned __int64 BigUInt;
 
-// A 3D Scalar vector type.
-struct Vec3
+// A 3D vector of precision T; Vec3 (Scalar precision) is used everywhere except in kernels with selectable precision.
+template<class T>
+struct Vec3T
 {
 	union {
 		struct {
-			Scalar x, y, z;
+			T x, y, z;
 		};
-		Scalar data[3];
+		T data[3];
 	};
 
-	Vec3() {}
-	Vec3(Scalar x, Scalar y, Scalar z) { this->x = x; this->y = y; this->z = z; }
+	Vec3T() {}
+	Vec3T(T x, T y, T z) { this->x = x; this->y = y; this->z = z; }
+	// Conversion from other precision (rounds to nearest).
+	template<class U>
+	explicit Vec3T(const Vec3T<U>& v) { x = (T)v.x; y = (T)v.y; z = (T)v.z; }
 
 	// Component multiply/divide.
-	Vec3 CMultiply(const Vec3& other) const { return Vec3(x*other.x, y*other.y, z*other.z); }
-	Vec3 CDivision(const Vec3& other) const { return Vec3(x/other.x, y/other.y, z/other.z); }
-	Scalar Length2() { return x*x+y*y+z*z; }
-	Scalar Length() { return std::sqrt(x*x+y*y+z*z); }
-	Vec3 Normal() { Scalar l = Length(); return Vec3(x/l, y/l, z/l); }
-	void Normalize() { Scalar l = Length(); x /= l; y /= l; z/= l; }
+	Vec3T CMultiply(const Vec3T& other) const { return Vec3T(x*other.x, y*other.y, z*other.z); }
+	Vec3T CDivision(const Vec3T& other) const { return Vec3T(x/other.x, y/other.y, z/other.z); }
+	T Length2() { return x*x+y*y+z*z; }
+	T Length() { return std::sqrt(x*x+y*y+z*z); }
+	Vec3T Normal() { T l = Length(); return Vec3T(x/l, y/l, z/l); }
+	void Normalize() { T l = Length(); x /= l; y /= l; z/= l; }
+
+	// Standard vector operators, * dot product, ^ cross product. They are friends defined in class, so
+	// arguments convert implicitly (v * 2) like for non-template functions.
+	friend Vec3T operator+(const Vec3T& v1, const Vec3T& v2) { return Vec3T(v1.x+v2.x, v1.y+v2.y, v1.z+v2.z); }
+	friend Vec3T operator-(const Vec3T& v1, const Vec3T& v2) { return Vec3T(v1.x-v2.x, v1.y-v2.y, v1.z-v2.z); }
+	friend Vec3T& operator+=(Vec3T& v1, const Vec3T& v2) { v1.x+=v2.x; v1.y+=v2.y; v1.z+=v2.z; return v1; }
+	friend Vec3T& operator-=(Vec3T& v1, const Vec3T& v2) { v1.x-=v2.x; v1.y-=v2.y; v1.z-=v2.z; return v1;}
+	friend Vec3T operator^(const Vec3T& v1, const Vec3T& v2) { return Vec3T(v1.y*v2.z-v2.y*v1.z, -v1.x*v2.z+v2.x*v1.z, v1.x*v2.y-v2.x*v1.y); }
+	friend T operator*(const Vec3T& v1, const Vec3T& v2) { return v1.x*v2.x+v1.y*v2.y+v1.z*v2.z; }
+	friend Vec3T operator*(const Vec3T& v1, const T f) { return Vec3T(v1.x*f, v1.y*f, v1.z*f); }
+	friend Vec3T operator*(const T f, const Vec3T& v1) { return Vec3T(v1.x*f, v1.y*f, v1.z*f); }
+	friend Vec3T operator/(const Vec3T& v1, const T f) { return Vec3T(v1.x/f, v1.y/f, v1.z/f); }
+	friend Vec3T operator-(const Vec3T& v) { return Vec3T(-v.x, -v.y, -v.z); }
 };
 
-// Standard vector operators, * dot product, ^ cross product.
-inline Vec3 operator+(const Vec3& v1, const Vec3& v2) { return Vec3(v1.x+v2.x, v1.y+v2.y, v1.z+v2.z); }
-inline Vec3 operator-(const Vec3& v1, const Vec3& v2) { return Vec3(v1.x-v2.x, v1.y-v2.y, v1.z-v2.z); }
-inline Vec3& operator+=(Vec3& v1, const Vec3& v2) { v1.x+=v2.x; v1.y+=v2.y; v1.z+=v2.z; return v1; }
-inline Vec3& operator-=(Vec3& v1, const Vec3& v2) { v1.x-=v2.x; v1.y-=v2.y; v1.z-=v2.z; return v1;}
-inline Vec3 operator^(const Vec3& v1, const Vec3& v2) { return Vec3(v1.y*v2.z-v2.y*v1.z, -v1.x*v2.z+v2.x*v1.z, v1.x*v2.y-v2.x*v1.y); }
-inline Scalar operator*(const Vec3& v1, const Vec3& v2) { return v1.x*v2.x+v1.y*v2.y+v1.z*v2.z; }
-inline Vec3 operator*(const Vec3& v1, const Scalar f) { return Vec3(v1.x*f, v1.y*f, v1.z*f); }
-inline Vec3 operator*(const Scalar f, const Vec3& v1) { return Vec3(v1.x*f, v1.y*f, v1.z*f); }
-inline Vec3 operator/(const Vec3& v1, const Scalar f) { return Vec3(v1.x/f, v1.y/f, v1.z/f); }
-inline Vec3 operator-(const Vec3& v) { return Vec3(-v.x, -v.y, -v.z); }
\ No newline at end of file
+typedef Vec3T<Scalar> Vec3;
+typedef Vec3T<ScalarCompressed> Vec3f;
+
+// A 3x3 Scalar matrix (row major), linear part of affine transformations.
+struct Mat3x3
+{
+	Scalar m[3][3];
+
+	Mat3x3() {}
+	Mat3x3(const Vec3& row0, const Vec3& row1, const Vec3& row2) 
+	{ 
+		for(int i = 0; i < 3; i++) { m[0][i] = row0.data[i]; m[1][i] = row1.data[i]; m[2][i] = row2.data[i]; }
+	}
+
+	static Mat3x3 Identity() { return Scale(Vec3(1,1,1)); }
+	static Mat3x3 Scale(const Vec3& s) { return Mat3x3(Vec3(s.x,0,0), Vec3(0,s.y,0), Vec3(0,0,s.z)); }
+	// Rotation around (normalized) axis, angle in radians.
+	static Mat3x3 Rotation(const Vec3& axis, Scalar angle)
+	{
+		Scalar c = std::cos(angle), s = std::sin(angle), t = 1 - c;
+		const Vec3& a = axis;
+		return Mat3x3(Vec3(t*a.x*a.x + c,     t*a.x*a.y - s*a.z, t*a.x*a.z + s*a.y),
+					  Vec3(t*a.x*a.y + s*a.z, t*a.y*a.y + c,     t*a.y*a.z - s*a.x),
+					  Vec3(t*a.x*a.z - s*a.y, t*a.y*a.z + s*a.x, t*a.z*a.z + c));
+	}
+
+	Vec3 Row(int i) const { return Vec3(m[i][0], m[i][1], m[i][2]); }
+	Mat3x3 Transposed() const 
+	{ 
+		return Mat3x3(Vec3(m[0][0], m[1][0], m[2][0]), Vec3(m[0][1], m[1][1], m[2][1]), Vec3(m[0][2], m[1][2], m[2][2])); 
+	}
+	Scalar Determinant() const { return Row(0) * (Row(1) ^ Row(2)); }
+	// Inverse by cofactors; matrix must not be singular.
+	Mat3x3 Inverse() const
+	{
+		Vec3 c0 = Row(1) ^ Row(2), c1 = Row(2) ^ Row(0), c2 = Row(0) ^ Row(1);
+		Scalar invDet = 1 / (Row(0) * c0);
+		return Mat3x3(c0 * invDet, c1 * invDet, c2 * invDet).Transposed();
+	}
+};
+
+inline Vec3 operator*(const Mat3x3& a, const Vec3& v) 
+{ 
+	return Vec3(a.m[0][0]*v.x + a.m[0][1]*v.y + a.m[0][2]*v.z, 
+				a.m[1][0]*v.x + a.m[1][1]*v.y + a.m[1][2]*v.z, 
+				a.m[2][0]*v.x + a.m[2][1]*v.y + a.m[2][2]*v.z); 
+}
+inline Mat3x3 operator*(const Mat3x3& a, const Mat3x3& b)
+{
+	Mat3x3 r;
+	for(int i = 0; i < 3; i++)
+		for(int j = 0; j < 3; j++)
+			r.m[i][j] = a.m[i][0]*b.m[0][j] + a.m[i][1]*b.m[1][j] + a.m[i][2]*b.m[2][j];
+	return r;
+}
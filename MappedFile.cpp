@@ -0,0 +1,112 @@
+#include "MappedFile.h"
+#include <exception>
+#include <stdexcept>
+#ifdef _WIN32
+#define WIN32_LEAN_AND_MEAN
+#define NOMINMAX
+#include <windows.h>
+#else
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+#endif
+
+// Data of empty files (they cannot be mapped).
+static const char MappedFile_Empty[1] = { 0 };
+
+#ifdef _WIN32
+
+MappedFile::MappedFile() : data(0), size(0), fileHandle(INVALID_HANDLE_VALUE), mappingHandle(0) {}
+
+void MappedFile::Open(const char* filename)
+{
+	Close();
+	fileHandle = CreateFileA(filename, GENERIC_READ, FILE_SHARE_READ, 0, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, 0);
+	if(fileHandle == INVALID_HANDLE_VALUE)
+		throw std::exception("Cannot open file");
+
+	LARGE_INTEGER fileSize;
+	if(!GetFileSizeEx(fileHandle, &fileSize))
+	{
+		Close();
+		throw std::exception("Cannot get file size");
+	}
+	size = fileSize.QuadPart;
+	if(size == 0)
+	{
+		data = MappedFile_Empty;
+		return;
+	}
+
+	mappingHandle = CreateFileMappingA(fileHandle, 0, PAGE_READONLY, 0, 0, 0);
+	if(mappingHandle)
+		data = (const char*)MapViewOfFile(mappingHandle, FILE_MAP_READ, 0, 0, 0);
+	if(!data)
+	{
+		Close();
+		throw std::exception("Cannot map file");
+	}
+}
+
+void MappedFile::Close()
+{
+	if(data && data != MappedFile_Empty)
+		UnmapViewOfFile(data);
+	if(mappingHandle)
+		CloseHandle(mappingHandle);
+	if(fileHandle != INVALID_HANDLE_VALUE)
+		CloseHandle(fileHandle);
+	data = 0;
+	size = 0;
+	mappingHandle = 0;
+	fileHandle = INVALID_HANDLE_VALUE;
+}
+
+#else
+
+// POSIX version; std::exception has no message constructor outside MSVC, so runtime_error is thrown.
+
+MappedFile::MappedFile() : data(0), size(0), fileDescriptor(-1) {}
+
+void MappedFile::Open(const char* filename)
+{
+	Close();
+	fileDescriptor = open(filename, O_RDONLY);
+	if(fileDescriptor < 0)
+		throw std::runtime_error("Cannot open file");
+
+	struct stat status;
+	if(fstat(fileDescriptor, &status) != 0)
+	{
+		Close();
+		throw std::runtime_error("Cannot get file size");
+	}
+	size = status.st_size;
+	if(size == 0)
+	{
+		data = MappedFile_Empty;
+		return;
+	}
+
+	void* mapping = mmap(0, size, PROT_READ, MAP_PRIVATE, fileDescriptor, 0);
+	if(mapping == MAP_FAILED)
+	{
+		Close();
+		throw std::runtime_error("Cannot map file");
+	}
+	data = (const char*)mapping;
+}
+
+void MappedFile::Close()
+{
+	if(data && data != MappedFile_Empty)
+		munmap((void*)data, size);
+	if(fileDescriptor >= 0)
+		close(fileDescriptor);
+	data = 0;
+	size = 0;
+	fileDescriptor = -1;
+}
+
+#endif
@@ -0,0 +1,31 @@
+#pragma once
+
+// A read only memory mapped file. Pages are loaded by the operating system when they are first touched, so
+// parsers running on several threads read the file directly without copying it into a buffer first.
+class MappedFile
+{
+	const char* data;
+	long long size;
+#ifdef _WIN32
+	void* fileHandle;
+	void* mappingHandle;
+#else
+	int fileDescriptor;
+#endif
+
+	// Not copyable.
+	MappedFile(const MappedFile&);
+	MappedFile& operator=(const MappedFile&);
+public:
+	MappedFile();
+	~MappedFile() { Close(); }
+
+	// Maps whole file, throws if it cannot be opened.
+	void Open(const char* filename);
+	void Close();
+	bool IsOpen() const { return data != 0; }
+
+	const char* GetData() const { return data; }
+	const char* GetEnd() const { return data + size; }
+	long long GetSize() const { return size; }
+};
@@ -0,0 +1,253 @@
+#include "MeshCache.h"
+#include "Platform.h"
+#include <exception>
+#include <cstdio>
+#include <cstring>
+#include <map>
+#include <algorithm>
+
+static const char MeshCache_Magic[8] = { 'R', 'T', 'M', 'E', 'S', 'H', 0, 0 };
+
+// Offset of the next array: size bytes after offset, rounded up to alignment.
+static long long NextOffset(long long offset, long long size)
+{
+	offset += size;
+	return (offset + MeshCache_Alignment - 1) / MeshCache_Alignment * MeshCache_Alignment;
+}
+
+// Writes array at offset, padding file with zeros from its current position.
+static void WriteArray(FILE* file, long long& position, long long offset, const void* data, long long size)
+{
+	static const char padding[MeshCache_Alignment] = { 0 };
+	if(fwrite(padding, 1, (size_t)(offset - position), file) != (size_t)(offset - position) ||
+		(size > 0 && fwrite(data, 1, (size_t)size, file) != (size_t)size))
+		throw std::exception("Cannot write mesh cache");
+	position = offset + size;
+}
+
+// Checks that nodes form a tree traversal can walk: leaves reference primitives in range, second children
+// follow their parents (so there are no cycles) and depth fits the traversal stack.
+bool AreNodesValid(const BVHNode* nodes, int nodeCount, int primitiveCount)
+{
+	std::vector<int> depth(nodeCount, 0);
+	for(int i = 0; i < nodeCount; i++)
+	{
+		const BVHNode& node = nodes[i];
+		if(node.count < 0 || depth[i] >= BVH_MaxDepth)
+			return false;
+		if(node.count > 0)
+		{
+			if(node.offset < 0 || node.offset > primitiveCount - node.count)
+				return false;
+			continue;
+		}
+		if(node.axis < 0 || node.axis > 2 || i + 1 >= nodeCount || node.offset <= i + 1 || node.offset >= nodeCount)
+			return false;
+		depth[i + 1] = std::max(depth[i + 1], depth[i] + 1);
+		depth[node.offset] = std::max(depth[node.offset], depth[i] + 1);
+	}
+	return true;
+}
+
+// Checks that all ids are in [0, count).
+bool AreIdsValid(const int* ids, int idCount, int count)
+{
+	for(int i = 0; i < idCount; i++)
+		if(ids[i] < 0 || ids[i] >= count)
+			return false;
+	return true;
+}
+
+// Index of material in palette for each entry of materials.
+static void GetMaterialIds(Material* const* materials, int count, const std::map<Material*, int>& ids, std::vector<int>& result)
+{
+	result.resize(count);
+	for(int i = 0; i < count; i++)
+	{
+		std::map<Material*, int>::const_iterator it = ids.find(materials[i]);
+		if(it == ids.end())
+			throw std::exception("Mesh material is not in cache palette");
+		result[i] = it->second;
+	}
+}
+
+MeshCacheSaveStats SaveMeshCache(const char* filename, TriangleMesh& mesh, const std::vector<Material*>& palette)
+{
+	double startTime = GetTime();
+	int vertexCount = mesh.GetVertexCount(), triangleCount = mesh.GetTriangleCount();
+	const Vec3* vertices = mesh.GetVertexData();
+	const int* indices = mesh.GetIndexData();
+
+	// Structures of mesh are used if it has a BVH compiled in Scalar precision, otherwise they are built here.
+	const BVH* bvh = &mesh.GetBVH();
+	const CompiledTriangles* compiled = &mesh.GetCompiledTriangles();
+	BVH cacheBVH;
+	CompiledTriangles cacheCompiled;
+	if((!bvh->IsBuilt() || compiled->Count() != triangleCount) && triangleCount > 0)
+	{
+		std::vector<BoundingBox> bounds(triangleCount);
+		for(int i = 0; i < triangleCount; i++)
+			for(int k = 0; k < 3; k++)
+				bounds[i].Extend(vertices[indices[i*3+k]]);
+		cacheBVH.Build(bounds);
+		std::vector<Vec3> vertexList(vertices, vertices + vertexCount);
+		std::vector<int> indexList(indices, indices + triangleCount*3);
+		std::vector<Material*> materialList(mesh.GetMaterialData(), mesh.GetMaterialData() + triangleCount);
+		cacheCompiled.Compile(vertexList, indexList, materialList, cacheBVH.GetPrimitiveOrder());
+		bvh = &cacheBVH;
+		compiled = &cacheCompiled;
+	}
+
+	std::map<Material*, int> ids;
+	for(unsigned int i = 0; i < palette.size(); i++)
+		ids.insert(std::make_pair(palette[i], (int)i));
+	std::vector<int> materialIds, compiledMaterialIds;
+	GetMaterialIds(mesh.GetMaterialData(), triangleCount, ids, materialIds);
+	std::vector<Material*> slotMaterials(triangleCount);
+	for(int i = 0; i < triangleCount; i++)
+		slotMaterials[i] = compiled->GetMaterial(i);
+	GetMaterialIds(slotMaterials.empty() ? 0 : &slotMaterials[0], triangleCount, ids, compiledMaterialIds);
+
+	MeshCacheHeader header;
+	memset(&header, 0, sizeof(header));
+	memcpy(header.magic, MeshCache_Magic, sizeof(header.magic));
+	header.version = MeshCache_Version;
+	header.byteOrder = MeshCache_ByteOrder;
+	header.scalarSize = sizeof(Scalar);
+	header.nodeSize = sizeof(BVHNode);
+	header.vertexCount = vertexCount;
+	header.triangleCount = triangleCount;
+	header.materialCount = (int)palette.size();
+	header.nodeCount = bvh->GetNodeCount();
+	header.vertexOffset = NextOffset(0, sizeof(header));
+	header.indexOffset = NextOffset(header.vertexOffset, (long long)vertexCount * sizeof(Vec3));
+	header.materialOffset = NextOffset(header.indexOffset, (long long)triangleCount * 3 * sizeof(int));
+	header.nodeOffset = NextOffset(header.materialOffset, (long long)triangleCount * sizeof(int));
+	header.orderOffset = NextOffset(header.nodeOffset, (long long)header.nodeCount * sizeof(BVHNode));
+	header.compiledOffset = NextOffset(header.orderOffset, (long long)triangleCount * sizeof(int));
+	header.compiledMaterialOffset = NextOffset(header.compiledOffset,
+		(long long)triangleCount * CompiledTriangles_ArrayCount * sizeof(Scalar));
+	header.fileSize = header.compiledMaterialOffset + (long long)triangleCount * sizeof(int);
+
+	FILE* file = fopen(filename, "wb");
+	if(!file)
+		throw std::exception("Cannot create mesh cache");
+	try
+	{
+		long long position = 0;
+		const std::vector<BVHNode>& nodes = bvh->GetNodes();
+		const std::vector<int>& order = bvh->GetPrimitiveOrder();
+		WriteArray(file, position, 0, &header, sizeof(header));
+		WriteArray(file, position, header.vertexOffset, vertices, (long long)vertexCount * sizeof(Vec3));
+		WriteArray(file, position, header.indexOffset, indices, (long long)triangleCount * 3 * sizeof(int));
+		WriteArray(file, position, header.materialOffset, materialIds.empty() ? 0 : &materialIds[0],
+			(long long)triangleCount * sizeof(int));
+		WriteArray(file, position, header.nodeOffset, nodes.empty() ? 0 : &nodes[0], (long long)nodes.size() * sizeof(BVHNode));
+		WriteArray(file, position, header.orderOffset, order.empty() ? 0 : &order[0], (long long)order.size() * sizeof(int));
+		WriteArray(file, position, header.compiledOffset, compiled->GetData(),
+			(long long)triangleCount * CompiledTriangles_ArrayCount * sizeof(Scalar));
+		WriteArray(file, position, header.compiledMaterialOffset, compiledMaterialIds.empty() ? 0 : &compiledMaterialIds[0],
+			(long long)triangleCount * sizeof(int));
+	}
+	catch(...)
+	{
+		fclose(file);
+		throw;
+	}
+	if(fclose(file) != 0)
+		throw std::exception("Cannot write mesh cache");
+
+	MeshCacheSaveStats stats;
+	stats.triangleCount = triangleCount;
+	stats.nodeCount = header.nodeCount;
+	stats.bytes = header.fileSize;
+	stats.time = GetTime() - startTime;
+	return stats;
+}
+
+void MappedTriangleMesh::Open(const char* filename, const std::vector<Material*>& palette)
+{
+	Close();
+	file.Open(filename);
+
+	// Header, nodes and index arrays are checked, so a corrupted file cannot make traversal read out of bounds.
+	const MeshCacheHeader* h = (const MeshCacheHeader*)file.GetData();
+	if(file.GetSize() < (long long)sizeof(MeshCacheHeader) || memcmp(h->magic, MeshCache_Magic, sizeof(h->magic)) != 0)
+	{
+		Close();
+		throw std::exception("Not a mesh cache file");
+	}
+	if(h->version != MeshCache_Version || h->byteOrder != MeshCache_ByteOrder ||
+		h->scalarSize != sizeof(Scalar) || h->nodeSize != sizeof(BVHNode))
+	{
+		Close();
+		throw std::exception("Mesh cache was saved by incompatible version or build");
+	}
+
+	long long arrayEnds[] = {
+		h->vertexOffset + (long long)h->vertexCount * (long long)sizeof(Vec3),
+		h->indexOffset + (long long)h->triangleCount * 3 * (long long)sizeof(int),
+		h->materialOffset + (long long)h->triangleCount * (long long)sizeof(int),
+		h->nodeOffset + (long long)h->nodeCount * (long long)sizeof(BVHNode),
+		h->orderOffset + (long long)h->triangleCount * (long long)sizeof(int),
+		h->compiledOffset + (long long)h->triangleCount * CompiledTriangles_ArrayCount * (long long)sizeof(Scalar),
+		h->compiledMaterialOffset + (long long)h->triangleCount * (long long)sizeof(int) };
+	long long offsets[] = { h->vertexOffset, h->indexOffset, h->materialOffset, h->nodeOffset, h->orderOffset,
+		h->compiledOffset, h->compiledMaterialOffset };
+	bool isValid = h->fileSize == file.GetSize() && h->vertexCount >= 0 && h->triangleCount >= 0 &&
+		h->materialCount >= 0 && h->nodeCount >= 0 && (h->nodeCount > 0) == (h->triangleCount > 0);
+	for(int i = 0; i < 7; i++)
+		isValid = isValid && offsets[i] >= (long long)sizeof(MeshCacheHeader) && offsets[i] % MeshCache_Alignment == 0 &&
+			arrayEnds[i] <= file.GetSize();
+	isValid = isValid && AreNodesValid(GetArray<BVHNode>(h->nodeOffset), h->nodeCount, h->triangleCount) &&
+		AreIdsValid(GetArray<int>(h->indexOffset), h->triangleCount * 3, h->vertexCount) &&
+		AreIdsValid(GetArray<int>(h->orderOffset), h->triangleCount, h->triangleCount) &&
+		AreIdsValid(GetArray<int>(h->materialOffset), h->triangleCount, h->materialCount) &&
+		AreIdsValid(GetArray<int>(h->compiledMaterialOffset), h->triangleCount, h->materialCount);
+	if(!isValid)
+	{
+		Close();
+		throw std::exception("Mesh cache file is corrupted");
+	}
+	if(h->materialCount > (int)palette.size())
+	{
+		Close();
+		throw std::exception("Palette has fewer materials than mesh cache");
+	}
+
+	header = h;
+	nodes = GetArray<BVHNode>(h->nodeOffset);
+	this->palette = palette;
+	compiled.Attach(GetArray<Scalar>(h->compiledOffset), GetArray<int>(h->compiledMaterialOffset), h->triangleCount,
+		this->palette.empty() ? 0 : &this->palette[0]);
+}
+
+void MappedTriangleMesh::Close()
+{
+	compiled.Clear();
+	palette.clear();
+	header = 0;
+	nodes = 0;
+	file.Close();
+}
+
+void MappedTriangleMesh::Intersect(const Ray& ray, IntersectResult& result)
+{
+	if(!header || header->nodeCount == 0)
+		return;
+	TriangleIntersector intersector(compiled);
+	BVH::IntersectNodes(nodes, ray, result, intersector);
+}
+
+bool MappedTriangleMesh::Occluded(const Ray& ray, Scalar maxDistance)
+{
+	if(!header || header->nodeCount == 0)
+		return false;
+	TriangleOccluder occluder(compiled);
+	return BVH::OccludedNodes(nodes, ray, maxDistance, occluder);
+}
+
+BoundingBox MappedTriangleMesh::GetBounds()
+{
+	return header && header->nodeCount > 0 ? nodes[0].bounds : BoundingBox();
+}
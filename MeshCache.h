@@ -0,0 +1,79 @@
+#pragma once
+
+#include "CommonGeometry.h"
+#include "MappedFile.h"
+#include <vector>
+
+// Mesh cache files store a triangle mesh together with its built BVH and compiled triangles. All data is in
+// fixed size arrays without pointers (materials are stored as indices to a palette given by the user), at
+// aligned offsets from the header, so a cache is used directly after the file is mapped: opening it does
+// no parsing or building and processes rendering the same cache share its pages.
+const int MeshCache_Version = 1;
+const int MeshCache_ByteOrder = 0x01020304;
+// Alignment of arrays in file.
+const int MeshCache_Alignment = 64;
+
+struct MeshCacheHeader
+{
+	char magic[8];				//< "RTMESH" padded with zeros.
+	int version;				//< MeshCache_Version.
+	int byteOrder;				//< MeshCache_ByteOrder as written by saving machine.
+	int scalarSize;				//< sizeof(Scalar) and sizeof(BVHNode); cache must be saved by the same build.
+	int nodeSize;
+	int vertexCount, triangleCount, materialCount, nodeCount;
+	long long vertexOffset;		//< Vec3[vertexCount].
+	long long indexOffset;		//< int[triangleCount*3].
+	long long materialOffset;	//< int[triangleCount], material of each triangle.
+	long long nodeOffset;		//< BVHNode[nodeCount].
+	long long orderOffset;		//< int[triangleCount], triangle in each BVH slot.
+	long long compiledOffset;	//< Scalar[CompiledTriangles_ArrayCount*triangleCount], compiled triangles in slot order.
+	long long compiledMaterialOffset;	//< int[triangleCount], material of each slot.
+	long long fileSize;
+};
+
+// Sizes and time of a saved mesh cache.
+struct MeshCacheSaveStats
+{
+	int triangleCount, nodeCount;
+	long long bytes;	//< Size of file.
+	double time;		//< Seconds spent saving, including BVH build if mesh had none.
+};
+
+// Writes mesh to cache file; material of each triangle must be in palette (its index is stored). BVH of mesh
+// is stored if it is built, otherwise one is built for the cache. Throws std::exception on failure.
+MeshCacheSaveStats SaveMeshCache(const char* filename, TriangleMesh& mesh, const std::vector<Material*>& palette);
+
+// Checks of arrays read from cache files, also used for out of core clusters.
+bool AreNodesValid(const BVHNode* nodes, int nodeCount, int primitiveCount);
+bool AreIdsValid(const int* ids, int idCount, int count);
+
+// Triangle mesh used directly from a mapped cache file. It is intersected through the stored binary BVH
+// and cannot be changed; geometry data may be read through the array accessors.
+class MappedTriangleMesh : public IGeometry
+{
+	MappedFile file;
+	const MeshCacheHeader* header;
+	const BVHNode* nodes;
+	CompiledTriangles compiled;
+	std::vector<Material*> palette;
+
+	template<class T>
+	const T* GetArray(long long offset) const { return (const T*)(file.GetData() + offset); }
+public:
+	MappedTriangleMesh() : header(0), nodes(0) {}
+
+	// Maps cache file, material index i of the file is palette[i]. Throws std::exception if file is not
+	// a valid cache of this build.
+	void Open(const char* filename, const std::vector<Material*>& palette);
+	void Close();
+
+	virtual void Intersect(const Ray& ray, IntersectResult& result);
+	virtual bool Occluded(const Ray& ray, Scalar maxDistance);
+	virtual BoundingBox GetBounds();
+
+	int GetVertexCount() const { return header ? header->vertexCount : 0; }
+	int GetTriangleCount() const { return header ? header->triangleCount : 0; }
+	const Vec3* GetVertexData() const { return GetArray<Vec3>(header->vertexOffset); }
+	const int* GetIndexData() const { return GetArray<int>(header->indexOffset); }
+	const int* GetMaterialIds() const { return GetArray<int>(header->materialOffset); }
+};
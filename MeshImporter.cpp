@@ -0,0 +1,1095 @@
+#include "MeshImporter.h"
+#include "MappedFile.h"
+#include "CommonBRDF.h"
+#include "Platform.h"
+#include <exception>
+#include <map>
+#include <sstream>
+#include <cstring>
+#include <cctype>
+#include <algorithm>
+#include <cstdlib>
+
+// Files are split into chunks of about this size; there are enough of them to balance threads.
+const long long MeshImporter_ChunkSize = 1 << 20;
+const int MeshImporter_MaxChunks = 4096;
+
+/// ---------------------------------------------------------------------------------------
+/// Parsing helpers
+/// ---------------------------------------------------------------------------------------
+
+static inline bool IsSpace(char c) { return c == ' ' || c == '\t' || c == '\r'; }
+static inline bool IsDigit(char c) { return c >= '0' && c <= '9'; }
+
+static inline const char* SkipSpaces(const char* p, const char* end)
+{
+	while(p < end && IsSpace(*p))
+		p++;
+	return p;
+}
+
+static inline const char* SkipToken(const char* p, const char* end)
+{
+	while(p < end && !IsSpace(*p))
+		p++;
+	return p;
+}
+
+// End of line starting at p (position of '\n' or end).
+static inline const char* FindLineEnd(const char* p, const char* end)
+{
+	const char* lineEnd = (const char*)memchr(p, '\n', end - p);
+	return lineEnd ? lineEnd : end;
+}
+
+// True if token [p, tokenEnd) equals keyword.
+static inline bool IsKeyword(const char* p, const char* tokenEnd, const char* keyword)
+{
+	size_t length = strlen(keyword);
+	return (size_t)(tokenEnd - p) == length && memcmp(p, keyword, length) == 0;
+}
+
+static const Scalar MeshImporter_PowersOf10[] = { 1e0, 1e1, 1e2, 1e3, 1e4, 1e5, 1e6, 1e7, 1e8, 1e9, 1e10,
+	1e11, 1e12, 1e13, 1e14, 1e15, 1e16, 1e17, 1e18, 1e19, 1e20, 1e21, 1e22 };
+
+// Parses decimal number with optional exponent and returns position after it; isValid is cleared if there
+// are no digits. Numbers with up to 15 significant digits (all usual exports) are converted exactly by
+// a single multiplication or division, which is several times faster than strtod; longer ones use strtod.
+static const char* ParseScalar(const char* p, const char* end, Scalar& value, bool& isValid)
+{
+	const char* begin = p;
+	bool isNegative = false;
+	if(p < end && (*p == '-' || *p == '+'))
+		isNegative = *p++ == '-';
+
+	// At most 19 significant digits fit into mantissa, further ones only change exponent.
+	unsigned long long mantissa = 0;
+	int exponent = 0, significant = 0;
+	bool hasDigits = false;
+	for(; p < end && IsDigit(*p); p++)
+	{
+		hasDigits = true;
+		if(significant < 19)
+		{
+			mantissa = mantissa*10 + (*p - '0');
+			if(mantissa) significant++;
+		}
+		else
+			exponent++;
+	}
+	if(p < end && *p == '.')
+	{
+		for(p++; p < end && IsDigit(*p); p++)
+		{
+			hasDigits = true;
+			if(significant < 19)
+			{
+				mantissa = mantissa*10 + (*p - '0');
+				if(mantissa) significant++;
+				exponent--;
+			}
+		}
+	}
+	if(!hasDigits)
+	{
+		isValid = false;
+		return p;
+	}
+	if(p < end && (*p == 'e' || *p == 'E'))
+	{
+		const char* q = p + 1;
+		bool isNegativeExponent = false;
+		if(q < end && (*q == '-' || *q == '+'))
+			isNegativeExponent = *q++ == '-';
+		int e = 0;
+		bool hasExponent = false;
+		for(; q < end && IsDigit(*q); q++)
+		{
+			hasExponent = true;
+			if(e < 10000) e = e*10 + (*q - '0');
+		}
+		if(hasExponent)
+		{
+			exponent += isNegativeExponent ? -e : e;
+			p = q;
+		}
+	}
+
+	// Mantissa and power of ten are exact doubles, so the operation rounds only once.
+	if(mantissa <= (1ULL << 53) && exponent >= -22 && exponent <= 22)
+	{
+		Scalar result = (Scalar)mantissa;
+		if(exponent < 0)
+			result /= MeshImporter_PowersOf10[-exponent];
+		else
+			result *= MeshImporter_PowersOf10[exponent];
+		value = isNegative ? -result : result;
+		return p;
+	}
+
+	char buffer[64];
+	if(p - begin >= (int)sizeof(buffer))
+	{
+		isValid = false;
+		return p;
+	}
+	memcpy(buffer, begin, p - begin);
+	buffer[p - begin] = 0;
+	value = (Scalar)strtod(buffer, 0);
+	return p;
+}
+
+static const char* ParseInt(const char* p, const char* end, int& value, bool& isValid)
+{
+	bool isNegative = false;
+	if(p < end && (*p == '-' || *p == '+'))
+		isNegative = *p++ == '-';
+	if(p >= end || !IsDigit(*p))
+	{
+		isValid = false;
+		return p;
+	}
+	long long result = 0;
+	for(; p < end && IsDigit(*p); p++)
+		if(result < 0x7FFFFFFF) result = result*10 + (*p - '0');
+	if(result > 0x7FFFFFFF)
+		isValid = false;
+	value = (int)(isNegative ? -result : result);
+	return p;
+}
+
+// Number of chunks text of given size is split to.
+static int GetChunkCount(long long size)
+{
+	long long count = size / MeshImporter_ChunkSize + 1;
+	return (int)(count < MeshImporter_MaxChunks ? count : MeshImporter_MaxChunks);
+}
+
+// Splits text into chunks of whole lines; chunk c is [bounds[c], bounds[c+1]). Chunks may be empty.
+static void SplitLines(const char* begin, const char* end, int chunkCount, std::vector<const char*>& bounds)
+{
+	bounds.assign(1, begin);
+	long long size = end - begin;
+	for(int c = 1; c < chunkCount; c++)
+	{
+		const char* p = begin + size * c / chunkCount;
+		if(p < bounds.back())
+			p = bounds.back();
+		p = FindLineEnd(p, end);
+		bounds.push_back(p < end ? p + 1 : end);
+	}
+	bounds.push_back(end);
+}
+
+void MeshImporter::SetLoaded(int vertexCount, int triangleCount, int materialCount, long long bytes, double startTime)
+{
+	lastLoad.vertexCount = vertexCount;
+	lastLoad.triangleCount = triangleCount;
+	lastLoad.materialCount = materialCount;
+	lastLoad.bytes = bytes;
+	lastLoad.time = GetTime() - startTime;
+}
+
+/// ---------------------------------------------------------------------------------------
+/// Materials
+/// ---------------------------------------------------------------------------------------
+
+Material* MeshImporter::GetDiffuseMaterial(const Vec3& colour)
+{
+	// Few materials are created, linear search is enough.
+	for(unsigned int i = 0; i < createdColours.size(); i++)
+		if(createdColours[i].x == colour.x && createdColours[i].y == colour.y && createdColours[i].z == colour.z)
+			return createdMaterials[i];
+
+	IBSDF* bsdf = new Diffuse(colour);
+	createdBSDFs.push_back(bsdf);
+	createdMaterials.push_back(new Material(bsdf));
+	createdColours.push_back(colour);
+	return createdMaterials.back();
+}
+
+Material* MeshImporter::GetDefaultMaterial()
+{
+	if(!defaultMaterial)
+		defaultMaterial = GetDiffuseMaterial(Vec3(1, 1, 1));
+	return defaultMaterial;
+}
+
+void MeshImporter::LoadMtl(const std::string& filename, std::vector<std::string>& names, std::vector<Vec3>& colours)
+{
+	MappedFile file;
+	file.Open(filename.c_str());
+	const char* end = file.GetEnd();
+	for(const char* line = file.GetData(); line < end;)
+	{
+		const char* lineEnd = FindLineEnd(line, end);
+		const char* p = SkipSpaces(line, lineEnd);
+		const char* tokenEnd = SkipToken(p, lineEnd);
+		if(IsKeyword(p, tokenEnd, "newmtl"))
+		{
+			const char* name = SkipSpaces(tokenEnd, lineEnd);
+			const char* nameEnd = lineEnd;
+			while(nameEnd > name && IsSpace(nameEnd[-1]))
+				nameEnd--;
+			names.push_back(std::string(name, nameEnd));
+			colours.push_back(Vec3(1, 1, 1));
+		}
+		else if(IsKeyword(p, tokenEnd, "Kd") && !names.empty())
+		{
+			bool isValid = true;
+			Vec3 colour;
+			p = ParseScalar(SkipSpaces(tokenEnd, lineEnd), lineEnd, colour.x, isValid);
+			p = ParseScalar(SkipSpaces(p, lineEnd), lineEnd, colour.y, isValid);
+			p = ParseScalar(SkipSpaces(p, lineEnd), lineEnd, colour.z, isValid);
+			if(!isValid)
+				throw std::exception("Malformed colour in MTL file");
+			colours.back() = colour;
+		}
+		line = lineEnd + 1;
+	}
+}
+
+TriangleMesh* MeshImporter::Load(const char* filename)
+{
+	const char* extension = strrchr(filename, '.');
+	std::string lower = extension ? extension : "";
+	for(unsigned int i = 0; i < lower.size(); i++)
+		lower[i] = (char)tolower(lower[i]);
+
+	if(lower == ".obj")
+		return LoadObj(filename);
+	if(lower == ".ply")
+		return LoadPly(filename);
+	throw std::exception("Unknown mesh file format");
+}
+
+/// ---------------------------------------------------------------------------------------
+/// OBJ
+/// ---------------------------------------------------------------------------------------
+
+// Chunk of OBJ file; counts and material names are found by first pass, offsets are their prefix sums.
+struct ObjChunk
+{
+	const char* begin;
+	const char* end;
+	int vertexCount, triangleCount;
+	int vertexOffset, triangleOffset;
+	std::vector<std::string> materialNames;	//< Names of usemtl statements, in order.
+	std::vector<std::string> libraries;		//< Files of mtllib statements.
+	bool hasUnnamedTriangles;				//< Faces precede the first usemtl of chunk.
+	int startMaterial;						//< Material in effect at chunk start (index to material table).
+	bool isValid;
+};
+
+// Rest of line without surrounding spaces.
+static std::string GetLineArgument(const char* p, const char* lineEnd)
+{
+	p = SkipSpaces(p, lineEnd);
+	const char* argumentEnd = lineEnd;
+	while(argumentEnd > p && IsSpace(argumentEnd[-1]))
+		argumentEnd--;
+	return std::string(p, argumentEnd);
+}
+
+// Counts vertices and triangles of chunk and collects its material names.
+static void CountObjChunk(ObjChunk& chunk)
+{
+	chunk.vertexCount = chunk.triangleCount = 0;
+	chunk.hasUnnamedTriangles = false;
+	chunk.isValid = true;
+	const char* end = chunk.end;
+	for(const char* line = chunk.begin; line < end;)
+	{
+		const char* lineEnd = FindLineEnd(line, end);
+		const char* p = SkipSpaces(line, lineEnd);
+		const char* tokenEnd = SkipToken(p, lineEnd);
+		if(tokenEnd - p == 1 && *p == 'v')
+			chunk.vertexCount++;
+		else if(tokenEnd - p == 1 && *p == 'f')
+		{
+			int corners = 0;
+			for(p = SkipSpaces(tokenEnd, lineEnd); p < lineEnd; p = SkipSpaces(SkipToken(p, lineEnd), lineEnd))
+				corners++;
+			if(corners < 3)
+				chunk.isValid = false;
+			else
+			{
+				chunk.triangleCount += corners - 2;
+				if(chunk.materialNames.empty())
+					chunk.hasUnnamedTriangles = true;
+			}
+		}
+		else if(IsKeyword(p, tokenEnd, "usemtl"))
+			chunk.materialNames.push_back(GetLineArgument(tokenEnd, lineEnd));
+		else if(IsKeyword(p, tokenEnd, "mtllib"))
+			chunk.libraries.push_back(GetLineArgument(tokenEnd, lineEnd));
+		line = lineEnd + 1;
+	}
+}
+
+// Writes vertices and triangles of chunk to their place in mesh buffers.
+static void ParseObjChunk(ObjChunk& chunk, const std::map<std::string, int>& materialIds, Material* const* materialTable,
+	int totalVertexCount, Vec3* vertices, int* indices, Material** materials)
+{
+	int vertex = chunk.vertexOffset, triangle = chunk.triangleOffset;
+	Material* material = materialTable[chunk.startMaterial];
+	const char* end = chunk.end;
+	bool isValid = true;
+	for(const char* line = chunk.begin; line < end && isValid;)
+	{
+		const char* lineEnd = FindLineEnd(line, end);
+		const char* p = SkipSpaces(line, lineEnd);
+		const char* tokenEnd = SkipToken(p, lineEnd);
+		if(tokenEnd - p == 1 && *p == 'v')
+		{
+			Vec3& v = vertices[vertex++];
+			p = ParseScalar(SkipSpaces(tokenEnd, lineEnd), lineEnd, v.x, isValid);
+			p = ParseScalar(SkipSpaces(p, lineEnd), lineEnd, v.y, isValid);
+			p = ParseScalar(SkipSpaces(p, lineEnd), lineEnd, v.z, isValid);
+		}
+		else if(tokenEnd - p == 1 && *p == 'f')
+		{
+			// Polygon is triangulated as fan around its first corner; only position indices are used.
+			int first = -1, previous = -1;
+			for(p = SkipSpaces(tokenEnd, lineEnd); p < lineEnd; p = SkipSpaces(SkipToken(p, lineEnd), lineEnd))
+			{
+				int index;
+				ParseInt(p, lineEnd, index, isValid);
+				// Negative indices are relative to vertices defined so far.
+				index = index > 0 ? index - 1 : vertex + index;
+				if(index < 0 || index >= totalVertexCount)
+					isValid = false;
+				if(!isValid)
+					break;
+
+				if(first < 0)
+					first = index;
+				else if(previous < 0)
+					previous = index;
+				else
+				{
+					indices[triangle*3] = first;
+					indices[triangle*3+1] = previous;
+					indices[triangle*3+2] = index;
+					materials[triangle++] = material;
+					previous = index;
+				}
+			}
+		}
+		else if(IsKeyword(p, tokenEnd, "usemtl"))
+			material = materialTable[materialIds.find(GetLineArgument(tokenEnd, lineEnd))->second];
+		line = lineEnd + 1;
+	}
+	chunk.isValid = isValid;
+}
+
+TriangleMesh* MeshImporter::LoadObj(const char* filename)
+{
+	double startTime = GetTime();
+	MappedFile file;
+	file.Open(filename);
+
+	std::vector<const char*> bounds;
+	SplitLines(file.GetData(), file.GetEnd(), GetChunkCount(file.GetSize()), bounds);
+	int chunkCount = bounds.size() - 1;
+	std::vector<ObjChunk> chunks(chunkCount);
+	for(int c = 0; c < chunkCount; c++)
+	{
+		chunks[c].begin = bounds[c];
+		chunks[c].end = bounds[c+1];
+	}
+
+	// First pass: counts.
+	#pragma omp parallel for schedule(dynamic, 1)
+	for(int c = 0; c < chunkCount; c++)
+		CountObjChunk(chunks[c]);
+
+	long long vertexCount = 0, triangleCount = 0;
+	for(int c = 0; c < chunkCount; c++)
+	{
+		if(!chunks[c].isValid)
+			throw std::exception("Malformed face in OBJ file");
+		chunks[c].vertexOffset = (int)vertexCount;
+		chunks[c].triangleOffset = (int)triangleCount;
+		vertexCount += chunks[c].vertexCount;
+		triangleCount += chunks[c].triangleCount;
+	}
+	if(vertexCount > 0x7FFFFFFF || triangleCount * 3 > 0x7FFFFFFF)
+		throw std::exception("OBJ file is too large");
+
+	// Material libraries are relative to OBJ file.
+	std::string directory = filename;
+	size_t slash = directory.find_last_of("/\\");
+	directory = slash == std::string::npos ? "" : directory.substr(0, slash + 1);
+	std::vector<std::string> libraryNames;
+	std::vector<Vec3> libraryColours;
+	std::vector<std::string> loadedLibraries;
+	for(int c = 0; c < chunkCount; c++)
+	{
+		for(unsigned int i = 0; i < chunks[c].libraries.size(); i++)
+		{
+			const std::string& library = chunks[c].libraries[i];
+			if(std::find(loadedLibraries.begin(), loadedLibraries.end(), library) != loadedLibraries.end())
+				continue;
+			loadedLibraries.push_back(library);
+			LoadMtl(directory + library, libraryNames, libraryColours);
+		}
+	}
+
+	// Material table: entry 0 is the default material, then one entry per distinct name. Names with
+	// the same colour share a material.
+	std::vector<Material*> materialTable(1, (Material*)0);
+	std::map<std::string, int> materialIds;
+	bool needsDefault = false;
+	int currentMaterial = 0;
+	for(int c = 0; c < chunkCount; c++)
+	{
+		// Faces before the first usemtl of file may be in any chunk (vertices can fill the first ones).
+		chunks[c].startMaterial = currentMaterial;
+		if(chunks[c].hasUnnamedTriangles && currentMaterial == 0)
+			needsDefault = true;
+		for(unsigned int i = 0; i < chunks[c].materialNames.size(); i++)
+		{
+			const std::string& name = chunks[c].materialNames[i];
+			std::map<std::string, int>::iterator it = materialIds.find(name);
+			if(it == materialIds.end())
+			{
+				std::vector<std::string>::iterator library = std::find(libraryNames.begin(), libraryNames.end(), name);
+				Material* material = 0;
+				if(library != libraryNames.end())
+					material = GetDiffuseMaterial(libraryColours[library - libraryNames.begin()]);
+				else
+					needsDefault = true;
+				it = materialIds.insert(std::make_pair(name, (int)materialTable.size())).first;
+				materialTable.push_back(material);
+			}
+			currentMaterial = it->second;
+		}
+	}
+	if(needsDefault)
+	{
+		Material* material = GetDefaultMaterial();
+		for(unsigned int i = 0; i < materialTable.size(); i++)
+			if(!materialTable[i])
+				materialTable[i] = material;
+	}
+
+	TriangleMesh* mesh = new TriangleMesh();
+	mesh->Resize((int)vertexCount, (int)triangleCount);
+	Vec3* vertices = mesh->GetVertexData();
+	int* indices = mesh->GetIndexData();
+	Material** materials = mesh->GetMaterialData();
+
+	// Second pass: parsing into mesh.
+	#pragma omp parallel for schedule(dynamic, 1)
+	for(int c = 0; c < chunkCount; c++)
+		ParseObjChunk(chunks[c], materialIds, &materialTable[0], (int)vertexCount, vertices, indices, materials);
+
+	for(int c = 0; c < chunkCount; c++)
+	{
+		if(!chunks[c].isValid)
+		{
+			delete mesh;
+			throw std::exception("Malformed OBJ file");
+		}
+	}
+
+	std::sort(materialTable.begin(), materialTable.end());
+	int materialCount = std::unique(materialTable.begin(), materialTable.end()) - materialTable.begin() - (needsDefault ? 0 : 1);
+	SetLoaded((int)vertexCount, (int)triangleCount, materialCount, file.GetSize(), startTime);
+	return mesh;
+}
+
+/// ---------------------------------------------------------------------------------------
+/// PLY
+/// ---------------------------------------------------------------------------------------
+
+enum PlyType { PlyInt8, PlyUInt8, PlyInt16, PlyUInt16, PlyInt32, PlyUInt32, PlyFloat32, PlyFloat64 };
+
+struct PlyProperty
+{
+	std::string name;
+	int type;			//< PlyType of value, of items for lists.
+	int countType;		//< PlyType of list length, -1 if property is not a list.
+};
+
+struct PlyElement
+{
+	std::string name;
+	long long count;
+	std::vector<PlyProperty> properties;
+};
+
+// PlyType of type name, -1 if unknown.
+static int ParsePlyType(const std::string& name)
+{
+	static const char* names[][2] = { { "char", "int8" }, { "uchar", "uint8" }, { "short", "int16" }, { "ushort", "uint16" },
+		{ "int", "int32" }, { "uint", "uint32" }, { "float", "float32" }, { "double", "float64" } };
+	for(int i = 0; i < 8; i++)
+		if(name == names[i][0] || name == names[i][1])
+			return i;
+	return -1;
+}
+
+static int GetPlyTypeSize(int type)
+{
+	static const int sizes[] = { 1, 1, 2, 2, 4, 4, 4, 8 };
+	return sizes[type];
+}
+
+// Reads binary little endian value (host is little endian).
+static double ReadPlyValue(const char* p, int type)
+{
+	switch(type)
+	{
+	case PlyInt8: return (signed char)*p;
+	case PlyUInt8: return (unsigned char)*p;
+	case PlyInt16: { short v; memcpy(&v, p, 2); return v; }
+	case PlyUInt16: { unsigned short v; memcpy(&v, p, 2); return v; }
+	case PlyInt32: { int v; memcpy(&v, p, 4); return v; }
+	case PlyUInt32: { unsigned int v; memcpy(&v, p, 4); return v; }
+	case PlyFloat32: { float v; memcpy(&v, p, 4); return v; }
+	default: { double v; memcpy(&v, p, 8); return v; }
+	}
+}
+
+// Layout of vertex and face elements used by parsers.
+struct PlyLayout
+{
+	const PlyElement* vertex;
+	const PlyElement* face;
+	int position[3];		//< Property indices of x, y, z.
+	int indexList;			//< Property index of vertex index list.
+};
+
+// Parses header, returns position of body.
+static const char* ParsePlyHeader(const char* data, const char* end, bool& isBinary, std::vector<PlyElement>& elements)
+{
+	const char* p = data;
+	bool hasFormat = false;
+	for(int lineNumber = 0;; lineNumber++)
+	{
+		if(p >= end)
+			throw std::exception("PLY header is not terminated");
+		const char* lineEnd = FindLineEnd(p, end);
+		std::istringstream line(std::string(p, lineEnd));
+		p = lineEnd + 1;
+
+		std::string keyword;
+		line >> keyword;
+		if(lineNumber == 0)
+		{
+			if(keyword != "ply")
+				throw std::exception("Not a PLY file");
+		}
+		else if(keyword == "format")
+		{
+			std::string format;
+			line >> format;
+			if(format == "ascii")
+				isBinary = false;
+			else if(format == "binary_little_endian")
+				isBinary = true;
+			else
+				throw std::exception("Unsupported PLY format (only ascii and binary_little_endian are supported)");
+			hasFormat = true;
+		}
+		else if(keyword == "element")
+		{
+			PlyElement element;
+			element.count = -1;
+			line >> element.name >> element.count;
+			if(element.count < 0)
+				throw std::exception("Malformed PLY element");
+			elements.push_back(element);
+		}
+		else if(keyword == "property")
+		{
+			if(elements.empty())
+				throw std::exception("PLY property outside of element");
+			PlyProperty property;
+			std::string type;
+			line >> type;
+			if(type == "list")
+			{
+				std::string countType, itemType;
+				line >> countType >> itemType;
+				property.countType = ParsePlyType(countType);
+				property.type = ParsePlyType(itemType);
+				if(property.countType < 0)
+					throw std::exception("Unknown PLY property type");
+			}
+			else
+			{
+				property.countType = -1;
+				property.type = ParsePlyType(type);
+			}
+			if(property.type < 0)
+				throw std::exception("Unknown PLY property type");
+			line >> property.name;
+			elements.back().properties.push_back(property);
+		}
+		else if(keyword == "end_header")
+			break;
+	}
+	if(!hasFormat)
+		throw std::exception("PLY format is not specified");
+	return p;
+}
+
+static void FindPlyLayout(const std::vector<PlyElement>& elements, PlyLayout& layout)
+{
+	layout.vertex = layout.face = 0;
+	layout.position[0] = layout.position[1] = layout.position[2] = layout.indexList = -1;
+	for(unsigned int e = 0; e < elements.size(); e++)
+	{
+		const PlyElement& element = elements[e];
+		if(element.name == "vertex")
+		{
+			layout.vertex = &element;
+			for(unsigned int i = 0; i < element.properties.size(); i++)
+			{
+				const PlyProperty& property = element.properties[i];
+				if(property.countType >= 0)
+					throw std::exception("PLY vertices with list properties are not supported");
+				if(property.name.size() == 1 && property.name[0] >= 'x' && property.name[0] <= 'z')
+					layout.position[property.name[0] - 'x'] = i;
+			}
+		}
+		else if(element.name == "face")
+		{
+			layout.face = &element;
+			for(unsigned int i = 0; i < element.properties.size(); i++)
+			{
+				const PlyProperty& property = element.properties[i];
+				if(property.countType >= 0 && (property.name == "vertex_indices" || property.name == "vertex_index"))
+					layout.indexList = i;
+			}
+		}
+	}
+	if(!layout.vertex || layout.position[0] < 0 || layout.position[1] < 0 || layout.position[2] < 0)
+		throw std::exception("PLY file has no vertex positions");
+	if(layout.face && layout.indexList < 0)
+		throw std::exception("PLY faces have no vertex indices");
+	if(layout.vertex->count > 0x7FFFFFFF)
+		throw std::exception("PLY file is too large");
+}
+
+// Writes fan triangulation of polygon, returns false for invalid indices.
+static inline bool WritePolygon(const int* polygon, int corners, int vertexCount, int* indices, Material** materials,
+	int& triangle, Material* material)
+{
+	for(int i = 0; i < corners; i++)
+		if(polygon[i] < 0 || polygon[i] >= vertexCount)
+			return false;
+	for(int i = 2; i < corners; i++)
+	{
+		indices[triangle*3] = polygon[0];
+		indices[triangle*3+1] = polygon[i-1];
+		indices[triangle*3+2] = polygon[i];
+		materials[triangle++] = material;
+	}
+	return true;
+}
+
+// Chunk of PLY file body; for binary faces chunks are ranges of faces, for ascii ranges of lines.
+struct PlyChunk
+{
+	const char* begin;
+	const char* end;
+	long long firstRecord;		//< Global index of first face or line.
+	long long recordCount;
+	long long triangleCount, triangleOffset;
+	bool isValid;
+};
+
+// Size of binary record, or -1 if element has lists.
+static int GetPlyRecordSize(const PlyElement& element)
+{
+	int size = 0;
+	for(unsigned int i = 0; i < element.properties.size(); i++)
+	{
+		if(element.properties[i].countType >= 0)
+			return -1;
+		size += GetPlyTypeSize(element.properties[i].type);
+	}
+	return size;
+}
+
+// Skips binary record with lists, returns 0 if it crosses end or has a negative list count.
+static const char* SkipPlyRecord(const char* p, const char* end, const PlyElement& element)
+{
+	for(unsigned int i = 0; i < element.properties.size() && p; i++)
+	{
+		const PlyProperty& property = element.properties[i];
+		if(property.countType < 0)
+			p += GetPlyTypeSize(property.type);
+		else
+		{
+			int countSize = GetPlyTypeSize(property.countType);
+			if(p + countSize > end)
+				return 0;
+			long long count = (long long)ReadPlyValue(p, property.countType);
+			if(count < 0)
+				return 0;
+			p += countSize + count * GetPlyTypeSize(property.type);
+		}
+		if(p > end)
+			return 0;
+	}
+	return p;
+}
+
+// Reads binary faces. If every face is a triangle, records have fixed size and are read in parallel directly;
+// otherwise a sequential scan finds chunk boundaries and triangle counts first.
+static const char* ReadPlyBinaryFaces(const char* p, const char* end, const PlyLayout& layout, TriangleMesh* mesh,
+	Material* material)
+{
+	const PlyElement& face = *layout.face;
+	long long faceCount = face.count;
+	int vertexCount = (int)layout.vertex->count;
+
+	// Record layout if all faces are triangles.
+	int triangleRecordSize = 0, listOffset = 0;
+	for(unsigned int i = 0; i < face.properties.size(); i++)
+	{
+		const PlyProperty& property = face.properties[i];
+		int size = property.countType < 0 ? GetPlyTypeSize(property.type) : -1;
+		if((int)i == layout.indexList)
+		{
+			listOffset = triangleRecordSize;
+			size = GetPlyTypeSize(property.countType) + 3*GetPlyTypeSize(property.type);
+		}
+		if(size < 0 || triangleRecordSize < 0)
+			triangleRecordSize = -1;
+		else
+			triangleRecordSize += size;
+	}
+	const PlyProperty& list = face.properties[layout.indexList];
+	int countSize = GetPlyTypeSize(list.countType), itemSize = GetPlyTypeSize(list.type);
+
+	if(triangleRecordSize > 0 && faceCount * triangleRecordSize <= end - p && faceCount * 3 <= 0x7FFFFFFF)
+	{
+		int nonTriangles = 0;
+		int triangleCount = (int)faceCount;
+		#pragma omp parallel for reduction(+:nonTriangles)
+		for(int f = 0; f < triangleCount; f++)
+			if(ReadPlyValue(p + (long long)f*triangleRecordSize + listOffset, list.countType) != 3)
+				nonTriangles++;
+
+		if(nonTriangles == 0)
+		{
+			mesh->Resize(vertexCount, triangleCount);
+			int* indices = mesh->GetIndexData();
+			Material** materials = mesh->GetMaterialData();
+			int invalid = 0;
+			#pragma omp parallel for reduction(+:invalid)
+			for(int f = 0; f < triangleCount; f++)
+			{
+				const char* items = p + (long long)f*triangleRecordSize + listOffset + countSize;
+				int polygon[3], triangle = f;
+				for(int k = 0; k < 3; k++)
+					polygon[k] = (int)ReadPlyValue(items + k*itemSize, list.type);
+				if(!WritePolygon(polygon, 3, vertexCount, indices, materials, triangle, material))
+					invalid++;
+			}
+			if(invalid)
+				throw std::exception("Invalid vertex index in PLY file");
+			return p + faceCount*triangleRecordSize;
+		}
+	}
+
+	// General polygons: chunk boundaries and triangle counts from sequential scan.
+	int chunkCount = GetChunkCount(faceCount * 16);
+	std::vector<PlyChunk> chunks(chunkCount);
+	long long triangleCount = 0;
+	for(int c = 0; c < chunkCount; c++)
+	{
+		PlyChunk& chunk = chunks[c];
+		chunk.firstRecord = faceCount * c / chunkCount;
+		chunk.recordCount = faceCount * (c + 1) / chunkCount - chunk.firstRecord;
+		chunk.begin = p;
+		chunk.triangleOffset = triangleCount;
+		chunk.triangleCount = 0;
+		for(long long f = 0; f < chunk.recordCount; f++)
+		{
+			const char* record = p;
+			for(int i = 0; i < layout.indexList && record; i++)
+				record = face.properties[i].countType < 0 ? record + GetPlyTypeSize(face.properties[i].type) : 0;
+			p = SkipPlyRecord(p, end, face);
+			if(!p || !record)
+				throw std::exception("Malformed PLY faces");
+			long long corners = (long long)ReadPlyValue(record, list.countType);
+			if(corners >= 3)
+				chunk.triangleCount += corners - 2;
+		}
+		chunk.end = p;
+		triangleCount += chunk.triangleCount;
+	}
+	if(triangleCount * 3 > 0x7FFFFFFF)
+		throw std::exception("PLY file is too large");
+
+	mesh->Resize(vertexCount, (int)triangleCount);
+	int* indices = mesh->GetIndexData();
+	Material** materials = mesh->GetMaterialData();
+	#pragma omp parallel for schedule(dynamic, 1)
+	for(int c = 0; c < chunkCount; c++)
+	{
+		PlyChunk& chunk = chunks[c];
+		chunk.isValid = true;
+		int triangle = (int)chunk.triangleOffset;
+		std::vector<int> polygon;
+		const char* record = chunk.begin;
+		for(long long f = 0; f < chunk.recordCount && chunk.isValid; f++)
+		{
+			const char* items = record;
+			for(int i = 0; i < layout.indexList; i++)
+				items += GetPlyTypeSize(face.properties[i].type);
+			int corners = (int)ReadPlyValue(items, list.countType);
+			items += countSize;
+			polygon.resize(corners > 0 ? corners : 0);
+			for(int k = 0; k < corners; k++)
+				polygon[k] = (int)ReadPlyValue(items + k*itemSize, list.type);
+			if(corners >= 3 && !WritePolygon(&polygon[0], corners, vertexCount, indices, materials, triangle, material))
+				chunk.isValid = false;
+			record = SkipPlyRecord(record, chunk.end, face);
+		}
+	}
+	for(int c = 0; c < chunkCount; c++)
+		if(!chunks[c].isValid)
+			throw std::exception("Invalid vertex index in PLY file");
+	return p;
+}
+
+static void ReadPlyBinary(const char* p, const char* end, const std::vector<PlyElement>& elements,
+	const PlyLayout& layout, TriangleMesh* mesh, Material* material)
+{
+	int vertexCount = (int)layout.vertex->count;
+	mesh->Resize(vertexCount, 0);
+	for(unsigned int e = 0; e < elements.size(); e++)
+	{
+		const PlyElement& element = elements[e];
+		if(&element == layout.face)
+		{
+			p = ReadPlyBinaryFaces(p, end, layout, mesh, material);
+			continue;
+		}
+
+		int recordSize = GetPlyRecordSize(element);
+		if(recordSize < 0)
+		{
+			// Unused elements with lists are skipped record by record.
+			for(long long i = 0; i < element.count; i++)
+				if(!(p = SkipPlyRecord(p, end, element)))
+					throw std::exception("Malformed PLY file");
+			continue;
+		}
+		if(element.count * recordSize > end - p)
+			throw std::exception("PLY file is truncated");
+
+		if(&element == layout.vertex)
+		{
+			int offsets[3], types[3];
+			for(int k = 0; k < 3; k++)
+			{
+				offsets[k] = 0;
+				for(int i = 0; i < layout.position[k]; i++)
+					offsets[k] += GetPlyTypeSize(element.properties[i].type);
+				types[k] = element.properties[layout.position[k]].type;
+			}
+			Vec3* vertices = mesh->GetVertexData();
+			#pragma omp parallel for
+			for(int i = 0; i < vertexCount; i++)
+			{
+				const char* record = p + (long long)i * recordSize;
+				vertices[i] = Vec3((Scalar)ReadPlyValue(record + offsets[0], types[0]), (Scalar)ReadPlyValue(record + offsets[1], types[1]),
+					(Scalar)ReadPlyValue(record + offsets[2], types[2]));
+			}
+		}
+		p += element.count * recordSize;
+	}
+}
+
+// Parses ascii record of face, returns number of corners (-1 if malformed); indices are stored only if polygon is given.
+static int ParsePlyAsciiFace(const char* p, const char* lineEnd, const PlyElement& face, int indexList, std::vector<int>* polygon)
+{
+	bool isValid = true;
+	int corners = -1;
+	for(unsigned int i = 0; i < face.properties.size() && isValid; i++)
+	{
+		if(face.properties[i].countType < 0)
+		{
+			p = SkipToken(SkipSpaces(p, lineEnd), lineEnd);
+			continue;
+		}
+		int count;
+		p = ParseInt(SkipSpaces(p, lineEnd), lineEnd, count, isValid);
+		if(count < 0)
+			isValid = false;
+		bool isIndexList = (int)i == indexList;
+		if(isIndexList)
+		{
+			corners = count;
+			if(polygon)
+				polygon->resize(count);
+		}
+		for(int k = 0; k < count && isValid; k++)
+		{
+			p = SkipSpaces(p, lineEnd);
+			if(isIndexList && polygon)
+				p = ParseInt(p, lineEnd, (*polygon)[k], isValid);
+			else
+				p = SkipToken(p, lineEnd);
+		}
+	}
+	return isValid ? corners : -1;
+}
+
+// Reads ascii body. Records are lines, so element of a line is given by its global index: first pass counts
+// lines of chunks, second counts triangles of face lines and third parses them.
+static void ReadPlyAscii(const char* body, const char* end, const std::vector<PlyElement>& elements,
+	const PlyLayout& layout, TriangleMesh* mesh, Material* material)
+{
+	long long vertexStart = 0, faceStart = 0, position = 0;
+	for(unsigned int e = 0; e < elements.size(); e++)
+	{
+		if(&elements[e] == layout.vertex)
+			vertexStart = position;
+		if(&elements[e] == layout.face)
+			faceStart = position;
+		position += elements[e].count;
+	}
+	long long vertexEnd = vertexStart + layout.vertex->count;
+	long long faceEnd = layout.face ? faceStart + layout.face->count : 0;
+	int vertexCount = (int)layout.vertex->count;
+
+	std::vector<const char*> bounds;
+	SplitLines(body, end, GetChunkCount(end - body), bounds);
+	int chunkCount = bounds.size() - 1;
+	std::vector<PlyChunk> chunks(chunkCount);
+
+	#pragma omp parallel for schedule(dynamic, 1)
+	for(int c = 0; c < chunkCount; c++)
+	{
+		PlyChunk& chunk = chunks[c];
+		chunk.begin = bounds[c];
+		chunk.end = bounds[c+1];
+		chunk.recordCount = 0;
+		for(const char* line = chunk.begin; line < chunk.end; line = FindLineEnd(line, chunk.end) + 1)
+			chunk.recordCount++;
+	}
+	long long lineCount = 0;
+	for(int c = 0; c < chunkCount; c++)
+	{
+		chunks[c].firstRecord = lineCount;
+		lineCount += chunks[c].recordCount;
+	}
+	if(lineCount < position)
+		throw std::exception("PLY file is truncated");
+
+	#pragma omp parallel for schedule(dynamic, 1)
+	for(int c = 0; c < chunkCount; c++)
+	{
+		PlyChunk& chunk = chunks[c];
+		chunk.triangleCount = 0;
+		chunk.isValid = true;
+		long long record = chunk.firstRecord;
+		for(const char* line = chunk.begin; line < chunk.end; record++)
+		{
+			const char* lineEnd = FindLineEnd(line, chunk.end);
+			if(record >= faceStart && record < faceEnd)
+			{
+				int corners = ParsePlyAsciiFace(line, lineEnd, *layout.face, layout.indexList, 0);
+				if(corners < 0)
+					chunk.isValid = false;
+				else if(corners >= 3)
+					chunk.triangleCount += corners - 2;
+			}
+			line = lineEnd + 1;
+		}
+	}
+	long long triangleCount = 0;
+	for(int c = 0; c < chunkCount; c++)
+	{
+		if(!chunks[c].isValid)
+			throw std::exception("Malformed PLY face");
+		chunks[c].triangleOffset = triangleCount;
+		triangleCount += chunks[c].triangleCount;
+	}
+	if(triangleCount * 3 > 0x7FFFFFFF)
+		throw std::exception("PLY file is too large");
+
+	mesh->Resize(vertexCount, (int)triangleCount);
+	Vec3* vertices = mesh->GetVertexData();
+	int* indices = mesh->GetIndexData();
+	Material** materials = mesh->GetMaterialData();
+
+	#pragma omp parallel for schedule(dynamic, 1)
+	for(int c = 0; c < chunkCount; c++)
+	{
+		PlyChunk& chunk = chunks[c];
+		int triangle = (int)chunk.triangleOffset;
+		std::vector<int> polygon;
+		long long record = chunk.firstRecord;
+		for(const char* line = chunk.begin; line < chunk.end && chunk.isValid; record++)
+		{
+			const char* lineEnd = FindLineEnd(line, chunk.end);
+			if(record >= vertexStart && record < vertexEnd)
+			{
+				const PlyElement& vertex = *layout.vertex;
+				Vec3& v = vertices[record - vertexStart];
+				const char* p = line;
+				for(unsigned int i = 0; i < vertex.properties.size(); i++)
+				{
+					p = SkipSpaces(p, lineEnd);
+					int axis = (int)i == layout.position[0] ? 0 : (int)i == layout.position[1] ? 1 : (int)i == layout.position[2] ? 2 : -1;
+					if(axis >= 0)
+						p = ParseScalar(p, lineEnd, v.data[axis], chunk.isValid);
+					else
+						p = SkipToken(p, lineEnd);
+				}
+			}
+			else if(record >= faceStart && record < faceEnd)
+			{
+				int corners = ParsePlyAsciiFace(line, lineEnd, *layout.face, layout.indexList, &polygon);
+				if(corners >= 3 && !WritePolygon(&polygon[0], corners, vertexCount, indices, materials, triangle, material))
+					chunk.isValid = false;
+			}
+			line = lineEnd + 1;
+		}
+	}
+	for(int c = 0; c < chunkCount; c++)
+		if(!chunks[c].isValid)
+			throw std::exception("Malformed PLY file");
+}
+
+TriangleMesh* MeshImporter::LoadPly(const char* filename)
+{
+	double startTime = GetTime();
+	MappedFile file;
+	file.Open(filename);
+
+	bool isBinary = false;
+	std::vector<PlyElement> elements;
+	const char* body = ParsePlyHeader(file.GetData(), file.GetEnd(), isBinary, elements);
+	PlyLayout layout;
+	FindPlyLayout(elements, layout);
+
+	Material* material = GetDefaultMaterial();
+	TriangleMesh* mesh = new TriangleMesh();
+	try
+	{
+		if(isBinary)
+			ReadPlyBinary(body, file.GetEnd(), elements, layout, mesh, material);
+		else
+			ReadPlyAscii(body, file.GetEnd(), elements, layout, mesh, material);
+	}
+	catch(...)
+	{
+		delete mesh;
+		throw;
+	}
+
+	SetLoaded(mesh->GetVertexCount(), mesh->GetTriangleCount(), 1, file.GetSize(), startTime);
+	return mesh;
+}
@@ -0,0 +1,55 @@
+#pragma once
+
+#include "CommonGeometry.h"
+#include <vector>
+#include <string>
+
+// Sizes and time of the last mesh loaded by MeshImporter.
+struct MeshLoadStats
+{
+	int vertexCount, triangleCount, materialCount;
+	long long bytes;	//< Size of file.
+	double time;		//< Seconds from opening file to returning mesh.
+
+	MeshLoadStats() : vertexCount(0), triangleCount(0), materialCount(0), bytes(0), time(0) {}
+};
+
+// Imports triangle meshes from Wavefront OBJ and PLY (ascii and binary little endian) files. File is memory
+// mapped and split into chunks that are parsed in parallel: first pass counts vertices and triangles of each
+// chunk, so mesh buffers are sized once and second pass writes every chunk directly to its place.
+// Polygons are triangulated as fans; only positions are imported (normals and texture coordinates are skipped).
+class MeshImporter
+{
+	std::vector<Material*> createdMaterials;
+	std::vector<IBSDF*> createdBSDFs;
+	std::vector<Vec3> createdColours;
+	MeshLoadStats lastLoad;
+
+	// Material for diffuse colour, materials with the same colour are shared.
+	Material* GetDiffuseMaterial(const Vec3& colour);
+	Material* GetDefaultMaterial();
+	// Reads diffuse colours of materials from MTL file (appending to names and colours).
+	void LoadMtl(const std::string& filename, std::vector<std::string>& names, std::vector<Vec3>& colours);
+	// Records stats of loaded mesh.
+	void SetLoaded(int vertexCount, int triangleCount, int materialCount, long long bytes, double startTime);
+public:
+	// Material of triangles without material (all PLY triangles and OBJ faces before usemtl or with
+	// unknown material). If 0, a white diffuse material is created when needed.
+	Material* defaultMaterial;
+
+	MeshImporter() : defaultMaterial(0) {}
+
+	// Loads mesh, format is chosen by extension. Returned mesh is owned by caller and is not built.
+	// Throws std::exception if file cannot be read or is malformed.
+	TriangleMesh* Load(const char* filename);
+	TriangleMesh* LoadObj(const char* filename);
+	TriangleMesh* LoadPly(const char* filename);
+
+	// Stats of the last successful load.
+	const MeshLoadStats& GetLastLoadStats() const { return lastLoad; }
+
+	// Materials created while loading (from MTL files and the default one); they are owned by caller
+	// together with their BSDFs and must outlive meshes using them.
+	const std::vector<Material*>& GetCreatedMaterials() const { return createdMaterials; }
+	const std::vector<IBSDF*>& GetCreatedBSDFs() const { return createdBSDFs; }
+};
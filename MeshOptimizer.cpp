@@ -0,0 +1,295 @@
+#include "MeshOptimizer.h"
+#include <exception>
+#include <algorithm>
+#include <map>
+#include <cmath>
+
+/// ---------------------------------------------------------------------------------------
+/// Mesh optimizer
+/// ---------------------------------------------------------------------------------------
+
+// Orders vertex indices by grid cell of their position (by position itself if cell size is 0) and by index,
+// so welded vertices are consecutive and the first one of them has the lowest index.
+struct WeldLess
+{
+	const Vec3* vertices;
+	Scalar cellSize;
+
+	WeldLess(const Vec3* v, Scalar c) : vertices(v), cellSize(c) {}
+	Scalar Key(int vertex, int k) const
+	{
+		Scalar p = vertices[vertex].data[k];
+		return cellSize > 0 ? std::floor(p / cellSize) : p;
+	}
+	bool operator()(int a, int b) const
+	{
+		for(int k = 0; k < 3; k++)
+		{
+			Scalar ka = Key(a, k), kb = Key(b, k);
+			if(ka != kb)
+				return ka < kb;
+		}
+		return a < b;
+	}
+	bool IsWelded(int a, int b) const { return Key(a, 0) == Key(b, 0) && Key(a, 1) == Key(b, 1) && Key(a, 2) == Key(b, 2); }
+};
+
+// Spreads lower 10 bits of value to every third bit.
+static unsigned int SpreadBits(unsigned int value)
+{
+	value &= 0x3FF;
+	value = (value | (value << 16)) & 0x030000FF;
+	value = (value | (value << 8)) & 0x0300F00F;
+	value = (value | (value << 4)) & 0x030C30C3;
+	value = (value | (value << 2)) & 0x09249249;
+	return value;
+}
+
+// Morton code of point on 1024^3 grid over bounds.
+static unsigned int MortonCode(const Vec3& point, const BoundingBox& bounds)
+{
+	unsigned int code = 0;
+	for(int k = 0; k < 3; k++)
+	{
+		Scalar extent = bounds.maxDim.data[k] - bounds.minDim.data[k];
+		Scalar t = extent > 0 ? (point.data[k] - bounds.minDim.data[k]) / extent : 0;
+		unsigned int cell = (unsigned int)std::max((Scalar)0, std::min((Scalar)1023, t * 1024));
+		code |= SpreadBits(cell) << k;
+	}
+	return code;
+}
+
+MeshOptimizeStats MeshOptimizer::Optimize(TriangleMesh& mesh)
+{
+	MeshOptimizeStats stats;
+	int V = mesh.GetVertexCount(), N = mesh.GetTriangleCount();
+	stats.verticesBefore = V;
+	stats.trianglesBefore = N;
+	stats.bytesBefore = mesh.GetDataSize();
+
+	const Vec3* vertices = mesh.GetVertexData();
+	const int* indices = mesh.GetIndexData();
+	Material* const* materials = mesh.GetMaterialData();
+
+	// Each vertex is replaced by the first vertex of its group.
+	WeldLess less(vertices, weldTolerance);
+	std::vector<int> sorted(V), weld(V);
+	for(int i = 0; i < V; i++)
+		sorted[i] = i;
+	std::sort(sorted.begin(), sorted.end(), less);
+	for(int i = 0; i < V; i++)
+		weld[sorted[i]] = i > 0 && less.IsWelded(sorted[i-1], sorted[i]) ? weld[sorted[i-1]] : sorted[i];
+	std::vector<int>().swap(sorted);
+
+	// Triangles with two welded vertices have no area.
+	std::vector<int> triangles;
+	triangles.reserve(N);
+	for(int i = 0; i < N; i++)
+	{
+		int a = weld[indices[i*3]], b = weld[indices[i*3+1]], c = weld[indices[i*3+2]];
+		if(a != b && b != c && a != c)
+			triangles.push_back(i);
+	}
+
+	if(reorder && !triangles.empty())
+	{
+		BoundingBox bounds;
+		for(int i = 0; i < V; i++)
+			bounds.Extend(vertices[i]);
+		std::vector<std::pair<unsigned int, int> > codes(triangles.size());
+		for(unsigned int i = 0; i < triangles.size(); i++)
+		{
+			int t = triangles[i];
+			Vec3 centroid = (vertices[weld[indices[t*3]]] + vertices[weld[indices[t*3+1]]] + vertices[weld[indices[t*3+2]]]) / 3;
+			codes[i] = std::make_pair(MortonCode(centroid, bounds), t);
+		}
+		std::sort(codes.begin(), codes.end());
+		for(unsigned int i = 0; i < codes.size(); i++)
+			triangles[i] = codes[i].second;
+	}
+
+	// Vertices are renumbered in order of first use (unused ones are dropped).
+	int M = triangles.size();
+	std::vector<int> newIndex(V, -1), newIndices(M*3);
+	std::vector<Vec3> newVertices;
+	std::vector<Material*> newMaterials(M);
+	for(int i = 0; i < M; i++)
+	{
+		int t = triangles[i];
+		for(int k = 0; k < 3; k++)
+		{
+			int v = weld[indices[t*3+k]];
+			if(newIndex[v] < 0)
+			{
+				newIndex[v] = newVertices.size();
+				newVertices.push_back(vertices[v]);
+			}
+			newIndices[i*3+k] = newIndex[v];
+		}
+		newMaterials[i] = materials[t];
+	}
+
+	// Resize keeps capacity of larger arrays, so they are replaced to release memory.
+	int newV = newVertices.size();
+	TriangleMesh optimized(M);
+	optimized.Resize(newV, M);
+	std::copy(newVertices.begin(), newVertices.end(), optimized.GetVertexData());
+	std::copy(newIndices.begin(), newIndices.end(), optimized.GetIndexData());
+	std::copy(newMaterials.begin(), newMaterials.end(), optimized.GetMaterialData());
+	mesh.Swap(optimized);
+
+	stats.verticesAfter = newV;
+	stats.trianglesAfter = M;
+	stats.bytesAfter = mesh.GetDataSize();
+	return stats;
+}
+
+/// ---------------------------------------------------------------------------------------
+/// Quantized triangle mesh
+/// ---------------------------------------------------------------------------------------
+
+void QuantizedTriangleMesh::Build(TriangleMesh& mesh)
+{
+	Clear();
+	int V = mesh.GetVertexCount(), N = mesh.GetTriangleCount();
+	const Vec3* meshVertices = mesh.GetVertexData();
+	const int* meshIndices = mesh.GetIndexData();
+	Material* const* meshMaterials = mesh.GetMaterialData();
+	if(N == 0)
+		return;
+
+	// Grid over bounds of all vertices.
+	BoundingBox bounds;
+	for(int i = 0; i < V; i++)
+		bounds.Extend(meshVertices[i]);
+	origin = bounds.minDim;
+	step = (bounds.maxDim - bounds.minDim) / 65535;
+	vertices.resize(V*3);
+	for(int i = 0; i < V; i++)
+		for(int k = 0; k < 3; k++)
+		{
+			Scalar q = step.data[k] > 0 ? (meshVertices[i].data[k] - origin.data[k]) / step.data[k] + (Scalar)0.5 : 0;
+			vertices[i*3+k] = (unsigned short)std::max((Scalar)0, std::min((Scalar)65535, q));
+		}
+
+	// Hierarchy is built over quantized triangles, which are then stored in its slot order.
+	std::vector<BoundingBox> triangleBounds(N);
+	for(int i = 0; i < N; i++)
+		for(int k = 0; k < 3; k++)
+			triangleBounds[i].Extend(GetVertex(meshIndices[i*3+k]));
+	BVH binary;
+	binary.Build(triangleBounds);
+	bvh.Build(binary);
+	const std::vector<int>& order = binary.GetPrimitiveOrder();
+
+	if(V <= 65536)
+		shortIndices.resize(N*3);
+	else
+		indices.resize(N*3);
+	std::map<Material*, int> ids;
+	materialIds.resize(N);
+	for(int i = 0; i < N; i++)
+	{
+		int t = order[i];
+		for(int k = 0; k < 3; k++)
+		{
+			if(shortIndices.empty())
+				indices[i*3+k] = meshIndices[t*3+k];
+			else
+				shortIndices[i*3+k] = (unsigned short)meshIndices[t*3+k];
+		}
+
+		std::map<Material*, int>::iterator it = ids.find(meshMaterials[t]);
+		if(it == ids.end())
+		{
+			if(palette.size() > 65535)
+				throw std::exception("Quantized mesh supports at most 65536 materials");
+			it = ids.insert(std::make_pair(meshMaterials[t], (int)palette.size())).first;
+			palette.push_back(meshMaterials[t]);
+		}
+		materialIds[i] = (unsigned short)it->second;
+	}
+}
+
+void QuantizedTriangleMesh::Clear()
+{
+	vertices.clear();
+	shortIndices.clear();
+	indices.clear();
+	materialIds.clear();
+	palette.clear();
+	bvh.Clear();
+}
+
+long long QuantizedTriangleMesh::GetDataSize() const
+{
+	return (long long)vertices.size() * sizeof(unsigned short) + (long long)shortIndices.size() * sizeof(unsigned short)
+		+ (long long)indices.size() * sizeof(int) + (long long)materialIds.size() * sizeof(unsigned short)
+		+ (long long)palette.size() * sizeof(Material*);
+}
+
+void QuantizedTriangleMesh::IntersectTriangle(int i, const Ray& ray, IntersectResult& result) const
+{
+	Vec3 p1 = GetVertex(GetIndex(i*3));
+	Vec3 e1 = GetVertex(GetIndex(i*3+1)) - p1;
+	Vec3 e2 = GetVertex(GetIndex(i*3+2)) - p1;
+
+	// Moller-Trumbore, edges are inclusive.
+	Vec3 p = ray.direction ^ e2;
+	Scalar det = e1 * p;
+	if(det == 0)
+		return;
+	Scalar invDet = 1 / det;
+	Vec3 t = ray.origin - p1;
+	Scalar u = (t * p) * invDet;
+	if(u < 0 || u > 1)
+		return;
+	Vec3 q = t ^ e1;
+	Scalar v = (ray.direction * q) * invDet;
+	if(v < 0 || u + v > 1)
+		return;
+
+	Scalar distance = (e2 * q) * invDet;
+	if(distance < IL_MinimumNextIntersectionDistance || distance > result.distance)
+		return;
+
+	result.distance = distance;
+	result.normal = (e1 ^ e2).Normal();
+	result.materialData = NULL;
+	result.material = palette[materialIds[i]];
+}
+
+bool QuantizedTriangleMesh::OccludesTriangle(int i, const Ray& ray, Scalar maxDistance) const
+{
+	IntersectResult result;
+	result.distance = maxDistance;
+	IntersectTriangle(i, ray, result);
+	return result.distance < maxDistance;
+}
+
+// Intersects triangles of quantized mesh in BVH leaves.
+struct QuantizedTriangleIntersector
+{
+	const QuantizedTriangleMesh& mesh;
+	QuantizedTriangleIntersector(const QuantizedTriangleMesh& m) : mesh(m) {}
+	void operator()(int slot, const Ray& ray, IntersectResult& result) { mesh.IntersectTriangle(slot, ray, result); }
+};
+
+struct QuantizedTriangleOccluder
+{
+	const QuantizedTriangleMesh& mesh;
+	QuantizedTriangleOccluder(const QuantizedTriangleMesh& m) : mesh(m) {}
+	bool operator()(int slot, const Ray& ray, Scalar maxDistance) { return mesh.OccludesTriangle(slot, ray, maxDistance); }
+};
+
+void QuantizedTriangleMesh::Intersect(const Ray& ray, IntersectResult& result)
+{
+	QuantizedTriangleIntersector intersector(*this);
+	bvh.Intersect(ray, result, intersector);
+}
+
+bool QuantizedTriangleMesh::Occluded(const Ray& ray, Scalar maxDistance)
+{
+	QuantizedTriangleOccluder occluder(*this);
+	return bvh.Occluded(ray, maxDistance, occluder);
+}
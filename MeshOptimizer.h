@@ -0,0 +1,71 @@
+#pragma once
+
+#include "CommonGeometry.h"
+#include "Acceleration\QuantizedBVH.h"
+#include <vector>
+
+// Sizes of mesh before and after optimization (bytes are TriangleMesh::GetDataSize).
+struct MeshOptimizeStats
+{
+	int verticesBefore, verticesAfter;
+	int trianglesBefore, trianglesAfter;
+	long long bytesBefore, bytesAfter;
+};
+
+// Preprocesses triangle meshes for rendering. Duplicate vertices are welded (meshes made by AddTriangle or
+// imported from triangle soups store every vertex several times) and triangles which lose their area by
+// welding are removed. Triangles are then reordered along Morton curve of their centroids and vertices
+// renumbered in order of first use, so triangles close in space are also close in memory.
+class MeshOptimizer
+{
+public:
+	// Vertices in the same cell of grid with this spacing are welded; 0 welds only equal positions.
+	Scalar weldTolerance;
+	// Reorders triangles and vertices for locality.
+	bool reorder;
+
+	MeshOptimizer() : weldTolerance(0), reorder(true) {}
+
+	// Optimizes mesh in place and returns sizes before and after. Built structures of mesh are released, so it must
+	// be built again.
+	MeshOptimizeStats Optimize(TriangleMesh& mesh);
+};
+
+// Compact read-only copy of a triangle mesh. Vertex coordinates are stored as 16 bit fractions of mesh
+// bounds, indices take 16 bits when mesh has at most 65536 vertices (32 bits otherwise) and materials are
+// 16 bit indices to a palette; triangles are stored in slot order of a 16 bit quantized BVH. Vertices move
+// by at most half of grid step (1/131070 of bounds extent); shared vertices stay shared, so mesh stays
+// watertight. Best for small meshes instanced or repeated many times, where memory matters more than speed.
+class QuantizedTriangleMesh : public IGeometry
+{
+	Vec3 origin, step;						//< Vertex is origin + q*step on each axis.
+	std::vector<unsigned short> vertices;	//< Three values per vertex.
+	std::vector<unsigned short> shortIndices;
+	std::vector<int> indices;				//< Used instead of shortIndices for meshes with more vertices.
+	std::vector<unsigned short> materialIds;
+	std::vector<Material*> palette;
+	QuantizedBVH16 bvh;
+public:
+	// Copies and quantizes mesh (it does not need to be built). Throws std::exception if mesh has more than
+	// 65536 distinct materials.
+	void Build(TriangleMesh& mesh);
+	void Clear();
+
+	int GetTriangleCount() const { return materialIds.size(); }
+	int GetIndex(int i) const { return shortIndices.empty() ? indices[i] : shortIndices[i]; }
+	Vec3 GetVertex(int i) const
+	{
+		const unsigned short* q = &vertices[i*3];
+		return Vec3(origin.x + q[0]*step.x, origin.y + q[1]*step.y, origin.z + q[2]*step.z);
+	}
+	// Bytes of vertex, index and material arrays, comparable to TriangleMesh::GetDataSize.
+	long long GetDataSize() const;
+
+	virtual void Intersect(const Ray& ray, IntersectResult& result);
+	virtual bool Occluded(const Ray& ray, Scalar maxDistance);
+	virtual BoundingBox GetBounds() { return bvh.GetBounds(); }
+
+	// Intersection of triangle in slot i; same rules as CompiledTriangles.
+	void IntersectTriangle(int i, const Ray& ray, IntersectResult& result) const;
+	bool OccludesTriangle(int i, const Ray& ray, Scalar maxDistance) const;
+};
@@ -0,0 +1,456 @@
+#include "OutOfCoreMesh.h"
+#include "MeshCache.h"
+#include <exception>
+#include <algorithm>
+#include <cstring>
+
+static const char OutOfCore_Magic[8] = { 'R', 'T', 'O', 'O', 'C', 0, 0, 0 };
+
+// Seeks to 64 bit offset.
+static bool SeekFile(FILE* file, long long offset)
+{
+#ifdef _WIN32
+	return _fseeki64(file, offset, SEEK_SET) == 0;
+#else
+	return fseeko(file, offset, SEEK_SET) == 0;
+#endif
+}
+
+// Size of file in bytes, -1 on failure; file position is undefined afterwards.
+static long long GetFileSize(FILE* file)
+{
+#ifdef _WIN32
+	return _fseeki64(file, 0, SEEK_END) == 0 ? _ftelli64(file) : -1;
+#else
+	return fseeko(file, 0, SEEK_END) == 0 ? (long long)ftello(file) : -1;
+#endif
+}
+
+// Memory of cluster buffer (rounded up to whole Scalar elements).
+static long long GetResidentSize(const OutOfCoreClusterInfo& info)
+{
+	return (info.size + sizeof(Scalar) - 1) / sizeof(Scalar) * sizeof(Scalar);
+}
+
+// Checks that cluster data lies in [dataStart, dataEnd) of file and is large enough for its arrays.
+static bool IsClusterValid(const OutOfCoreClusterInfo& info, long long dataStart, long long dataEnd)
+{
+	if(info.triangleCount <= 0 || info.nodeCount <= 0 || info.nodeCount > 2 * info.triangleCount - 1)
+		return false;
+	long long minimumSize = (long long)info.nodeCount * sizeof(BVHNode) +
+		(long long)info.triangleCount * (CompiledTriangles_ArrayCount * sizeof(Scalar) + sizeof(int));
+	return info.size >= minimumSize && info.offset >= dataStart && info.offset <= dataEnd - info.size;
+}
+
+static void WriteData(FILE* file, long long& position, const void* data, long long size)
+{
+	if(size > 0 && fwrite(data, 1, (size_t)size, file) != (size_t)size)
+		throw std::exception("Cannot write out of core mesh");
+	position += size;
+}
+
+/// ---------------------------------------------------------------------------------------
+/// OutOfCoreWriter
+/// ---------------------------------------------------------------------------------------
+
+// Orders triangles by centroid coordinate on axis.
+struct CentroidLess
+{
+	const std::vector<Vec3>& centroids;
+	int axis;
+	CentroidLess(const std::vector<Vec3>& c, int a) : centroids(c), axis(a) {}
+	bool operator()(int a, int b) const { return centroids[a].data[axis] < centroids[b].data[axis]; }
+};
+
+void OutOfCoreWriter::Open(const char* filename, const std::vector<Material*>& palette)
+{
+	if(file)
+		fclose(file);
+	file = fopen(filename, "wb");
+	if(!file)
+		throw std::exception("Cannot create out of core mesh");
+
+	clusters.clear();
+	materialIds.clear();
+	for(unsigned int i = 0; i < palette.size(); i++)
+		materialIds.insert(std::make_pair(palette[i], (int)i));
+	materialCount = palette.size();
+	triangleCount = 0;
+
+	// Header is written at Close, when cluster table is known.
+	OutOfCoreHeader header;
+	memset(&header, 0, sizeof(header));
+	position = 0;
+	WriteData(file, position, &header, sizeof(header));
+}
+
+void OutOfCoreWriter::AddMesh(TriangleMesh& mesh)
+{
+	int N = mesh.GetTriangleCount();
+	const Vec3* vertices = mesh.GetVertexData();
+	const int* indices = mesh.GetIndexData();
+	std::vector<Vec3> centroids(N);
+	std::vector<int> triangles(N);
+	for(int i = 0; i < N; i++)
+	{
+		centroids[i] = (vertices[indices[i*3]] + vertices[indices[i*3+1]] + vertices[indices[i*3+2]]) / 3;
+		triangles[i] = i;
+	}
+	if(N > 0)
+		WriteClusters(mesh, triangles, centroids, 0, N);
+	triangleCount += N;
+}
+
+void OutOfCoreWriter::WriteClusters(TriangleMesh& mesh, std::vector<int>& triangles, const std::vector<Vec3>& centroids,
+	int start, int end)
+{
+	if(end - start <= clusterSize)
+	{
+		WriteCluster(mesh, &triangles[start], end - start);
+		return;
+	}
+
+	// Median split along the longest axis of centroid bounds gives compact clusters of equal size.
+	BoundingBox bounds;
+	for(int i = start; i < end; i++)
+		bounds.Extend(centroids[triangles[i]]);
+	Vec3 extent = bounds.Extent();
+	int axis = extent.x > extent.y ? (extent.x > extent.z ? 0 : 2) : (extent.y > extent.z ? 1 : 2);
+	int middle = (start + end) / 2;
+	std::vector<int>::iterator first = triangles.begin();
+	std::nth_element(first + start, first + middle, first + end, CentroidLess(centroids, axis));
+	WriteClusters(mesh, triangles, centroids, start, middle);
+	WriteClusters(mesh, triangles, centroids, middle, end);
+}
+
+void OutOfCoreWriter::WriteCluster(TriangleMesh& mesh, const int* triangles, int count)
+{
+	const Vec3* vertices = mesh.GetVertexData();
+	const int* indices = mesh.GetIndexData();
+	Material** materials = mesh.GetMaterialData();
+
+	// Cluster is compiled from its own copy of triangles.
+	std::vector<Vec3> clusterVertices(count * 3);
+	std::vector<int> clusterIndices(count * 3);
+	std::vector<Material*> clusterMaterials(count);
+	std::vector<BoundingBox> bounds(count);
+	OutOfCoreClusterInfo info;
+	for(int i = 0; i < count; i++)
+	{
+		for(int k = 0; k < 3; k++)
+		{
+			clusterVertices[i*3+k] = vertices[indices[triangles[i]*3+k]];
+			clusterIndices[i*3+k] = i*3+k;
+			bounds[i].Extend(clusterVertices[i*3+k]);
+		}
+		clusterMaterials[i] = materials[triangles[i]];
+		info.bounds.Extend(bounds[i]);
+	}
+
+	BVH bvh;
+	bvh.Build(bounds);
+	CompiledTriangles compiled;
+	compiled.Compile(clusterVertices, clusterIndices, clusterMaterials, bvh.GetPrimitiveOrder());
+
+	std::vector<int> ids(count);
+	for(int i = 0; i < count; i++)
+	{
+		std::map<Material*, int>::const_iterator it = materialIds.find(compiled.GetMaterial(i));
+		if(it == materialIds.end())
+			throw std::exception("Mesh material is not in out of core palette");
+		ids[i] = it->second;
+	}
+
+	const std::vector<BVHNode>& nodes = bvh.GetNodes();
+	info.triangleCount = count;
+	info.nodeCount = nodes.size();
+	info.offset = position;
+	WriteData(file, position, &nodes[0], (long long)nodes.size() * sizeof(BVHNode));
+	WriteData(file, position, compiled.GetData(), (long long)count * CompiledTriangles_ArrayCount * sizeof(Scalar));
+	WriteData(file, position, &ids[0], (long long)count * sizeof(int));
+	info.size = position - info.offset;
+	clusters.push_back(info);
+}
+
+OutOfCoreWriteStats OutOfCoreWriter::Close()
+{
+	OutOfCoreWriteStats stats;
+	memset(&stats, 0, sizeof(stats));
+	if(!file)
+		return stats;
+
+	OutOfCoreHeader header;
+	memset(&header, 0, sizeof(header));
+	memcpy(header.magic, OutOfCore_Magic, sizeof(header.magic));
+	header.version = OutOfCore_Version;
+	header.byteOrder = MeshCache_ByteOrder;
+	header.scalarSize = sizeof(Scalar);
+	header.nodeSize = sizeof(BVHNode);
+	header.clusterCount = clusters.size();
+	header.materialCount = materialCount;
+	header.triangleCount = triangleCount;
+	header.clusterTableOffset = position;
+
+	bool isWritten = true;
+	try
+	{
+		WriteData(file, position, clusters.empty() ? 0 : &clusters[0], (long long)clusters.size() * sizeof(OutOfCoreClusterInfo));
+		isWritten = SeekFile(file, 0) && fwrite(&header, sizeof(header), 1, file) == 1;
+	}
+	catch(...)
+	{
+		isWritten = false;
+	}
+	isWritten = fclose(file) == 0 && isWritten;
+	file = 0;
+	if(!isWritten)
+		throw std::exception("Cannot write out of core mesh");
+
+	stats.triangleCount = triangleCount;
+	stats.clusterCount = clusters.size();
+	stats.bytes = position;
+	return stats;
+}
+
+/// ---------------------------------------------------------------------------------------
+/// OutOfCoreMesh
+/// ---------------------------------------------------------------------------------------
+
+void OutOfCoreMesh::Open(const char* filename, const std::vector<Material*>& palette)
+{
+	Close();
+	file = fopen(filename, "rb");
+	if(!file)
+		throw std::exception("Cannot open out of core mesh");
+
+	OutOfCoreHeader header;
+	if(fread(&header, sizeof(header), 1, file) != 1 || memcmp(header.magic, OutOfCore_Magic, sizeof(header.magic)) != 0)
+	{
+		Close();
+		throw std::exception("Not an out of core mesh file");
+	}
+	if(header.version != OutOfCore_Version || header.byteOrder != MeshCache_ByteOrder ||
+		header.scalarSize != sizeof(Scalar) || header.nodeSize != sizeof(BVHNode))
+	{
+		Close();
+		throw std::exception("Out of core mesh was written by incompatible version or build");
+	}
+	if(header.materialCount > (int)palette.size())
+	{
+		Close();
+		throw std::exception("Palette has fewer materials than out of core mesh");
+	}
+
+	// Cluster data lies between header and cluster table, which ends the file.
+	long long fileSize = GetFileSize(file);
+	bool isValid = header.clusterCount >= 0 && header.materialCount >= 0 &&
+		header.clusterTableOffset >= (long long)sizeof(header) && header.clusterTableOffset <= fileSize - (long long)header.clusterCount * (long long)sizeof(OutOfCoreClusterInfo);
+	if(isValid)
+	{
+		clusters.resize(header.clusterCount);
+		isValid = SeekFile(file, header.clusterTableOffset) && (header.clusterCount == 0 ||
+			fread(&clusters[0], sizeof(OutOfCoreClusterInfo), header.clusterCount, file) == (size_t)header.clusterCount);
+	}
+	for(int i = 0; isValid && i < header.clusterCount; i++)
+		isValid = IsClusterValid(clusters[i], sizeof(header), header.clusterTableOffset);
+	if(!isValid)
+	{
+		Close();
+		throw std::exception("Out of core mesh file is corrupted");
+	}
+
+	// Top level hierarchy has single cluster leaves.
+	std::vector<BoundingBox> bounds(clusters.size());
+	for(unsigned int i = 0; i < clusters.size(); i++)
+		bounds[i] = clusters[i].bounds;
+	topLevel.maxLeafSize = 1;
+	topLevel.Build(bounds);
+
+	this->palette = palette;
+	materialCount = header.materialCount;
+	resident.assign(clusters.size(), (OutOfCoreResident*)0);
+	ResetStats();
+}
+
+void OutOfCoreMesh::Close()
+{
+	for(unsigned int i = 0; i < resident.size(); i++)
+		delete resident[i];
+	resident.clear();
+	lru.clear();
+	clusters.clear();
+	palette.clear();
+	materialCount = 0;
+	topLevel.Clear();
+	if(file)
+		fclose(file);
+	file = 0;
+	stats.residentBytes = 0;
+	stats.residentClusters = 0;
+}
+
+OutOfCoreResident* OutOfCoreMesh::Load(int cluster)
+{
+	const OutOfCoreClusterInfo& info = clusters[cluster];
+	OutOfCoreResident* result = new OutOfCoreResident();
+	result->buffer.resize((size_t)(GetResidentSize(info) / sizeof(Scalar)));
+	if(!SeekFile(file, info.offset) || fread(&result->buffer[0], 1, (size_t)info.size, file) != (size_t)info.size)
+	{
+		delete result;
+		return 0;
+	}
+
+	const char* data = (const char*)&result->buffer[0];
+	result->nodes = (const BVHNode*)data;
+	data += info.nodeCount * sizeof(BVHNode);
+	const Scalar* arrays = (const Scalar*)data;
+	data += (long long)info.triangleCount * CompiledTriangles_ArrayCount * sizeof(Scalar);
+	const int* materialIds = (const int*)data;
+	if(!AreNodesValid(result->nodes, info.nodeCount, info.triangleCount) ||
+		!AreIdsValid(materialIds, info.triangleCount, materialCount))
+	{
+		delete result;
+		return 0;
+	}
+	result->triangles.Attach(arrays, materialIds, info.triangleCount, palette.empty() ? 0 : &palette[0]);
+	return result;
+}
+
+OutOfCoreResident* OutOfCoreMesh::Acquire(int cluster)
+{
+	OutOfCoreResident* result;
+	#pragma omp critical(OutOfCoreMesh_Cache)
+	{
+		result = resident[cluster];
+		if(result)
+		{
+			result->users++;
+			lru.splice(lru.begin(), lru, result->lruPosition);
+			stats.hits++;
+		}
+	}
+	if(result)
+		return result;
+
+	// Reads are serialized (file position is shared); cluster may have been loaded by another thread meanwhile.
+	#pragma omp critical(OutOfCoreMesh_Load)
+	{
+		#pragma omp critical(OutOfCoreMesh_Cache)
+		{
+			result = resident[cluster];
+			if(result)
+			{
+				result->users++;
+				lru.splice(lru.begin(), lru, result->lruPosition);
+				stats.hits++;
+			}
+		}
+		if(!result)
+		{
+			// Room is made before the buffer is allocated, so resident memory stays in budget while reading.
+			#pragma omp critical(OutOfCoreMesh_Cache)
+			Evict(GetResidentSize(clusters[cluster]));
+			result = Load(cluster);
+			#pragma omp critical(OutOfCoreMesh_Cache)
+			{
+				// Failed cluster is not cached, so a later visit reads it again.
+				if(!result)
+					stats.readFailures++;
+				else
+				{
+					result->users = 1;
+					lru.push_front(cluster);
+					result->lruPosition = lru.begin();
+					resident[cluster] = result;
+					stats.misses++;
+					stats.bytesRead += clusters[cluster].size;
+					stats.residentBytes += result->buffer.size() * sizeof(Scalar);
+					stats.peakResidentBytes = std::max(stats.peakResidentBytes, stats.residentBytes);
+					stats.residentClusters++;
+				}
+			}
+		}
+	}
+	return result;
+}
+
+void OutOfCoreMesh::Release(OutOfCoreResident* cluster)
+{
+	#pragma omp critical(OutOfCoreMesh_Cache)
+	cluster->users--;
+}
+
+void OutOfCoreMesh::Evict(long long incoming)
+{
+	std::list<int>::iterator it = lru.end();
+	while(stats.residentBytes + incoming > memoryBudget && it != lru.begin())
+	{
+		--it;
+		OutOfCoreResident* cluster = resident[*it];
+		if(cluster->users > 0)
+			continue;
+		stats.residentBytes -= cluster->buffer.size() * sizeof(Scalar);
+		stats.residentClusters--;
+		stats.evictions++;
+		resident[*it] = 0;
+		delete cluster;
+		it = lru.erase(it);
+	}
+}
+
+void OutOfCoreMesh::ResetStats()
+{
+	long long residentBytes = stats.residentBytes;
+	int residentClusters = stats.residentClusters;
+	if(resident.empty())
+		residentBytes = residentClusters = 0;
+	memset(&stats, 0, sizeof(stats));
+	stats.residentBytes = stats.peakResidentBytes = residentBytes;
+	stats.residentClusters = residentClusters;
+}
+
+// Intersects clusters in leaves of top level hierarchy.
+struct ClusterIntersector
+{
+	OutOfCoreMesh& mesh;
+	const std::vector<int>& order;
+	ClusterIntersector(OutOfCoreMesh& m, const std::vector<int>& o) : mesh(m), order(o) {}
+	void operator()(int slot, const Ray& ray, IntersectResult& result)
+	{
+		OutOfCoreResident* cluster = mesh.Acquire(order[slot]);
+		if(!cluster)
+			return;
+		TriangleIntersector intersector(cluster->triangles);
+		BVH::IntersectNodes(cluster->nodes, ray, result, intersector);
+		mesh.Release(cluster);
+	}
+};
+
+struct ClusterOccluder
+{
+	OutOfCoreMesh& mesh;
+	const std::vector<int>& order;
+	ClusterOccluder(OutOfCoreMesh& m, const std::vector<int>& o) : mesh(m), order(o) {}
+	bool operator()(int slot, const Ray& ray, Scalar maxDistance)
+	{
+		OutOfCoreResident* cluster = mesh.Acquire(order[slot]);
+		if(!cluster)
+			return false;
+		TriangleOccluder occluder(cluster->triangles);
+		bool isOccluded = BVH::OccludedNodes(cluster->nodes, ray, maxDistance, occluder);
+		mesh.Release(cluster);
+		return isOccluded;
+	}
+};
+
+void OutOfCoreMesh::Intersect(const Ray& ray, IntersectResult& result)
+{
+	ClusterIntersector intersector(*this, topLevel.GetPrimitiveOrder());
+	topLevel.Intersect(ray, result, intersector);
+}
+
+bool OutOfCoreMesh::Occluded(const Ray& ray, Scalar maxDistance)
+{
+	ClusterOccluder occluder(*this, topLevel.GetPrimitiveOrder());
+	return topLevel.Occluded(ray, maxDistance, occluder);
+}
@@ -0,0 +1,145 @@
+#pragma once
+
+#include "CommonGeometry.h"
+#include <vector>
+#include <list>
+#include <map>
+#include <cstdio>
+
+// Out of core meshes are stored as spatial clusters of triangles in a file. Every cluster holds its own BVH and
+// compiled triangles (in mesh cache layout, see MeshCache.h), so paging it in is a single read without parsing
+// or building. Only cluster bounds and a top level BVH over them are kept in memory.
+const int OutOfCore_Version = 1;
+
+struct OutOfCoreHeader
+{
+	char magic[8];				//< "RTOOC" padded with zeros.
+	int version;				//< OutOfCore_Version.
+	int byteOrder;				//< MeshCache_ByteOrder as written by saving machine.
+	int scalarSize;				//< sizeof(Scalar) and sizeof(BVHNode); file must be written by the same build.
+	int nodeSize;
+	int clusterCount;
+	int materialCount;
+	long long triangleCount;
+	long long clusterTableOffset;	//< OutOfCoreClusterInfo[clusterCount].
+};
+
+// Cluster record. Data at offset is BVHNode[nodeCount], Scalar[CompiledTriangles_ArrayCount*triangleCount]
+// and int[triangleCount] material indices.
+struct OutOfCoreClusterInfo
+{
+	BoundingBox bounds;
+	int triangleCount;
+	int nodeCount;
+	long long offset;
+	long long size;
+};
+
+// Sizes of written out of core mesh file.
+struct OutOfCoreWriteStats
+{
+	long long triangleCount;
+	int clusterCount;
+	long long bytes;	//< Size of file.
+};
+
+// Writes out of core mesh file. Meshes are added one by one and written immediately, so the whole scene
+// never has to be in memory; each mesh is split into clusters of at most clusterSize spatially close triangles.
+class OutOfCoreWriter
+{
+	FILE* file;
+	long long position;
+	std::vector<OutOfCoreClusterInfo> clusters;
+	std::map<Material*, int> materialIds;
+	int materialCount;
+	long long triangleCount;
+
+	// Splits triangles[start, end) at median of centroids until ranges are small enough and writes them.
+	void WriteClusters(TriangleMesh& mesh, std::vector<int>& triangles, const std::vector<Vec3>& centroids, int start, int end);
+	void WriteCluster(TriangleMesh& mesh, const int* triangles, int count);
+public:
+	// Maximum number of triangles in a cluster.
+	int clusterSize;
+
+	OutOfCoreWriter() : file(0), clusterSize(64 * 1024) {}
+	~OutOfCoreWriter() { if(file) fclose(file); }
+
+	// Creates file; materials of added meshes must be in palette. Throws std::exception on failure.
+	void Open(const char* filename, const std::vector<Material*>& palette);
+	// Writes clusters of mesh, which may be released afterwards.
+	void AddMesh(TriangleMesh& mesh);
+	// Writes cluster table and header and returns sizes of file (zeros if file is not open).
+	OutOfCoreWriteStats Close();
+};
+
+// Paging statistics of out of core mesh.
+struct OutOfCoreStats
+{
+	long long hits;				//< Cluster visits served from memory.
+	long long misses;			//< Cluster visits that read cluster from file.
+	long long evictions;		//< Clusters dropped to stay in budget.
+	long long readFailures;		//< Cluster visits whose read failed or data was invalid; cluster was skipped and is read again next time.
+	long long bytesRead;
+	long long residentBytes;	//< Memory used by resident clusters now and at most.
+	long long peakResidentBytes;
+	int residentClusters;
+};
+
+// A cluster in memory.
+struct OutOfCoreResident
+{
+	std::vector<Scalar> buffer;		//< Cluster data (Scalar elements keep arrays aligned).
+	const BVHNode* nodes;
+	CompiledTriangles triangles;
+	int users;						//< Threads intersecting cluster now; it cannot be evicted while used.
+	std::list<int>::iterator lruPosition;
+};
+
+// Mesh intersected out of core: top level BVH over cluster bounds is in memory and clusters hit by rays are
+// paged in on demand through an LRU cache limited by memoryBudget. Cache is shared by all rendering threads.
+class OutOfCoreMesh : public IGeometry
+{
+	FILE* file;
+	std::vector<OutOfCoreClusterInfo> clusters;
+	std::vector<Material*> palette;
+	int materialCount;
+	BVH topLevel;
+
+	// Resident clusters by index (0 if not resident), least recently used at back of lru.
+	std::vector<OutOfCoreResident*> resident;
+	std::list<int> lru;
+	OutOfCoreStats stats;
+
+	OutOfCoreMesh(const OutOfCoreMesh&);
+	OutOfCoreMesh& operator=(const OutOfCoreMesh&);
+	// Reads cluster from file, returns 0 if it cannot be read or its data is not valid.
+	OutOfCoreResident* Load(int cluster);
+	// Evicts least recently used clusters not in use until resident memory plus incoming bytes is in budget.
+	void Evict(long long incoming);
+public:
+	// Maximum memory of resident clusters in bytes, including cluster being read (clusters are evicted before
+	// it is allocated); exceeded only when clusters in use leave no room for it.
+	long long memoryBudget;
+
+	OutOfCoreMesh() : file(0), materialCount(0), memoryBudget(1024LL * 1024 * 1024) { ResetStats(); }
+	~OutOfCoreMesh() { Close(); }
+
+	// Opens file written by OutOfCoreWriter, material index i of the file is palette[i]. Throws std::exception
+	// if file or its cluster table is not valid (cluster data is checked when it is read).
+	void Open(const char* filename, const std::vector<Material*>& palette);
+	void Close();
+
+	// Returns cluster with given index in memory (paging it in) and marks it used; Release must follow. Returns 0
+	// if cluster cannot be read (counted in stats, as intersection cannot report errors).
+	OutOfCoreResident* Acquire(int cluster);
+	void Release(OutOfCoreResident* cluster);
+
+	virtual void Intersect(const Ray& ray, IntersectResult& result);
+	virtual bool Occluded(const Ray& ray, Scalar maxDistance);
+	virtual BoundingBox GetBounds() { return topLevel.GetBounds(); }
+
+	int GetClusterCount() const { return clusters.size(); }
+	// Hit rate and memory use, for sizing memoryBudget.
+	OutOfCoreStats GetStats() const { return stats; }
+	void ResetStats();
+};
@@ -0,0 +1,144 @@
+#include "PathTracer.h"
+#include "SimdMath.h"
+#include <algorithm>
+
+Colour PathTracer::Shade(const Ray& cameraRay, const IntersectResult& cameraResult, RandomGenerator* random, int /*depth*/, int /*depth2*/,
+	MediumStack& mediumStack)
+{
+	Ray ray = cameraRay;
+	IntersectResult result = cameraResult;
+	Vec4d L(0,0,0), throughput(1,1,1);
+	// Singular light geometry is only seen directly and through perfect reflections/refractions (as in Raytracer,
+	// where it is intersected only for depth2 = 0), otherwise lights would be counted twice.
+	bool isPerfectPath = true;
+
+	for(int bounce = 0; ; bounce++)
+	{
+		if(bounce > 0)
+		{
+			geometry->Intersect(ray, result);
+			if(isPerfectPath && this->singularLightGeometry)
+				singularLightGeometry->Intersect(ray, result);
+		}
+		if(result.distance >= std::numeric_limits<Scalar>::max())
+			break; //< "Sky" radiance is zero
+
+		Vec3 position = result.distance * ray.direction + ray.origin;
+		Vec3 cameraDirection = -ray.direction;
+		Ray newRay;
+
+		// Medium scattering replaces the surface hit.
+		ColourScalar scateringWeight;
+		Vec3 scatteringPos, scatteringDir;
+		bool isScattered = ray.medium->SampleScattering(ray.origin, result.normal, position, random, scateringWeight,
+			scatteringPos, scatteringDir);
+		throughput = throughput.CMultiply(Vec4d(scateringWeight));
+		if(isScattered)
+		{
+			newRay = Ray(scatteringPos, scatteringDir);
+			newRay.medium = ray.medium;
+		} else {
+			bool isInsideMedium = cameraDirection * result.normal < 0;
+			IMedium* insideMedium, *outsideMedium;
+			if(isInsideMedium)
+			{
+				// Hits from inside with empty stack are ignored, as in Raytracer.
+				if(mediumStack.IsEmpty())
+					break;
+				outsideMedium = mediumStack.Top();
+				insideMedium = ray.medium;
+			} else {
+				outsideMedium = ray.medium;
+				insideMedium = result.material->insideMedium;
+			}
+
+			// 1) self radiance
+			if(result.material->surfaceLight != 0)
+				L += throughput.CMultiply(Vec4d(result.material->surfaceLight->Radiance(position, cameraDirection, result.normal)));
+
+			IBSDF* bsdf = result.material->bsdf;
+			if(bsdf == 0)
+				break;
+			SamplingType samplingType = bsdf->GetSamplingType(cameraDirection, result.normal);
+
+			// 2) radiance from singular sources
+			if((samplingType & Singular) != 0)
+			{
+				for(std::vector<ISingularLight*>::iterator i = lights.begin(); i != lights.end(); i++)
+				{
+					Vec3 towardsLightDirection;
+					Vec3 Li = (*i)->Radiance(position, result.normal, result.distance, towardsLightDirection, geometry);
+					if(Li.x == 0 && Li.y == 0 && Li.z == 0)
+						continue;
+
+					Vec4d t = (result.normal * towardsLightDirection)*Vec4d(Li).CMultiply(Vec4d(bsdf->BSDF(position, result.normal,
+						cameraDirection, towardsLightDirection, result.materialData, insideMedium, outsideMedium)));
+					L += throughput.CMultiply(t);
+				}
+			}
+
+			// 3) one continuation ray. Perfect BSDFs (few samples needed) are split into branches (reflection
+			// and refraction), one is followed and its weight scaled by number of branches.
+			if((samplingType & MultipleSample) == 0)
+				break;
+			int branches = bsdf->GetMaxNumberOfSamples(cameraDirection, result.normal);
+			bool isPerfectReflection = branches <= this->gatherIterationThreeshold;
+			int branch = 0;
+			if(isPerfectReflection)
+				branch = std::min((int)(random->NextUniform() * branches), branches - 1);
+			else
+				branches = 1;
+			isPerfectPath = isPerfectPath && isPerfectReflection;
+
+			Vec3 newDirection;
+			ColourScalar S = bsdf->Sample(branch, branches, position, result.normal, cameraDirection, random,
+				result.materialData, insideMedium, outsideMedium, newDirection);
+			throughput = throughput.CMultiply(Vec4d(S) * (Scalar)branches);
+
+			// Path keeps only its current medium stack.
+			newRay = Ray(position, newDirection);
+			if(isInsideMedium)
+			{
+				// In-Out combination
+				if(newDirection * result.normal > 0)
+				{
+					newRay.medium = mediumStack.Top();
+					mediumStack.Pop();
+				}
+				// In-In combination
+				else
+					newRay.medium = ray.medium;
+			} else {
+				// Out-out combination
+				if(newDirection * result.normal > 0)
+					newRay.medium = ray.medium;
+				else
+				{
+					newRay.medium = result.material->insideMedium;
+					mediumStack.Push(ray.medium);
+				}
+			}
+			newRay.origin = OffsetRayOrigin(position, result.distance, result.normal, newDirection);
+		}
+
+		// NaN check (same unknown source as in Raytracer), the rest of path is dropped.
+		if(throughput.X() != throughput.X() || throughput.Y() != throughput.Y() || throughput.Z() != throughput.Z())
+			break;
+		if(bounce + 1 >= maxBounces)
+			break;
+
+		// Russian roulette.
+		if(bounce + 1 >= rouletteDepth)
+		{
+			Scalar survival = std::min((Scalar)1, std::max(std::max(throughput.X(), throughput.Y()), throughput.Z()));
+			if(random->NextUniform() >= survival)
+				break;
+			throughput = throughput / survival;
+		}
+
+		ray = newRay;
+		result = IntersectResult();
+	}
+
+	return L.ToVec3();
+}
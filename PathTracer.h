@@ -0,0 +1,28 @@
+#pragma once
+#include "Raytracer.h"
+
+// A path tracing version of Raytracer. Raytracer estimates the integral at each diffuse hit with many
+// secondary rays, each of which does the same at its hit, so cost grows exponentially with
+// maxGatherIterations. Here each camera sample follows a single path: at every hit self radiance and
+// singular lights are added, weighted by throughput of the path, and the path continues with one ray sampled
+// from the BSDF (one branch, chosen at random, of perfect reflections/refractions). Paths are ended by Russian
+// roulette, so cost is linear in number of bounces and noise is controlled only by number of samples per
+// pixel (raysPerPixel or progressive passes). secondaryRays, secondaryRayDecay, maxGatherIterations and
+// maxIterations are not used; photon maps are ignored (singular lights are still sampled directly, but
+// caustics of point lights can not be found by paths).
+class PathTracer : public Raytracer
+{
+public:
+	// Maximum number of bounces of path.
+	int maxBounces;
+	// From this bounce on, path survives with probability of its brightest throughput component (and
+	// throughput is divided by it), so dark paths end early without bias.
+	int rouletteDepth;
+
+	PathTracer() : maxBounces(32), rouletteDepth(3) {}
+
+protected:
+	// Traces the whole path iteratively; depth and depth2 are not used, mediumStack is the medium stack of path.
+	virtual Colour Shade(const Ray& ray, const IntersectResult& result, RandomGenerator* generator, int depth, int depth2,
+		MediumStack& mediumStack);
+};
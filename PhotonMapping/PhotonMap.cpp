@@ -4,11 +4,14 @@
 PhotonMap::PhotonMap()
 {
 	kdTree = 0;
+	blockUsed = PhotonMap_BlockSize;
 }
 
 PhotonMap::~PhotonMap()
 {
 	kd_free(kdTree);
+	for(unsigned int i = 0; i < blocks.size(); i++)
+		delete[] blocks[i];
 }
 
 void PhotonMap::AddPhoton(Photon* photon)
@@ -16,6 +19,18 @@ void PhotonMap::AddPhoton(Photon* photon)
 	photonMap.push_back(photon);
 }
 
+void PhotonMap::StorePhoton(const Photon& photon)
+{
+	if(blockUsed == PhotonMap_BlockSize)
+	{
+		blocks.push_back(new Photon[PhotonMap_BlockSize]);
+		blockUsed = 0;
+	}
+	Photon* p = &blocks.back()[blockUsed++];
+	*p = photon;
+	photonMap.push_back(p);
+}
+
 void PhotonMap::Optimise()
 {
 	if(kdTree)
@@ -36,16 +51,17 @@ int PhotonMap::FindNNearest(int n, const Vec3& position, Photon** list)
 	return 1;
 }
 
-void PhotonMap::FindInRange(const Vec3& position, Scalar range, std::vector<Photon*>& list)
+// Appends photon of visited kd-tree node to list.
+static void AppendPhoton(void* data, void* list)
 {
-	kdres* res = kd_nearest_range3(kdTree, position.x, position.y, position.z, range);
-	int size = kd_res_size(res);
-	list.reserve(kd_res_size(res));	//< Preallocates appropriate size
-	for(int i = 0; i < size; i++)
-	{
-		list.push_back((Photon*)kd_res_item_data(res));
-		kd_res_next(res);
-	}
+	((std::vector<Photon*>*)list)->push_back((Photon*)data);
+}
 
-	kd_res_free(res);
+void PhotonMap::FindInRange(const Vec3& position, Scalar range, std::vector<Photon*>& list)
+{
+	// Nodes are visited without kd-tree result set (which allocates every node); visit order is reversed to
+	// the order of result set, so sums over photons do not change.
+	int start = list.size();
+	kd_nearest_range3_visit(kdTree, position.x, position.y, position.z, range, AppendPhoton, &list);
+	std::reverse(list.begin() + start, list.end());
 }
\ No newline at end of file
@@ -15,6 +15,9 @@ struct Photon
 	Vec3 power;
 };
 
+// Number of photons in a block of photons stored by map.
+const int PhotonMap_BlockSize = 4096;
+
 // A photon map is efficient data structure for retrieving photons.
 class PhotonMap
 {
@@ -23,6 +26,13 @@ class PhotonMap
 
 	// Optimized K-d tree.
 	kdtree* kdTree;
+
+	// Photons copied by StorePhoton, in blocks of PhotonMap_BlockSize; the last one is filled to blockUsed.
+	std::vector<Photon*> blocks;
+	int blockUsed;
+
+	PhotonMap(const PhotonMap&);
+	PhotonMap& operator=(const PhotonMap&);
 public:
 	PhotonMap();
 	~PhotonMap();
@@ -32,9 +42,11 @@ public:
 	void Optimise();
 	// Adds a photon to map; data will be freed by destructor.
 	void AddPhoton(Photon* photon);
+	// Adds a copy of photon, stored in blocks owned by map, so photon tracing does not allocate each photon.
+	void StorePhoton(const Photon& photon);
 	// Finds N nearest photons.
 	int FindNNearest(int n, const Vec3& position, Photon** list);
-	// Finds photons in range.
+	// Finds photons in range, appends them to list (which is not cleared, so a reused list does not allocate).
 	void FindInRange(const Vec3& position, Scalar range, std::vector<Photon*>& list);
 
 };
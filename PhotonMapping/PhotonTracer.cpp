@@ -3,8 +3,7 @@
 #include <iostream>
 
 PhotonTracer::PhotonTracer()
-: photonsTraced(0), primaryPhotonsTraced(0), rejectRatio(1/(Scalar)100), hitTranslate(3*IL_MinimumNextIntersectionDistance),
-maxIterations(10)
+: photonsTraced(0), primaryPhotonsTraced(0), rejectRatio(1/(Scalar)100), maxIterations(10)
 {
 	vacuum = new NonInteractMedium(1);
 }
@@ -46,15 +45,15 @@ void PhotonTracer::TracePhotons(IGeometry* geometry,
 		Ray ray(photonPos, photonDir);
 		ray.medium = startMedium;
 
-		std::list<IMedium*> mediumList;
-		Trace(ray, photonE, photonE, random, 0, mediumList, caustics);
+		MediumStack mediumStack;
+		Trace(ray, photonE, photonE, random, 0, mediumStack, caustics);
 	}
 
 	std::cout << "Done with " << photonMap->Count() << " samples" << std::endl;
 }
 
 void PhotonTracer::Trace(const Ray& ray, const Vec3& initialEnergy, Vec3 energy, RandomGenerator* random, 
-		int depth, std::list<IMedium*>& mediumList, bool caustics)
+		int depth, MediumStack& mediumStack, bool caustics)
 {
 	// Iteration depth check
 	if(depth >= this->maxIterations)
@@ -84,7 +83,7 @@ void PhotonTracer::Trace(const Ray& ray, const Vec3& initialEnergy, Vec3 energy,
 	{
 		Ray newRay(scatteringPos, scatteringDir);
 		newRay.medium = ray.medium;
-		Trace(newRay, initialEnergy, scateringWeight.CMultiply(energy), random, depth, mediumList, caustics);
+		Trace(newRay, initialEnergy, scateringWeight.CMultiply(energy), random, depth, mediumStack, caustics);
 		return;
 	}
 
@@ -95,12 +94,12 @@ void PhotonTracer::Trace(const Ray& ray, const Vec3& initialEnergy, Vec3 energy,
 	// came to non-caustics surface).
 	if(!caustics || ((samplingType & Caustics) == 0 && depth > 0))
 	{
-		Photon* photon = new Photon;
-		photon->position = position;
-		photon->outDirection = -ray.direction;
-		photon->power = energy;
+		Photon photon;
+		photon.position = position;
+		photon.outDirection = -ray.direction;
+		photon.power = energy;
 
-		photonMap->AddPhoton(photon);
+		photonMap->StorePhoton(photon);
 	}
 
 	// 3) Photon reflection (only single), for caustics we need caustic surface to proceed.
@@ -113,9 +112,9 @@ void PhotonTracer::Trace(const Ray& ray, const Vec3& initialEnergy, Vec3 energy,
 	if(isInsideMedium)
 	{
 		// FIXME: in rare cases, this will not work since stack is incomplete. Ignore those cases
-		if(mediumList.size() == 0)
+		if(mediumStack.IsEmpty())
 			return;
-		outsideMedium = mediumList.back();
+		outsideMedium = mediumStack.Top();
 		insideMedium = ray.medium;
 	} else {
 		outsideMedium = ray.medium;
@@ -130,15 +129,13 @@ void PhotonTracer::Trace(const Ray& ray, const Vec3& initialEnergy, Vec3 energy,
 	// Create new ray and translate the position of intersection for numerical issues.
 	Ray newRay(position, newDirection);
 
-	Scalar translateInwards = -1;
 	if(isInsideMedium)
 	{
 		// In-Out combination
 		if(newDirection * result.normal > 0)
 		{
-			newRay.medium = mediumList.back();
-			mediumList.pop_back();
-			translateInwards = 1;
+			newRay.medium = mediumStack.Top();
+			mediumStack.Pop();
 		}
 		// In-In combination
 		else
@@ -151,15 +148,14 @@ void PhotonTracer::Trace(const Ray& ray, const Vec3& initialEnergy, Vec3 energy,
 		else
 		{
 			newRay.medium = result.material->insideMedium;
-			mediumList.push_back(ray.medium);
-			translateInwards = 1;
+			mediumStack.Push(ray.medium);
 		}
 	}
 
-	// Translation of ray position so the whole solid angle can be sampled (also in corners)
-	newRay.origin = newRay.origin + (translateInwards * this->hitTranslate) * ray.direction;
+	// Origin is moved off the surface to the side of new direction, so the ray does not hit it again.
+	newRay.origin = OffsetRayOrigin(position, result.distance, result.normal, newDirection);
 	newRay.direction = newDirection;
 
-	Trace(newRay, initialEnergy, scale.CMultiply(energy), random, depth+1, mediumList, caustics);
+	Trace(newRay, initialEnergy, scale.CMultiply(energy), random, depth+1, mediumStack, caustics);
 
 }
\ No newline at end of file
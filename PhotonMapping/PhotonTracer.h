@@ -3,7 +3,6 @@
 #include "../Illumination.h"
 #include "PhotonMap.h"
 #include "../CommonMediums.h"
-#include <list>
 
 // Traces photons from different lights and stores them into photon map.
 class PhotonTracer 
@@ -16,7 +15,7 @@ class PhotonTracer
 	IMedium* vacuum;
 
 	void Trace(const Ray& ray, const Vec3& initialEnergy, Vec3 energy, RandomGenerator* random, 
-		int depth, std::list<IMedium*>& mediumList, bool caustics);
+		int depth, MediumStack& mediumStack, bool caustics);
 
 	
 public:
@@ -25,8 +24,6 @@ public:
 	// Termination on energy criteria; when energy falls under initial_energy * rejectRatio for
 	// all components of light.
 	Scalar rejectRatio;
-	// Numerical position translate to account for full sampling.
-	Scalar hitTranslate;
 
 	PhotonTracer();
 	~PhotonTracer();
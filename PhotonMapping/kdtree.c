@@ -531,6 +531,46 @@ struct kdres *kd_nearest_range3f(struct kdtree *tree, float x, float y, float z,
 	return kd_nearest_range(tree, buf, range);
 }
 
+static int visit_nearest(struct kdnode *node, const double *pos, double range, int dim, void (*callback)(void*, void*), void *user)
+{
+	double dist_sq, dx;
+	int i, count = 0;
+
+	if(!node) return 0;
+
+	/* same traversal order as find_nearest */
+	dist_sq = 0;
+	for(i=0; i<dim; i++) {
+		dist_sq += SQ(node->pos[i] - pos[i]);
+	}
+	if(dist_sq <= SQ(range)) {
+		callback(node->data, user);
+		count = 1;
+	}
+
+	dx = pos[node->dir] - node->pos[node->dir];
+
+	count += visit_nearest(dx <= 0.0 ? node->left : node->right, pos, range, dim, callback, user);
+	if(fabs(dx) < range) {
+		count += visit_nearest(dx <= 0.0 ? node->right : node->left, pos, range, dim, callback, user);
+	}
+	return count;
+}
+
+int kd_nearest_range_visit(struct kdtree *kd, const double *pos, double range, void (*callback)(void*, void*), void *user)
+{
+	return visit_nearest(kd->root, pos, range, kd->dim, callback, user);
+}
+
+int kd_nearest_range3_visit(struct kdtree *tree, double x, double y, double z, double range, void (*callback)(void*, void*), void *user)
+{
+	double buf[3];
+	buf[0] = x;
+	buf[1] = y;
+	buf[2] = z;
+	return kd_nearest_range_visit(tree, buf, range, callback, user);
+}
+
 void kd_res_free(struct kdres *rset)
 {
 	clear_results(rset);
@@ -78,6 +78,16 @@ struct kdres *kd_nearest_rangef(struct kdtree *tree, const float *pos, float ran
 struct kdres *kd_nearest_range3(struct kdtree *tree, double x, double y, double z, double range);
 struct kdres *kd_nearest_range3f(struct kdtree *tree, float x, float y, float z, float range);
 
+/* Visit all nodes within a range of the specified point, without creating a
+ * result set (nothing is allocated).
+ *
+ * The callback is called with the data pointer of each node and the user
+ * pointer. Nodes are visited in reverse order of the result set returned by
+ * kd_nearest_range(). Returns the number of nodes visited.
+ */
+int kd_nearest_range_visit(struct kdtree *tree, const double *pos, double range, void (*callback)(void *data, void *user), void *user);
+int kd_nearest_range3_visit(struct kdtree *tree, double x, double y, double z, double range, void (*callback)(void *data, void *user), void *user);
+
 /* frees a result set returned by kd_nearest_range() */
 void kd_res_free(struct kdres *set);
 
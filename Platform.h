@@ -0,0 +1,39 @@
+#pragma once
+
+// Wall clock time and thread queries shared by renderers, builders and benchmarks, with serial fallbacks
+// when OpenMP is disabled.
+#ifdef _OPENMP
+#include <omp.h>
+#else
+#include <ctime>
+#endif
+
+// Wall clock time in seconds (processor time without OpenMP).
+inline double GetTime()
+{
+#ifdef _OPENMP
+	return omp_get_wtime();
+#else
+	return (double)clock() / CLOCKS_PER_SEC;
+#endif
+}
+
+// Index of calling thread in its parallel region, 0 outside of one.
+inline int GetThreadIndex()
+{
+#ifdef _OPENMP
+	return omp_get_thread_num();
+#else
+	return 0;
+#endif
+}
+
+// Number of threads a parallel region will use.
+inline int GetThreadCount()
+{
+#ifdef _OPENMP
+	return omp_get_max_threads();
+#else
+	return 1;
+#endif
+}
@@ -1,7 +1,9 @@
 #include "Raytracer.h"
+#include "SimdMath.h"
+#include "TileScheduler.h"
+#include "Platform.h"
 #include <exception>
 #include <iostream>
-#include <list>
 #include <algorithm>
 
 // These are useful for debugging; for example you can filter just indirect lightning etc.
@@ -41,41 +43,227 @@ void Raytracer::Render(Camera* camera, IGeometry* geometry, IGeometry* singularL
 	// Stat data set to zero.
 	primaryRaysTraced = 0;
 	raysTraced = 0;
+	PrepareScratch();
 
+	if(progressive)
+		RenderProgressive();
+	else
+		RenderTiles(0);
+
+	this->isRunning = false;
+}
+
+void Raytracer::PrepareScratch()
+{
+	if((int)scratch.size() < GetThreadCount())
+		scratch.resize(GetThreadCount());
+}
+
+std::vector<Photon*>& Raytracer::GatherPhotons(PhotonMap* map, const Vec3& position, Scalar range)
+{
+	std::vector<Photon*>& photons = scratch[GetThreadIndex()].photons;
+	photons.clear();
+	map->FindInRange(position, range, photons);
+	return photons;
+}
+
+void Raytracer::RenderTiles(int pass)
+{
 	int width = camera->image.GetWidth(), height = camera->image.GetHeight();
-	// Cast ray(s) for each pixel (in parallel)
-	#pragma omp parallel for
-	for(int x = 0; x < width; x++)
+	int packetWidth = std::max(1, std::min(packetSize, 8));
+	int tileWidth = std::max(1, tileSize / packetWidth) * packetWidth;
+	TileScheduler scheduler;
+	scheduler.Prepare(width, height, tileWidth, GetThreadCount());
+
+	// Cast ray(s) for each pixel, threads take tiles from scheduler and walk them by rows of packets.
+	// Rays are counted once per tile in a critical section so the progress read is not torn; only the
+	// first thread prints progress (progressive passes print their own).
+	int samples = progressive ? 1 : raysPerPixel;
+	long long totalRays = (long long)width * height * samples;
+	int lastProgress = progressive ? 100 : -1;
+	#pragma omp parallel
 	{
-		for(int y = 0; y < height; y++)
+		int thread = GetThreadIndex();
+		ImageTile tile;
+		while(scheduler.NextTile(thread, tile))
 		{
-			// FIXME: better to create generator using time, here we use "deterministic"
-			// generator based on pixel id. Each random generator is in it's own thread, so no thread-safety required.
-			RandomGenerator random(x*height + y);
-			for(int n = 0; n < raysPerPixel; n++)
+			int tileRays = 0;
+			for(int y0 = tile.y0; y0 < tile.y1; y0 += packetWidth)
+				for(int x0 = tile.x0; x0 < tile.x1; x0 += packetWidth)
+					tileRays += RenderPacket(x0, y0, std::min(x0 + packetWidth, tile.x1), std::min(y0 + packetWidth, tile.y1), pass);
+			int progress;
+			#pragma omp critical(RaytracerProgress)
+			{
+				primaryRaysTraced += tileRays;
+				progress = (int)(primaryRaysTraced * 100LL / totalRays);
+			}
+			if(thread == 0 && !progressive && progress != lastProgress)
 			{
-				Ray ray(camera->position, camera->GetPixelDirection(x, y, raysPerPixel==1?0:&random));
-				ray.medium = camera->startingMedium == 0 ? this->vacuum : camera->startingMedium;
-				Colour& pixelData = camera->image.GetData()[x + width * y];
+				std::cout << progress << "% processed" << std::endl;
+				lastProgress = progress;
+			}
+		}
+	}
+	if(lastProgress != 100)
+		std::cout << "100% processed" << std::endl;
+}
 
-				std::list<IMedium*> mediumList;
-				pixelData = pixelData + (Trace(ray, &random, 0, 0, mediumList) / (Scalar)raysPerPixel);
+void Raytracer::RenderProgressive()
+{
+	int width = camera->image.GetWidth(), height = camera->image.GetHeight(), pixelCount = width * height;
+	std::vector<char> below(pixelCount);
+	PixelEstimate empty;
+	empty.mean = empty.deviation2 = Vec3f(0,0,0);
+	empty.count = 0;
+	empty.converged = false;
+	estimates.assign(pixelCount, empty);
+	double startTime = GetTime();
+	for(int passes = 1; ; passes++)
+	{
+		double passStart = GetTime();
+		RenderTiles(passes - 1);
+
+		// Publish averages and find pixels whose standard error of mean is below threshold.
+		Colour* data = camera->image.GetData();
+		bool adaptive = adaptiveThreshold > 0 && passes >= adaptiveMinPasses;
+		#pragma omp parallel for
+		for(int i = 0; i < pixelCount; i++)
+		{
+			PixelEstimate& e = estimates[i];
+			data[i] = Vec3(e.mean);
+			below[i] = e.converged;
+			if(adaptive && !e.converged && e.count > 1)
+			{
+				// Noise of each component is compared to the brightest one (colour noise of bounced light
+				// is visible on surfaces of other colour).
+				Vec3 error = Vec3(e.deviation2) / ((e.count - 1) * (Scalar)e.count);
+				Scalar brightness = std::max(std::max((Scalar)e.mean.x, (Scalar)e.mean.y), (Scalar)e.mean.z);
+				Scalar tolerance = adaptiveThreshold * std::max(brightness, Raytracer_MinAdaptiveBrightness);
+				below[i] = std::max(std::max(error.x, error.y), error.z) <= tolerance * tolerance;
+			}
+		}
 
-				this->primaryRaysTraced++;
+		// Pixel converges only with its whole 3x3 neighbourhood. Variance of pixel which has not yet seen a rare
+		// bright sample (light seen through glass, a lit spot found by gather) is underestimated, but its
+		// neighbours usually have seen one.
+		int active = 0;
+		#pragma omp parallel for reduction(+:active)
+		for(int y = 0; y < height; y++)
+		{
+			for(int x = 0; x < width; x++)
+			{
+				PixelEstimate& e = estimates[x + width * y];
+				if(adaptive && !e.converged)
+				{
+					e.converged = true;
+					for(int ny = std::max(y - 1, 0); ny <= std::min(y + 1, height - 1); ny++)
+						for(int nx = std::max(x - 1, 0); nx <= std::min(x + 1, width - 1); nx++)
+							e.converged = e.converged && below[nx + width * ny];
+				}
+				if(!e.converged)
+					active++;
 			}
-			
 		}
 
-		#pragma omp critical
-		std::cout << (primaryRaysTraced*100)/(width*height*raysPerPixel) << "% processed" << std::endl;
+		double now = GetTime();
+		std::cout << "Pass " << passes << " done in " << (now - passStart) << " s, " << active << " pixels active" << std::endl;
+		if(passCallback)
+			passCallback(camera->image, passes, passCallbackData);
+
+		// Stop if the next pass (taking as long as this one) would not fit into budget.
+		if(active == 0 || passes >= maxPasses || (timeBudget > 0 && (now - startTime) + (now - passStart) > timeBudget))
+			break;
 	}
+	std::vector<PixelEstimate>().swap(estimates);
+}
 
+int Raytracer::RenderPacket(int x0, int y0, int x1, int y1, int pass)
+{
+	int width = camera->image.GetWidth(), height = camera->image.GetHeight();
+	IMedium* startingMedium = camera->startingMedium == 0 ? this->vacuum : camera->startingMedium;
+	// Progressive passes trace one sample per pixel, always jittered over pixel.
+	int samples = progressive ? 1 : raysPerPixel;
+	bool jitter = progressive || raysPerPixel > 1;
+
+	// FIXME: better to create generator using time, here we use "deterministic"
+	// generator based on pixel id (and pass). Each random generator is in it's own thread, so no thread-safety required.
+	BigUInt seedOffset = (BigUInt)pass * width * height;
+	std::vector<RandomGenerator>& randoms = scratch[GetThreadIndex()].randoms;
+	randoms.clear();
+	for(int x = x0; x < x1; x++)
+		for(int y = y0; y < y1; y++)
+			randoms.push_back(RandomGenerator(x*height + y + seedOffset));
+
+	RayPacket packet;
+	IntersectResult results[RayPacket::MaxSize];
+	// Pixel of each packet ray, as index to randoms.
+	int pixels[RayPacket::MaxSize];
+	int traced = 0;
+	for(int n = 0; n < samples; n++)
+	{
+		// Each pixel's generator is used for its direction and then for its shading, the same
+		// sequence as if pixel was traced alone. Converged pixels of progressive mode are skipped.
+		packet.size = 0;
+		int p = 0;
+		for(int x = x0; x < x1; x++)
+		{
+			for(int y = y0; y < y1; y++, p++)
+			{
+				if(progressive && estimates[x + width * y].converged)
+					continue;
+				Ray& ray = packet.rays[packet.size];
+				ray = Ray(camera->position, camera->GetPixelDirection(x, y, jitter ? &randoms[p] : 0));
+				ray.medium = startingMedium;
+				results[packet.size] = IntersectResult();
+				pixels[packet.size] = p;
+				packet.size++;
+			}
+		}
+		if(packet.size == 0)
+			break;
+		traced += packet.size;
 
-	this->isRunning = false;
-}
+		// First hits of whole packet, including "singular light geometry". Single rays use the (faster) single ray path.
+		if(packet.size == 1)
+		{
+			geometry->Intersect(packet.rays[0], results[0]);
+			if(this->singularLightGeometry)
+				singularLightGeometry->Intersect(packet.rays[0], results[0]);
+		} else {
+			packet.Prepare();
+			geometry->IntersectPacket(packet, results);
+			if(this->singularLightGeometry)
+				singularLightGeometry->IntersectPacket(packet, results);
+		}
 
+		for(int i = 0; i < packet.size; i++)
+		{
+			int x = x0 + pixels[i] / (y1 - y0), y = y0 + pixels[i] % (y1 - y0);
+			Colour& pixelData = camera->image.GetData()[x + width * y];
 
-Colour Raytracer::Trace(const Ray& ray, RandomGenerator* random, int depth, int depth2, std::list<IMedium*>& mediumList)
+			MediumStack mediumStack;
+			if(this->maxIterations > 0)
+			{
+				Colour radiance = Shade(packet.rays[i], results[i], &randoms[pixels[i]], 0, 0, mediumStack);
+				if(progressive)
+				{
+					// Welford's update of mean and squared deviations.
+					PixelEstimate& e = estimates[x + width * y];
+					Vec3f sample(radiance);
+					e.count++;
+					Vec3f delta = sample - e.mean;
+					e.mean += delta / (float)e.count;
+					e.deviation2 += delta.CMultiply(sample - e.mean);
+				}
+				else
+					pixelData = pixelData + (radiance / (Scalar)raysPerPixel);
+			}
+		}
+	}
+	return traced;
+}
+
+Colour Raytracer::Trace(const Ray& ray, RandomGenerator* random, int depth, int depth2, MediumStack& mediumStack)
 {
 	if(depth >= this->maxIterations)
 		return Vec3(0,0,0);
@@ -88,6 +276,12 @@ Colour Raytracer::Trace(const Ray& ray, RandomGenerator* random, int depth, int
 	if(depth2 == 0 && this->singularLightGeometry)
 		singularLightGeometry->Intersect(ray, result);
 
+	return Shade(ray, result, random, depth, depth2, mediumStack);
+}
+
+Colour Raytracer::Shade(const Ray& ray, const IntersectResult& result, RandomGenerator* random, int depth, int depth2, 
+	MediumStack& mediumStack)
+{
 	if(result.distance >= std::numeric_limits<Scalar>::max())
 		return Vec3(0,0,0); //< Return "sky" radiance
 
@@ -104,7 +298,7 @@ Colour Raytracer::Trace(const Ray& ray, RandomGenerator* random, int depth, int
 	{
 		Ray newRay(scatteringPos, scatteringDir);
 		newRay.medium = ray.medium;
-		return scateringWeight.CMultiply(Trace(newRay, random, depth+1, depth2, mediumList));
+		return scateringWeight.CMultiply(Trace(newRay, random, depth+1, depth2, mediumStack));
 	}
 
 
@@ -114,25 +308,25 @@ Colour Raytracer::Trace(const Ray& ray, RandomGenerator* random, int depth, int
 	if(isInsideMedium)
 	{
 		// FIXME: sometimes due to numerical errors, we ignore those hits (alternative - set to vacuum).
-		if(mediumList.size() == 0)
+		if(mediumStack.IsEmpty())
 			return Vec3(0,0,0);
-		outsideMedium = mediumList.back();
+		outsideMedium = mediumStack.Top();
 		insideMedium = ray.medium;
 	} else {
 		outsideMedium = ray.medium;
 		insideMedium = result.material->insideMedium;
 	}
 
-	// Compute radiance of point.
-	Vec3 L(0,0,0);
+	// Compute radiance of point; sums are kept in SIMD registers.
+	Vec4d L(0,0,0);
 
 	// 1) self radiance
 	if(SELF_LIGHTNING_BIT(depth, depth2) && result.material->surfaceLight != 0)
-		L = SELF_LIGHTNING_MASK(depth, depth2, result.material->surfaceLight->Radiance(position, cameraDirection, result.normal));
+		L = Vec4d(SELF_LIGHTNING_MASK(depth, depth2, result.material->surfaceLight->Radiance(position, cameraDirection, result.normal)));
 	
 	// Early exit for non-reflective materials. This is useful for singular lights.
 	if(result.material->bsdf == 0)
-		return scateringWeight.CMultiply(L);
+		return scateringWeight.CMultiply(L.ToVec3());
 	SamplingType samplingType = result.material->bsdf->GetSamplingType(cameraDirection, result.normal);
 	
 
@@ -145,26 +339,26 @@ Colour Raytracer::Trace(const Ray& ray, RandomGenerator* random, int depth, int
 			Vec3 towardsLightDirection;
 
 			// We can use radiance at position for point lights (no translate).
-			Vec3 Li = light->Radiance(position, towardsLightDirection, geometry);
+			Vec3 Li = light->Radiance(position, result.normal, result.distance, towardsLightDirection, geometry);
 
 			// Early exit for shadowed lights (no BRDF execution) && when backfacing lights.
 			if(Li.x == 0 && Li.y == 0 && Li.z == 0)
 				continue;
 			 
 			// Weights with cosine.
-			Vec3 t = (result.normal * towardsLightDirection)*Li.CMultiply(result.material->bsdf->BSDF(position, result.normal,
-				 cameraDirection, towardsLightDirection, result.materialData, insideMedium, outsideMedium));
+			Vec4d t = (result.normal * towardsLightDirection)*Vec4d(Li).CMultiply(Vec4d(result.material->bsdf->BSDF(position, result.normal,
+				 cameraDirection, towardsLightDirection, result.materialData, insideMedium, outsideMedium)));
 			L += DIRECT_LIGHTNING_MASK(depth, depth2, t);
 		}
 	}
 	// 3) caustics map lightning
 	if(PHOTONMAP_CAUSTICS_BIT(depth, depth2) && this->causticsMap)
 	{
-		std::vector<Photon*> photons;
-		causticsMap->FindInRange(position, this->causticsPhotonMapGatherRadius, photons);
+		// Photons are used before any recursion, so the thread's buffer is free.
+		std::vector<Photon*>& photons = GatherPhotons(causticsMap, position, this->causticsPhotonMapGatherRadius);
 
 		// We estimate radiance at the point.
-		Vec3 Flux(0,0,0);
+		Vec4d Flux(0,0,0);
 		for(std::vector<Photon*>::iterator i = photons.begin(); i != photons.end(); i++)
 		{
 			Photon* p = *i;
@@ -173,11 +367,11 @@ Colour Raytracer::Trace(const Ray& ray, RandomGenerator* random, int depth, int
 			if(p->outDirection * result.normal < 0)
 				continue;
 
-			Flux += p->power.CMultiply((result.normal * p->outDirection) * result.material->bsdf->BSDF(position, result.normal, p->outDirection, cameraDirection, result.materialData,
-				insideMedium, outsideMedium));
+			Flux += Vec4d(p->power).CMultiply((result.normal * p->outDirection) * Vec4d(result.material->bsdf->BSDF(position, result.normal, p->outDirection, cameraDirection, result.materialData,
+				insideMedium, outsideMedium)));
 		}
 
-		Vec3 t = Flux / (PI*this->causticsPhotonMapGatherRadius*this->causticsPhotonMapGatherRadius);
+		Vec4d t = Flux / (PI*this->causticsPhotonMapGatherRadius*this->causticsPhotonMapGatherRadius);
 
 		L += PHOTONMAP_CAUSTICS_MASK(depth, depth2, t);
 	}
@@ -192,11 +386,10 @@ Colour Raytracer::Trace(const Ray& ray, RandomGenerator* random, int depth, int
 	// normal raytracing
 	if(PHOTONMAP_GLOBAL_BIT(depth, depth2) && !isPerfectReflection && this->globalMap)
 	{
-		std::vector<Photon*> photons;
-		globalMap->FindInRange(position, this->globalPhotonMapGatherRadius, photons);
+		std::vector<Photon*>& photons = GatherPhotons(globalMap, position, this->globalPhotonMapGatherRadius);
 
 		// We estimate radiance at the point.
-		Vec3 Flux(0,0,0);
+		Vec4d Flux(0,0,0);
 		for(std::vector<Photon*>::iterator i = photons.begin(); i != photons.end(); i++)
 		{
 			Photon* p = *i;
@@ -205,22 +398,22 @@ Colour Raytracer::Trace(const Ray& ray, RandomGenerator* random, int depth, int
 			if(p->outDirection * result.normal < 0)
 				continue;
 
-			Flux += p->power.CMultiply((result.normal * p->outDirection) * result.material->bsdf->BSDF(position, result.normal, p->outDirection, cameraDirection, result.materialData,
-				insideMedium, outsideMedium));
+			Flux += Vec4d(p->power).CMultiply((result.normal * p->outDirection) * Vec4d(result.material->bsdf->BSDF(position, result.normal, p->outDirection, cameraDirection, result.materialData,
+				insideMedium, outsideMedium)));
 		}
 
-		Vec3 t = Flux / (PI*this->globalPhotonMapGatherRadius*this->globalPhotonMapGatherRadius);
+		Vec4d t = Flux / (PI*this->globalPhotonMapGatherRadius*this->globalPhotonMapGatherRadius);
 
 		L += PHOTONMAP_GLOBAL_MASK(depth, depth2, t);
 
 		// We skip through
-		return scateringWeight.CMultiply(L);
+		return scateringWeight.CMultiply(L.ToVec3());
 	}
 
 
 	// 4b) integrated radiance over hemisphere
 	if((samplingType & MultipleSample) == 0 || INDIRECT_LIGHTNING_BIT(depth, depth2) == false)
-		return scateringWeight.CMultiply(L);
+		return scateringWeight.CMultiply(L.ToVec3());
 
 	
 	if(depth2 < this->maxGatherIterations || isPerfectReflection)
@@ -235,16 +428,14 @@ Colour Raytracer::Trace(const Ray& ray, RandomGenerator* random, int depth, int
 			// Trace new ray.
 			Ray newRay(position, newDirection);
 			bool needsPop = false, needsPush = false;
-			Scalar translateInwards = -1;
 			if(isInsideMedium)
 			{
 				// In-Out combination
 				if(newDirection * result.normal > 0)
 				{
-					newRay.medium = mediumList.back();
-					mediumList.pop_back();
+					newRay.medium = mediumStack.Top();
+					mediumStack.Pop();
 					needsPush = true;
-					translateInwards = 1;
 				}
 				// In-In combination
 				else
@@ -257,22 +448,21 @@ Colour Raytracer::Trace(const Ray& ray, RandomGenerator* random, int depth, int
 				else
 				{
 					newRay.medium = result.material->insideMedium;
-					mediumList.push_back(ray.medium);
+					mediumStack.Push(ray.medium);
 					needsPop = true;
-					translateInwards = 1;
 				}
 			}
 
-			// Translation of ray position so the whole solid angle can be sampled (also in corners)
-			newRay.origin = newRay.origin + (translateInwards * this->hitTranslate) * ray.direction;
+			// Origin is moved off the surface to the side of new direction, so the ray does not hit it again.
+			newRay.origin = OffsetRayOrigin(position, result.distance, result.normal, newDirection);
 
-			ColourScalar newL = Trace(newRay, random, depth+1, depth2 + (isPerfectReflection ? 0 : 1), mediumList);
+			ColourScalar newL = Trace(newRay, random, depth+1, depth2 + (isPerfectReflection ? 0 : 1), mediumStack);
 
-			// Undo medium list to prev state
+			// Undo medium stack to prev state
 			if(needsPush)
-				mediumList.push_back(newRay.medium);
+				mediumStack.Push(newRay.medium);
 			if(needsPop)
-				mediumList.pop_back();
+				mediumStack.Pop();
 
 			// NaN check (FIXME: must get rid of it and find the source).
 			if(newL.x != newL.x || newL.y != newL.y || newL.z != newL.z)
@@ -281,11 +471,11 @@ Colour Raytracer::Trace(const Ray& ray, RandomGenerator* random, int depth, int
 			}
 
 			// Add already weighted result to intensity.
-			Vec3 t = S.CMultiply(newL);
+			Vec4d t = Vec4d(S).CMultiply(Vec4d(newL));
 			L += INDIRECT_LIGHTNING_MASK(depth,depth2,t);
 		}
 	}
 
-	return scateringWeight.CMultiply(L);
+	return scateringWeight.CMultiply(L.ToVec3());
 
 }
\ No newline at end of file
@@ -2,19 +2,44 @@
 #include "Illumination.h"
 #include "CommonMediums.h"
 #include "PhotonMapping\PhotonMap.h"
-#include <list>
+#include <vector>
 
 
+// Pixel brightness below which adaptive sampling error is measured in absolute terms, so dark pixels converge.
+const Scalar Raytracer_MinAdaptiveBrightness = (Scalar)0.01;
+
+// Running statistics of pixel samples in progressive mode: mean colour and sum of squared deviations from
+// it for each component, updated by Welford's algorithm. Single precision halves memory of large images.
+struct PixelEstimate
+{
+	Vec3f mean, deviation2;
+	int count;
+	bool converged;
+};
+
+// Buffers of a render thread, reused by all its packets and gathers so tracing does not allocate once they
+// have grown.
+struct RaytracerScratch
+{
+	std::vector<RandomGenerator> randoms;	//< Generators of packet pixels.
+	std::vector<Photon*> photons;			//< Result of photon map gather.
+	char padding[64];						//< Keeps buffers of threads on separate cache lines.
+};
 
 // A raytracing renderer. 
-class Raytracer : IRenderer
+class Raytracer : public IRenderer
 {
+protected:
 	Camera* camera;
 	IGeometry* geometry;
 	IGeometry* singularLightGeometry;
 	std::vector<ISingularLight*> lights;
 	PhotonMap* globalMap;
 	PhotonMap* causticsMap;
+	// Sample statistics of pixels in progressive mode.
+	std::vector<PixelEstimate> estimates;
+	// Buffers of each thread, kept between renders.
+	std::vector<RaytracerScratch> scratch;
 
 	// Dummy medium.
 	IMedium* vacuum;
@@ -39,14 +64,30 @@ public:
 	// The diminished number of secondary rays when, exp(-secondaryRayDecay*secondaryIterationDepth)*secondaryRays
 	// are spawned on second/third/... iteration.
 	Scalar secondaryRayDecay;
-	// When surface is hit, this parameter controls the translatement along the ray (inwards or outwards,
-	// depending on the kind of ray - in the surface or reflected) to get away with numerical errors with intersections.
-	// Remarks: must be greater than IL_MinimumNextIntersectionDistance, a multiple of 3 usually suffices.
-	Scalar hitTranslate;
 	// Radiuses for gather operation in second pass from photon map, if maps are present. For caustics map, this
 	// represents the scale of features visible.
 	Scalar globalPhotonMapGatherRadius;
 	Scalar causticsPhotonMapGatherRadius;
+	// Primary rays are traced in square packets of packetSize x packetSize pixels (at most 8), so the geometry
+	// can cull coherent rays together. Value 1 traces each camera ray alone.
+	int packetSize;
+	// Threads render square tiles of about tileSize x tileSize pixels (rounded to whole packets), handed out by
+	// TileScheduler.
+	int tileSize;
+	// Progressive mode: Render traces one jittered sample per pixel in each pass and keeps average of passes
+	// in camera image, until maxPasses passes are done or the next pass would exceed timeBudget seconds
+	// (0 is no limit; at least one pass is always done). raysPerPixel is not used.
+	bool progressive;
+	int maxPasses;
+	double timeBudget;
+	// Called after each progressive pass with camera image holding the average of passes done so far.
+	void (*passCallback)(Image& image, int passes, void* userData);
+	void* passCallbackData;
+	// Adaptive sampling of progressive mode: from pass adaptiveMinPasses on, pixels whose standard error of
+	// mean (of each colour component) is below adaptiveThreshold times their brightest component are converged
+	// and get no more samples; rendering stops early when all pixels converged. 0 samples all pixels in each pass.
+	Scalar adaptiveThreshold;
+	int adaptiveMinPasses;
 
 
 	Raytracer()
@@ -55,20 +96,47 @@ public:
 		  maxGatherIterations(1),
 		  secondaryRays(1000),
 		  raysPerPixel(1),
-		  hitTranslate(3*IL_MinimumNextIntersectionDistance),
 		  secondaryRayDecay(3),
 		  gatherIterationThreeshold(3),
 		  globalPhotonMapGatherRadius((Scalar)0.4),
-		  causticsPhotonMapGatherRadius((Scalar)0.1)
+		  causticsPhotonMapGatherRadius((Scalar)0.1),
+		  packetSize(4),
+		  tileSize(16),
+		  progressive(false),
+		  maxPasses(16),
+		  timeBudget(0),
+		  passCallback(0),
+		  passCallbackData(0),
+		  adaptiveThreshold(0),
+		  adaptiveMinPasses(8)
 	{
 		this->vacuum = new NonInteractMedium(1);
 	}
 
 	virtual void Render(Camera* camera, IGeometry* geometry, IGeometry* singularLightGeom, 
 		std::vector<ISingularLight*> lights, PhotonMap* globalMap, PhotonMap* causticsMap);
+
+	// Number of camera rays traced by the last Render.
+	int GetPrimaryRaysTraced() const { return primaryRaysTraced; }
 protected:
 	// The trace function, with depth of recursion and secondary ray depth of recursion.
-	Colour Trace(const Ray& ray, RandomGenerator* generator, int depth, int depth2, std::list<IMedium*>& mediumList);
+	Colour Trace(const Ray& ray, RandomGenerator* generator, int depth, int depth2, MediumStack& mediumStack);
+	// Computes radiance along ray from its already found closest intersection (camera rays are shaded by it,
+	// so derived renderers can replace the estimator and keep tile scheduling and progressive passes).
+	virtual Colour Shade(const Ray& ray, const IntersectResult& result, RandomGenerator* generator, int depth, int depth2, 
+		MediumStack& mediumStack);
+
+	// Renders all tiles of image in parallel, pass selects random sequences of progressive pass.
+	void RenderTiles(int pass);
+	// Renders pixels [x0,x1)x[y0,y1) with packets of primary rays, returns number of primary rays.
+	int RenderPacket(int x0, int y0, int x1, int y1, int pass);
+	// Runs progressive passes (see progressive).
+	void RenderProgressive();
+
+	// Creates scratch buffers for threads of Render (buffers which exist are kept).
+	void PrepareScratch();
+	// Finds photons of map in range into scratch buffer of calling thread.
+	std::vector<Photon*>& GatherPhotons(PhotonMap* map, const Vec3& position, Scalar range);
 
 	// Checks if points are shadowed.
 	bool IsShadowed(const Vec3& p1, const Vec3& p2);
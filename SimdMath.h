@@ -0,0 +1,160 @@
+#pragma once
+
+/// ----------------------------------------------------------------------------
+/// SIMD vectors
+/// ----------------------------------------------------------------------------
+// 4 wide vectors with the operator set of Vec3, used for accumulations in hot loops (colours, radiance
+// sums). Only x, y and z take part in dot products and lengths; w is carried along and should be 0.
+// They use SSE2, which 32 bit builds already require (MSVC compiles x86 code with /arch:SSE2 by default),
+// and are inline, so unlike AVX2 kernels they can be used anywhere without CPU detection. Arithmetic is
+// done in the same order as by Vec3, so Vec4d gives bit identical results. Defining NO_SIMD_MATH replaces
+// them with scalar Vec3 based types, to measure what SSE2 gains (see Benchmark_SimdShading).
+#include "LinearAlgebra.h"
+
+#ifdef NO_SIMD_MATH
+
+// Scalar fallback with the interface of the SIMD types: operators of Vec3T, with results converted back.
+template<class T>
+struct Vec4Scalar : public Vec3T<T>
+{
+	typedef Vec3T<T> Base;
+
+	Vec4Scalar() {}
+	Vec4Scalar(T x, T y, T z, T w = 0) : Base(x, y, z) {}
+	Vec4Scalar(const Base& v) : Base(v) {}
+	template<class U>
+	explicit Vec4Scalar(const Vec3T<U>& v) : Base(v) {}
+	static Vec4Scalar Splat(T f) { return Vec4Scalar(f, f, f); }
+
+	Vec3 ToVec3() const { return Vec3(this->x, this->y, this->z); }
+	T X() const { return this->x; }
+	T Y() const { return this->y; }
+	T Z() const { return this->z; }
+
+	Vec4Scalar CMultiply(const Vec4Scalar& other) const { return Base::CMultiply(other); }
+	Vec4Scalar CDivision(const Vec4Scalar& other) const { return Base::CDivision(other); }
+	Vec4Scalar Normal() const { Base v = *this; return v.Normal(); }
+
+	friend Vec4Scalar operator+(const Vec4Scalar& v1, const Vec4Scalar& v2) { return (const Base&)v1 + v2; }
+	friend Vec4Scalar operator-(const Vec4Scalar& v1, const Vec4Scalar& v2) { return (const Base&)v1 - v2; }
+	friend Vec4Scalar operator^(const Vec4Scalar& v1, const Vec4Scalar& v2) { return (const Base&)v1 ^ v2; }
+	friend T operator*(const Vec4Scalar& v1, const Vec4Scalar& v2) { return (const Base&)v1 * (const Base&)v2; }
+	friend Vec4Scalar operator*(const Vec4Scalar& v, const T f) { return (const Base&)v * f; }
+	friend Vec4Scalar operator*(const T f, const Vec4Scalar& v) { return f * (const Base&)v; }
+	friend Vec4Scalar operator/(const Vec4Scalar& v, const T f) { return (const Base&)v / f; }
+	friend Vec4Scalar operator-(const Vec4Scalar& v) { return -(const Base&)v; }
+};
+
+typedef Vec4Scalar<Scalar> Vec4d;
+typedef Vec4Scalar<float> Vec4f;
+
+#else
+
+#include <emmintrin.h>
+
+// Double precision vector, kept in two SSE2 registers.
+struct Vec4d
+{
+	__m128d xy, zw;
+
+	Vec4d() {}
+	Vec4d(__m128d xy, __m128d zw) { this->xy = xy; this->zw = zw; }
+	Vec4d(Scalar x, Scalar y, Scalar z, Scalar w = 0) { xy = _mm_set_pd(y, x); zw = _mm_set_pd(w, z); }
+	explicit Vec4d(const Vec3& v) { xy = _mm_loadu_pd(v.data); zw = _mm_load_sd(v.data + 2); }
+	static Vec4d Splat(Scalar f) { __m128d s = _mm_set1_pd(f); return Vec4d(s, s); }
+
+	Vec3 ToVec3() const { Vec3 v; _mm_storeu_pd(v.data, xy); _mm_store_sd(v.data + 2, zw); return v; }
+	Scalar X() const { return _mm_cvtsd_f64(xy); }
+	Scalar Y() const { return _mm_cvtsd_f64(_mm_unpackhi_pd(xy, xy)); }
+	Scalar Z() const { return _mm_cvtsd_f64(zw); }
+
+	// Component multiply/divide.
+	Vec4d CMultiply(const Vec4d& other) const { return Vec4d(_mm_mul_pd(xy, other.xy), _mm_mul_pd(zw, other.zw)); }
+	Vec4d CDivision(const Vec4d& other) const { return Vec4d(_mm_div_pd(xy, other.xy), _mm_div_pd(zw, other.zw)); }
+	Scalar Length2() const { return *this * *this; }
+	Scalar Length() const { return std::sqrt(Length2()); }
+	Vec4d Normal() const { return *this / Length(); }
+	void Normalize() { *this = Normal(); }
+
+	// Standard vector operators, * dot product (of x, y, z), ^ cross product.
+	friend Vec4d operator+(const Vec4d& v1, const Vec4d& v2) { return Vec4d(_mm_add_pd(v1.xy, v2.xy), _mm_add_pd(v1.zw, v2.zw)); }
+	friend Vec4d operator-(const Vec4d& v1, const Vec4d& v2) { return Vec4d(_mm_sub_pd(v1.xy, v2.xy), _mm_sub_pd(v1.zw, v2.zw)); }
+	friend Vec4d& operator+=(Vec4d& v1, const Vec4d& v2) { v1 = v1 + v2; return v1; }
+	friend Vec4d& operator-=(Vec4d& v1, const Vec4d& v2) { v1 = v1 - v2; return v1; }
+	friend Vec4d operator^(const Vec4d& v1, const Vec4d& v2)
+	{
+		// (y, z) and (z, x) pairs of both vectors.
+		__m128d yz1 = _mm_shuffle_pd(v1.xy, v1.zw, 1), yz2 = _mm_shuffle_pd(v2.xy, v2.zw, 1);
+		__m128d zx1 = _mm_unpacklo_pd(v1.zw, v1.xy), zx2 = _mm_unpacklo_pd(v2.zw, v2.xy);
+		__m128d xy = _mm_sub_pd(_mm_mul_pd(yz1, zx2), _mm_mul_pd(yz2, zx1));
+		__m128d z = _mm_sub_pd(_mm_mul_pd(v1.xy, _mm_unpackhi_pd(v2.xy, v2.xy)), _mm_mul_pd(v2.xy, _mm_unpackhi_pd(v1.xy, v1.xy)));
+		return Vec4d(xy, _mm_move_sd(_mm_setzero_pd(), z));
+	}
+	friend Scalar operator*(const Vec4d& v1, const Vec4d& v2)
+	{
+		__m128d xy = _mm_mul_pd(v1.xy, v2.xy);
+		__m128d sum = _mm_add_sd(_mm_add_sd(xy, _mm_unpackhi_pd(xy, xy)), _mm_mul_sd(v1.zw, v2.zw));
+		return _mm_cvtsd_f64(sum);
+	}
+	friend Vec4d operator*(const Vec4d& v, const Scalar f) { __m128d s = _mm_set1_pd(f); return Vec4d(_mm_mul_pd(v.xy, s), _mm_mul_pd(v.zw, s)); }
+	friend Vec4d operator*(const Scalar f, const Vec4d& v) { return v * f; }
+	friend Vec4d operator/(const Vec4d& v, const Scalar f) { __m128d s = _mm_set1_pd(f); return Vec4d(_mm_div_pd(v.xy, s), _mm_div_pd(v.zw, s)); }
+	friend Vec4d operator-(const Vec4d& v) { return Vec4d(_mm_sub_pd(_mm_setzero_pd(), v.xy), _mm_sub_pd(_mm_setzero_pd(), v.zw)); }
+};
+
+// Single precision vector in one SSE register, for bulk data where float accuracy suffices.
+struct Vec4f
+{
+	__m128 xyzw;
+
+	Vec4f() {}
+	Vec4f(__m128 xyzw) { this->xyzw = xyzw; }
+	Vec4f(float x, float y, float z, float w = 0) { xyzw = _mm_set_ps(w, z, y, x); }
+	explicit Vec4f(const Vec3f& v) { xyzw = _mm_set_ps(0, v.z, v.y, v.x); }
+	explicit Vec4f(const Vec3& v) { xyzw = _mm_movelh_ps(_mm_cvtpd_ps(_mm_loadu_pd(v.data)), _mm_cvtpd_ps(_mm_load_sd(v.data + 2))); }
+	static Vec4f Splat(float f) { return Vec4f(_mm_set1_ps(f)); }
+
+	Vec3 ToVec3() const
+	{
+		Vec3 v;
+		_mm_storeu_pd(v.data, _mm_cvtps_pd(xyzw));
+		_mm_store_sd(v.data + 2, _mm_cvtps_pd(_mm_movehl_ps(xyzw, xyzw)));
+		return v;
+	}
+	float X() const { return _mm_cvtss_f32(xyzw); }
+	float Y() const { return _mm_cvtss_f32(_mm_shuffle_ps(xyzw, xyzw, _MM_SHUFFLE(1, 1, 1, 1))); }
+	float Z() const { return _mm_cvtss_f32(_mm_movehl_ps(xyzw, xyzw)); }
+
+	// Component multiply/divide.
+	Vec4f CMultiply(const Vec4f& other) const { return Vec4f(_mm_mul_ps(xyzw, other.xyzw)); }
+	Vec4f CDivision(const Vec4f& other) const { return Vec4f(_mm_div_ps(xyzw, other.xyzw)); }
+	float Length2() const { return *this * *this; }
+	float Length() const { return std::sqrt(Length2()); }
+	Vec4f Normal() const { return *this / Length(); }
+	void Normalize() { *this = Normal(); }
+
+	// Standard vector operators, * dot product (of x, y, z), ^ cross product.
+	friend Vec4f operator+(const Vec4f& v1, const Vec4f& v2) { return Vec4f(_mm_add_ps(v1.xyzw, v2.xyzw)); }
+	friend Vec4f operator-(const Vec4f& v1, const Vec4f& v2) { return Vec4f(_mm_sub_ps(v1.xyzw, v2.xyzw)); }
+	friend Vec4f& operator+=(Vec4f& v1, const Vec4f& v2) { v1.xyzw = _mm_add_ps(v1.xyzw, v2.xyzw); return v1; }
+	friend Vec4f& operator-=(Vec4f& v1, const Vec4f& v2) { v1.xyzw = _mm_sub_ps(v1.xyzw, v2.xyzw); return v1; }
+	friend Vec4f operator^(const Vec4f& v1, const Vec4f& v2)
+	{
+		__m128 yzx1 = _mm_shuffle_ps(v1.xyzw, v1.xyzw, _MM_SHUFFLE(3, 0, 2, 1));
+		__m128 yzx2 = _mm_shuffle_ps(v2.xyzw, v2.xyzw, _MM_SHUFFLE(3, 0, 2, 1));
+		__m128 c = _mm_sub_ps(_mm_mul_ps(v1.xyzw, yzx2), _mm_mul_ps(yzx1, v2.xyzw));
+		return Vec4f(_mm_shuffle_ps(c, c, _MM_SHUFFLE(3, 0, 2, 1)));
+	}
+	friend float operator*(const Vec4f& v1, const Vec4f& v2)
+	{
+		__m128 p = _mm_mul_ps(v1.xyzw, v2.xyzw);
+		__m128 sum = _mm_add_ss(_mm_add_ss(p, _mm_shuffle_ps(p, p, _MM_SHUFFLE(1, 1, 1, 1))), _mm_movehl_ps(p, p));
+		return _mm_cvtss_f32(sum);
+	}
+	friend Vec4f operator*(const Vec4f& v, const float f) { return Vec4f(_mm_mul_ps(v.xyzw, _mm_set1_ps(f))); }
+	friend Vec4f operator*(const float f, const Vec4f& v) { return v * f; }
+	friend Vec4f operator/(const Vec4f& v, const float f) { return Vec4f(_mm_div_ps(v.xyzw, _mm_set1_ps(f))); }
+	friend Vec4f operator-(const Vec4f& v) { return Vec4f(_mm_sub_ps(_mm_setzero_ps(), v.xyzw)); }
+};
+
+#endif
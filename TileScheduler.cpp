@@ -0,0 +1,140 @@
+#include "TileScheduler.h"
+#include <algorithm>
+#ifdef _OPENMP
+#include <omp.h>
+#endif
+
+// Tiles of queue are [begin, end) of tile order. Queues are padded to separate cache lines.
+struct TileQueue
+{
+	int begin, end;
+#ifdef _OPENMP
+	omp_lock_t lock;
+#endif
+	char padding[64];
+
+	void Lock()
+	{
+#ifdef _OPENMP
+		omp_set_lock(&lock);
+#endif
+	}
+	void Unlock()
+	{
+#ifdef _OPENMP
+		omp_unset_lock(&lock);
+#endif
+	}
+};
+
+// Converts distance along Hilbert curve filling n x n grid (n power of two) to cell coordinates.
+static void HilbertToGrid(int n, int d, int& x, int& y)
+{
+	x = y = 0;
+	for(int s = 1; s < n; s *= 2)
+	{
+		int rx = 1 & (d / 2);
+		int ry = 1 & (d ^ rx);
+		if(ry == 0)
+		{
+			if(rx == 1)
+			{
+				x = s - 1 - x;
+				y = s - 1 - y;
+			}
+			std::swap(x, y);
+		}
+		x += s * rx;
+		y += s * ry;
+		d /= 4;
+	}
+}
+
+void TileScheduler::Prepare(int width, int height, int tileSize, int threadCount)
+{
+	Clear();
+	tileSize = std::max(1, tileSize);
+	threadCount = std::max(1, threadCount);
+	int tilesX = (width + tileSize - 1) / tileSize, tilesY = (height + tileSize - 1) / tileSize;
+
+	// Curve fills the smallest power of two grid covering all tiles, cells outside the image are skipped.
+	int n = 1;
+	while(n < tilesX || n < tilesY)
+		n *= 2;
+	tiles.reserve(tilesX * tilesY);
+	for(int d = 0; d < n*n; d++)
+	{
+		int x, y;
+		HilbertToGrid(n, d, x, y);
+		if(x >= tilesX || y >= tilesY)
+			continue;
+		ImageTile tile;
+		tile.x0 = x * tileSize;
+		tile.y0 = y * tileSize;
+		tile.x1 = std::min(tile.x0 + tileSize, width);
+		tile.y1 = std::min(tile.y0 + tileSize, height);
+		tiles.push_back(tile);
+	}
+
+	int T = tiles.size();
+	queueCount = threadCount;
+	queues = new TileQueue[queueCount];
+	for(int i = 0; i < queueCount; i++)
+	{
+		queues[i].begin = (int)((long long)T * i / queueCount);
+		queues[i].end = (int)((long long)T * (i + 1) / queueCount);
+#ifdef _OPENMP
+		omp_init_lock(&queues[i].lock);
+#endif
+	}
+}
+
+void TileScheduler::Clear()
+{
+#ifdef _OPENMP
+	for(int i = 0; i < queueCount; i++)
+		omp_destroy_lock(&queues[i].lock);
+#endif
+	delete[] queues;
+	queues = 0;
+	queueCount = 0;
+	tiles.clear();
+}
+
+bool TileScheduler::NextTile(int thread, ImageTile& tile)
+{
+	TileQueue& own = queues[thread];
+	own.Lock();
+	bool found = own.begin < own.end;
+	if(found)
+		tile = tiles[own.begin++];
+	own.Unlock();
+	return found || Steal(thread, tile);
+}
+
+bool TileScheduler::Steal(int thread, ImageTile& tile)
+{
+	// Victims are tried in order starting after thread, so thieves spread over different queues.
+	for(int i = 1; i < queueCount; i++)
+	{
+		TileQueue& victim = queues[(thread + i) % queueCount];
+		victim.Lock();
+		int count = victim.end - victim.begin;
+		int first = victim.end - (count + 1) / 2, last = victim.end;
+		if(count > 0)
+			victim.end = first;
+		victim.Unlock();
+		if(count <= 0)
+			continue;
+
+		// First stolen tile is returned, the rest refills own queue (others may steal from it again).
+		TileQueue& own = queues[thread];
+		own.Lock();
+		own.begin = first + 1;
+		own.end = last;
+		own.Unlock();
+		tile = tiles[first];
+		return true;
+	}
+	return false;
+}
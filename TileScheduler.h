@@ -0,0 +1,42 @@
+#pragma once
+
+#include <vector>
+
+// A rectangle of image pixels [x0,x1)x[y0,y1).
+struct ImageTile
+{
+	int x0, y0, x1, y1;
+
+	int GetPixelCount() const { return (x1 - x0) * (y1 - y0); }
+};
+
+struct TileQueue;
+
+// Distributes image tiles among render threads. Tiles are ordered along Hilbert curve, so consecutive tiles
+// are neighbours in the image and share cached geometry, and the order is split into one contiguous queue
+// per thread. A thread takes tiles from the front of its own queue; when it is empty it steals the back half
+// of another thread's queue, so threads stay busy when some parts of the image (glass, caustics) are much
+// more expensive than others. Each queue has its own lock, threads only meet when stealing.
+class TileScheduler
+{
+	std::vector<ImageTile> tiles;
+	TileQueue* queues;
+	int queueCount;
+
+	bool Steal(int thread, ImageTile& tile);
+
+	TileScheduler(const TileScheduler&);
+	TileScheduler& operator=(const TileScheduler&);
+public:
+	TileScheduler() : queues(0), queueCount(0) {}
+	~TileScheduler() { Clear(); }
+
+	// Splits image to tiles of tileSize x tileSize pixels (smaller at right and bottom border) and divides
+	// them among threadCount queues.
+	void Prepare(int width, int height, int tileSize, int threadCount);
+	void Clear();
+
+	// Gets next tile for thread (0 to threadCount-1), returns false when all tiles are taken.
+	bool NextTile(int thread, ImageTile& tile);
+	int GetTileCount() const { return tiles.size(); }
+};
@@ -0,0 +1,428 @@
+#include "WavefrontRaytracer.h"
+#include "SimdMath.h"
+#include "Platform.h"
+#include <exception>
+#include <iostream>
+#include <algorithm>
+
+void WavefrontRaytracer::Render(Camera* camera, IGeometry* geometry, IGeometry* singularLightGeometry,
+	std::vector<ISingularLight*> lights, PhotonMap* globalMap, PhotonMap* causticsMap)
+{
+	if(isRunning)
+		throw std::exception("Raytracer already running.");
+	if(progressive)
+		throw std::exception("Wavefront raytracer does not support progressive rendering");
+	isRunning = true;
+
+	this->camera = camera;
+	this->geometry = geometry;
+	this->lights = lights;
+	this->causticsMap = causticsMap;
+	this->globalMap = globalMap;
+	this->singularLightGeometry = singularLightGeometry;
+	if(camera == NULL || geometry == NULL)
+		throw std::exception("Invalid parameters");
+
+	// Stat data set to zero.
+	primaryRaysTraced = 0;
+	raysTraced = 0;
+
+	threadRays.resize(GetThreadCount());
+	threadShadowRays.resize(GetThreadCount());
+	PrepareScratch();
+
+	int width = camera->image.GetWidth(), height = camera->image.GetHeight();
+	int pixelCount = width * height, nextPixel = 0, lastProgress = -1;
+	while(nextPixel < pixelCount || !pending.empty())
+	{
+		// Primary rays of next pixels fill up what spawned rays leave of the wave.
+		while((int)pending.size() < waveSize && nextPixel < pixelCount)
+		{
+			int lastPixel = std::min(nextPixel + pixelBatchSize, pixelCount);
+			GeneratePrimaryRays(nextPixel, lastPixel);
+			nextPixel = lastPixel;
+		}
+		if(!pending.empty())
+			ProcessWave();
+
+		int progress = (int)(((long long)primaryRaysTraced*100)/((long long)pixelCount*raysPerPixel));
+		if(progress != lastProgress)
+			std::cout << progress << "% processed" << std::endl;
+		lastProgress = progress;
+	}
+
+	// Release queues.
+	std::vector<WavefrontRay>().swap(pending);
+	threadRays.clear();
+	threadShadowRays.clear();
+
+	this->isRunning = false;
+}
+
+void WavefrontRaytracer::GeneratePrimaryRays(int firstPixel, int lastPixel)
+{
+	if(this->maxIterations <= 0)
+		return;
+
+	int width = camera->image.GetWidth(), height = camera->image.GetHeight();
+	IMedium* startingMedium = camera->startingMedium == 0 ? this->vacuum : camera->startingMedium;
+
+	// Pixels are numbered like generator seeds in Raytracer (by columns).
+	for(int p = firstPixel; p < lastPixel; p++)
+	{
+		int x = p / height, y = p % height;
+		RandomGenerator random(p);
+		for(int n = 0; n < raysPerPixel; n++)
+		{
+			WavefrontRay r(random.NextInt64());
+			r.ray = Ray(camera->position, camera->GetPixelDirection(x, y, raysPerPixel==1?0:&random));
+			r.ray.medium = startingMedium;
+			r.weight = Vec3(1,1,1) / (Scalar)raysPerPixel;
+			r.pixel = x + width * y;
+			pending.push_back(r);
+		}
+	}
+}
+
+// Appends lists filled by threads to result; lists are copied to their places in parallel. With one thread
+// the list is inserted directly, because resizing first would write every element twice.
+template<class T>
+static void AppendThreadLists(std::vector<T>& result, const std::vector<std::vector<T> >& lists, const T& filler)
+{
+	int count = lists.size();
+	if(count == 1)
+	{
+		result.insert(result.end(), lists[0].begin(), lists[0].end());
+		return;
+	}
+	std::vector<size_t> offsets(count + 1, result.size());
+	for(int t = 0; t < count; t++)
+		offsets[t + 1] = offsets[t] + lists[t].size();
+	result.resize(offsets[count], filler);
+
+	#pragma omp parallel for schedule(dynamic, 1)
+	for(int t = 0; t < count; t++)
+		std::copy(lists[t].begin(), lists[t].end(), result.begin() + offsets[t]);
+}
+
+void WavefrontRaytracer::ProcessWave()
+{
+	// Wave is processed in place at the back of the queue, it is removed only after accumulation.
+	waveCount = std::min(waveSize, (int)pending.size());
+	int waveStart = pending.size() - waveCount;
+	wave = &pending[waveStart];
+
+	IntersectStage();
+	SortStage();
+	ShadeStage();
+	ShadowStage();
+	AccumulateStage();
+
+	// Requeue spawned rays.
+	pending.erase(pending.begin() + waveStart, pending.end());
+	wave = 0;
+	AppendThreadLists(pending, threadRays, WavefrontRay(0));
+}
+
+void WavefrontRaytracer::IntersectStage()
+{
+	int count = waveCount;
+	results.assign(count, IntersectResult());
+
+	int primaryRays = 0;
+	#pragma omp parallel for schedule(dynamic, 64) reduction(+:primaryRays)
+	for(int i = 0; i < count; i++)
+	{
+		geometry->Intersect(wave[i].ray, results[i]);
+
+		// First depth2=0, we also include "singular light geometry"
+		if(wave[i].depth2 == 0 && this->singularLightGeometry)
+			singularLightGeometry->Intersect(wave[i].ray, results[i]);
+		if(wave[i].depth == 0)
+			primaryRays++;
+	}
+	this->primaryRaysTraced += primaryRays;
+}
+
+// Orders materials by BSDF, so shading runs same code over same data.
+struct WavefrontMaterialLess
+{
+	bool operator()(const Material* a, const Material* b) const
+	{
+		if(a->bsdf != b->bsdf)
+			return a->bsdf < b->bsdf;
+		return a < b;
+	}
+};
+
+void WavefrontRaytracer::SortStage()
+{
+	// Hits are bucket sorted by material: a wave hits few distinct materials, so only they are sorted and
+	// hits are then scattered to buckets in wave order. Misses return "sky" radiance (zero) and are dropped.
+	int count = results.size();
+	buckets.resize(count);
+	waveMaterials.clear();
+	const Material* last = 0;
+	int material = -1;
+	for(int i = 0; i < count; i++)
+	{
+		buckets[i] = -1;
+		if(results[i].distance == std::numeric_limits<Scalar>::max())
+			continue;
+		// Neighbouring rays mostly hit the same material, so the linear search is rare.
+		if(results[i].material != last)
+		{
+			last = results[i].material;
+			material = std::find(waveMaterials.begin(), waveMaterials.end(), last) - waveMaterials.begin();
+			if(material == (int)waveMaterials.size())
+				waveMaterials.push_back(last);
+		}
+		buckets[i] = material;
+	}
+
+	// Materials are numbered in order of first hit, bucket of material is its place in sorted order.
+	int materialCount = waveMaterials.size();
+	sortedMaterials.assign(waveMaterials.begin(), waveMaterials.end());
+	std::sort(sortedMaterials.begin(), sortedMaterials.end(), WavefrontMaterialLess());
+	materialBuckets.resize(materialCount);
+	for(int m = 0; m < materialCount; m++)
+		materialBuckets[m] = std::lower_bound(sortedMaterials.begin(), sortedMaterials.end(), waveMaterials[m],
+			WavefrontMaterialLess()) - sortedMaterials.begin();
+
+	bucketStarts.assign(materialCount + 1, 0);
+	for(int i = 0; i < count; i++)
+		if(buckets[i] >= 0)
+		{
+			buckets[i] = materialBuckets[buckets[i]];
+			bucketStarts[buckets[i] + 1]++;
+		}
+	for(int b = 0; b < materialCount; b++)
+		bucketStarts[b + 1] += bucketStarts[b];
+
+	order.resize(bucketStarts[materialCount]);
+	for(int i = 0; i < count; i++)
+		if(buckets[i] >= 0)
+			order[bucketStarts[buckets[i]]++] = i;
+}
+
+void WavefrontRaytracer::ShadeStage()
+{
+	int count = order.size();
+	radiance.assign(waveCount, Vec3(0,0,0));
+	for(unsigned int t = 0; t < threadRays.size(); t++)
+	{
+		threadRays[t].clear();
+		threadShadowRays[t].clear();
+	}
+
+	#pragma omp parallel for schedule(dynamic, 64)
+	for(int k = 0; k < count; k++)
+	{
+		int t = GetThreadIndex();
+		ShadeRay(order[k], threadRays[t], threadShadowRays[t]);
+	}
+}
+
+void WavefrontRaytracer::ShadowStage()
+{
+	shadowRays.clear();
+	AppendThreadLists(shadowRays, threadShadowRays, WavefrontShadowRay());
+
+	int count = shadowRays.size();
+	shadowed.resize(count);
+
+	#pragma omp parallel for schedule(dynamic, 64)
+	for(int i = 0; i < count; i++)
+		shadowed[i] = geometry->IsInShadow(shadowRays[i].from, shadowRays[i].to);
+}
+
+void WavefrontRaytracer::AccumulateStage()
+{
+	// Emitted and gathered radiance and unoccluded shadow rays are added to image. Pixels are split among
+	// stripes by index, each stripe adds only to its own pixels, so there are no races and terms of a pixel
+	// are added in the same order for any number of threads.
+	Colour* data = camera->image.GetData();
+	int stripes = GetThreadCount(), shadowCount = shadowRays.size();
+	#pragma omp parallel for schedule(static, 1)
+	for(int s = 0; s < stripes; s++)
+	{
+		for(int i = 0; i < waveCount; i++)
+		{
+			const Colour& L = radiance[i];
+			if(wave[i].pixel % stripes != s || L.x != L.x || L.y != L.y || L.z != L.z)
+				continue;
+			data[wave[i].pixel] += L;
+		}
+		for(int i = 0; i < shadowCount; i++)
+		{
+			const Colour& L = shadowRays[i].contribution;
+			if(shadowRays[i].pixel % stripes != s || shadowed[i] || L.x != L.x || L.y != L.y || L.z != L.z)
+				continue;
+			data[shadowRays[i].pixel] += L;
+		}
+	}
+}
+
+void WavefrontRaytracer::ShadeRay(int index, std::vector<WavefrontRay>& spawned, std::vector<WavefrontShadowRay>& shadows)
+{
+	WavefrontRay& r = wave[index];
+	const IntersectResult& result = results[index];
+	const Ray& ray = r.ray;
+
+	Vec3 position = result.distance * ray.direction + ray.origin;
+	Vec3 cameraDirection = -ray.direction;
+
+	// Check for interaction with medium (scaterring)
+	ColourScalar scateringWeight;
+	Vec3 scatteringPos, scatteringDir;
+	if(ray.medium->SampleScattering(ray.origin, result.normal, position, &r.random, scateringWeight,
+		scatteringPos, scatteringDir))
+	{
+		if(r.depth + 1 >= this->maxIterations)
+			return;
+
+		WavefrontRay s = r;
+		s.random = RandomGenerator(r.random.NextInt64());
+		s.ray = Ray(scatteringPos, scatteringDir);
+		s.ray.medium = ray.medium;
+		s.weight = r.weight.CMultiply(scateringWeight);
+		s.depth++;
+		spawned.push_back(s);
+		return;
+	}
+	ColourScalar weight = r.weight.CMultiply(scateringWeight);
+
+	// Now calculate mediums.
+	bool isInsideMedium = cameraDirection * result.normal < 0;
+	IMedium* insideMedium, *outsideMedium;
+	if(isInsideMedium)
+	{
+		// FIXME: sometimes due to numerical errors, we ignore those hits (alternative - set to vacuum).
+		if(r.mediumStack.IsEmpty())
+			return;
+		outsideMedium = r.mediumStack.Top();
+		insideMedium = ray.medium;
+	} else {
+		outsideMedium = ray.medium;
+		insideMedium = result.material->insideMedium;
+	}
+
+	// 1) self radiance
+	Colour& L = radiance[index];
+	if(result.material->surfaceLight != 0)
+		L += weight.CMultiply(result.material->surfaceLight->Radiance(position, cameraDirection, result.normal));
+
+	if(result.material->bsdf == 0)
+		return;
+	SamplingType samplingType = result.material->bsdf->GetSamplingType(cameraDirection, result.normal);
+
+	// 2) radiance from singular sources, visibility is tested in shadow stage.
+	if((samplingType & Singular) != 0)
+	{
+		for(std::vector<ISingularLight*>::iterator i = lights.begin(); i != lights.end(); i++)
+		{
+			WavefrontShadowRay shadow;
+			Vec3 towardsLightDirection;
+			Vec3 Li = (*i)->UnoccludedRadiance(position, towardsLightDirection, shadow.to);
+			if(Li.x == 0 && Li.y == 0 && Li.z == 0)
+				continue;
+
+			Vec3 t = (result.normal * towardsLightDirection)*Li.CMultiply(result.material->bsdf->BSDF(position, result.normal,
+				 cameraDirection, towardsLightDirection, result.materialData, insideMedium, outsideMedium));
+			shadow.from = OffsetRayOrigin(position, result.distance, result.normal, towardsLightDirection);
+			shadow.contribution = weight.CMultiply(t);
+			shadow.pixel = r.pixel;
+			shadows.push_back(shadow);
+		}
+	}
+
+	// 3) caustics map lightning
+	if(this->causticsMap)
+	{
+		std::vector<Photon*>& photons = GatherPhotons(causticsMap, position, this->causticsPhotonMapGatherRadius);
+
+		Vec4d Flux(0,0,0);
+		for(std::vector<Photon*>::iterator i = photons.begin(); i != photons.end(); i++)
+		{
+			Photon* p = *i;
+			if(p->outDirection * result.normal < 0)
+				continue;
+
+			Flux += Vec4d(p->power).CMultiply((result.normal * p->outDirection) * Vec4d(result.material->bsdf->BSDF(position, result.normal, p->outDirection, cameraDirection, result.materialData,
+				insideMedium, outsideMedium)));
+		}
+
+		L += weight.CMultiply((Flux / (PI*this->causticsPhotonMapGatherRadius*this->causticsPhotonMapGatherRadius)).ToVec3());
+	}
+
+	int numberOfSamples = std::min(result.material->bsdf->GetMaxNumberOfSamples(cameraDirection, result.normal),
+		(int)(this->secondaryRays * exp(-secondaryRayDecay*r.depth2)));
+	bool isPerfectReflection = numberOfSamples <= this->gatherIterationThreeshold;
+
+	// 4a) indirect photon map rendering, used instead of hemisphere integration for gathering steps
+	if(r.depth2 > 0 && !isPerfectReflection && this->globalMap)
+	{
+		std::vector<Photon*>& photons = GatherPhotons(globalMap, position, this->globalPhotonMapGatherRadius);
+
+		Vec4d Flux(0,0,0);
+		for(std::vector<Photon*>::iterator i = photons.begin(); i != photons.end(); i++)
+		{
+			Photon* p = *i;
+			if(p->outDirection * result.normal < 0)
+				continue;
+
+			Flux += Vec4d(p->power).CMultiply((result.normal * p->outDirection) * Vec4d(result.material->bsdf->BSDF(position, result.normal, p->outDirection, cameraDirection, result.materialData,
+				insideMedium, outsideMedium)));
+		}
+
+		L += weight.CMultiply((Flux / (PI*this->globalPhotonMapGatherRadius*this->globalPhotonMapGatherRadius)).ToVec3());
+		return;
+	}
+
+	// 4b) integrated radiance over hemisphere, spawned as new rays.
+	if((samplingType & MultipleSample) == 0)
+		return;
+	if(r.depth + 1 >= this->maxIterations || !(r.depth2 < this->maxGatherIterations || isPerfectReflection))
+		return;
+
+	for(int i = 0; i < numberOfSamples; i++)
+	{
+		Vec3 newDirection;
+		ColourScalar S = result.material->bsdf->Sample(i, numberOfSamples, position, result.normal,
+			cameraDirection, &r.random, result.materialData, insideMedium, outsideMedium, newDirection);
+
+		WavefrontRay s = r;
+		s.random = RandomGenerator(r.random.NextInt64());
+		s.ray = Ray(position, newDirection);
+		s.weight = weight.CMultiply(S);
+		s.depth = r.depth + 1;
+		s.depth2 = r.depth2 + (isPerfectReflection ? 0 : 1);
+
+		// Same medium transitions as in Raytracer, the stack is copied with the ray.
+		if(isInsideMedium)
+		{
+			// In-Out combination
+			if(newDirection * result.normal > 0)
+			{
+				s.ray.medium = s.mediumStack.Top();
+				s.mediumStack.Pop();
+			}
+			// In-In combination
+			else
+				s.ray.medium = ray.medium;
+		}
+		else {
+			// Out-out combination
+			if(newDirection * result.normal > 0)
+				s.ray.medium = ray.medium;
+			else
+			{
+				s.ray.medium = result.material->insideMedium;
+				s.mediumStack.Push(ray.medium);
+			}
+		}
+
+		s.ray.origin = OffsetRayOrigin(position, result.distance, result.normal, newDirection);
+		spawned.push_back(s);
+	}
+}
@@ -0,0 +1,78 @@
+#pragma once
+#include "Raytracer.h"
+#include <vector>
+
+// A ray waiting in wavefront queue. It carries everything recursive tracer keeps on stack: the path
+// weight, pixel it contributes to and stack of mediums it is nested in.
+struct WavefrontRay
+{
+	Ray ray;
+	ColourScalar weight;
+	RandomGenerator random;
+	int pixel;
+	int depth, depth2;
+	MediumStack mediumStack;
+
+	WavefrontRay(BigUInt seed) : random(seed), pixel(0), depth(0), depth2(0) {}
+};
+
+// A pending shadow test; contribution is added to pixel if the segment is not occluded.
+struct WavefrontShadowRay
+{
+	Vec3 from, to;
+	ColourScalar contribution;
+	int pixel;
+};
+
+// A streaming (wavefront) version of Raytracer. Instead of tracing each path recursively, rays are kept in
+// queues and processed in stages, each stage being a parallel loop over whole wave: intersect, medium
+// scattering, sort by material, shade (spawns secondary and shadow rays), shadow test, accumulation to
+// image and requeue. Primary rays are added whenever queued rays cannot fill a wave, so waves stay full.
+// Parameters and estimator are the same as in Raytracer; images differ only by random sequence used,
+// because paths are sampled in different order. Progressive mode (and so adaptive sampling) is not supported,
+// Render throws if progressive is set. Rays are not traced in packets, packetSize is ignored (waveSize and
+// sorting by material give coherence instead).
+class WavefrontRaytracer : public Raytracer
+{
+	// Rays waiting to be processed. Waves are taken from the back, so spawned rays are processed
+	// before older ones and queue stays small (depth first over waves).
+	std::vector<WavefrontRay> pending;
+
+	// Wave data, indexed by position in wave. Rays of wave are the last waveCount rays of pending.
+	WavefrontRay* wave;
+	int waveCount;
+	std::vector<IntersectResult> results;
+	std::vector<int> order;
+	// Bucket of each ray (-1 for misses) and distinct materials of wave, for sorting by material.
+	std::vector<int> buckets;
+	std::vector<const Material*> waveMaterials, sortedMaterials;
+	std::vector<int> materialBuckets;
+	std::vector<int> bucketStarts;
+	std::vector<Colour> radiance;
+	std::vector<WavefrontShadowRay> shadowRays;
+	std::vector<char> shadowed;
+	// Rays and shadow rays spawned by each thread.
+	std::vector<std::vector<WavefrontRay> > threadRays;
+	std::vector<std::vector<WavefrontShadowRay> > threadShadowRays;
+
+	void GeneratePrimaryRays(int firstPixel, int lastPixel);
+	void ProcessWave();
+	void IntersectStage();
+	void SortStage();
+	void ShadeStage();
+	void ShadowStage();
+	void AccumulateStage();
+
+	// Shades one intersected ray of wave, may spawn rays and shadow rays into given queues.
+	void ShadeRay(int index, std::vector<WavefrontRay>& spawned, std::vector<WavefrontShadowRay>& shadows);
+public:
+	// Number of rays processed in one wave (more means better coherence, but more memory).
+	int waveSize;
+	// Number of pixels whose primary rays are generated at once when queue is refilled.
+	int pixelBatchSize;
+
+	WavefrontRaytracer() : wave(0), waveCount(0), waveSize(4096), pixelBatchSize(64) {}
+
+	virtual void Render(Camera* camera, IGeometry* geometry, IGeometry* singularLightGeom,
+		std::vector<ISingularLight*> lights, PhotonMap* globalMap, PhotonMap* causticsMap);
+};
@@ -1,23 +1,28 @@
 #include "Raytracer.h"
+#include "PathTracer.h"
+#include "WavefrontRaytracer.h"
 #include "CommonBRDF.h"
 #include "CommonGeometry.h"
 #include "CommonLights.h"
 #include "CommonBTDF.h"
 #include "CommonMediums.h"
 #include "Image.h"
+#include "SimdMath.h"
+#include "MeshOptimizer.h"
+#include "MeshImporter.h"
+#include "MeshCache.h"
+#include "OutOfCoreMesh.h"
+#include "AllocationCounter.h"
 #include "PhotonMapping\PhotonMap.h"
 #include "PhotonMapping\PhotonTracer.h"
+#include "Platform.h"
+#include <cstdio>
+#include <cmath>
 
 
-// Creates a cornell box (5 walls).
-void CreateCornellBox(Scene* scene)
+// Adds walls of a cornell box (5 walls) to mesh and builds it.
+void AddCornellBox(TriangleMesh* mesh, Material* whiteDiffuse, Material* redDiffuse, Material* greenDiffuse)
 {
-	Material* whiteDiffuse = new Material(new Diffuse(Vec3(1,1,1)));
-	Material* redDiffuse = new Material(new Diffuse(Vec3(1,0,0)));
-	Material* greenDiffuse = new Material(new Diffuse(Vec3(0,1,0)));
-
-	
-	TriangleMesh* mesh = new TriangleMesh;
 	mesh->AddVertex(Vec3(-1,-1,1));  mesh->AddVertex(Vec3(1,-1,1));  mesh->AddVertex(Vec3(1,1,1));  mesh->AddVertex(Vec3(-1,1,1));
 	mesh->AddVertex(Vec3(-1,-1,-1)); mesh->AddVertex(Vec3(1,-1,-1)); mesh->AddVertex(Vec3(1,1,-1)); mesh->AddVertex(Vec3(-1,1,-1));
 	
@@ -36,7 +41,17 @@ void CreateCornellBox(Scene* scene)
 	//BACK
 	mesh->AddIndexedTriangle(5, 6, 7, whiteDiffuse);
 	mesh->AddIndexedTriangle(5, 7, 4, whiteDiffuse);
+	mesh->Build();
+}
 
+// Creates a cornell box (5 walls).
+void CreateCornellBox(Scene* scene)
+{
+	Material* whiteDiffuse = new Material(new Diffuse(Vec3(1,1,1)));
+	Material* redDiffuse = new Material(new Diffuse(Vec3(1,0,0)));
+	Material* greenDiffuse = new Material(new Diffuse(Vec3(0,1,0)));
+	TriangleMesh* mesh = new TriangleMesh;
+	AddCornellBox(mesh, whiteDiffuse, redDiffuse, greenDiffuse);
 	scene->AddGeometry(mesh);
 }
 
@@ -44,7 +59,7 @@ void CreateCornellBox(Scene* scene)
 // only LR*DR*E paths (tweek maxGather for more D paths)
 void Test_SurfaceLight(const char* filename)
 {
-	Scene scene;
+	BVHScene scene;
 	CreateCornellBox(&scene);
 
 	// Create 2 spheres, one light one normal.
@@ -55,6 +70,7 @@ void Test_SurfaceLight(const char* filename)
 	Sphere sphere2(Vec3(-0.5, 0.5, -0.5), 0.1, &mat2);
 	scene.AddGeometry(&sphere1);
 	scene.AddGeometry(&sphere2);
+	scene.Build();
 
 	std::vector<ISingularLight*> lights;
 
@@ -79,7 +95,7 @@ void Test_SurfaceLight(const char* filename)
 // Tests the correctness of reflections/refractions. No secondary reflections
 void Test_ReflectRefract(const char* filename)
 {
-	Scene scene;
+	BVHScene scene;
 	CreateCornellBox(&scene);
 
 	// We add 2 spheres.
@@ -91,6 +107,7 @@ void Test_ReflectRefract(const char* filename)
 	Sphere sphere2(Vec3(-0.5, -0.6, -0.0), 0.35, &mat2);
 	scene.AddGeometry(&sphere1);
 	scene.AddGeometry(&sphere2);
+	scene.Build();
 
 	// We add single light source.
 	// FIXME: errors for Vec3(0.2, 0.3, -0.3), fix that!
@@ -118,7 +135,7 @@ void Test_ReflectRefract(const char* filename)
 // Tests caustics of light
 void Test_Caustics(const char* filename, Scalar index, Scalar scateringLen, const Vec3& absorption)
 {
-	Scene scene;
+	BVHScene scene;
 	CreateCornellBox(&scene);
 
 	// We add 2 spheres.
@@ -128,6 +145,7 @@ void Test_Caustics(const char* filename, Scalar index, Scalar scateringLen, cons
 
 	Sphere sphere1(Vec3(-0.5, -0.3, 0), 0.35, &mat1);
 	scene.AddGeometry(&sphere1);
+	scene.Build();
 
 	// We add single light source.
 	std::vector<ISingularLight*> lights;
@@ -169,7 +187,7 @@ void Test_Caustics(const char* filename, Scalar index, Scalar scateringLen, cons
 // Tests photon mapping
 void Test_PhotonMapping(const char* filename)
 {
-	Scene scene;
+	BVHScene scene;
 	CreateCornellBox(&scene);
 
 	// We add 2 spheres.
@@ -182,6 +200,7 @@ void Test_PhotonMapping(const char* filename)
 	scene.AddGeometry(&sphere1);
 	Sphere sphere2(Vec3(0.5, -0.6, -0.2), 0.2, &mat2);
 	scene.AddGeometry(&sphere2);
+	scene.Build();
 
 	// We add single light source.
 	std::vector<ISingularLight*> lights;
@@ -227,7 +246,7 @@ void Test_PhotonMapping(const char* filename)
 // FIXME: not working
 void Test_SubsurfaceScatering(const char* filename)
 {
-	Scene scene;
+	BVHScene scene;
 	CreateCornellBox(&scene);
 
 	// We add one big sphere
@@ -237,6 +256,7 @@ void Test_SubsurfaceScatering(const char* filename)
 
 	Sphere sphere1(Vec3(0, -0.2, 0), 0.5, &mat1);
 	scene.AddGeometry(&sphere1);
+	scene.Build();
 
 
 	// We add single light source.
@@ -267,10 +287,964 @@ void Test_SubsurfaceScatering(const char* filename)
 	image.SaveAsBmp(filename);
 }
 
+// Tests instancing: thousands of instances share one mesh (and its BVH), scene BVH is built over instances.
+void Test_Instancing(const char* filename)
+{
+	BVHScene scene;
+	CreateCornellBox(&scene);
+
+	// A tetrahedron, base on y=0.
+	Material mat(new Diffuse(Vec3(1,1,1)));
+	TriangleMesh* mesh = new TriangleMesh;
+	mesh->AddVertex(Vec3(1,0,0)); mesh->AddVertex(Vec3(-0.5,0,0.866)); mesh->AddVertex(Vec3(-0.5,0,-0.866));
+	mesh->AddVertex(Vec3(0,1.5,0));
+	mesh->AddIndexedTriangle(0, 1, 2, &mat);
+	mesh->AddIndexedTriangle(0, 3, 1, &mat);
+	mesh->AddIndexedTriangle(1, 3, 2, &mat);
+	mesh->AddIndexedTriangle(2, 3, 0, &mat);
+	mesh->Build();
+
+	// Grid of randomly rotated and scaled instances on the floor.
+	const int N = 30;
+	RandomGenerator random(0);
+	std::vector<TransformedGeometry*> instances;
+	for(int i = 0; i < N; i++)
+	{
+		for(int j = 0; j < N; j++)
+		{
+			Scalar scale = (Scalar)0.03 + (Scalar)0.02*random.NextUniform();
+			Mat3x3 transform = Mat3x3::Rotation(Vec3(0,1,0), 2*PI*random.NextUniform()) * Mat3x3::Scale(Vec3(scale, scale, scale));
+			Vec3 position(-0.9 + 1.8*i/(N-1), -0.999, -0.9 + 1.8*j/(N-1));
+			instances.push_back(new TransformedGeometry(mesh, transform, position));
+			scene.AddGeometry(instances.back());
+		}
+	}
+	scene.Build();
+
+	std::vector<ISingularLight*> lights;
+	PointLight light(Vec3(0.2, 0.3, 1.1), Vec3(1,1,1));
+	lights.push_back(&light);
+
+	// Raytrace scene.
+	Camera camera(300,300, PI/3);
+	camera.position = Vec3(0,0,2.5);
+
+	Raytracer raytracer;
+	raytracer.maxGatherIterations = 1; 
+	raytracer.secondaryRays = 50;	   
+	raytracer.raysPerPixel = 4;
+	raytracer.Render(&camera, &scene, 0, lights, 0, 0);
+
+	Image& image = camera.image;
+	image.EyeResponseTransform1();
+	image.Multiply(1/image.Max());
+	image.SaveAsBmp(filename);
+
+	for(unsigned int i = 0; i < instances.size(); i++)
+		delete instances[i];
+}
+
+
+// Adds axis aligned box (12 triangles) to mesh.
+void AddBox(TriangleMesh* mesh, const Vec3& minimum, const Vec3& maximum, Material* material)
+{
+	int v = mesh->GetVertexCount();
+	for(int i = 0; i < 8; i++)
+		mesh->AddVertex(Vec3(i & 1 ? maximum.x : minimum.x, i & 2 ? maximum.y : minimum.y, i & 4 ? maximum.z : minimum.z));
+	int faces[6][4] = { {0,2,3,1}, {4,5,7,6}, {0,1,5,4}, {2,6,7,3}, {0,4,6,2}, {1,3,7,5} };
+	for(int f = 0; f < 6; f++)
+	{
+		mesh->AddIndexedTriangle(v + faces[f][0], v + faces[f][1], v + faces[f][2], material);
+		mesh->AddIndexedTriangle(v + faces[f][0], v + faces[f][2], v + faces[f][3], material);
+	}
+}
+
+// Architectural scene: a floor with a grid of rooms (walls with door gaps) and pillars.
+void CreateArchitectureMesh(TriangleMesh* mesh, Material* material)
+{
+	const int N = 40;
+	AddBox(mesh, Vec3(-1,-1.01,-1), Vec3(1,-1,1), material);
+	for(int i = 0; i < N; i++)
+	{
+		for(int j = 0; j < N; j++)
+		{
+			Scalar x = -1 + 2*(Scalar)i/N, z = -1 + 2*(Scalar)j/N, cell = (Scalar)2/N;
+			AddBox(mesh, Vec3(x, -1, z), Vec3(x + cell*0.4, -0.8, z + cell*0.02), material);
+			AddBox(mesh, Vec3(x, -1, z), Vec3(x + cell*0.02, -0.8, z + cell*0.7), material);
+			AddBox(mesh, Vec3(x + cell*0.5, -1, z + cell*0.5), Vec3(x + cell*0.55, -0.7, z + cell*0.55), material);
+		}
+	}
+}
+
+// Organic scene: a bumpy sphere with 2*N*N triangles.
+void CreateBumpySphereMesh(TriangleMesh* mesh, Material* material)
+{
+	const int N = 300;
+	for(int i = 0; i <= N; i++)
+	{
+		for(int j = 0; j <= N; j++)
+		{
+			Scalar theta = PI*i/N, phi = 2*PI*j/N;
+			Scalar r = (Scalar)0.6*(1 + (Scalar)0.05*std::sin(theta*17)*std::cos(phi*13));
+			mesh->AddVertex(Vec3(r*std::sin(theta)*std::cos(phi), r*std::cos(theta) - 0.3, r*std::sin(theta)*std::sin(phi)));
+		}
+	}
+	for(int i = 0; i < N; i++)
+	{
+		for(int j = 0; j < N; j++)
+		{
+			int a = i*(N+1) + j;
+			mesh->AddIndexedTriangle(a, a + 1, a + N + 1, material);
+			mesh->AddIndexedTriangle(a + 1, a + N + 2, a + N + 1, material);
+		}
+	}
+}
+
+// Compares build and render times of triangle mesh accelerators on the same scenes, so the accelerator can
+// be chosen per scene. Results are printed as a table; BVH column is the binary hierarchy phase of build, which
+// wide BVH is converted from.
+void Benchmark_Accelerators()
+{
+	const char* sceneNames[] = { "architecture", "bumpy sphere" };
+	const char* acceleratorNames[] = { "BVH", "wide BVH", "kd-tree" };
+	MeshAccelerator accelerators[] = { AcceleratorBVH, AcceleratorWideBVH, AcceleratorKdTree };
+	Material material(new Diffuse(Vec3(1,1,1)));
+
+	printf("%-14s %-10s %10s %10s %10s %10s %10s\n", "scene", "structure", "build [s]", "BVH [s]", "nodes", "render [s]",
+		"Msamples/s");
+	for(int s = 0; s < 2; s++)
+	{
+		for(int a = 0; a < 3; a++)
+		{
+			TriangleMesh* mesh = new TriangleMesh;
+			if(s == 0)
+				CreateArchitectureMesh(mesh, &material);
+			else
+				CreateBumpySphereMesh(mesh, &material);
+			mesh->accelerator = accelerators[a];
+			double buildStart = GetTime();
+			BVHBuildStats bvhStats = mesh->Build();
+			double buildTime = GetTime() - buildStart;
+
+			std::vector<ISingularLight*> lights;
+			PointLight light(Vec3(0.3, 0.5, 1.5), Vec3(1,1,1));
+			lights.push_back(&light);
+			Camera camera(400,400, PI/3);
+			camera.position = Vec3(0,0.3,2.5);
+
+			// Direct lighting only: primary and shadow rays.
+			Raytracer raytracer;
+			raytracer.maxGatherIterations = 0;
+			raytracer.raysPerPixel = 4;
+			double renderStart = GetTime();
+			raytracer.Render(&camera, mesh, 0, lights, 0, 0);
+			double renderTime = GetTime() - renderStart;
+
+			double samples = 400.0 * 400 * raytracer.raysPerPixel;
+			printf("%-14s %-10s %10.3f %10.3f %10d %10.3f %10.2f\n", sceneNames[s], acceleratorNames[a], buildTime,
+				bvhStats.time, bvhStats.nodeCount, renderTime, samples / renderTime / 1e6);
+			delete mesh;
+		}
+	}
+}
+
+// Compares double and single precision BVH traversal on the benchmark scenes; difference is the mean
+// absolute difference of pixel components from the double precision image.
+void Benchmark_Precision()
+{
+	const char* sceneNames[] = { "architecture", "bumpy sphere" };
+	const char* precisionNames[] = { "double", "float" };
+	MeshPrecision precisions[] = { PrecisionDouble, PrecisionFloat };
+	Material material(new Diffuse(Vec3(1,1,1)));
+
+	printf("%-14s %-10s %10s %10s %10s %10s\n", "scene", "precision", "build [s]", "render [s]", "Msamples/s", "difference");
+	for(int s = 0; s < 2; s++)
+	{
+		std::vector<Colour> reference;
+		for(int p = 0; p < 2; p++)
+		{
+			TriangleMesh* mesh = new TriangleMesh;
+			if(s == 0)
+				CreateArchitectureMesh(mesh, &material);
+			else
+				CreateBumpySphereMesh(mesh, &material);
+			mesh->accelerator = AcceleratorBVH;
+			mesh->precision = precisions[p];
+			double buildStart = GetTime();
+			mesh->Build();
+			double buildTime = GetTime() - buildStart;
+
+			std::vector<ISingularLight*> lights;
+			PointLight light(Vec3(0.3, 0.5, 1.5), Vec3(1,1,1));
+			lights.push_back(&light);
+			Camera camera(400,400, PI/3);
+			camera.position = Vec3(0,0.3,2.5);
+
+			Raytracer raytracer;
+			raytracer.maxGatherIterations = 0;
+			raytracer.raysPerPixel = 4;
+			double renderStart = GetTime();
+			raytracer.Render(&camera, mesh, 0, lights, 0, 0);
+			double renderTime = GetTime() - renderStart;
+
+			Colour* data = camera.image.GetData();
+			int pixelCount = camera.image.GetWidth() * camera.image.GetHeight();
+			if(p == 0)
+				reference.assign(data, data + pixelCount);
+			Scalar difference = 0;
+			for(int i = 0; i < pixelCount; i++)
+				for(int k = 0; k < 3; k++)
+					difference += std::abs(data[i].data[k] - reference[i].data[k]);
+			difference /= 3 * pixelCount;
+
+			double samples = 400.0 * 400 * raytracer.raysPerPixel;
+			printf("%-14s %-10s %10.3f %10.3f %10.2f %10.6f\n", sceneNames[s], precisionNames[p], buildTime, renderTime, 
+				samples / renderTime / 1e6, difference);
+			delete mesh;
+		}
+	}
+}
+
+// Intersects camera rays with bumpy sphere moved away from the world origin, with double precision BVH as
+// reference. Wide BVH confirms its single precision candidates in double precision, so it must find the same
+// hits at any offset with each kernel. Single precision BVH is not watertight and is expected to lose hits far
+// from the origin. Lost are reference hits that are missed, different are other hits at other distances.
+void Benchmark_FarFromOrigin()
+{
+	const char* acceleratorNames[] = { "BVH", "wide AVX2", "wide SSE2", "wide C++", "BVH float" };
+	MeshAccelerator accelerators[] = { AcceleratorBVH, AcceleratorWideBVH, AcceleratorWideBVH, AcceleratorWideBVH,
+		AcceleratorBVH };
+	MeshPrecision precisions[] = { PrecisionDouble, PrecisionDouble, PrecisionDouble, PrecisionDouble, PrecisionFloat };
+	SimdLevel levels[] = { SimdAVX2, SimdAVX2, SimdSSE2, SimdScalar, SimdAVX2 };
+	Scalar offsets[] = { 0, 1e2, 1e3, 1e4, 1e5 };
+	Material material(new Diffuse(Vec3(1,1,1)));
+	TriangleMesh source;
+	CreateBumpySphereMesh(&source, &material);
+	const int size = 400;
+
+	printf("%10s %-10s %10s %10s\n", "offset", "structure", "lost", "different");
+	for(int o = 0; o < 5; o++)
+	{
+		Vec3 offset(offsets[o], offsets[o] * (Scalar)0.5, -offsets[o]);
+		std::vector<Scalar> reference;
+		for(int a = 0; a < 5; a++)
+		{
+			TriangleMesh* mesh = new TriangleMesh(source.GetTriangleCount());
+			for(int i = 0; i < source.GetVertexCount(); i++)
+				mesh->AddVertex(source.GetVertexData()[i] + offset);
+			const int* indices = source.GetIndexData();
+			for(int i = 0; i < source.GetTriangleCount(); i++)
+				mesh->AddIndexedTriangle(indices[i*3], indices[i*3+1], indices[i*3+2], &material);
+			mesh->accelerator = accelerators[a];
+			mesh->precision = precisions[a];
+			LimitSimdLevel(levels[a]);
+			mesh->Build();
+			LimitSimdLevel(SimdAVX2);
+
+			int lost = 0, different = 0;
+			for(int y = 0; y < size; y++)
+			{
+				for(int x = 0; x < size; x++)
+				{
+					Vec3 direction((Scalar)(x - size/2) / size, (Scalar)(size/2 - y) / size, -1);
+					Ray ray(Vec3(0,0.3,2.5) + offset, direction.Normal());
+					IntersectResult result;
+					mesh->Intersect(ray, result);
+					if(a == 0)
+						reference.push_back(result.distance);
+					else if(result.distance != reference[y*size + x])
+						(result.distance == std::numeric_limits<Scalar>::max() ? lost : different)++;
+				}
+			}
+			printf("%10.0e %-10s %10d %10d\n", offsets[o], acceleratorNames[a], lost, different);
+			delete mesh;
+		}
+	}
+}
+
+// Times photon gather accumulation (flux += power * cosine * BSDF, as in Raytracer::Shade) with Vec3 and with
+// SIMD vectors on the same random photons; Vec3 and Vec4d fluxes must be equal.
+void Benchmark_SimdMath()
+{
+	const int photonCount = 64 * 1024, repeats = 200;
+	RandomGenerator random(1);
+	std::vector<Photon> photons(photonCount);
+	std::vector<Vec3f> powers(photonCount), directions(photonCount);
+	for(int i = 0; i < photonCount; i++)
+	{
+		photons[i].power = Vec3(random.NextUniform(), random.NextUniform(), random.NextUniform());
+		photons[i].outDirection = Vec3(random.NextUniform() - 0.5, random.NextUniform() - 0.5, random.NextUniform() - 0.5).Normal();
+		powers[i] = Vec3f(photons[i].power);
+		directions[i] = Vec3f(photons[i].outDirection);
+	}
+	Vec3 normal(0,1,0);
+	ColourScalar coefficients = Vec3(0.8, 0.5, 0.2) / PI;
+	double samples = (double)photonCount * repeats;
+
+	printf("%-8s %10s %12s %10s %10s %10s\n", "type", "time [s]", "Mphotons/s", "flux r", "flux g", "flux b");
+	double start = GetTime();
+	Vec3 flux3(0,0,0);
+	for(int r = 0; r < repeats; r++)
+		for(int i = 0; i < photonCount; i++)
+		{
+			Scalar cosine = normal * photons[i].outDirection;
+			if(cosine >= 0)
+				flux3 += photons[i].power.CMultiply(cosine * coefficients);
+		}
+	double time = GetTime() - start;
+	printf("%-8s %10.3f %12.2f %10.4f %10.4f %10.4f\n", "Vec3", time, samples / time / 1e6, flux3.x, flux3.y, flux3.z);
+
+	start = GetTime();
+	Vec4d flux4d(0,0,0);
+	Vec4d normal4d(normal), coefficients4d(coefficients);
+	for(int r = 0; r < repeats; r++)
+		for(int i = 0; i < photonCount; i++)
+		{
+			Scalar cosine = normal4d * Vec4d(photons[i].outDirection);
+			if(cosine >= 0)
+				flux4d += Vec4d(photons[i].power).CMultiply(cosine * coefficients4d);
+		}
+	time = GetTime() - start;
+	printf("%-8s %10.3f %12.2f %10.4f %10.4f %10.4f\n", "Vec4d", time, samples / time / 1e6, flux4d.X(), flux4d.Y(), flux4d.Z());
+
+	// Photons stored in single precision, as a compressed photon map would keep them.
+	start = GetTime();
+	Vec4f flux4f(0,0,0);
+	Vec4f normal4f(normal), coefficients4f(coefficients);
+	for(int r = 0; r < repeats; r++)
+	{
+		// Partial sums per repeat keep single precision error small.
+		Vec4f partial(0,0,0);
+		for(int i = 0; i < photonCount; i++)
+		{
+			float cosine = normal4f * Vec4f(directions[i]);
+			if(cosine >= 0)
+				partial += Vec4f(powers[i]).CMultiply(cosine * coefficients4f);
+		}
+		flux4f += partial;
+	}
+	time = GetTime() - start;
+	printf("%-8s %10.3f %12.2f %10.4f %10.4f %10.4f\n", "Vec4f", time, samples / time / 1e6, flux4f.X(), flux4f.Y(), flux4f.Z());
+}
+
+// Renders bumpy sphere stored as triangle soup (three vertices per triangle, like AddTriangle makes), the same
+// mesh after MeshOptimizer and its quantized copy; difference is mean absolute pixel difference from the soup.
+void Benchmark_MeshOptimizer()
+{
+	Material material(new Diffuse(Vec3(1,1,1)));
+	TriangleMesh indexed;
+	CreateBumpySphereMesh(&indexed, &material);
+	TriangleMesh* soup = new TriangleMesh(indexed.GetTriangleCount());
+	TriangleMesh* optimized = new TriangleMesh(indexed.GetTriangleCount());
+	for(int i = 0; i < indexed.GetTriangleCount(); i++)
+	{
+		Vec3 p1, p2, p3;
+		Material* triangleMaterial;
+		indexed.GetTriangle(i, p1, p2, p3, triangleMaterial);
+		soup->AddTriangle(p1, p2, p3, triangleMaterial);
+		optimized->AddTriangle(p1, p2, p3, triangleMaterial);
+	}
+
+	MeshOptimizer optimizer;
+	MeshOptimizeStats stats = optimizer.Optimize(*optimized);
+	printf("Welded %d -> %d vertices, %d -> %d triangles\n", stats.verticesBefore, stats.verticesAfter, 
+		stats.trianglesBefore, stats.trianglesAfter);
+	QuantizedTriangleMesh* quantized = new QuantizedTriangleMesh;
+	quantized->Build(*optimized);
+	soup->accelerator = optimized->accelerator = AcceleratorBVH;
+	soup->Build();
+	optimized->Build();
 
+	const char* names[] = { "soup", "optimized", "quantized" };
+	IGeometry* meshes[] = { soup, optimized, quantized };
+	long long sizes[] = { soup->GetDataSize(), optimized->GetDataSize(), quantized->GetDataSize() };
+	std::vector<Colour> reference;
+	printf("%-10s %10s %10s %10s %10s\n", "mesh", "data [MB]", "render [s]", "Msamples/s", "difference");
+	for(int m = 0; m < 3; m++)
+	{
+		std::vector<ISingularLight*> lights;
+		PointLight light(Vec3(0.3, 0.5, 1.5), Vec3(1,1,1));
+		lights.push_back(&light);
+		Camera camera(400,400, PI/3);
+		camera.position = Vec3(0,0.3,2.5);
 
+		Raytracer raytracer;
+		raytracer.maxGatherIterations = 0;
+		raytracer.raysPerPixel = 4;
+		double renderStart = GetTime();
+		raytracer.Render(&camera, meshes[m], 0, lights, 0, 0);
+		double renderTime = GetTime() - renderStart;
 
+		Colour* data = camera.image.GetData();
+		int pixelCount = camera.image.GetWidth() * camera.image.GetHeight();
+		if(m == 0)
+			reference.assign(data, data + pixelCount);
+		Scalar difference = 0;
+		for(int i = 0; i < pixelCount; i++)
+			for(int k = 0; k < 3; k++)
+				difference += std::abs(data[i].data[k] - reference[i].data[k]);
+		difference /= 3 * pixelCount;
 
+		double samples = 400.0 * 400 * raytracer.raysPerPixel;
+		printf("%-10s %10.2f %10.3f %10.2f %10.6f\n", names[m], sizes[m] / (1024.0*1024.0), renderTime, 
+			samples / renderTime / 1e6, difference);
+	}
+	delete soup;
+	delete optimized;
+	delete quantized;
+}
+
+// Time to first image with eager and lazy BVH: build plus a small low sample preview (lazy BVH splits only
+// nodes its rays reach), followed by a full render which shows steady state throughput.
+void Benchmark_LazyBVH()
+{
+	const char* sceneNames[] = { "architecture", "bumpy sphere" };
+	const char* acceleratorNames[] = { "BVH", "lazy BVH" };
+	MeshAccelerator accelerators[] = { AcceleratorBVH, AcceleratorLazyBVH };
+	Material material(new Diffuse(Vec3(1,1,1)));
+
+	printf("%-14s %-10s %10s %12s %12s %10s %10s\n", "scene", "structure", "build [s]", "preview [s]", "first [s]", 
+		"render [s]", "Msamples/s");
+	for(int s = 0; s < 2; s++)
+	{
+		for(int a = 0; a < 2; a++)
+		{
+			TriangleMesh* mesh = new TriangleMesh;
+			if(s == 0)
+				CreateArchitectureMesh(mesh, &material);
+			else
+				CreateBumpySphereMesh(mesh, &material);
+			mesh->accelerator = accelerators[a];
+			double buildStart = GetTime();
+			mesh->Build();
+			double buildTime = GetTime() - buildStart;
+
+			std::vector<ISingularLight*> lights;
+			PointLight light(Vec3(0.3, 0.5, 1.5), Vec3(1,1,1));
+			lights.push_back(&light);
+			Raytracer raytracer;
+			raytracer.maxGatherIterations = 0;
+
+			Camera preview(100,100, PI/3);
+			preview.position = Vec3(0,0.3,2.5);
+			raytracer.raysPerPixel = 1;
+			double previewStart = GetTime();
+			raytracer.Render(&preview, mesh, 0, lights, 0, 0);
+			double previewTime = GetTime() - previewStart;
+
+			Camera camera(400,400, PI/3);
+			camera.position = Vec3(0,0.3,2.5);
+			raytracer.raysPerPixel = 4;
+			double renderStart = GetTime();
+			raytracer.Render(&camera, mesh, 0, lights, 0, 0);
+			double renderTime = GetTime() - renderStart;
+
+			double samples = 400.0 * 400 * raytracer.raysPerPixel;
+			printf("%-14s %-10s %10.3f %12.3f %12.3f %10.3f %10.2f\n", sceneNames[s], acceleratorNames[a], buildTime, 
+				previewTime, buildTime + previewTime, renderTime, samples / renderTime / 1e6);
+			delete mesh;
+		}
+	}
+}
+
+// Cornell box with a glass sphere (its pixels cost much more than walls) and a point light, shared by renderer
+// benchmarks. Mirror adds a reflective sphere, lamp a small sphere with surface light. Unlike scenes of tests,
+// it owns all its objects.
+class BenchmarkScene
+{
+	Diffuse whiteBSDF, redBSDF, greenBSDF;
+	Refractive glassBSDF;
+	Reflective mirrorBSDF;
+	NonInteractMedium glassMedium;
+	UniformSurfaceLight lampLight;
+	Material white, red, green, glass, mirror, lamp;
+	TriangleMesh walls;
+	Sphere glassSphere, mirrorSphere, lampSphere;
+	PointLight light;
+public:
+	BVHScene scene;
+	std::vector<ISingularLight*> lights;
+
+	BenchmarkScene(bool hasMirror, bool hasLamp);
+
+	// Places camera in front of the open side of the box.
+	void SetupCamera(Camera& camera) const { camera.position = Vec3(0,0,2.5); }
+};
+
+BenchmarkScene::BenchmarkScene(bool hasMirror, bool hasLamp)
+	: whiteBSDF(Vec3(1,1,1)), redBSDF(Vec3(1,0,0)), greenBSDF(Vec3(0,1,0)), glassBSDF(Vec3(1,1,1)), mirrorBSDF(Vec3(1,1,1)),
+	  glassMedium(1.4), lampLight(Vec3(4,4,4)), white(&whiteBSDF), red(&redBSDF), green(&greenBSDF), glass(&glassBSDF),
+	  mirror(&mirrorBSDF), lamp(&whiteBSDF), glassSphere(Vec3(-0.4, -0.5, 0), 0.45, &glass),
+	  mirrorSphere(Vec3(0.5, -0.6, -0.3), 0.3, &mirror), lampSphere(Vec3(0.3, 0.6, 0.2), 0.15, &lamp),
+	  light(Vec3(0.2, 0.3, 1.1), Vec3(1,1,1))
+{
+	glass.insideMedium = &glassMedium;
+	lamp.surfaceLight = &lampLight;
+	AddCornellBox(&walls, &white, &red, &green);
+	scene.AddGeometry(&walls);
+	scene.AddGeometry(&glassSphere);
+	if(hasMirror)
+		scene.AddGeometry(&mirrorSphere);
+	if(hasLamp)
+		scene.AddGeometry(&lampSphere);
+	scene.Build();
+	lights.push_back(&light);
+}
+
+// Renders benchmark scene with growing number of threads and prints speedup over one thread, showing how tile
+// scheduling balances uneven work.
+void Benchmark_RenderScaling()
+{
+	BenchmarkScene scene(false, false);
+
+	int maxThreads = 1, previousThreads = 1;
+#ifdef _OPENMP
+	maxThreads = omp_get_num_procs();
+	previousThreads = omp_get_max_threads();
+#endif
+	double singleTime = 0;
+	printf("%8s %10s %10s %10s\n", "threads", "render [s]", "speedup", "efficiency");
+	for(int threads = 1; ; threads = std::min(threads * 2, maxThreads))
+	{
+#ifdef _OPENMP
+		omp_set_num_threads(threads);
+#endif
+		Camera camera(300,300, PI/3);
+		scene.SetupCamera(camera);
+		Raytracer raytracer;
+		raytracer.maxGatherIterations = 1;
+		raytracer.secondaryRays = 20;
+		raytracer.raysPerPixel = 4;
+		double renderStart = GetTime();
+		raytracer.Render(&camera, &scene.scene, 0, scene.lights, 0, 0);
+		double renderTime = GetTime() - renderStart;
+
+		if(threads == 1)
+			singleTime = renderTime;
+		printf("%8d %10.3f %10.2f %10.2f\n", threads, renderTime, singleTime / renderTime, singleTime / renderTime / threads);
+		if(threads == maxThreads)
+			break;
+	}
+#ifdef _OPENMP
+	omp_set_num_threads(previousThreads);
+#endif
+}
+
+// Counts progressive passes (passed to Raytracer::passCallback).
+void CountPass(Image& /*image*/, int passes, void* userData)
+{
+	*(int*)userData = passes;
+}
+
+// Renders benchmark scene progressively with several time budgets and prints how closely render time follows
+// the budget and how many passes fit into it.
+void Benchmark_Progressive()
+{
+	BenchmarkScene scene(false, false);
+
+	double budgets[] = { 0.5, 1, 2, 4 };
+	printf("%10s %10s %8s\n", "budget [s]", "render [s]", "passes");
+	for(int b = 0; b < 4; b++)
+	{
+		Camera camera(200,200, PI/3);
+		scene.SetupCamera(camera);
+		Raytracer raytracer;
+		raytracer.maxGatherIterations = 1;
+		raytracer.secondaryRays = 20;
+		raytracer.progressive = true;
+		raytracer.maxPasses = 10000;
+		raytracer.timeBudget = budgets[b];
+		int passes = 0;
+		raytracer.passCallback = CountPass;
+		raytracer.passCallbackData = &passes;
+		double renderStart = GetTime();
+		raytracer.Render(&camera, &scene.scene, 0, scene.lights, 0, 0);
+		double renderTime = GetTime() - renderStart;
+		printf("%10.2f %10.3f %8d\n", budgets[b], renderTime, passes);
+	}
+}
+
+// Root mean square difference of pixel components relative to brightest component of reference pixel (like
+// the error adaptive sampling controls), for images of the same size.
+Scalar RelativeImageDifference(Image& image, const std::vector<Colour>& reference)
+{
+	Colour* data = image.GetData();
+	Scalar sum = 0;
+	for(unsigned int i = 0; i < reference.size(); i++)
+	{
+		const Colour& r = reference[i];
+		Scalar brightness = std::max(std::max(r.x, r.y), r.z) + (Scalar)0.01;
+		sum += (data[i] - r).Length2() / (brightness * brightness);
+	}
+	return std::sqrt(sum / (3 * reference.size()));
+}
+
+// Compares uniform progressive sampling with adaptive sampling: camera rays, render time and relative error
+// against a converged reference (many uniform passes). The first scene has direct lighting only, so noise
+// is concentrated at edges, in soft shadows and in glass; in the second every pixel gathers indirect light.
+void Benchmark_AdaptiveSampling()
+{
+	BenchmarkScene scene(true, true);
+
+	// Uniform runs differ by number of passes, adaptive ones by threshold; the first run is the reference.
+	const char* sceneNames[] = { "direct", "gather" };
+	const int runCount = 7;
+	int passes[runCount] = { 512, 4, 16, 64, 512, 512, 512 };
+	Scalar thresholds[runCount] = { 0, 0, 0, 0, 0.2, 0.1, 0.05 };
+	printf("%-7s %-9s %8s %10s %12s %10s %10s\n", "scene", "sampling", "passes", "threshold", "camera rays", "render [s]", 
+		"rel. error");
+	for(int s = 0; s < 2; s++)
+	{
+		std::vector<Colour> reference;
+		for(int r = 0; r < runCount; r++)
+		{
+			Camera camera(100,100, PI/3);
+			scene.SetupCamera(camera);
+			Raytracer raytracer;
+			raytracer.maxGatherIterations = s;
+			raytracer.secondaryRays = 20;
+			raytracer.progressive = true;
+			raytracer.maxPasses = passes[r];
+			raytracer.adaptiveThreshold = thresholds[r];
+			double renderStart = GetTime();
+			raytracer.Render(&camera, &scene.scene, 0, scene.lights, 0, 0);
+			double renderTime = GetTime() - renderStart;
+
+			Colour* data = camera.image.GetData();
+			if(r == 0)
+			{
+				reference.assign(data, data + camera.image.GetWidth() * camera.image.GetHeight());
+				continue;
+			}
+			printf("%-7s %-9s %8d %10.3f %12d %10.3f %10.5f\n", sceneNames[s], thresholds[r] > 0 ? "adaptive" : "uniform", 
+				passes[r], thresholds[r], raytracer.GetPrimaryRaysTraced(), renderTime, 
+				RelativeImageDifference(camera.image, reference));
+		}
+	}
+}
+
+// Compares cost of indirect bounces: Raytracer spawns secondaryRays rays at every gathering hit, so render time
+// grows exponentially with maxGatherIterations, while PathTracer follows one ray per bounce and grows linearly
+// with maxBounces (Russian roulette is disabled for these rows, the last row uses it).
+void Benchmark_PathTracer()
+{
+	BenchmarkScene scene(false, true);
+
+	printf("%-11s %8s %10s %10s\n", "renderer", "bounces", "render [s]", "per pixel");
+	for(int gather = 0; gather <= 3; gather++)
+	{
+		Camera camera(100,100, PI/3);
+		scene.SetupCamera(camera);
+		Raytracer raytracer;
+		raytracer.maxGatherIterations = gather;
+		raytracer.maxIterations = 8;
+		raytracer.secondaryRays = 8;
+		raytracer.secondaryRayDecay = 0;
+		raytracer.raysPerPixel = 8;
+		double renderStart = GetTime();
+		raytracer.Render(&camera, &scene.scene, 0, scene.lights, 0, 0);
+		double renderTime = GetTime() - renderStart;
+		printf("%-11s %8d %10.3f %10.1f\n", "raytracer", gather, renderTime, renderTime * 1e6 / (100 * 100));
+	}
+
+	int bounces[] = { 1, 2, 4, 8, 16, 16 };
+	for(int b = 0; b < 6; b++)
+	{
+		Camera camera(100,100, PI/3);
+		scene.SetupCamera(camera);
+		PathTracer pathTracer;
+		pathTracer.maxBounces = bounces[b];
+		pathTracer.rouletteDepth = b < 5 ? bounces[b] : 3;
+		pathTracer.raysPerPixel = 64;
+		double renderStart = GetTime();
+		pathTracer.Render(&camera, &scene.scene, 0, scene.lights, 0, 0);
+		double renderTime = GetTime() - renderStart;
+		printf("%-11s %8d %10.3f %10.1f\n", b < 5 ? "path" : "path+RR", bounces[b], renderTime, renderTime * 1e6 / (100 * 100));
+	}
+}
+
+// Counts heap allocations of photon tracing and of renders with increasing number of samples. Allocations of
+// setup (tile scheduler, buffers) do not depend on number of samples, so equal counts in each column show
+// the trace loop itself does not allocate. With several threads, buffers of a thread may still grow in
+// the first few renders (until it has gathered in the densest part of photon map).
+void Benchmark_Allocations()
+{
+	if(GetHeapAllocationCount() < 0)
+	{
+		printf("Allocations are not counted, define COUNT_HEAP_ALLOCATIONS\n");
+		return;
+	}
+
+	BenchmarkScene scene(false, false);
+	ISingularLight* light = scene.lights[0];
+
+	// Photons are stored by the map, so photon tracing allocates only when map grows.
+	PhotonMap causticsMap, globalMap;
+	PhotonTracer tracer;
+	tracer.rejectRatio = 0.05;
+	printf("%-16s %8s %12s\n", "photons", "stored", "allocations");
+	int photonCounts[] = { 10000, 20000, 40000 };
+	for(int i = 0; i < 3; i++)
+	{
+		PhotonMap map;
+		long long allocations = GetHeapAllocationCount();
+		tracer.TraceCausticsPhotons(&scene.scene, photonCounts[i], light, &map);
+		printf("%-16d %8d %12lld\n", photonCounts[i], map.Count(), GetHeapAllocationCount() - allocations);
+	}
+	tracer.TraceCausticsPhotons(&scene.scene, 100000, light, &causticsMap);
+	tracer.TracePhotons(&scene.scene, 3000, light, &globalMap);
+	causticsMap.Optimise();
+	globalMap.Optimise();
+
+	// The same renderers are reused, so thread buffers have already grown in the first render.
+	Raytracer raytracer;
+	raytracer.maxGatherIterations = 1;
+	raytracer.secondaryRays = 20;
+	raytracer.globalPhotonMapGatherRadius = 0.05;
+	raytracer.causticsPhotonMapGatherRadius = 0.01;
+	PathTracer pathTracer;
+	printf("%-16s %8s %12s\n", "renderer", "samples", "allocations");
+	for(int r = 0; r < 2; r++)
+	{
+		Raytracer* renderer = r == 0 ? &raytracer : &pathTracer;
+		for(int samples = 1; samples <= 8; samples *= 2)
+		{
+			Camera camera(100,100, PI/3);
+			scene.SetupCamera(camera);
+			renderer->raysPerPixel = samples;
+			long long allocations = GetHeapAllocationCount();
+			renderer->Render(&camera, &scene.scene, 0, scene.lights, &globalMap, &causticsMap);
+			printf("%-16s %8d %12lld\n", r == 0 ? "raytracer" : "path tracer", samples, GetHeapAllocationCount() - allocations);
+		}
+	}
+}
+
+// Render times of shading loops which accumulate radiance in SIMD vectors (photon gathers, direct light and
+// path throughput). Build once as is and once with NO_SIMD_MATH (scalar Vec3 based vectors) and compare the
+// times; images are bit identical, so checksums must match.
+void Benchmark_SimdShading()
+{
+	BenchmarkScene scene(true, true);
+	PhotonMap causticsMap, globalMap;
+	PhotonTracer tracer;
+	tracer.rejectRatio = 0.05;
+	tracer.TraceCausticsPhotons(&scene.scene, 100000, scene.lights[0], &causticsMap);
+	tracer.TracePhotons(&scene.scene, 3000, scene.lights[0], &globalMap);
+	causticsMap.Optimise();
+	globalMap.Optimise();
+
+#ifdef NO_SIMD_MATH
+	printf("Vectors: scalar (NO_SIMD_MATH)\n");
+#else
+	printf("Vectors: SSE2\n");
+#endif
+	printf("%-12s %8s %10s %12s\n", "renderer", "samples", "render [s]", "checksum");
+	for(int r = 0; r < 2; r++)
+	{
+		Raytracer raytracer;
+		PathTracer pathTracer;
+		Raytracer* renderer = r == 0 ? &raytracer : &pathTracer;
+		renderer->maxGatherIterations = 1;
+		renderer->secondaryRays = 20;
+		renderer->globalPhotonMapGatherRadius = 0.05;
+		renderer->causticsPhotonMapGatherRadius = 0.01;
+		renderer->raysPerPixel = 4;
+		Camera camera(200,200, PI/3);
+		scene.SetupCamera(camera);
+		double renderStart = GetTime();
+		renderer->Render(&camera, &scene.scene, 0, scene.lights, &globalMap, &causticsMap);
+		double renderTime = GetTime() - renderStart;
+
+		Colour* data = camera.image.GetData();
+		double checksum = 0;
+		for(int i = 0; i < 200 * 200; i++)
+			checksum += data[i].x + data[i].y + data[i].z;
+		printf("%-12s %8d %10.3f %12.6f\n", r == 0 ? "raytracer" : "path tracer", renderer->raysPerPixel, renderTime, checksum);
+	}
+}
+
+// Compares wavefront and recursive raytracer with the same parameters: render time and relative error against
+// a converged recursive render. Images differ only by random sequences, so errors should be close (recursive
+// render shares its random sequences with the reference, which makes its error slightly lower).
+void Benchmark_Wavefront()
+{
+	BenchmarkScene scene(false, false);
+
+	Camera referenceCamera(100,100, PI/3);
+	scene.SetupCamera(referenceCamera);
+	Raytracer referenceRaytracer;
+	referenceRaytracer.maxGatherIterations = 1;
+	referenceRaytracer.secondaryRays = 20;
+	referenceRaytracer.raysPerPixel = 256;
+	referenceRaytracer.Render(&referenceCamera, &scene.scene, 0, scene.lights, 0, 0);
+	Colour* data = referenceCamera.image.GetData();
+	std::vector<Colour> reference(data, data + referenceCamera.image.GetWidth() * referenceCamera.image.GetHeight());
+
+	// Throughput is in camera samples (paths) per second, speedup is recursive time over wavefront time.
+	printf("%-10s %8s %10s %12s %8s %10s\n", "renderer", "samples", "render [s]", "Msamples/s", "speedup", "rel. error");
+	for(int samples = 4; samples <= 16; samples *= 2)
+	{
+		double recursiveTime = 0;
+		for(int r = 0; r < 2; r++)
+		{
+			Camera camera(100,100, PI/3);
+			scene.SetupCamera(camera);
+			Raytracer raytracer;
+			WavefrontRaytracer wavefrontRaytracer;
+			Raytracer* renderer = r == 0 ? &raytracer : &wavefrontRaytracer;
+			renderer->maxGatherIterations = 1;
+			renderer->secondaryRays = 20;
+			renderer->raysPerPixel = samples;
+			double renderStart = GetTime();
+			renderer->Render(&camera, &scene.scene, 0, scene.lights, 0, 0);
+			double renderTime = GetTime() - renderStart;
+			if(r == 0)
+				recursiveTime = renderTime;
+			double paths = (double)camera.image.GetWidth() * camera.image.GetHeight() * samples;
+			printf("%-10s %8d %10.3f %12.3f %8.2f %10.5f\n", r == 0 ? "recursive" : "wavefront", samples, renderTime,
+				paths / renderTime * 1e-6, recursiveTime / renderTime, RelativeImageDifference(camera.image, reference));
+		}
+	}
+}
+
+// Writes mesh as PLY file in ascii or binary little endian format (positions as doubles, so they round-trip exactly).
+static void WritePly(const char* filename, TriangleMesh& mesh, bool isBinary)
+{
+	FILE* file = fopen(filename, isBinary ? "wb" : "w");
+	if(!file)
+		throw std::exception("Cannot create PLY file");
+	fprintf(file, "ply\nformat %s 1.0\nelement vertex %d\nproperty double x\nproperty double y\nproperty double z\n"
+		"element face %d\nproperty list uchar int vertex_indices\nend_header\n", isBinary ? "binary_little_endian" : "ascii",
+		mesh.GetVertexCount(), mesh.GetTriangleCount());
+	for(int i = 0; i < mesh.GetVertexCount(); i++)
+	{
+		const Vec3& v = mesh.GetVertexData()[i];
+		double position[3] = { v.x, v.y, v.z };
+		if(isBinary)
+			fwrite(position, sizeof(double), 3, file);
+		else
+			fprintf(file, "%.17g %.17g %.17g\n", position[0], position[1], position[2]);
+	}
+	const int* indices = mesh.GetIndexData();
+	for(int i = 0; i < mesh.GetTriangleCount(); i++)
+	{
+		unsigned char corners = 3;
+		if(isBinary)
+		{
+			fwrite(&corners, 1, 1, file);
+			fwrite(indices + i*3, sizeof(int), 3, file);
+		}
+		else
+			fprintf(file, "3 %d %d %d\n", indices[i*3], indices[i*3+1], indices[i*3+2]);
+	}
+	fclose(file);
+}
+
+// Saves bumpy sphere as OBJ and PLY (ascii and binary) files, imports them and stores the OBJ import as mesh cache
+// and out of core mesh (with memory budget of a few clusters, so clusters are paged in and out). Loading times are
+// printed and hits of camera rays of each mesh are compared with the OBJ import; different counts rays with other
+// hit distance or occlusion.
+void Benchmark_MeshFormats()
+{
+	Material material(new Diffuse(Vec3(1,1,1)));
+	TriangleMesh source;
+	CreateBumpySphereMesh(&source, &material);
+	FILE* file = fopen("bumpy.obj", "w");
+	if(!file)
+		throw std::exception("Cannot create bumpy.obj");
+	for(int i = 0; i < source.GetVertexCount(); i++)
+	{
+		const Vec3& v = source.GetVertexData()[i];
+		fprintf(file, "v %.17g %.17g %.17g\n", v.x, v.y, v.z);
+	}
+	const int* indices = source.GetIndexData();
+	for(int i = 0; i < source.GetTriangleCount(); i++)
+		fprintf(file, "f %d %d %d\n", indices[i*3] + 1, indices[i*3+1] + 1, indices[i*3+2] + 1);
+	fclose(file);
+	WritePly("bumpy_ascii.ply", source, false);
+	WritePly("bumpy_binary.ply", source, true);
+
+	std::vector<Material*> palette(1, &material);
+	MeshImporter importer;
+	importer.defaultMaterial = &material;
+	const char* importNames[] = { "bumpy.obj", "bumpy_ascii.ply", "bumpy_binary.ply" };
+	TriangleMesh* imports[3];
+	double importTimes[3];
+	for(int i = 0; i < 3; i++)
+	{
+		double start = GetTime();
+		imports[i] = importer.Load(importNames[i]);
+		imports[i]->accelerator = AcceleratorBVH;
+		imports[i]->Build();
+		importTimes[i] = GetTime() - start;
+		const MeshLoadStats& load = importer.GetLastLoadStats();
+		printf("Mesh loaded: %s, %d vertices, %d triangles, %d materials in %.3f s (%.1f MB/s)\n", importNames[i],
+			load.vertexCount, load.triangleCount, load.materialCount, load.time,
+			load.bytes / (1024.0*1024.0) / std::max(load.time, 1e-9));
+	}
+	TriangleMesh* imported = imports[0];
+
+	MeshCacheSaveStats saved = SaveMeshCache("bumpy.rtmesh", *imported, palette);
+	printf("Mesh cache saved: %d triangles, %d nodes, %.1f MB in %.3f s\n", saved.triangleCount, saved.nodeCount,
+		saved.bytes / (1024.0*1024.0), saved.time);
+	MappedTriangleMesh cached;
+	double start = GetTime();
+	cached.Open("bumpy.rtmesh", palette);
+	double cacheTime = GetTime() - start;
+
+	OutOfCoreWriter writer;
+	writer.clusterSize = 16 * 1024;
+	writer.Open("bumpy.rtooc", palette);
+	writer.AddMesh(*imported);
+	OutOfCoreWriteStats written = writer.Close();
+	printf("Out of core mesh written: %lld triangles in %d clusters, %.1f MB\n", written.triangleCount,
+		written.clusterCount, written.bytes / (1024.0*1024.0));
+	OutOfCoreMesh outOfCore;
+	outOfCore.memoryBudget = 16 * 1024 * 1024;
+	start = GetTime();
+	outOfCore.Open("bumpy.rtooc", palette);
+	double outOfCoreTime = GetTime() - start;
+
+	const char* names[] = { "OBJ", "ascii PLY", "binary PLY", "cached", "out of core" };
+	IGeometry* meshes[] = { imports[0], imports[1], imports[2], &cached, &outOfCore };
+	double loadTimes[] = { importTimes[0], importTimes[1], importTimes[2], cacheTime, outOfCoreTime };
+	const int size = 400;
+	std::vector<Scalar> reference;
+	printf("%-12s %10s %10s\n", "mesh", "load [s]", "different");
+	for(int m = 0; m < 5; m++)
+	{
+		int different = 0;
+		for(int y = 0; y < size; y++)
+		{
+			for(int x = 0; x < size; x++)
+			{
+				Vec3 direction((Scalar)(x - size/2) / size, (Scalar)(size/2 - y) / size, -1);
+				Ray ray(Vec3(0,0.3,2.5), direction.Normal());
+				IntersectResult result;
+				meshes[m]->Intersect(ray, result);
+				bool isOccluded = meshes[m]->Occluded(ray, 10);
+				if(m == 0)
+					reference.push_back(result.distance);
+				else if(result.distance != reference[y*size + x])
+					different++;
+				if(isOccluded != (result.distance < 10))
+					different++;
+			}
+		}
+		printf("%-12s %10.3f %10d\n", names[m], loadTimes[m], different);
+	}
+	OutOfCoreStats stats = outOfCore.GetStats();
+	long long visits = stats.hits + stats.misses;
+	printf("Out of core cache: %lld hits, %lld misses (%.2f%% hit rate), %lld evictions, %lld read failures, %.1f MB read\n",
+		stats.hits, stats.misses, visits ? 100.0 * stats.hits / visits : 0.0, stats.evictions, stats.readFailures,
+		stats.bytesRead / (1024.0*1024.0));
+	printf("Resident: %d clusters, %.1f MB (peak %.1f MB, budget %.1f MB)\n", stats.residentClusters,
+		stats.residentBytes / (1024.0*1024.0), stats.peakResidentBytes / (1024.0*1024.0), outOfCore.memoryBudget / (1024.0*1024.0));
+	if(stats.peakResidentBytes > outOfCore.memoryBudget)
+		printf("Out of core cache exceeded its memory budget\n");
+	for(int i = 0; i < 3; i++)
+		delete imports[i];
+}
 
 int main()
 {